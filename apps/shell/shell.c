@@ -1457,6 +1457,8 @@ static void session_add_service(IOEXCarrier *w, int argc, char *argv[])
 
     if (strcmp(argv[2], "tcp") == 0)
         protocol = PortForwardingProtocol_TCP;
+    else if (strcmp(argv[2], "udp") == 0)
+        protocol = PortForwardingProtocol_UDP;
     else {
         output("Unknown protocol %s.\n", argv[2]);
         return;
@@ -1490,6 +1492,8 @@ static void portforwarding_open(IOEXCarrier *w, int argc, char *argv[])
 
     if (strcmp(argv[3], "tcp") == 0)
         protocol = PortForwardingProtocol_TCP;
+    else if (strcmp(argv[3], "udp") == 0)
+        protocol = PortForwardingProtocol_UDP;
     else {
         output("Unknown protocol %s.\n", argv[3]);
         return;
@@ -1507,6 +1511,63 @@ static void portforwarding_open(IOEXCarrier *w, int argc, char *argv[])
     }
 }
 
+static bool portforwarding_stats_callback(const IOEXPortForwardingStats *stats,
+                                          void *context)
+{
+    static const char *latency_bounds[IOEX_PORTFORWARDING_LATENCY_BUCKETS] = {
+        "<1ms", "<5ms", "<10ms", "<50ms", "<100ms", "<500ms", "<1s", ">=1s"
+    };
+    int *count = (int *)context;
+    int i;
+
+    if (!stats) {
+        output("  ----------------\n");
+        output("Total %d services and portforwardings.\n", *count);
+        return true;
+    }
+
+    if (stats->stream > 0)
+        output("  Portforwarding %d on stream %d to service %s (%s):\n",
+               stats->portforwarding, stats->stream, stats->service,
+               stats->protocol == PortForwardingProtocol_TCP ? "tcp" : "udp");
+    else
+        output("  Service %s (%s):\n", stats->service,
+               stats->protocol == PortForwardingProtocol_TCP ? "tcp" : "udp");
+
+    output("    connections: %llu total, %llu active, %llu failed\n",
+           (unsigned long long)stats->connections,
+           (unsigned long long)stats->active_connections,
+           (unsigned long long)stats->failed_connections);
+    output("    bytes: %llu sent, %llu received\n",
+           (unsigned long long)stats->bytes_sent,
+           (unsigned long long)stats->bytes_received);
+    output("    first byte latency:");
+    for (i = 0; i < IOEX_PORTFORWARDING_LATENCY_BUCKETS; i++)
+        output(" %s:%llu", latency_bounds[i],
+               (unsigned long long)stats->first_byte_latency[i]);
+    output("\n");
+
+    (*count)++;
+    return true;
+}
+
+static void portforwarding_stats(IOEXCarrier *w, int argc, char *argv[])
+{
+    int count = 0;
+    int rc;
+
+    if (argc != 1) {
+        output("Invalid command syntax.\n");
+        return;
+    }
+
+    output("Portforwarding statistics:\n");
+    rc = IOEX_session_get_portforwarding_stats(session_ctx.ws,
+                                    portforwarding_stats_callback, &count);
+    if (rc < 0)
+        output("Get portforwarding statistics failed.\n");
+}
+
 static void portforwarding_close(IOEXCarrier *w, int argc, char *argv[])
 {
     int pfid;
@@ -1564,13 +1625,25 @@ static void list_files(IOEXCarrier *w, int argc, char *argv[])
 
 static void file_send_request(IOEXCarrier *w, int argc, char *argv[])
 {
+    IOEXFilePriority priority = IOEXFilePriority_Normal;
     int rc;
-    if(argc != 3){
+    if(argc != 3 && argc != 4){
         output("Invalid command syntax.\n");
         return;
     }
 
-    rc = IOEX_send_file_request(w, argv[1], argv[2]);
+    if(argc == 4){
+        if(strcmp(argv[3], "low") == 0)
+            priority = IOEXFilePriority_Low;
+        else if(strcmp(argv[3], "high") == 0)
+            priority = IOEXFilePriority_High;
+        else if(strcmp(argv[3], "normal") != 0){
+            output("Invalid priority, should be low, normal or high.\n");
+            return;
+        }
+    }
+
+    rc = IOEX_send_file_request_with_priority(w, argv[1], argv[2], priority);
     if(rc < 0){
         output("Invalid request.(0x%8X)\n", IOEX_get_error());
     }
@@ -1720,9 +1793,10 @@ struct command {
     { "spfsvcremove", session_remove_service, "spfsvcremove name" },
     { "spfopen",    portforwarding_open,    "spfopen stream service tcp|udp host port" },
     { "spfclose",   portforwarding_close,   "spfclose stream pfid" },
+    { "pfstats",    portforwarding_stats,   "pfstats" },
     { "scleanup",   session_cleanup,        "scleanup" },
 
-    { "filesend",   file_send_request, 	    "filesend userid filename" },
+    { "filesend",   file_send_request, 	    "filesend userid filename [low | normal | high]" },
     { "fileseek",   file_send_seek, 	    "fileseek userid fileindex position" },
     { "fileaccept", file_send_accept, 	    "fileaccept userid fileindex newfilename filepath" },
     { "filereject", file_send_reject, 	    "filereject userid fileindex" },
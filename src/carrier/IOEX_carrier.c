@@ -30,15 +30,21 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #include <rc_mem.h>
 #include <base58.h>
 #include <vlog.h>
 #include <crypto.h>
 #include <linkedlist.h>
+#include <time_util.h>
+#include <epoch.h>
 
 #include "IOEX_carrier.h"
 #include "IOEX_carrier_impl.h"
@@ -46,6 +52,7 @@
 #include "friends.h"
 #include "tcallbacks.h"
 #include "thistory.h"
+#include "ftrackers.h"
 #include "IOEXcp.h"
 #include "dht.h"
 
@@ -152,56 +159,76 @@ void IOEX_log_init(IOEXLogLevel level, const char *log_file,
 #endif
 }
 
+/* Features this revision advertises to friends in user information */
+#define CARRIER_FEATURES                (IOEXCP_FEATURE_MESSAGE_BATCH | \
+                                         IOEXCP_FEATURE_FILE_HASH | \
+                                         IOEXCP_FEATURE_FILE_STREAM)
+
+/*
+ * The id is only decoded when it is not of a friend, to tell an invalid id
+ * from the id of someone else.
+ */
+static
+int get_friend(IOEXCarrier *w, const char *friendid, FriendInfo **fi)
+{
+    assert(w);
+    assert(friendid);
+    assert(fi);
+
+    *fi = friend_index_get(w->friend_index, friendid);
+    if (*fi)
+        return 0;
+
+    if (!is_valid_key(friendid))
+        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
+
+    //vlogE("Carrier: friendid %s is not friend yet.", friendid);
+    return IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
+}
+
 static
 int get_friend_number(IOEXCarrier *w, const char *friendid, uint32_t *friend_number)
 {
-    uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
-    ssize_t len;
+    FriendInfo *fi;
     int rc;
 
-    assert(w);
-    assert(friendid);
     assert(friend_number);
 
-    len = base58_decode(friendid, strlen(friendid), public_key, sizeof(public_key));
-    if (len != DHT_PUBLIC_KEY_SIZE) {
-        vlogE("Carrier: friendid %s not base58 encoded.", friendid);
-        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
-    }
+    rc = get_friend(w, friendid, &fi);
+    if (rc < 0)
+        return rc;
 
-    rc = dht_get_friend_number(&w->dht, public_key, friend_number);
-    if (rc < 0) {
-        //vlogE("Carrier: friendid %s is not friend yet.", friendid);
-        return IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
-    }
+    *friend_number = fi->friend_number;
+    deref(fi);
 
-    return rc;
+    return 0;
 }
 
-static void fill_empty_user_desc(IOEXCarrier *w)
+static void publish_self_desc(IOEXCarrier *w)
 {
+    IOEXCPStorage storage;
     IOEXCP *cp;
-    uint8_t *data;
+    const uint8_t *data;
     size_t data_len;
 
     assert(w);
 
-    cp = IOEXcp_create(IOEXCP_TYPE_USERINFO, NULL);
+    cp = IOEXcp_init(&storage, IOEXCP_TYPE_USERINFO, NULL);
     if (!cp) {
         vlogE("Carrier: Out of memory!!!");
         return;
     }
 
-    IOEXcp_set_has_avatar(cp, false);
-    IOEXcp_set_name(cp, "");
-    IOEXcp_set_descr(cp, "");
-    IOEXcp_set_gender(cp, "");
-    IOEXcp_set_phone(cp, "");
-    IOEXcp_set_email(cp, "");
-    IOEXcp_set_region(cp, "");
+    IOEXcp_set_has_avatar(cp, w->me.has_avatar);
+    IOEXcp_set_name(cp, w->me.name);
+    IOEXcp_set_descr(cp, w->me.description);
+    IOEXcp_set_gender(cp, w->me.gender);
+    IOEXcp_set_phone(cp, w->me.phone);
+    IOEXcp_set_email(cp, w->me.email);
+    IOEXcp_set_region(cp, w->me.region);
+    IOEXcp_set_features(cp, CARRIER_FEATURES);
 
-    data = IOEXcp_encode(cp, &data_len);
-    IOEXcp_free(cp);
+    data = IOEXcp_encode_reused(cp, &data_len);
 
     if (!data) {
         vlogE("Carrier: Encode user desc to packet error");
@@ -209,13 +236,13 @@ static void fill_empty_user_desc(IOEXCarrier *w)
     }
 
     dht_self_set_desc(&w->dht, data, data_len);
-    free(data);
 }
 
 static
 int unpack_user_desc(const uint8_t *desc, size_t desc_len, IOEXUserInfo *info,
-                     bool *changed)
+                     uint32_t *features, bool *changed)
 {
+    IOEXCPStorage storage;
     IOEXCP *cp;
     const char *name;
     const char *descr;
@@ -230,12 +257,11 @@ int unpack_user_desc(const uint8_t *desc, size_t desc_len, IOEXUserInfo *info,
     assert(desc_len > 0);
     assert(info);
 
-    cp = IOEXcp_decode(desc, desc_len);
+    cp = IOEXcp_decode_into(&storage, desc, desc_len);
     if (!cp)
         return -1;
 
     if (IOEXcp_get_type(cp) != IOEXCP_TYPE_USERINFO) {
-        IOEXcp_free(cp);
         vlogE("Carrier: Unkown userinfo type format.");
         return -1;
     }
@@ -284,7 +310,8 @@ int unpack_user_desc(const uint8_t *desc, size_t desc_len, IOEXUserInfo *info,
         did_changed = true;
     }
 
-    IOEXcp_free(cp);
+    if (features)
+        *features = IOEXcp_get_features(cp);
 
     if (changed)
         *changed = did_changed;
@@ -313,6 +340,7 @@ static void get_self_info_cb(const uint8_t *address, const uint8_t *public_key,
 {
     IOEXCarrier *w = (IOEXCarrier *)context;
     IOEXUserInfo *ui = &w->me;
+    uint32_t features = 0;
     size_t text_len;
 
     memcpy(w->address, address, DHT_ADDRESS_SIZE);
@@ -326,9 +354,11 @@ static void get_self_info_cb(const uint8_t *address, const uint8_t *public_key,
     w->presence_status = get_presence_status(user_status);
 
     if (desc_len > 0)
-        unpack_user_desc(desc, desc_len, ui, NULL);
-    else
-        fill_empty_user_desc(w);
+        unpack_user_desc(desc, desc_len, ui, &features, NULL);
+
+    // Also republished by older revisions not advertising features.
+    if (desc_len == 0 || features != CARRIER_FEATURES)
+        publish_self_desc(w);
 }
 
 static bool friends_iterate_cb(uint32_t friend_number,
@@ -345,15 +375,16 @@ static bool friends_iterate_cb(uint32_t friend_number,
 
     assert(friend_number != UINT32_MAX);
 
-    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), NULL);
+    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), friend_info_destroy);
     if (!fi)
         return false;
 
     ui = &fi->info.user_info;
     base58_encode(public_key, DHT_PUBLIC_KEY_SIZE, ui->userid, &_len);
+    memcpy(fi->public_key, public_key, DHT_PUBLIC_KEY_SIZE);
 
     if (desc_len > 0) {
-        rc = unpack_user_desc(desc, desc_len, ui, NULL);
+        rc = unpack_user_desc(desc, desc_len, ui, &fi->features, NULL);
         if (rc < 0) {
             deref(fi);
             return false;
@@ -367,6 +398,7 @@ static bool friends_iterate_cb(uint32_t friend_number,
     // Label will be synched later from data file.
 
     friends_put(w->friends, fi);
+    friend_index_put(w->friend_index, fi);
 
     deref(fi);
 
@@ -384,11 +416,17 @@ static const char *old_IOEXdata_filename = "IOEXdata";
 
 #define ROUND256(s)     (((((s) + 64) >> 8) + 1) << 8)
 
+// Changes within the delay go into one snapshot; in microseconds.
+#define PERSISTENCE_DELAY                   (2 * 1000000ULL)
+// DHT keeps changing its state on its own, taken anyway this often.
+#define PERSISTENCE_INTERVAL                (10 * 60 * 1000000ULL)
+
 typedef struct persistence_data {
     size_t dht_savedata_len;
     const uint8_t *dht_savedata;
     size_t extra_savedata_len;
     const uint8_t *extra_savedata;
+    uint64_t seq;   // first change log record not in the data.
 } persistence_data;
 
 static int convert_old_dhtdata(const char *data_location)
@@ -565,6 +603,8 @@ static int _load_persistence_data_i(int fd, persistence_data *data)
     size_t extra_data_len;
     unsigned char p_sum[SHA256_BYTES];
     unsigned char c_sum[SHA256_BYTES];
+    uint8_t seq[sizeof(uint64_t)];
+    int i;
 
     uint8_t *buf;
 
@@ -628,6 +668,12 @@ static int _load_persistence_data_i(int fd, persistence_data *data)
         return -1;
     }
 
+    // Zero in data files written before the change log.
+    if (read(fd, seq, sizeof(seq)) != sizeof(seq)) {
+        vlogW("Load persistence data failed, read error(%d).", errno);
+        return -1;
+    }
+
     buf = (uint8_t *)malloc(st.st_size - 256);
     if (!buf) {
         vlogW("Load persistence data failed, out of memory.");
@@ -653,6 +699,9 @@ static int _load_persistence_data_i(int fd, persistence_data *data)
     data->extra_savedata_len = extra_data_len;
     data->extra_savedata = (const uint8_t *)buf + ROUND256(dht_data_len);
 
+    for (i = 0; i < sizeof(seq); i++)
+        data->seq = (data->seq << 8) | seq[i];
+
     return 0;
 }
 
@@ -870,21 +919,27 @@ static void get_extra_savedata(IOEXCarrier *w, void *data, size_t len)
     return;
 }
 
-static int store_persistence_data(IOEXCarrier *w)
+/*
+ * Serializes the persistent data on the carrier thread, then hands it over to
+ * the writer thread to be hashed and stored.
+ */
+static int take_persistence_snapshot(IOEXCarrier *w)
 {
     uint8_t *buf;
     uint8_t *pos;
-    char *journal_filename;
-    char *filename;
     uint32_t val;
-    int fd;
-    int rc;
+    uint64_t seq;
+    int i;
 
     size_t dht_data_len;
     size_t extra_data_len;
     size_t total_len;
 
     assert(w);
+    assert(w->persistence);
+
+    // Stamped before serializing, changes logged meanwhile are replayed.
+    seq = persistence_seq(w->persistence);
 
     dht_data_len = dht_get_savedata_size(&w->dht);
     extra_data_len = get_extra_savedata_size(w);
@@ -894,6 +949,9 @@ static int store_persistence_data(IOEXCarrier *w)
     if (!buf)
         return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
 
+    w->persistence_due = 0;
+    w->persistence_taken = get_monotonic_time();
+
     pos = buf;
     val = htonl(PERSISTENCE_MAGIC);
     memcpy(pos, &val, sizeof(uint32_t));
@@ -910,56 +968,180 @@ static int store_persistence_data(IOEXCarrier *w)
     val = htonl((uint32_t)extra_data_len);
     memcpy(pos, &val, sizeof(uint32_t));
 
+    pos = buf + PERSISTENCE_SEQ_OFFSET;
+    for (i = 0; i < sizeof(uint64_t); i++)
+        pos[i] = (uint8_t)(seq >> ((sizeof(uint64_t) - 1 - i) * 8));
+
     pos = buf + 256;
     dht_get_savedata(&w->dht, pos);
     pos += ROUND256(dht_data_len);
     get_extra_savedata(w, pos, ROUND256(extra_data_len));
 
-    pos = buf + 256;
-    sha256(pos, total_len - 256, buf + (sizeof(uint32_t) * 4), SHA256_BYTES);
+    persistence_store(w->persistence, buf, total_len, seq);
 
-    rc = mkdirs(w->pref.data_location, S_IRWXU);
-    if (rc < 0) {
-        free(buf);
-        return IOEX_SYS_ERROR(errno);
-    }
+    return 0;
+}
 
-    filename = (char *)alloca(strlen(w->pref.data_location) + strlen(data_filename) + 4);
-    sprintf(filename, "%s/%s", w->pref.data_location, data_filename);
-    journal_filename = (char *)alloca(strlen(w->pref.data_location) + strlen(data_filename) + 16);
-    sprintf(journal_filename, "%s/%s.journal", w->pref.data_location, data_filename);
+static int wakeup_open(IOEXCarrier *w)
+{
+#if defined(__linux__)
+    w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    w->wakeup_wfd = w->wakeup_fd;
 
-    fd = open(journal_filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        free(buf);
-        return IOEX_SYS_ERROR(errno);
+    return w->wakeup_fd < 0 ? -1 : 0;
+#else
+    int fds[2];
+    int i;
+
+    if (pipe(fds) < 0)
+        return -1;
+
+    for (i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
     }
 
-    if (write(fd, buf, total_len) != total_len) {
-        close(fd);
-        remove(journal_filename);
-        return IOEX_SYS_ERROR(errno);
+    w->wakeup_fd = fds[0];
+    w->wakeup_wfd = fds[1];
+
+    return 0;
+#endif
+}
+
+static void wakeup_close(IOEXCarrier *w)
+{
+    if (w->wakeup_wfd >= 0 && w->wakeup_wfd != w->wakeup_fd)
+        close(w->wakeup_wfd);
+
+    if (w->wakeup_fd >= 0)
+        close(w->wakeup_fd);
+}
+
+/* Called from any thread, after leaving work for the loop. */
+static void carrier_wakeup(IOEXCarrier *w)
+{
+#if defined(__linux__)
+    uint64_t value = 1;
+#else
+    uint8_t value = 1;
+#endif
+
+    if (w->wakeup_wfd >= 0)
+        (void)!write(w->wakeup_wfd, &value, sizeof(value));
+}
+
+static void fileio_wakeup(void *context)
+{
+    carrier_wakeup((IOEXCarrier *)context);
+}
+
+/*
+ * Has the carrier thread take a snapshot of the persistent data shortly,
+ * rather than serializing DHT state from the calling thread.
+ */
+static void mark_persistence_dirty(IOEXCarrier *w)
+{
+    __atomic_store_n(&w->persistence_dirty, 1, __ATOMIC_RELEASE);
+    carrier_wakeup(w);
+}
+
+/*
+ * Friend and label changes are made durable by the change log right away,
+ * the snapshot taken later folds them in.
+ */
+static void log_friend_change(IOEXCarrier *w, PersistenceRecordType type,
+                              FriendInfo *fi)
+{
+    persistence_log(w->persistence, type, fi->public_key, fi->info.label);
+    mark_persistence_dirty(w);
+}
+
+static void replay_friend_change(PersistenceRecordType type,
+                                 const uint8_t *public_key,
+                                 const char *label, void *context)
+{
+    IOEXCarrier *w = (IOEXCarrier *)context;
+    uint32_t friend_number;
+    int exist;
+
+    exist = dht_get_friend_number(&w->dht, public_key, &friend_number) == 0;
+
+    if (type == PersistenceRecord_FriendAdded && !exist)
+        dht_friend_add_norequest(&w->dht, public_key, &friend_number);
+    else if (type == PersistenceRecord_FriendRemoved && exist)
+        dht_friend_delete(&w->dht, friend_number);
+}
+
+static void replay_label_change(PersistenceRecordType type,
+                                const uint8_t *public_key,
+                                const char *label, void *context)
+{
+    IOEXCarrier *w = (IOEXCarrier *)context;
+    uint32_t friend_number;
+    FriendInfo *fi;
+
+    if (type != PersistenceRecord_Label ||
+            dht_get_friend_number(&w->dht, public_key, &friend_number) < 0)
+        return;
+
+    fi = friends_get(w->friends, friend_number);
+    if (fi) {
+        strcpy(fi->info.label, label);
+        deref(fi);
     }
+}
 
-    if (fsync(fd) < 0) {
-        close(fd);
-        remove(journal_filename);
-        return IOEX_SYS_ERROR(errno);
+/*
+ * Takes a snapshot a while after the data changed, so a burst of changes
+ * costs a single one, and every now and then regardless.
+ */
+static void do_persistence(IOEXCarrier *w)
+{
+    uint64_t now = get_monotonic_time();
+
+    if (__atomic_exchange_n(&w->persistence_dirty, 0, __ATOMIC_ACQ_REL)) {
+        if (!w->persistence_due)
+            w->persistence_due = now + PERSISTENCE_DELAY;
     }
 
-    close(fd);
-    free(buf);
+    if (!w->persistence_due &&
+            now - w->persistence_taken >= PERSISTENCE_INTERVAL)
+        w->persistence_due = now;
 
-    remove(filename);
-    rename(journal_filename, filename);
+    if (w->persistence_due && now >= w->persistence_due)
+        take_persistence_snapshot(w);
+}
 
-    return 0;
+static void wakeup_drain(IOEXCarrier *w)
+{
+    uint64_t value[16];
+
+    while (read(w->wakeup_fd, value, sizeof(value)) > 0) {
+#if defined(__linux__)
+        break;
+#endif
+    }
 }
 
 static void IOEX_destroy(void *argv)
 {
     IOEXCarrier *w = (IOEXCarrier *)argv;
 
+    // Stopped first, it wakes the carrier up.
+    if (w->fileio)
+        deref(w->fileio);
+
+    // Changes made to a carrier never run; the writer stores the snapshot
+    // before it stops.
+    if (w->persistence) {
+        if (__atomic_load_n(&w->persistence_dirty, __ATOMIC_ACQUIRE) ||
+                w->persistence_due)
+            take_persistence_snapshot(w);
+        deref(w->persistence);
+    }
+
+    wakeup_close(w);
+
     if (w->pref.data_location)
         free(w->pref.data_location);
 
@@ -975,9 +1157,26 @@ static void IOEX_destroy(void *argv)
     if (w->friends)
         deref(w->friends);
 
+    if (w->friend_index)
+        deref(w->friend_index);
+
     if (w->friend_events)
         deref(w->friend_events);
 
+    if (w->file_stream_events)
+        deref(w->file_stream_events);
+
+    if (w->outq_friends)
+        deref(w->outq_friends);
+
+    if (w->outq_sending.data)
+        free(w->outq_sending.data);
+
+    pthread_mutex_destroy(&w->outq_lock);
+
+    if (w->file_sched)
+        deref(w->file_sched);
+
     if (w->file_senders)
         deref(w->file_senders);
 
@@ -1011,6 +1210,17 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
+    w->wakeup_fd = -1;
+    w->wakeup_wfd = -1;
+
+    pthread_mutex_init(&w->outq_lock, NULL);
+
+    if (wakeup_open(w) < 0) {
+        IOEX_set_error(IOEX_SYS_ERROR(errno));
+        deref(w);
+        return NULL;
+    }
+
     w->pref.udp_enabled = opts->udp_enabled;
     w->pref.data_location = strdup(opts->persistent_location);
     w->pref.bootstraps_size = opts->bootstraps_size;
@@ -1084,6 +1294,11 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
+    // Friends added or removed after the data was stored, labels follow
+    // once the friends are known.
+    persistence_replay(w->pref.data_location, data_filename, data.seq,
+                       replay_friend_change, w);
+
     w->friends = friends_create();
     if (!w->friends) {
         free_persistence_data(&data);
@@ -1092,6 +1307,14 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
+    w->friend_index = friend_index_create();
+    if (!w->friend_index) {
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
     w->friend_events = list_create(1, NULL);
     if (!w->friend_events) {
         free_persistence_data(&data);
@@ -1100,7 +1323,23 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
-    w->file_senders = list_create(1, NULL);
+    w->file_stream_events = list_create(1, NULL);
+    if (!w->file_stream_events) {
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->outq_friends = list_create(1, NULL);
+    if (!w->outq_friends) {
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->file_senders = file_trackers_create(16);
     if (!w->file_senders) {
         free_persistence_data(&data);
         deref(w);
@@ -1108,7 +1347,7 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
-    w->file_receivers = list_create(1, NULL);
+    w->file_receivers = file_trackers_create(16);
     if (!w->file_receivers) {
         free_persistence_data(&data);
         deref(w);
@@ -1116,6 +1355,24 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
         return NULL;
     }
 
+    w->file_sched = list_create(0, NULL);
+    if (!w->file_sched) {
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    w->fileio = fileio_create(fileio_wakeup, w);
+    if (!w->fileio) {
+        int err = errno;
+
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_SYS_ERROR(err));
+        return NULL;
+    }
+
     w->tcallbacks = transacted_callbacks_create(32);
     if (!w->tcallbacks) {
         free_persistence_data(&data);
@@ -1149,9 +1406,23 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
     }
 
     apply_extra_data(w, data.extra_savedata, data.extra_savedata_len);
+    persistence_replay(w->pref.data_location, data_filename, data.seq,
+                       replay_label_change, w);
+
+    if (mkdirs(w->pref.data_location, S_IRWXU) < 0 ||
+            !(w->persistence = persistence_create(w->pref.data_location,
+                                                  data_filename, data.seq))) {
+        int err = errno;
+
+        free_persistence_data(&data);
+        deref(w);
+        IOEX_set_error(IOEX_SYS_ERROR(err));
+        return NULL;
+    }
+
     free_persistence_data(&data);
 
-    store_persistence_data(w);
+    take_persistence_snapshot(w);
 
     srand((unsigned int)time(NULL));
 
@@ -1165,6 +1436,14 @@ IOEXCarrier *IOEX_new(const IOEXOptions *opts,
     return w;
 }
 
+static void carrier_stop(IOEXCarrier *w);
+static void file_transfers_interrupt(IOEXCarrier *w, uint32_t friend_number);
+static void file_transfers_resume(IOEXCarrier *w, uint32_t friend_number);
+static void friend_outq_schedule(IOEXCarrier *w, FriendInfo *fi);
+static void handle_file_stream_request(IOEXCarrier *w, uint32_t friend_number,
+                                       const char *friendid,
+                                       const void *data, size_t len);
+
 void IOEX_kill(IOEXCarrier *w)
 {
     if (!w) {
@@ -1174,8 +1453,11 @@ void IOEX_kill(IOEXCarrier *w)
 
     if (w->running) {
         w->quit = 1;
+        carrier_wakeup(w);
 
-        if (!pthread_equal(pthread_self(), w->main_thread))
+        if (w->embedded)
+            carrier_stop(w);
+        else if (!pthread_equal(pthread_self(), w->main_thread))
             while(!w->quit) usleep(5000);
     }
 
@@ -1275,7 +1557,7 @@ void notify_friend_description_cb(uint32_t friend_number, const uint8_t *desc,
     }
 
     ui = &fi->info.user_info;
-    unpack_user_desc(desc, length, ui, &changed);
+    unpack_user_desc(desc, length, ui, &fi->features, &changed);
 
     if (changed) {
         IOEXFriendInfo tmpfi;
@@ -1322,6 +1604,18 @@ void notify_friend_connection_cb(uint32_t friend_number, bool connected,
         fi->info.status = status;
         strcpy(tmpid, fi->info.user_info.userid);
 
+        if (connected) {
+            file_transfers_resume(w, friend_number);
+
+            // Messages held while offline.
+            pthread_mutex_lock(&w->outq_lock);
+            if (fi->outq.len > 0)
+                friend_outq_schedule(w, fi);
+            pthread_mutex_unlock(&w->outq_lock);
+        } else {
+            file_transfers_interrupt(w, friend_number);
+        }
+
         notify_friend_connection(w, tmpid, status);
     }
 
@@ -1376,25 +1670,26 @@ void notify_friend_request_cb(const uint8_t *public_key, const uint8_t* gretting
                               size_t length, void *context)
 {
     IOEXCarrier *w = (IOEXCarrier *)context;
-    uint32_t friend_number;
-    IOEXCP* cp;
+    FriendInfo *fi;
+    IOEXCPStorage storage;
+    IOEXCP *cp;
     IOEXUserInfo ui;
     size_t _len = sizeof(ui.userid);
     const char *name;
     const char *descr;
     const char *hello;
-    int rc;
 
     assert(public_key);
     assert(gretting && length > 0);
 
-    rc = dht_get_friend_number(&w->dht, public_key, &friend_number);
-    if (rc == 0 && friend_number != UINT32_MAX) {
+    fi = friend_index_get_by_key(w->friend_index, public_key);
+    if (fi) {
+        deref(fi);
         vlogW("Carrier: friend already exist, dropped friend request.");
         return;
     }
 
-    cp = IOEXcp_decode(gretting, length);
+    cp = IOEXcp_decode_into(&storage, gretting, length);
     if (!cp) {
         vlogE("Carrier: Inavlid friend request, dropped this request.");
         return;
@@ -1402,7 +1697,6 @@ void notify_friend_request_cb(const uint8_t *public_key, const uint8_t* gretting
 
     if (IOEXcp_get_type(cp) != IOEXCP_TYPE_FRIEND_REQUEST) {
         vlogE("Carrier: Invalid friend request, dropped this request.");
-        IOEXcp_free(cp);
         return;
     }
 
@@ -1420,47 +1714,49 @@ void notify_friend_request_cb(const uint8_t *public_key, const uint8_t* gretting
 
     if (w->callbacks.friend_request)
         w->callbacks.friend_request(w, ui.userid, &ui, hello, w->context);
-
-    IOEXcp_free(cp);
 }
 
-static void notify_friend_added(IOEXCarrier *w, IOEXFriendInfo *fi)
+static void notify_friend_added(IOEXCarrier *w, FriendInfo *fi)
 {
     FriendEvent *event;
 
     assert(w);
     assert(fi);
 
-    store_persistence_data(w);
+    log_friend_change(w, PersistenceRecord_FriendAdded, fi);
 
     event = (FriendEvent *)rc_alloc(sizeof(FriendEvent), NULL);
     if (event) {
         event->type = FriendEventType_Added;
-        memcpy(&event->fi, fi, sizeof(*fi));
+        memcpy(&event->fi, &fi->info, sizeof(fi->info));
 
         event->le.data = event;
         list_push_tail(w->friend_events, &event->le);
         deref(event);
+
+        carrier_wakeup(w);
     }
 }
 
-static void notify_friend_removed(IOEXCarrier *w, IOEXFriendInfo *fi)
+static void notify_friend_removed(IOEXCarrier *w, FriendInfo *fi)
 {
     FriendEvent *event;
 
     assert(w);
     assert(fi);
 
-    store_persistence_data(w);
+    log_friend_change(w, PersistenceRecord_FriendRemoved, fi);
 
     event = (FriendEvent *)rc_alloc(sizeof(FriendEvent), NULL);
     if (event) {
         event->type = FriendEventType_Removed;
-        memcpy(&event->fi, fi, sizeof(*fi));
+        memcpy(&event->fi, &fi->info, sizeof(fi->info));
 
         event->le.data = event;
         list_push_tail(w->friend_events, &event->le);
         deref(event);
+
+        carrier_wakeup(w);
     }
 }
 
@@ -1524,11 +1820,13 @@ void handle_friend_message(IOEXCarrier *w, uint32_t friend_number, IOEXCP *cp)
     const char *name;
     const void *msg;
     size_t len;
+    size_t i;
 
     assert(w);
     assert(friend_number != UINT32_MAX);
     assert(cp);
-    assert(IOEXcp_get_type(cp) == IOEXCP_TYPE_MESSAGE);
+    assert(IOEXcp_get_type(cp) == IOEXCP_TYPE_MESSAGE ||
+           IOEXcp_get_type(cp) == IOEXCP_TYPE_MESSAGE_BATCH);
 
     fi = friends_get(w->friends, friend_number);
     if (!fi) {
@@ -1540,6 +1838,15 @@ void handle_friend_message(IOEXCarrier *w, uint32_t friend_number, IOEXCP *cp)
     strcpy(friendid, fi->info.user_info.userid);
     deref(fi);
 
+    if (IOEXcp_get_type(cp) == IOEXCP_TYPE_MESSAGE_BATCH) {
+        for (i = 0; i < IOEXcp_get_message_count(cp); i++) {
+            msg = IOEXcp_get_message(cp, i, &name, &len);
+            if (msg && !name && w->callbacks.friend_message)
+                w->callbacks.friend_message(w, friendid, msg, len, w->context);
+        }
+        return;
+    }
+
     name = IOEXcp_get_extension(cp);
     msg  = IOEXcp_get_raw_data(cp);
     len  = IOEXcp_get_raw_data_length(cp);
@@ -1593,6 +1900,8 @@ void handle_invite_request(IOEXCarrier *w, uint32_t friend_number, IOEXCP *cp)
             SessionExtension *ext = (SessionExtension *)w->session;
             if (ext && ext->friend_invite_cb)
                 ext->friend_invite_cb(w, friendid, data, len, ext);
+        } else if (strcmp(name, IOEX_FILESTREAM_EXTENSION) == 0) {
+            handle_file_stream_request(w, friend_number, friendid, data, len);
         }
     } else {
         if (w->callbacks.friend_invite)
@@ -1659,9 +1968,10 @@ void notify_friend_message_cb(uint32_t friend_number, const uint8_t *message,
                               size_t length, void *context)
 {
     IOEXCarrier *w = (IOEXCarrier *)context;
+    IOEXCPStorage storage;
     IOEXCP *cp;
 
-    cp = IOEXcp_decode(message, length);
+    cp = IOEXcp_decode_into(&storage, message, length);
     if (!cp) {
         vlogE("Carrier: Invalid DHT message, dropped.");
         return;
@@ -1669,6 +1979,7 @@ void notify_friend_message_cb(uint32_t friend_number, const uint8_t *message,
 
     switch(IOEXcp_get_type(cp)) {
     case IOEXCP_TYPE_MESSAGE:
+    case IOEXCP_TYPE_MESSAGE_BATCH:
         handle_friend_message(w, friend_number, cp);
         break;
     case IOEXCP_TYPE_INVITE_REQUEST:
@@ -1681,8 +1992,6 @@ void notify_friend_message_cb(uint32_t friend_number, const uint8_t *message,
         vlogE("Carrier: Unknown DHT message, dropped.");
         break;
     }
-
-    IOEXcp_free(cp);
 }
 
 bool get_fullpath(const FileTracker *ft, char *fullpath)
@@ -1706,92 +2015,775 @@ bool get_fullpath(const FileTracker *ft, char *fullpath)
     return true;
 }
 
-bool is_sender(uint32_t file_number)
-{
-    return file_number < 65536;
-}
+/* Toxcore requests at most TOX_MAX_FILE_CHUNK bytes at once */
+#define FILE_CHUNK_MAX          4096
 
-FileTracker* _find_file_tracker(List *list, uint32_t friend_number, uint32_t file_number)
-{
-    if(!list)
-        return NULL;
+/*
+ * Files sent at once over toxcore, to a friend and overall. Files accepted
+ * beyond are paused until their turn: by priority, then the small ones,
+ * then in order of acceptance.
+ */
+#define FILE_SEND_PEER_MAX      2
+#define FILE_SEND_MAX           8
+#define FILE_SEND_SMALL         (1024 * 1024)
 
-    ListIterator it;
-    FileTracker *ft = NULL;
-    IOEXFileInfo *info = NULL;
-    int rc;
+/* Chunks a file sends before the next one's turn */
+#define FILE_SEND_QUANTUM       16
 
-    list_iterate(list, &it);
-    while(list_iterator_has_next(&it)){
-        rc = list_iterator_next(&it, (void **)&ft);
-        if(rc == 0){
-            break;
-        }
-        info = &ft->fi;
-        if(info->friend_number == friend_number && info->file_index == file_number){
-            return ft;
-        }
-    }
-    return NULL;
-}
+/* Reads queued to the file I/O worker at once, for all files */
+#define FILE_READS_MAX          4
 
-FileTracker* find_file_sender(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number)
+/* Files of a friend gone offline wait that long to be offered again */
+#define FILE_INTERRUPTED_EXPIRY         (60 * 60 * 1000000ULL)
+#define FILE_EXPIRE_CHECK_INTERVAL      (60 * 1000000ULL)
+
+static void file_tracker_destroy(void *p)
 {
-    return _find_file_tracker(w->file_senders, friend_number, file_number);
+    FileTracker *ft = (FileTracker *)p;
+
+    if (ft->fd >= 0)
+        close(ft->fd);
+
+    if (ft->window)
+        free(ft->window);
+
+    if (ft->next)
+        free(ft->next);
+
+    if (ft->wbuf)
+        free(ft->wbuf);
+
+    // Left on disk to resume the transfer later.
+    fileio_journal_free(ft->journal);
 }
 
-FileTracker* find_file_receiver(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number)
+static FileTracker *file_tracker_create(void)
 {
-    return _find_file_tracker(w->file_receivers, friend_number, file_number);
+    FileTracker *ft;
+
+    ft = (FileTracker *)rc_zalloc(sizeof(FileTracker), file_tracker_destroy);
+    if (!ft)
+        return NULL;
+
+    ft->fd = -1;
+
+    return ft;
 }
 
-int add_new_file_sender(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number, const char *fullpath)
+static void file_tracker_set_fullpath(FileTracker *ft, const char *fullpath)
 {
-    FileTracker *sender = (FileTracker *)rc_alloc(sizeof(FileTracker), NULL);
-    if(sender == NULL){
-        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
-    }
-    if(fullpath == NULL){
-        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
-    }
-
     char *pch = strrchr(fullpath, '/');
     if(pch == NULL){
-        strncpy(sender->fi.file_name, fullpath, sizeof(sender->fi.file_name));
-        strncpy(sender->fi.file_path, "", sizeof(sender->fi.file_path));
+        strncpy(ft->fi.file_name, fullpath, sizeof(ft->fi.file_name));
+        strncpy(ft->fi.file_path, "", sizeof(ft->fi.file_path));
     }
     else{
-        strncpy(sender->fi.file_name, pch+1, sizeof(sender->fi.file_name));
-        strncpy(sender->fi.file_path, fullpath, pch-fullpath+1);
-        sender->fi.file_path[pch-fullpath] = '\0';
+        strncpy(ft->fi.file_name, pch+1, sizeof(ft->fi.file_name));
+        strncpy(ft->fi.file_path, fullpath, pch-fullpath+1);
+        ft->fi.file_path[pch-fullpath] = '\0';
     }
-    sender->fi.friend_number = friend_number;
-    sender->fi.file_index = file_number;
-    sender->le.data = sender;
+}
 
-    list_add(w->file_senders, &sender->le);
-    deref(sender);
+/*
+ * Path the worker opens the file with, passed along the first job only.
+ */
+static const char *file_tracker_path(FileTracker *ft, char *fullpath)
+{
+    if (ft->open_requested || !get_fullpath(ft, fullpath))
+        return NULL;
 
-    return IOEXSUCCESS;
+    ft->open_requested = true;
+    return fullpath;
 }
 
-int add_new_file_receiver(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number, const char *filename)
+int add_new_file_sender(IOEXCarrier *w, uint32_t friend_number,
+                        uint32_t file_number, const char *fullpath,
+                        const uint8_t *file_id, uint64_t file_size,
+                        int priority);
+bool is_sender(uint32_t file_number);
+
+static void file_sender_error(IOEXCarrier *w, FileTracker *ft,
+                              uint64_t position, size_t length)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    FriendInfo *fi;
+
+    get_fullpath(ft, fullpath);
+    vlogE("Cannot respond to the file[%s] chunk request", fullpath);
+
+    fi = friends_get(w->friends, ft->fi.friend_number);
+    if (fi && w->callbacks.file_chunk_send_error) {
+        w->callbacks.file_chunk_send_error(w, IOEX_GENERAL_ERROR(IOEXERR_FILE_INVALID),
+                                           fi->info.user_info.userid, ft->fi.file_index,
+                                           fullpath, position, length, w->context);
+    }
+    deref(fi);
+}
+
+/*
+ * Bytes read ahead from position on, the next buffer following the window.
+ */
+static size_t file_sender_available(FileTracker *ft, uint64_t position)
+{
+    uint64_t window_end = ft->window_pos + ft->window_len;
+
+    if (!ft->window || position < ft->window_pos || position >= window_end +
+            (ft->next ? ft->next_len : 0))
+        return 0;
+
+    return (size_t)(window_end - position) + (ft->next ? ft->next_len : 0);
+}
+
+static const uint8_t *file_sender_data(FileTracker *ft, uint64_t position,
+                                       size_t length, uint8_t *buf)
+{
+    size_t offset = (size_t)(position - ft->window_pos);
+    size_t in_window;
+
+    if (offset >= ft->window_len)
+        return ft->next + (offset - ft->window_len);
+
+    in_window = ft->window_len - offset;
+    if (length <= in_window)
+        return ft->window + offset;
+
+    // Chunk across both buffers.
+    memcpy(buf, ft->window + offset, in_window);
+    memcpy(buf + in_window, ft->next, length - in_window);
+    return buf;
+}
+
+static void file_sender_schedule(IOEXCarrier *w, FileTracker *ft)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    const char *path;
+    uint64_t position;
+
+    if (ft->reading || ft->failed || ft->canceled ||
+        w->file_reads >= FILE_READS_MAX)
+        return;
+
+    if (ft->req_pos < ft->req_end && !file_sender_available(ft, ft->req_pos))
+        position = ft->req_pos;
+    else if (ft->window && !ft->next && !ft->eof)
+        position = ft->window_pos + ft->window_len;
+    else
+        return;
+
+    path = file_tracker_path(ft, fullpath);
+    if (fileio_read(w->fileio, ft, path, position) < 0) {
+        vlogE("Carrier: Queue file read error.");
+        if (path)
+            ft->open_requested = false;
+        return;
+    }
+
+    ft->reading = true;
+    w->file_reads++;
+}
+
+/*
+ * Sends up to quantum requested chunks the worker has read already, in order
+ * as toxcore wants them, then has the worker read ahead. Returns the number
+ * of chunks sent.
+ */
+static int file_sender_serve(IOEXCarrier *w, FileTracker *ft, int quantum)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    uint8_t buf[FILE_CHUNK_MAX];
+    const uint8_t *data;
+    FriendInfo *fi = NULL;
+    uint64_t window_end;
+    size_t length;
+    size_t avail;
+    int sent = 0;
+    int rc;
+
+    while (ft->req_pos < ft->req_end && sent < quantum) {
+        length = ft->req_end - ft->req_pos;
+        if (length > ft->req_chunk)
+            length = ft->req_chunk;
+
+        avail = file_sender_available(ft, ft->req_pos);
+        if (avail < length) {
+            if (!ft->eof || ft->req_pos + avail < ft->eof_pos)
+                break;
+
+            // Last chunk of the file.
+            length = avail;
+        }
+
+        if (length == 0) {
+            file_sender_error(w, ft, ft->req_pos, ft->req_end - ft->req_pos);
+            ft->req_pos = ft->req_end;
+            break;
+        }
+
+        if (!fi) {
+            fi = friends_get(w->friends, ft->fi.friend_number);
+            if (!fi)
+                break;
+            get_fullpath(ft, fullpath);
+        }
+
+        data = file_sender_data(ft, ft->req_pos, length, buf);
+
+        rc = dht_file_send_chunk(&w->dht, ft->fi.friend_number, ft->fi.file_index,
+                                 ft->req_pos, data, (int)length);
+        if(rc < 0 && w->callbacks.file_chunk_send_error){
+            w->callbacks.file_chunk_send_error(w, rc, fi->info.user_info.userid, ft->fi.file_index,
+                                               fullpath, ft->req_pos, length, w->context);
+        }
+        else if( w->callbacks.file_chunk_send){
+            w->callbacks.file_chunk_send(w, fi->info.user_info.userid, ft->fi.file_index,
+                                         fullpath, ft->req_pos, length, w->context);
+        }
+
+        ft->req_pos += length;
+        sent++;
+
+        window_end = ft->window_pos + ft->window_len;
+        if (ft->req_pos >= window_end && ft->next) {
+            free(ft->window);
+            ft->window = ft->next;
+            ft->window_pos = window_end;
+            ft->window_len = ft->next_len;
+            ft->next = NULL;
+            ft->next_len = 0;
+        }
+    }
+
+    deref(fi);
+
+    // Toxcore sent what it asked for before it pauses.
+    if (ft->send_state == FileSendState_Pausing && ft->req_pos == ft->req_end) {
+        dht_file_send_pause(&w->dht, ft->fi.friend_number, ft->fi.file_index);
+        ft->send_state = FileSendState_Paused;
+    }
+
+    file_sender_schedule(w, ft);
+    return sent;
+}
+
+static void file_sender_read_done(IOEXCarrier *w, FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+
+    ft->reading = false;
+    w->file_reads--;
+
+    if (ft->canceled)
+        return;
+
+    if (job->error) {
+        vlogE("Carrier: Read file error (%d).", job->error);
+        ft->failed = true;
+        if (ft->req_pos < ft->req_end)
+            file_sender_error(w, ft, ft->req_pos, ft->req_end - ft->req_pos);
+        ft->req_pos = ft->req_end;
+        return;
+    }
+
+    if (job->length < FILEIO_READ_SIZE) {
+        ft->eof = true;
+        ft->eof_pos = job->position + job->length;
+    }
+
+    if (job->length > 0) {
+        if (ft->window && !ft->next &&
+                job->position == ft->window_pos + ft->window_len) {
+            ft->next = job->data;
+            ft->next_len = job->length;
+        } else {
+            if (ft->window)
+                free(ft->window);
+            if (ft->next)
+                free(ft->next);
+
+            ft->window = job->data;
+            ft->window_pos = job->position;
+            ft->window_len = job->length;
+            ft->next = NULL;
+            ft->next_len = 0;
+        }
+        job->data = NULL;
+    }
+}
+
+static void file_sender_accept(IOEXCarrier *w, FileTracker *ft);
+
+static void file_sender_request(IOEXCarrier *w, FileTracker *ft,
+                                uint64_t position, size_t length)
+{
+    if (length > FILE_CHUNK_MAX)
+        length = FILE_CHUNK_MAX;
+
+    if (ft->req_pos < ft->req_end && position == ft->req_end) {
+        ft->req_end += length;
+    } else {
+        // First request, or seeked by the receiver.
+        ft->req_pos = position;
+        ft->req_end = position + length;
+        ft->req_chunk = length;
+    }
+
+    // Served along with the others once toxcore is done asking.
+    if (ft->send_state == FileSendState_Offered)
+        file_sender_accept(w, ft);
+}
+
+static bool file_sender_small(FileTracker *ft)
+{
+    return ft->file_size < ft->req_pos + FILE_SEND_SMALL;
+}
+
+/*
+ * Rank of files waiting to be sent: by priority, then the small ones, then
+ * in order of acceptance. Returns < 0 if a goes first.
+ */
+static int file_sender_compare(FileTracker *a, FileTracker *b, bool by_seq)
+{
+    if (a->priority != b->priority)
+        return b->priority - a->priority;
+
+    if (file_sender_small(a) != file_sender_small(b))
+        return file_sender_small(a) ? -1 : 1;
+
+    if (!by_seq || a->seq == b->seq)
+        return 0;
+
+    return a->seq < b->seq ? -1 : 1;
+}
+
+static void file_sender_hold(IOEXCarrier *w, FileTracker *ft)
+{
+    if (ft->req_pos < ft->req_end) {
+        ft->send_state = FileSendState_Pausing;
+    } else {
+        dht_file_send_pause(&w->dht, ft->fi.friend_number, ft->fi.file_index);
+        ft->send_state = FileSendState_Paused;
+    }
+}
+
+static void file_sender_activate(IOEXCarrier *w, FileTracker *ft)
+{
+    if (ft->send_state == FileSendState_Paused)
+        dht_file_send_resume(&w->dht, ft->fi.friend_number, ft->fi.file_index);
+
+    ft->send_state = FileSendState_Active;
+}
+
+/*
+ * Drops the senders gone, canceled from any thread or interrupted.
+ */
+static void file_senders_prune(IOEXCarrier *w)
+{
+    ListIterator it;
+    FileTracker *ft;
+
+    list_iterate(w->file_sched, &it);
+    while (list_iterator_has_next(&it)) {
+        if (list_iterator_next(&it, (void **)&ft) != 1)
+            break;
+
+        if (__atomic_load_n(&ft->canceled, __ATOMIC_ACQUIRE) || ft->interrupted) {
+            ft->send_state = FileSendState_Offered;
+            list_iterator_remove(&it);
+        }
+
+        deref(ft);
+    }
+}
+
+/*
+ * Whether ft can go within the limits, otherwise the lowest ranked active
+ * file it would go in place of: of its friend if the friend has no room.
+ */
+static bool file_senders_room(IOEXCarrier *w, FileTracker *ft,
+                              FileTracker **victim)
+{
+    FileTracker *worst = NULL;
+    FileTracker *peer_worst = NULL;
+    FileTracker *cur;
+    ListIterator it;
+    int total = 0;
+    int peer = 0;
+
+    list_iterate(w->file_sched, &it);
+    while (list_iterator_has_next(&it)) {
+        if (list_iterator_next(&it, (void **)&cur) != 1)
+            break;
+
+        // Still referenced by the list.
+        deref(cur);
+
+        if (cur->send_state != FileSendState_Active)
+            continue;
+
+        total++;
+        if (!worst || file_sender_compare(cur, worst, true) > 0)
+            worst = cur;
+
+        if (cur->fi.friend_number == ft->fi.friend_number) {
+            peer++;
+            if (!peer_worst || file_sender_compare(cur, peer_worst, true) > 0)
+                peer_worst = cur;
+        }
+    }
+
+    if (peer < FILE_SEND_PEER_MAX && total < FILE_SEND_MAX)
+        return true;
+
+    *victim = peer >= FILE_SEND_PEER_MAX ? peer_worst : worst;
+    return false;
+}
+
+/*
+ * Lets the files waiting go within the limits, or in place of active ones
+ * ranked below them.
+ */
+static void file_senders_admit(IOEXCarrier *w)
+{
+    file_senders_prune(w);
+
+    for (;;) {
+        FileTracker *best = NULL;
+        FileTracker *victim = NULL;
+        FileTracker *ft;
+        ListIterator it;
+
+        list_iterate(w->file_sched, &it);
+        while (list_iterator_has_next(&it)) {
+            if (list_iterator_next(&it, (void **)&ft) != 1)
+                break;
+
+            deref(ft);
+
+            if (ft->send_state != FileSendState_Active &&
+                (!best || file_sender_compare(ft, best, true) < 0))
+                best = ft;
+        }
+
+        if (!best)
+            break;
+
+        if (!file_senders_room(w, best, &victim)) {
+            // Never in place of a file ranked the same but for the order.
+            if (!victim || file_sender_compare(best, victim, false) >= 0)
+                break;
+
+            file_sender_hold(w, victim);
+        }
+
+        file_sender_activate(w, best);
+    }
+}
+
+static void file_sender_accept(IOEXCarrier *w, FileTracker *ft)
+{
+    if (__atomic_load_n(&ft->canceled, __ATOMIC_ACQUIRE) || ft->interrupted ||
+        ft->streamed || ft->send_state != FileSendState_Offered)
+        return;
+
+    ft->seq = w->file_seq++;
+    ft->send_state = FileSendState_Pausing;
+    ft->le.data = ft;
+    list_add(w->file_sched, &ft->le);
+
+    file_senders_admit(w);
+
+    if (ft->send_state != FileSendState_Active)
+        file_sender_hold(w, ft);
+}
+
+/*
+ * Serves the chunks toxcore requested and the worker read, round robin
+ * across the files a quantum at a time, from the next file on each time.
+ */
+static void file_senders_service(IOEXCarrier *w)
+{
+    FileTracker *ft;
+    size_t count;
+    size_t i;
+    int sent;
+
+    if (__atomic_exchange_n(&w->file_sched_changed, 0, __ATOMIC_ACQ_REL))
+        file_senders_admit(w);
+
+    count = list_size(w->file_sched);
+    if (count == 0)
+        return;
+
+    do {
+        sent = 0;
+        for (i = 0; i < count; i++) {
+            ft = (FileTracker *)list_get(w->file_sched, (int)i);
+
+            if (ft->send_state == FileSendState_Active ||
+                ft->send_state == FileSendState_Pausing)
+                sent += file_sender_serve(w, ft, FILE_SEND_QUANTUM);
+
+            deref(ft);
+        }
+    } while (sent > 0);
+
+    ft = (FileTracker *)list_pop_head(w->file_sched);
+    list_push_tail(w->file_sched, &ft->le);
+    deref(ft);
+}
+
+/*
+ * Hands the gathered chunks over to the worker.
+ */
+static void file_receiver_flush(IOEXCarrier *w, FileTracker *ft)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    const char *path;
+    int rc;
+
+    if (!ft->wbuf_len)
+        return;
+
+    path = file_tracker_path(ft, fullpath);
+    rc = fileio_write(w->fileio, ft, path, ft->wbuf_pos, ft->wbuf,
+                      ft->wbuf_len);
+    if (rc < 0) {
+        vlogE("Carrier: Queue file write error.");
+        if (path)
+            ft->open_requested = false;
+    } else if (rc > 0) {
+        // The disk lags behind, resumed once the worker catches up.
+        vlogD("Carrier: Pause receiving file %u, writes queued.",
+              ft->fi.file_index);
+        dht_file_send_pause(&w->dht, ft->fi.friend_number, ft->fi.file_index);
+    }
+
+    ft->wbuf = NULL;
+    ft->wbuf_len = 0;
+}
+
+static int file_receiver_write(IOEXCarrier *w, FileTracker *ft,
+                               uint64_t position, const uint8_t *data,
+                               size_t length)
+{
+    if (ft->wbuf_len && (position != ft->wbuf_pos + ft->wbuf_len ||
+                         ft->wbuf_len + length > FILEIO_READ_SIZE))
+        file_receiver_flush(w, ft);
+
+    if (!ft->wbuf) {
+        ft->wbuf = (uint8_t *)malloc(length > FILEIO_READ_SIZE ?
+                                     length : FILEIO_READ_SIZE);
+        if (!ft->wbuf)
+            return -1;
+
+        ft->wbuf_pos = position;
+    }
+
+    memcpy(ft->wbuf + ft->wbuf_len, data, length);
+    ft->wbuf_len += length;
+
+    if (ft->wbuf_len >= FILEIO_READ_SIZE)
+        file_receiver_flush(w, ft);
+
+    return 0;
+}
+
+static void file_receiver_finish(IOEXCarrier *w, FileTracker *ft,
+                                 uint64_t size)
+{
+    file_receiver_flush(w, ft);
+
+    // Drops stale data past the end if the file existed already.
+    if (ft->open_requested && fileio_finish(w->fileio, ft, size) < 0)
+        vlogW("Carrier: Queue file truncate error.");
+}
+
+static void file_receiver_corrupted(IOEXCarrier *w, FileTracker *ft)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    char friendid[IOEX_MAX_ID_LEN + 1] = {0};
+    FriendInfo *fi;
+
+    get_fullpath(ft, fullpath);
+    vlogE("Carrier: File %s does not match its hash.", fullpath);
+
+    fi = friends_get(w->friends, ft->fi.friend_number);
+    if (fi) {
+        strcpy(friendid, fi->info.user_info.userid);
+        deref(fi);
+    }
+
+    if (w->callbacks.file_receive_error)
+        w->callbacks.file_receive_error(w, IOEX_GENERAL_ERROR(IOEXERR_FILE_CORRUPTED),
+                                        friendid, ft->fi.file_index, fullpath,
+                                        w->context);
+}
+
+/*
+ * Offers the file hashed on the worker, the tracker only carried its path,
+ * friend and priority meanwhile.
+ */
+static void file_sender_hashed(IOEXCarrier *w, FileIOJob *job)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    FileTracker *ft = job->ft;
+    uint32_t file_number = UINT32_MAX;
+    int rc;
+
+    get_fullpath(ft, fullpath);
+
+    if (job->error) {
+        vlogE("Carrier: Hash file %s error (%d), not offered.", fullpath,
+              job->error);
+        return;
+    }
+
+    rc = dht_file_send_request(&w->dht, ft->fi.friend_number, fullpath,
+                               job->digest, &file_number);
+    if (rc < 0 || file_number == UINT32_MAX ||
+        add_new_file_sender(w, ft->fi.friend_number, file_number, fullpath,
+                            job->digest, job->position, ft->priority) < 0)
+        vlogE("Carrier: Offer file %s error.", fullpath);
+    else
+        vlogD("Carrier: Offered file %s hashed as %u.", fullpath, file_number);
+}
+
+/*
+ * Completes a file received over a stream, hashed whole on the worker.
+ */
+static void file_receiver_verified(IOEXCarrier *w, FileIOJob *job)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    char friendid[IOEX_MAX_ID_LEN + 1] = {0};
+    FileTracker *ft = job->ft;
+    FriendInfo *fi;
+
+    get_fullpath(ft, fullpath);
+
+    // Corrupted data is not resumed either, the journal goes anyway.
+    fileio_journal_unlink(fullpath);
+
+    if (job->error || job->position != ft->file_size ||
+        memcmp(job->digest, ft->file_id, FILEIO_FILE_ID_LEN) != 0) {
+        if (job->error)
+            vlogE("Carrier: Hash file %s error (%d).", fullpath, job->error);
+        file_receiver_corrupted(w, ft);
+        return;
+    }
+
+    vlogI("File[%s] receive complete.", fullpath);
+
+    fi = friends_get(w->friends, ft->fi.friend_number);
+    if (fi) {
+        strcpy(friendid, fi->info.user_info.userid);
+        deref(fi);
+    }
+
+    if (w->callbacks.file_chunk_receive)
+        w->callbacks.file_chunk_receive(w, friendid, ft->fi.file_index, fullpath,
+                                        ft->file_size, 0, w->context);
+}
+
+static void do_file_io(IOEXCarrier *w)
+{
+    FileIOJob *job;
+
+    while ((job = fileio_poll(w->fileio)) != NULL) {
+        if (job->type == FileIOType_Read) {
+            file_sender_read_done(w, job);
+        } else if (job->type == FileIOType_Hash) {
+            if (is_sender(job->ft->fi.file_index))
+                file_sender_hashed(w, job);
+            else
+                file_receiver_verified(w, job);
+        } else if (job->error == EBADMSG) {
+            file_receiver_corrupted(w, job->ft);
+        } else if (job->error) {
+            char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+
+            get_fullpath(job->ft, fullpath);
+            vlogE("Carrier: Write file %s error (%d).", fullpath, job->error);
+        }
+
+        if (job->drained &&
+            !__atomic_load_n(&job->ft->canceled, __ATOMIC_ACQUIRE)) {
+            vlogD("Carrier: Resume receiving file %u, writes drained.",
+                  job->ft->fi.file_index);
+            dht_file_send_resume(&w->dht, job->ft->fi.friend_number,
+                                 job->ft->fi.file_index);
+        }
+
+        fileio_job_free(job);
+    }
+}
+
+bool is_sender(uint32_t file_number)
+{
+    return file_number < 65536;
+}
+
+/*
+ * Returns a referenced tracker, or NULL.
+ */
+FileTracker* find_file_sender(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number)
+{
+    return file_trackers_get(w->file_senders, friend_number, file_number);
+}
+
+FileTracker* find_file_receiver(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number)
+{
+    return file_trackers_get(w->file_receivers, friend_number, file_number);
+}
+
+int add_new_file_sender(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number, const char *fullpath,
+                        const uint8_t *file_id, uint64_t file_size, int priority)
+{
+    if(fullpath == NULL){
+        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
+    }
+    FileTracker *sender = file_tracker_create();
+    if(sender == NULL){
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+    }
+
+    file_tracker_set_fullpath(sender, fullpath);
+    sender->fi.friend_number = friend_number;
+    sender->fi.file_index = file_number;
+    sender->file_size = file_size;
+    sender->priority = priority;
+    if(file_id){
+        memcpy(sender->file_id, file_id, sizeof(sender->file_id));
+        sender->hashed = true;
+    }
+
+    file_trackers_put(w->file_senders, sender);
+    deref(sender);
+
+    return IOEXSUCCESS;
+}
+
+int add_new_file_receiver(IOEXCarrier *w, uint32_t friend_number, uint32_t file_number, const char *filename,
+                          const uint8_t *file_id, uint64_t file_size)
 {
-    FileTracker *receiver = (FileTracker *)rc_alloc(sizeof(FileTracker), NULL);
-    if(receiver == NULL){
-        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
-    }
     if(filename == NULL){
         return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
     }
+    FileTracker *receiver = file_tracker_create();
+    if(receiver == NULL){
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+    }
 
     strncpy(receiver->fi.file_name, filename, sizeof(receiver->fi.file_name));
     strncpy(receiver->fi.file_path, "/tmp/", sizeof(receiver->fi.file_path));
     receiver->fi.friend_number = friend_number;
     receiver->fi.file_index = file_number;
-    receiver->le.data = receiver;
+    receiver->file_size = file_size;
+    if(file_id){
+        memcpy(receiver->file_id, file_id, sizeof(receiver->file_id));
+        receiver->hashed = true;
+    }
 
-    list_add(w->file_receivers, &receiver->le);
+    file_trackers_put(w->file_receivers, receiver);
     deref(receiver);
 
     return IOEXSUCCESS;
@@ -1799,12 +2791,24 @@ int add_new_file_receiver(IOEXCarrier *w, uint32_t friend_number, uint32_t file_
 
 void remove_file_sender(IOEXCarrier *w, FileTracker *sender)
 {
-    deref(list_remove_entry(w->file_senders, &sender->le));
+    if(sender){
+        // Reads still queued for it are dropped.
+        __atomic_store_n(&sender->canceled, true, __ATOMIC_RELEASE);
+        deref(file_trackers_remove(w->file_senders, sender->fi.friend_number, sender->fi.file_index));
+
+        // The next file waiting goes, from the loop as this may be an API call.
+        if (sender->send_state != FileSendState_Offered) {
+            __atomic_store_n(&w->file_sched_changed, 1, __ATOMIC_RELEASE);
+            carrier_wakeup(w);
+        }
+    }
 }
 
 void remove_file_receiver(IOEXCarrier *w, FileTracker *receiver)
 {
-    deref(list_remove_entry(w->file_receivers, &receiver->le));
+    if(receiver){
+        deref(file_trackers_remove(w->file_receivers, receiver->fi.friend_number, receiver->fi.file_index));
+    }
 }
 
 int update_file_receiver_path(FileTracker *receiver, const char *filename, const char *filepath)
@@ -1820,9 +2824,367 @@ int update_file_receiver_path(FileTracker *receiver, const char *filename, const
     return IOEXSUCCESS;
 }
 
+/*
+ * Returns a referenced tracker of the friend, or NULL.
+ */
+static FileTracker *file_tracker_of_friend(Hashtable *trackers,
+                                           uint32_t friend_number,
+                                           bool interrupted)
+{
+    HashtableIterator it;
+    FileTracker *ft;
+    int rc;
+
+refind:
+    file_trackers_iterate(trackers, &it);
+    while (hashtable_iterator_has_next(&it)) {
+        rc = file_trackers_iterator_next(&it, &ft);
+        if (rc == 0)
+            break;
+
+        if (rc < 0)
+            goto refind;
+
+        if (ft->fi.friend_number == friend_number &&
+            ft->interrupted == interrupted)
+            return ft;
+
+        deref(ft);
+    }
+
+    return NULL;
+}
+
+/*
+ * Toxcore drops the transfers of a friend going offline. Data received is
+ * kept with its journal, and files offered with their hash are offered
+ * again once the friend is back.
+ */
+static void file_transfers_interrupt(IOEXCarrier *w, uint32_t friend_number)
+{
+    FileTracker *ft;
+
+    while ((ft = file_tracker_of_friend(w->file_receivers, friend_number,
+                                        false)) != NULL) {
+        file_receiver_flush(w, ft);
+        remove_file_receiver(w, ft);
+        deref(ft);
+    }
+
+    while ((ft = file_tracker_of_friend(w->file_senders, friend_number,
+                                        false)) != NULL) {
+        if (ft->hashed) {
+            ft->interrupted = true;
+            ft->interrupted_at = get_monotonic_time();
+            ft->req_end = ft->req_pos;
+            w->file_sched_changed = 1;
+        } else {
+            remove_file_sender(w, ft);
+        }
+        deref(ft);
+    }
+}
+
+/*
+ * Drops the files kept for friends offline too long, swept every now and
+ * then from the loop.
+ */
+static void file_senders_expire(IOEXCarrier *w)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    uint64_t now = get_monotonic_time();
+    HashtableIterator it;
+    FileTracker *ft;
+    int rc;
+
+    if (now - w->file_expire_checked < FILE_EXPIRE_CHECK_INTERVAL)
+        return;
+
+    w->file_expire_checked = now;
+
+reexpire:
+    file_trackers_iterate(w->file_senders, &it);
+    while (hashtable_iterator_has_next(&it)) {
+        rc = file_trackers_iterator_next(&it, &ft);
+        if (rc == 0)
+            break;
+
+        if (rc < 0)
+            goto reexpire;
+
+        if (ft->interrupted &&
+                now - ft->interrupted_at >= FILE_INTERRUPTED_EXPIRY) {
+            get_fullpath(ft, fullpath);
+            vlogI("Carrier: File %s not offered again, friend %u offline "
+                  "too long.", fullpath, ft->fi.friend_number);
+            remove_file_sender(w, ft);
+        }
+
+        deref(ft);
+    }
+}
+
+static void file_transfers_resume(IOEXCarrier *w, uint32_t friend_number)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    FileTracker **offers = NULL;
+    FileTracker *ft;
+    uint32_t file_number;
+    size_t count = 0;
+    size_t i;
+    int rc;
+
+    // All taken out first, the new file numbers may clash with old ones.
+    while ((ft = file_tracker_of_friend(w->file_senders, friend_number,
+                                        true)) != NULL) {
+        FileTracker **p = (FileTracker **)realloc(offers, (count + 1) * sizeof(*p));
+
+        remove_file_sender(w, ft);
+        if (!p) {
+            deref(ft);
+            continue;
+        }
+
+        offers = p;
+        offers[count++] = ft;
+    }
+
+    for (i = 0; i < count; i++) {
+        ft = offers[i];
+
+        file_number = UINT32_MAX;
+        get_fullpath(ft, fullpath);
+        rc = dht_file_send_request(&w->dht, friend_number, fullpath,
+                                   ft->file_id, &file_number);
+        if (rc < 0 || file_number == UINT32_MAX ||
+            add_new_file_sender(w, friend_number, file_number, fullpath,
+                                ft->file_id, ft->file_size, ft->priority) < 0)
+            vlogE("Carrier: Offer file %s again error.", fullpath);
+        else
+            vlogI("Carrier: Offered file %s again as %u.", fullpath, file_number);
+
+        deref(ft);
+    }
+
+    if (offers)
+        free(offers);
+}
+
+static void file_stream_cancel(IOEXCarrier *w, FileTracker *ft)
+{
+    SessionExtension *ext = (SessionExtension *)w->session;
+    FriendInfo *fi;
+
+    if (!ft || !ft->streamed || !ext || !ext->file_cancel_cb)
+        return;
+
+    fi = friends_get(w->friends, ft->fi.friend_number);
+    if (fi) {
+        ext->file_cancel_cb(w, fi->info.user_info.userid, ft->fi.file_index, ext);
+        deref(fi);
+    }
+}
+
+/*
+ * Stream request from the receiver of a file we offered, data is the file
+ * index at the receiver side and the position to send from, in a line
+ * before the SDP.
+ */
+static void handle_file_stream_request(IOEXCarrier *w, uint32_t friend_number,
+                                       const char *friendid,
+                                       const void *data, size_t len)
+{
+    SessionExtension *ext = (SessionExtension *)w->session;
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    char from[IOEX_MAX_ID_LEN + IOEX_MAX_EXTENSION_NAME_LEN + 4];
+    const char *req = (const char *)data;
+    const char *sdp;
+    unsigned long long position;
+    uint32_t fileindex;
+    FileTracker *sender = NULL;
+    int rc = IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
+
+    if (!req || !len || req[len - 1] != 0 ||
+        sscanf(req, "%u %llu", &fileindex, &position) != 2 ||
+        (sdp = strchr(req, '\n')) == NULL)
+        goto refuse;
+    sdp++;
+
+    // The receiver numbers files we send (our number + 1) << 16.
+    rc = IOEX_GENERAL_ERROR(IOEXERR_FILE_TRACKER_INVALID);
+    sender = find_file_sender(w, friend_number, (fileindex >> 16) - 1);
+    if (!sender || !get_fullpath(sender, fullpath))
+        goto refuse;
+
+    rc = IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
+    if (!ext || !ext->file_send_cb)
+        goto refuse;
+
+    sender->streamed = true;
+    rc = ext->file_send_cb(w, friendid, sender->fi.file_index, fullpath,
+                           position, sdp, len - (sdp - req), ext);
+    if (rc < 0) {
+        sender->streamed = false;
+        goto refuse;
+    }
+
+    deref(sender);
+    return;
+
+refuse:
+    vlogW("Carrier: File stream request from %s refused (0x%x).", friendid, rc);
+    deref(sender);
+
+    snprintf(from, sizeof(from), "%s:%s", friendid, IOEX_FILESTREAM_EXTENSION);
+    IOEX_reply_friend_invite(w, from, rc, "File stream refused", NULL, 0);
+}
+
+/*
+ * Called from the stream transfer threads, the events are handled on the
+ * carrier loop in the order reported.
+ */
+void IOEX_file_stream_notify(IOEXCarrier *w, const char *friendid,
+                             uint32_t fileindex, IOEXFileStreamEvent event,
+                             uint64_t position, size_t length, int errcode)
+{
+    FileStreamEvent *ev;
+
+    if (!w || !friendid || strlen(friendid) > IOEX_MAX_ID_LEN)
+        return;
+
+    ev = (FileStreamEvent *)rc_zalloc(sizeof(FileStreamEvent), NULL);
+    if (!ev) {
+        vlogE("Carrier: File %u stream event %d dropped, out of memory.",
+              fileindex, event);
+        return;
+    }
+
+    strcpy(ev->friendid, friendid);
+    ev->fileindex = fileindex;
+    ev->event = event;
+    ev->position = position;
+    ev->length = length;
+    ev->errcode = errcode;
+
+    ev->le.data = ev;
+    list_push_tail(w->file_stream_events, &ev->le);
+    deref(ev);
+
+    carrier_wakeup(w);
+}
+
+static void do_file_stream_event(IOEXCarrier *w, FileStreamEvent *ev)
+{
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
+    const char *friendid = ev->friendid;
+    uint32_t fileindex = ev->fileindex;
+    uint64_t position = ev->position;
+    size_t length = ev->length;
+    uint32_t friend_number;
+    FileTracker *ft;
+    bool sender = is_sender(fileindex);
+    int rc;
+
+    if (get_friend_number(w, friendid, &friend_number) < 0)
+        return;
+
+    ft = sender ? find_file_sender(w, friend_number, fileindex) :
+                  find_file_receiver(w, friend_number, fileindex);
+    if (!ft)
+        return;
+
+    get_fullpath(ft, fullpath);
+
+    switch (ev->event) {
+    case IOEXFileStreamEvent_Sent:
+        if (w->callbacks.file_chunk_send)
+            w->callbacks.file_chunk_send(w, friendid, fileindex, fullpath,
+                                         position, length, w->context);
+        break;
+
+    case IOEXFileStreamEvent_Received:
+        // Toxcore resumes past it if the stream fails later on.
+        if (fileio_record(w->fileio, ft, fullpath, position, length) < 0)
+            vlogW("Carrier: Queue journal record of file %s error.", fullpath);
+        if (w->callbacks.file_chunk_receive)
+            w->callbacks.file_chunk_receive(w, friendid, fileindex, fullpath,
+                                            position, length, w->context);
+        break;
+
+    case IOEXFileStreamEvent_Completed:
+        // The receiver is done first, the sender then drops the idle offer.
+        if (sender) {
+            remove_file_sender(w, ft);
+            dht_file_send_cancel(&w->dht, friend_number, fileindex);
+            carrier_wakeup(w);
+        } else {
+            remove_file_receiver(w, ft);
+
+            // Reported complete once the whole file matches its hash.
+            if (ft->hashed && fileio_hash(w->fileio, ft, fullpath) == 0)
+                break;
+
+            if (ft->hashed)
+                vlogW("Carrier: Queue hash of file %s error, not verified.",
+                      fullpath);
+
+            fileio_journal_unlink(fullpath);
+            vlogI("File[%s] receive complete.", fullpath);
+            if (w->callbacks.file_chunk_receive)
+                w->callbacks.file_chunk_receive(w, friendid, fileindex, fullpath,
+                                                position, 0, w->context);
+        }
+        break;
+
+    case IOEXFileStreamEvent_Failed:
+        vlogW("Carrier: File %s stream failed at %llu (0x%x).", fullpath,
+              (unsigned long long)position, ev->errcode);
+        ft->streamed = false;
+
+        // Toxcore is yet to be accepted, and the sender waits for that.
+        if (!sender && !ft->canceled) {
+            if (position > 0)
+                dht_file_send_seek(&w->dht, friend_number, fileindex, position);
+            rc = dht_file_send_accept(&w->dht, friend_number, fileindex);
+            carrier_wakeup(w);
+            if (rc < 0)
+                vlogE("Carrier: Accept file %s error (0x%x).", fullpath, rc);
+        }
+        break;
+    }
+
+    deref(ft);
+}
+
+static void do_file_stream_events(IOEXCarrier *w)
+{
+    List *events = w->file_stream_events;
+    ListIterator it;
+
+redo_events:
+    list_iterate(events, &it);
+    while (list_iterator_has_next(&it)) {
+        FileStreamEvent *ev;
+        int rc;
+
+        rc = list_iterator_next(&it, (void **)&ev);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto redo_events;
+
+        do_file_stream_event(w, ev);
+        list_iterator_remove(&it);
+
+        deref(ev);
+    }
+}
+
 static 
 void notify_file_request_cb(uint32_t friend_number, uint32_t file_number, 
-                            const uint8_t *filename, uint64_t filesize, void *context)
+                            const uint8_t *file_id, const uint8_t *filename,
+                            uint64_t filesize, void *context)
 {
     IOEXCarrier *w = (IOEXCarrier *)context;
     FriendInfo *fi;
@@ -1838,7 +3200,10 @@ void notify_file_request_cb(uint32_t friend_number, uint32_t file_number,
         return;
     }
 
-    rc = add_new_file_receiver(w, friend_number, file_number, (char *)filename);
+    // Journaled to be resumed and verified if file id is the content hash.
+    rc = add_new_file_receiver(w, friend_number, file_number, (char *)filename,
+                               (fi->features & IOEXCP_FEATURE_FILE_HASH) ? file_id : NULL,
+                               filesize);
     if(rc < 0){
         IOEX_set_error(rc);
         vlogE("Carrier: cannot add file receiver for friend_number:%u, file_number:%u (0x%08X)", friend_number, file_number, rc);
@@ -1866,11 +3231,14 @@ void notify_file_accepted_cb(const uint32_t friend_number, const uint32_t file_n
         return;
     }
 
-    if(!find_file_sender(w, friend_number, file_number)){
+    FileTracker *sender = find_file_sender(w, friend_number, file_number);
+    if(!sender){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_TRACKER_INVALID));
         vlogE("Carrier: cannot find file sender for friend_number:%u file_number:%u", friend_number, file_number);
         return;
     }
+    file_sender_accept(w, sender);
+    deref(sender);
 
     if(w->callbacks.file_accepted){
         w->callbacks.file_accepted(w, fi->info.user_info.userid, file_number, w->context);
@@ -1900,6 +3268,7 @@ void notify_file_rejected_cb(const uint32_t friend_number, const uint32_t file_n
         return;
     }
     remove_file_sender(w, sender);
+    deref(sender);
 
     if(w->callbacks.file_rejected){
         w->callbacks.file_rejected(w, fi->info.user_info.userid, file_number, w->context);
@@ -1934,6 +3303,7 @@ void notify_file_paused_cb(const uint32_t friend_number, const uint32_t file_num
         vlogE("Carrier: cannot find file tracker for friend_number:%u file_number:%u", friend_number, file_number);
         return;
     }
+    deref(tracker);
 
     if(w->callbacks.file_paused){
         w->callbacks.file_paused(w, fi->info.user_info.userid, file_number, w->context);
@@ -1968,6 +3338,7 @@ void notify_file_resumed_cb(const uint32_t friend_number, const uint32_t file_nu
         vlogE("Carrier: cannot find file tracker for friend_number:%u file_number:%u", friend_number, file_number);
         return;
     }
+    deref(tracker);
 
     if(w->callbacks.file_resumed){
         w->callbacks.file_resumed(w, fi->info.user_info.userid, file_number, w->context);
@@ -1994,16 +3365,30 @@ void notify_file_canceled_cb(const uint32_t friend_number, const uint32_t file_n
     FileTracker *tracker = NULL;
     if(is_sender(file_number)){
         tracker = find_file_sender(w, friend_number, file_number);
+        file_stream_cancel(w, tracker);
         remove_file_sender(w, tracker);
     }
     else {
         // Receiver side should remove the partially completed file
         tracker = find_file_receiver(w, friend_number, file_number);
+        if(tracker){
+            // Keeps the worker from writing the file again.
+            __atomic_store_n(&tracker->canceled, true, __ATOMIC_RELEASE);
+            file_stream_cancel(w, tracker);
+        }
         if(get_fullpath(tracker, fullpath)){
             unlink(fullpath);
+            fileio_journal_unlink(fullpath);
         }
         remove_file_receiver(w, tracker);
     }
+
+    // Also sent once a file streamed completely, nothing left to report.
+    if(!tracker){
+        vlogD("Carrier: File %u of friend %u canceled, not tracked.", file_number, friend_number);
+        return;
+    }
+    deref(tracker);
     
     if(w->callbacks.file_canceled){
         w->callbacks.file_canceled(w, fi->info.user_info.userid, file_number, w->context);
@@ -2017,7 +3402,6 @@ void notify_file_chunk_request_cb(const uint32_t friend_number, const uint32_t f
     IOEXCarrier *w = (IOEXCarrier *)context;
     FriendInfo *fi;
     char tmpid[IOEX_MAX_ID_LEN + 1];
-    int rc;
 
     assert(friend_number != UINT32_MAX);
 
@@ -2028,43 +3412,26 @@ void notify_file_chunk_request_cb(const uint32_t friend_number, const uint32_t f
     }
     strcpy(tmpid, fi->info.user_info.userid);
 
-    // TODO: use file sender structure to set the event, and do the transimitting in main loop
-    //       don't just send the chunk in this callback
-
-    FILE *fp = NULL;
-    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    // Chunks are sent once the file I/O worker has read them.
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
     FileTracker *sender;
     if((sender = find_file_sender(w, friend_number, file_number)) != NULL){
         if(length == 0){
             remove_file_sender(w, sender);
         }
-        else if(get_fullpath(sender, fullpath)){
-            fp = fopen(fullpath, "rb");
+        else {
+            file_sender_request(w, sender, position, length);
         }
     }
-
-    if(length > 0){
-        if(fp != NULL){
-            fseek(fp, position, SEEK_SET);
-            uint8_t data[4096];
-            int len = fread(data, 1, length, fp);
-            rc = dht_file_send_chunk(&w->dht, friend_number, file_number, position, data, len);
-            fclose(fp);
-            if(rc < 0 && w->callbacks.file_chunk_send_error){
-                w->callbacks.file_chunk_send_error(w, rc, tmpid, file_number, fullpath, position, length, w->context);
-            }
-            else if( w->callbacks.file_chunk_send){
-                w->callbacks.file_chunk_send(w, tmpid, file_number, fullpath, position, length, w->context);
-            }
-        }
-        else {
-            vlogE("Cannot respond to the file[%s] chunk request", fullpath);
-            if(w->callbacks.file_chunk_send_error){
-                w->callbacks.file_chunk_send_error(w, IOEX_GENERAL_ERROR(IOEXERR_FILE_INVALID), tmpid, file_number,
-                                                   fullpath, position, length, w->context);
-            }
+    else if(length > 0){
+        vlogE("Cannot respond to the file[%s] chunk request", fullpath);
+        if(w->callbacks.file_chunk_send_error){
+            w->callbacks.file_chunk_send_error(w, IOEX_GENERAL_ERROR(IOEXERR_FILE_INVALID), tmpid, file_number,
+                                               fullpath, position, length, w->context);
         }
     }
+
+    deref(sender);
 }
 
 static
@@ -2084,38 +3451,32 @@ void notify_file_chunk_receive_cb(uint32_t friend_number, uint32_t file_number,
     }
     strcpy(tmpid, fi->info.user_info.userid);
 
-    // TODO: use file sender structure to set the event, and do the transimitting in main loop
-    //       don't just send the chunk in this callback
-
+    // Chunks are written by the file I/O worker.
     FileTracker *receiver;
-    FILE *fp = NULL;
-    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    char fullpath[IOEX_MAX_FULL_PATH_LEN + 1] = {0};
     if((receiver = find_file_receiver(w, friend_number, file_number)) != NULL){
+        get_fullpath(receiver, fullpath);
         if(length == 0){
+            file_receiver_finish(w, receiver, position);
             remove_file_receiver(w, receiver);
         }
-        else if(get_fullpath(receiver, fullpath)){
-            fp = fopen(fullpath, "ab");
-        }
-    }
-
-    if(length > 0){
-        if(fp != NULL){
-            fseek(fp, position, SEEK_SET);
-            fwrite(data, length, 1, fp);
-            fclose(fp);
-        }
-        else {
+        else if(file_receiver_write(w, receiver, position, data, length) < 0){
             vlogE("Cannot write file chunk to the file[%s]", fullpath);
         }
     }
-    else{
+    else if(length > 0){
+        vlogE("Cannot write file chunk to the file[%s]", fullpath);
+    }
+
+    if(length == 0){
         vlogI("File[%s] receive complete.", fullpath);
     }
 
     if(w->callbacks.file_chunk_receive){
         w->callbacks.file_chunk_receive(w, tmpid, file_number, fullpath, position, length, w->context);
     }
+
+    deref(receiver);
 }
 
 static void connect_to_bootstraps(IOEXCarrier *w)
@@ -2144,18 +3505,253 @@ static void connect_to_bootstraps(IOEXCarrier *w)
     }
 }
 
-int IOEX_run(IOEXCarrier *w, int interval)
+/*
+ * Queued messages are packed back to back as records of the 16-bit message
+ * length, the 8-bit extension name length, the NUL terminated extension
+ * name if any, and the message.
+ */
+#define FRIEND_OUTQ_MAX                 (256 * 1024)
+
+#define BATCH_OVERHEAD                  64
+#define BATCH_MESSAGE_OVERHEAD          40
+
+static int friend_outq_reserve(MessageBuffer *q, size_t len)
+{
+    uint8_t *data;
+    size_t size;
+
+    if (q->len + len <= q->size)
+        return 0;
+
+    size = q->size ? q->size : 4096;
+    while (size < q->len + len)
+        size *= 2;
+
+    data = (uint8_t *)realloc(q->data, size);
+    if (!data)
+        return -1;
+
+    q->data = data;
+    q->size = size;
+
+    return 0;
+}
+
+static void friend_outq_schedule(IOEXCarrier *w, FriendInfo *fi)
+{
+    if (!fi->outq_pending) {
+        fi->outq_pending = 1;
+        fi->outq_le.data = fi;
+        list_push_tail(w->outq_friends, &fi->outq_le);
+    }
+}
+
+static int friend_outq_append(IOEXCarrier *w, FriendInfo *fi, const char *ext,
+                              const void *msg, size_t len)
+{
+    MessageBuffer *q = &fi->outq;
+    size_t ext_len = ext ? strlen(ext) : 0;
+    size_t rec_len = 3 + (ext_len ? ext_len + 1 : 0) + len;
+    uint8_t *pos;
+    int rc = 0;
+
+    assert(len > 0 && len <= UINT16_MAX);
+    assert(ext_len <= UINT8_MAX);
+
+    pthread_mutex_lock(&w->outq_lock);
+
+    if (q->len + rec_len > FRIEND_OUTQ_MAX) {
+        rc = IOEX_GENERAL_ERROR(IOEXERR_BUSY);
+        goto exit;
+    }
+
+    if (friend_outq_reserve(q, rec_len) < 0) {
+        rc = IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+        goto exit;
+    }
+
+    pos = q->data + q->len;
+    *pos++ = (uint8_t)(len >> 8);
+    *pos++ = (uint8_t)len;
+    *pos++ = (uint8_t)ext_len;
+    if (ext_len) {
+        memcpy(pos, ext, ext_len + 1);
+        pos += ext_len + 1;
+    }
+    memcpy(pos, msg, len);
+    q->len += rec_len;
+
+    friend_outq_schedule(w, fi);
+
+exit:
+    pthread_mutex_unlock(&w->outq_lock);
+    return rc;
+}
+
+/*
+ * Puts the unsent messages back in front of those queued meanwhile. Not
+ * rescheduled, they are held until the friend connects again.
+ */
+static void friend_outq_requeue(IOEXCarrier *w, FriendInfo *fi,
+                                const uint8_t *data, size_t len,
+                                bool schedule)
+{
+    MessageBuffer *q = &fi->outq;
+
+    pthread_mutex_lock(&w->outq_lock);
+
+    if (friend_outq_reserve(q, len) < 0) {
+        vlogE("Carrier: Out of memory, %zu bytes of messages to friend %lu "
+              "dropped.", len, fi->friend_number);
+    } else {
+        memmove(q->data + len, q->data, q->len);
+        memcpy(q->data, data, len);
+        q->len += len;
+
+        if (schedule)
+            friend_outq_schedule(w, fi);
+    }
+
+    pthread_mutex_unlock(&w->outq_lock);
+}
+
+static const uint8_t *friend_outq_next(const uint8_t *pos, const char **ext,
+                                       const uint8_t **msg, size_t *len)
+{
+    size_t ext_len;
+
+    *len = ((size_t)pos[0] << 8) | pos[1];
+    ext_len = pos[2];
+    pos += 3;
+
+    *ext = ext_len ? (const char *)pos : NULL;
+    pos += ext_len ? ext_len + 1 : 0;
+
+    *msg = pos;
+    return pos + *len;
+}
+
+static void send_friend_messages(IOEXCarrier *w, FriendInfo *fi,
+                                 const uint8_t *data, size_t len)
+{
+    const uint8_t *pos = data;
+    const uint8_t *end = data + len;
+
+    while (pos < end) {
+        const uint8_t *next;
+        const uint8_t *batch_end;
+        const uint8_t *msg;
+        const char *ext;
+        size_t msg_len;
+        size_t estimated = BATCH_OVERHEAD;
+        size_t count = 0;
+        IOEXCPStorage storage;
+        IOEXCP *cp;
+        const uint8_t *encoded;
+        size_t encoded_len;
+        int rc;
+
+        // Packs small messages together if friend understands batches.
+        for (batch_end = pos; batch_end < end &&
+                count < IOEXCP_MAX_BATCH_MESSAGES; count++) {
+            next = friend_outq_next(batch_end, &ext, &msg, &msg_len);
+            estimated += msg_len + BATCH_MESSAGE_OVERHEAD;
+            if (ext)
+                estimated += strlen(ext);
+
+            if (count > 0 && estimated > DHT_MAX_MESSAGE_LENGTH)
+                break;
+
+            batch_end = next;
+
+            if (!(fi->features & IOEXCP_FEATURE_MESSAGE_BATCH))
+                break;
+        }
+
+        if (batch_end == friend_outq_next(pos, &ext, &msg, &msg_len)) {
+            cp = IOEXcp_init(&storage, IOEXCP_TYPE_MESSAGE, ext);
+            if (cp)
+                IOEXcp_set_raw_data(cp, msg, msg_len);
+        } else {
+            cp = IOEXcp_init(&storage, IOEXCP_TYPE_MESSAGE_BATCH, NULL);
+            for (next = pos; cp && next < batch_end; ) {
+                next = friend_outq_next(next, &ext, &msg, &msg_len);
+                IOEXcp_add_message(cp, ext, msg, msg_len);
+            }
+        }
+
+        if (!cp) {
+            friend_outq_requeue(w, fi, pos, end - pos, true);
+            return;
+        }
+
+        encoded = IOEXcp_encode_reused(cp, &encoded_len);
+
+        if (!encoded) {
+            friend_outq_requeue(w, fi, pos, end - pos, true);
+            return;
+        }
+
+        rc = dht_friend_message(&w->dht, fi->friend_number, encoded,
+                                encoded_len);
+
+        if (rc == IOEX_DHT_ERROR(IOEXERR_OUT_OF_MEMORY)) {
+            // Tox send queue full, retry on next iteration.
+            friend_outq_requeue(w, fi, pos, end - pos, true);
+            return;
+        } else if (rc == IOEX_DHT_ERROR(IOEXERR_FRIEND_OFFLINE)) {
+            // Sent once the friend connects again.
+            friend_outq_requeue(w, fi, pos, end - pos, false);
+            return;
+        } else if (rc < 0) {
+            // Only this batch is refused, the messages behind it go on.
+            vlogW("Carrier: Send messages to friend %lu error (%x), %zu bytes "
+                  "of messages dropped.", fi->friend_number, rc,
+                  (size_t)(batch_end - pos));
+        }
+
+        pos = batch_end;
+    }
+}
+
+static void do_friend_messages(IOEXCarrier *w)
 {
-    if (!w || interval < 0) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
+    size_t nfriends;
+    MessageBuffer sending;
+    FriendInfo *fi;
+    FriendInfo *cur;
 
-    if (interval == 0)
-        interval = 1000; // in milliseconds.
+    // Friends queueing meanwhile are left to the next iteration.
+    nfriends = list_size(w->outq_friends);
 
-    ref(w);
+    while (nfriends-- > 0) {
+        fi = (FriendInfo *)list_pop_head(w->outq_friends);
+        if (!fi)
+            break;
+
+        // Swaps the queue out so callers keep appending while sending.
+        pthread_mutex_lock(&w->outq_lock);
+        sending = fi->outq;
+        fi->outq = w->outq_sending;
+        fi->outq.len = 0;
+        fi->outq_pending = 0;
+        pthread_mutex_unlock(&w->outq_lock);
+
+        w->outq_sending = sending;
+
+        cur = friends_get(w->friends, fi->friend_number);
+        if (cur == fi)
+            send_friend_messages(w, fi, sending.data, sending.len);
+        if (cur)
+            deref(cur);
+
+        w->outq_sending.len = 0;
+        deref(fi);
+    }
+}
 
+static void carrier_start(IOEXCarrier *w)
+{
     w->dht_callbacks.notify_connection = notify_connection_cb;
     w->dht_callbacks.notify_friend_desc = notify_friend_description_cb;
     w->dht_callbacks.notify_friend_connection = notify_friend_connection_cb;
@@ -2174,53 +3770,150 @@ int IOEX_run(IOEXCarrier *w, int interval)
 
     w->dht_callbacks.context = w;
 
+    w->main_thread = pthread_self();
+
     notify_friends(w);
 
     w->running = 1;
 
     connect_to_bootstraps(w);
+}
+
+/*
+ * Processes the work left by API calls, and lets DHT do its work. Returns
+ * the interval before DHT needs to iterate again.
+ */
+static int carrier_iterate(IOEXCarrier *w)
+{
+    int idle_interval;
+
+    wakeup_drain(w);
+
+    do_file_io(w);
+
+    do_friend_messages(w);
+
+    dht_iterate(&w->dht, &w->dht_callbacks);
+
+    file_senders_service(w);
+
+    file_senders_expire(w);
+
+    do_file_stream_events(w);
+
+    do_friend_events(w);
+
+    do_persistence(w);
+
+    // Friends removed meanwhile are released once lookups are done.
+    epoch_collect();
+
+    idle_interval = dht_iteration_idle(&w->dht);
+    if (idle_interval > 0)
+        notify_idle(w);
+
+    // TODO: Check connection:.
+
+    return idle_interval;
+}
+
+static void carrier_stop(IOEXCarrier *w)
+{
+    if (!w->running)
+        return;
+
+    w->running = 0;
+
+    // The DHT state changes all along, the snapshot is taken regardless.
+    __atomic_store_n(&w->persistence_dirty, 0, __ATOMIC_RELEASE);
+    take_persistence_snapshot(w);
+
+    if (persistence_flush(w->persistence) < 0)
+        vlogE("Carrier: Store persistence data error (%d).", errno);
+}
+
+int IOEX_run(IOEXCarrier *w, int interval)
+{
+    struct pollfd pfd;
+
+    if (!w || interval < 0) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (interval == 0)
+        interval = 1000; // in milliseconds.
 
+    ref(w);
+
+    carrier_start(w);
+
+    pfd.fd = w->wakeup_fd;
+    pfd.events = POLLIN;
+
+    // Tox has no sockets of its own to wait on exposed, so it is iterated
+    // when it asks, or as soon as an API call leaves work.
     while(!w->quit) {
         int idle_interval;
-        struct timeval expire;
-        struct timeval check;
-        struct timeval tmp;
 
-        gettimeofday(&expire, NULL);
-
-        idle_interval = dht_iteration_idle(&w->dht);
+        idle_interval = carrier_iterate(w);
         if (idle_interval > interval)
             idle_interval = interval;
 
-        tmp.tv_sec = 0;
-        tmp.tv_usec = idle_interval * 1000;
+        if (w->quit)
+            break;
+
+        if (idle_interval > 0 && poll(&pfd, 1, idle_interval) < 0 &&
+                errno != EINTR) {
+            vlogE("Carrier: Wait for events error (%d).", errno);
+            usleep(idle_interval * 1000);
+        }
+    }
+
+    carrier_stop(w);
 
-        timeradd(&expire, &tmp, &expire);
+    deref(w);
 
-        do_friend_events(w);
+    return 0;
+}
 
-        if (idle_interval > 0)
-            notify_idle(w);
+int IOEX_get_fd(IOEXCarrier *w)
+{
+    if (!w) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
+        return -1;
+    }
 
-        // TODO: Check connection:.
+    return w->wakeup_fd;
+}
 
-        gettimeofday(&check, NULL);
+int IOEX_process_events(IOEXCarrier *w)
+{
+    int idle_interval;
 
-        if (timercmp(&expire, &check, >)) {
-            timersub(&expire, &check, &tmp);
-            usleep(tmp.tv_usec);
-        }
+    if (!w) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
+        return -1;
+    }
 
-        dht_iterate(&w->dht, &w->dht_callbacks);
+    if (w->quit) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE));
+        return -1;
     }
 
-    w->running = 0;
+    // Alive even when killed from a callback meanwhile.
+    ref(w);
 
-    store_persistence_data(w);
+    if (!w->running) {
+        w->embedded = 1;
+        carrier_start(w);
+    }
+
+    idle_interval = carrier_iterate(w);
 
     deref(w);
 
-    return 0;
+    return idle_interval;
 }
 
 char *IOEX_get_address(IOEXCarrier *w, char *address, size_t length)
@@ -2270,6 +3963,7 @@ int IOEX_set_self_nospam(IOEXCarrier *w, uint32_t nospam)
     }
 
     dht_self_set_nospam(&w->dht, nospam);
+    carrier_wakeup(w);
 
     rc = dht_get_self_info(&w->dht, get_self_info_cb, w);
     if (rc < 0) {
@@ -2277,7 +3971,7 @@ int IOEX_set_self_nospam(IOEXCarrier *w, uint32_t nospam)
         return -1;
     }
 
-    store_persistence_data(w);
+    mark_persistence_dirty(w);
 
     return 0;
 }
@@ -2296,8 +3990,9 @@ int IOEX_get_self_nospam(IOEXCarrier *w, uint32_t *nospam)
 
 int IOEX_set_self_info(IOEXCarrier *w, const IOEXUserInfo *info)
 {
+    IOEXCPStorage storage;
     IOEXCP *cp;
-    uint8_t *data;
+    const uint8_t *data;
     size_t data_len;
     bool did_changed = false;
 
@@ -2311,7 +4006,7 @@ int IOEX_set_self_info(IOEXCarrier *w, const IOEXUserInfo *info)
         return -1;
     }
 
-    cp = IOEXcp_create(IOEXCP_TYPE_USERINFO, NULL);
+    cp = IOEXcp_init(&storage, IOEXCP_TYPE_USERINFO, NULL);
     if (!cp) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         return -1;
@@ -2325,8 +4020,6 @@ int IOEX_set_self_info(IOEXCarrier *w, const IOEXUserInfo *info)
         strcmp(info->email, w->me.email) ||
         strcmp(info->region, w->me.region)) {
         did_changed = true;
-    } else {
-        IOEXcp_free(cp);
     }
 
     if (did_changed) {
@@ -2337,9 +4030,9 @@ int IOEX_set_self_info(IOEXCarrier *w, const IOEXUserInfo *info)
         IOEXcp_set_phone(cp, info->phone);
         IOEXcp_set_email(cp, info->email);
         IOEXcp_set_region(cp, info->region);
+        IOEXcp_set_features(cp, CARRIER_FEATURES);
 
-        data = IOEXcp_encode(cp, &data_len);
-        IOEXcp_free(cp);
+        data = IOEXcp_encode_reused(cp, &data_len);
 
         if (!data) {
             IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
@@ -2359,9 +4052,7 @@ int IOEX_set_self_info(IOEXCarrier *w, const IOEXUserInfo *info)
         strcpy(w->me.region, info->region);
         dht_self_set_desc(&w->dht, data, data_len);
 
-        store_persistence_data(w);
-
-        free(data);
+        mark_persistence_dirty(w);
     }
 
     return 0;
@@ -2393,6 +4084,7 @@ int IOEX_set_self_presence(IOEXCarrier *w, IOEXPresenceStatus status)
     }
 
     dht_self_set_status(&w->dht, (int)status);
+    carrier_wakeup(w);
 
     return 0;
 }
@@ -2462,7 +4154,6 @@ int IOEX_get_friends(IOEXCarrier *w,
 int IOEX_get_friend_info(IOEXCarrier *w, const char *friendid,
                         IOEXFriendInfo *info)
 {
-    uint32_t friend_number;
     FriendInfo *fi;
     int rc;
 
@@ -2471,17 +4162,11 @@ int IOEX_get_friend_info(IOEXCarrier *w, const char *friendid,
         return -1;
     }
 
-    rc = get_friend_number(w, friendid, &friend_number);
+    rc = get_friend(w, friendid, &fi);
     if (rc < 0) {
         IOEX_set_error(rc);
         return -1;
     }
-
-    fi = friends_get(w->friends, friend_number);
-    if (!fi) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
     assert(!strcmp(friendid, fi->info.user_info.userid));
 
     memcpy(info, &fi->info, sizeof(IOEXFriendInfo));
@@ -2494,7 +4179,6 @@ int IOEX_get_friend_info(IOEXCarrier *w, const char *friendid,
 int IOEX_set_friend_label(IOEXCarrier *w,
                              const char *friendid, const char *label)
 {
-    uint32_t friend_number;
     FriendInfo *fi;
     int rc;
 
@@ -2508,31 +4192,25 @@ int IOEX_set_friend_label(IOEXCarrier *w,
         return -1;
     }
 
-    rc = get_friend_number(w, friendid, &friend_number);
+    rc = get_friend(w, friendid, &fi);
     if (rc < 0) {
         IOEX_set_error(rc);
         return -1;
     }
-
-    fi = friends_get(w->friends, friend_number);
-    if (!fi) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
     assert(!strcmp(friendid, fi->info.user_info.userid));
 
     strcpy(fi->info.label, label ? label : "");
 
-    deref(fi);
+    log_friend_change(w, PersistenceRecord_Label, fi);
 
-    store_persistence_data(w);
+    deref(fi);
 
     return 0;
 }
 
 bool IOEX_is_friend(IOEXCarrier *w, const char *userid)
 {
-    uint32_t friend_number;
+    FriendInfo *fi;
     int rc;
 
     if (!w || !userid) {
@@ -2540,13 +4218,14 @@ bool IOEX_is_friend(IOEXCarrier *w, const char *userid)
         return false;
     }
 
-    rc = get_friend_number(w, userid, &friend_number);
-    if (rc < 0 || friend_number == UINT32_MAX) {
+    rc = get_friend(w, userid, &fi);
+    if (rc < 0) {
         IOEX_set_error(rc);
         return false;
     }
 
-    return !!friends_exist(w->friends, friend_number);
+    deref(fi);
+    return true;
 }
 
 int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
@@ -2554,8 +4233,9 @@ int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
     uint32_t friend_number;
     FriendInfo *fi;
     uint8_t addr[DHT_ADDRESS_SIZE];
+    IOEXCPStorage storage;
     IOEXCP *cp;
-    uint8_t *data;
+    const uint8_t *data;
     size_t data_len;
     size_t _len;
     int rc;
@@ -2582,19 +4262,21 @@ int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
 
     base58_decode(address, strlen(address), addr, sizeof(addr));
 
-    rc = dht_get_friend_number(&w->dht, addr, &friend_number);
-    if (rc == 0 && friend_number != UINT32_MAX) {
+    // The address starts with the public key.
+    fi = friend_index_get_by_key(w->friend_index, addr);
+    if (fi) {
+        deref(fi);
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_ALREADY_EXIST));
         return -1;
     }
 
-    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), NULL);
+    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), friend_info_destroy);
     if (!fi) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         return -1;
     }
 
-    cp = IOEXcp_create(IOEXCP_TYPE_FRIEND_REQUEST, NULL);
+    cp = IOEXcp_init(&storage, IOEXCP_TYPE_FRIEND_REQUEST, NULL);
     if (!cp) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         deref(fi);
@@ -2605,8 +4287,7 @@ int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
     IOEXcp_set_descr(cp, w->me.description);
     IOEXcp_set_hello(cp, hello);
 
-    data = IOEXcp_encode(cp, &data_len);
-    IOEXcp_free(cp);
+    data = IOEXcp_encode_reused(cp, &data_len);
 
     if (!data) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
@@ -2615,7 +4296,7 @@ int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
     }
 
     rc = dht_friend_add(&w->dht, addr, data, data_len, &friend_number);
-    free(data);
+    carrier_wakeup(w);
 
     if (rc < 0) {
         IOEX_set_error(rc);
@@ -2625,13 +4306,15 @@ int IOEX_add_friend(IOEXCarrier *w, const char *address, const char *hello)
 
     _len = sizeof(fi->info.user_info.userid);
     base58_encode(addr, DHT_PUBLIC_KEY_SIZE, fi->info.user_info.userid, &_len);
+    memcpy(fi->public_key, addr, DHT_PUBLIC_KEY_SIZE);
 
     fi->friend_number = friend_number;
     fi->info.presence = IOEXPresenceStatus_None;
     fi->info.status   = IOEXConnectionStatus_Disconnected;
     friends_put(w->friends, fi);
+    friend_index_put(w->friend_index, fi);
 
-    notify_friend_added(w, &fi->info);
+    notify_friend_added(w, fi);
 
     deref(fi);
 
@@ -2650,7 +4333,8 @@ int IOEX_accept_friend(IOEXCarrier *w, const char *userid)
         return -1;
     }
 
-    if (!is_valid_key(userid)) {
+    if (base58_decode(userid, strlen(userid), public_key,
+                      sizeof(public_key)) != DHT_PUBLIC_KEY_SIZE) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
@@ -2665,20 +4349,21 @@ int IOEX_accept_friend(IOEXCarrier *w, const char *userid)
         return -1;
     }
 
-    rc = get_friend_number(w, userid, &friend_number);
-    if (rc == 0 && friend_number != UINT32_MAX) {
+    fi = friend_index_get_by_key(w->friend_index, public_key);
+    if (fi) {
+        deref(fi);
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_ALREADY_EXIST));
         return -1;
     }
 
-    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), NULL);
+    fi = (FriendInfo *)rc_zalloc(sizeof(FriendInfo), friend_info_destroy);
     if (!fi) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         return -1;
     }
 
-    base58_decode(userid, strlen(userid), public_key, sizeof(public_key));
     rc = dht_friend_add_norequest(&w->dht, public_key, &friend_number);
+    carrier_wakeup(w);
     if (rc < 0) {
         deref(fi);
         IOEX_set_error(rc);
@@ -2686,14 +4371,16 @@ int IOEX_accept_friend(IOEXCarrier *w, const char *userid)
     }
 
     strcpy(fi->info.user_info.userid, userid);
+    memcpy(fi->public_key, public_key, DHT_PUBLIC_KEY_SIZE);
 
     fi->friend_number = friend_number;
     fi->info.presence = IOEXPresenceStatus_None;
     fi->info.status   = IOEXConnectionStatus_Disconnected;
 
     friends_put(w->friends, fi);
+    friend_index_put(w->friend_index, fi);
 
-    notify_friend_added(w, &fi->info);
+    notify_friend_added(w, fi);
 
     deref(fi);
 
@@ -2711,11 +4398,6 @@ int IOEX_remove_friend(IOEXCarrier *w, const char *friendid)
         return -1;
     }
 
-    if (!is_valid_key(friendid)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-
     if (!w->is_ready) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -2727,17 +4409,19 @@ int IOEX_remove_friend(IOEXCarrier *w, const char *friendid)
         return -1;
     }
 
-    if (!friends_exist(w->friends, friend_number)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
-
     dht_friend_delete(&w->dht, friend_number);
+    carrier_wakeup(w);
 
     fi = friends_remove(w->friends, friend_number);
     assert(fi);
 
-    notify_friend_removed(w, &fi->info);
+    friend_index_remove(w->friend_index, fi);
+
+    pthread_mutex_lock(&w->outq_lock);
+    fi->outq.len = 0;
+    pthread_mutex_unlock(&w->outq_lock);
+
+    notify_friend_removed(w, fi);
 
     deref(fi);
 
@@ -2770,11 +4454,8 @@ int IOEX_send_friend_message(IOEXCarrier *w, const char *to, const void *msg,
                             size_t len)
 {
     char *addr, *userid, *ext_name;
-    uint32_t friend_number;
+    FriendInfo *fi;
     int rc;
-    IOEXCP *cp;
-    uint8_t *data;
-    size_t data_len;
 
     if (!w || !to || !msg || !len || len > IOEX_MAX_APP_MESSAGE_LEN) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
@@ -2785,11 +4466,6 @@ int IOEX_send_friend_message(IOEXCarrier *w, const char *to, const void *msg,
     strcpy(addr, to);
     parse_address(addr, &userid, &ext_name);
 
-    if (!is_valid_key(userid)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-
     if (ext_name && strlen(ext_name) > IOEX_MAX_USER_NAME_LEN) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
@@ -2806,41 +4482,29 @@ int IOEX_send_friend_message(IOEXCarrier *w, const char *to, const void *msg,
         return -1;
     }
 
-    rc = get_friend_number(w, userid, &friend_number);
+    rc = get_friend(w, userid, &fi);
     if (rc < 0) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
-
-    if (!friends_exist(w->friends, friend_number)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
-
-    cp = IOEXcp_create(IOEXCP_TYPE_MESSAGE, ext_name);
-    if (!cp) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        IOEX_set_error(rc);
         return -1;
     }
 
-    IOEXcp_set_raw_data(cp, msg, len);
-
-    data = IOEXcp_encode(cp, &data_len);
-    IOEXcp_free(cp);
-
-    if (!data) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+    if (fi->info.status != IOEXConnectionStatus_Connected) {
+        deref(fi);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FRIEND_OFFLINE));
         return -1;
     }
 
-    rc = dht_friend_message(&w->dht, friend_number, data, data_len);
-    free(data);
+    // Sent from carrier thread, see do_friend_messages().
+    rc = friend_outq_append(w, fi, ext_name, msg, len);
+    deref(fi);
 
     if (rc < 0) {
         IOEX_set_error(rc);
         return -1;
     }
 
+    carrier_wakeup(w);
+
     return 0;
 }
 
@@ -2863,11 +4527,12 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
 {
     char *addr, *userid, *ext_name;
     uint32_t friend_number;
+    IOEXCPStorage storage;
     IOEXCP *cp;
     int rc;
     TransactedCallback *tcb;
     int64_t tid;
-    uint8_t *_data;
+    const uint8_t *_data;
     size_t _data_len;
 
     if (!w || !to || !data || !len || !callback) {
@@ -2879,11 +4544,6 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
     strcpy(addr, to);
     parse_address(addr, &userid, &ext_name);
 
-    if (!is_valid_key(userid)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-
     if (ext_name && strlen(ext_name) > IOEX_MAX_USER_NAME_LEN) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
@@ -2896,16 +4556,11 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
 
     rc = get_friend_number(w, userid, &friend_number);
     if (rc < 0) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
-        return -1;
-    }
-
-    if (!friends_exist(w->friends, friend_number)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
+        IOEX_set_error(rc);
         return -1;
     }
 
-    cp = IOEXcp_create(IOEXCP_TYPE_INVITE_REQUEST, ext_name);
+    cp = IOEXcp_init(&storage, IOEXCP_TYPE_INVITE_REQUEST, ext_name);
     if (!cp) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         return -1;
@@ -2916,8 +4571,7 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
     IOEXcp_set_tid(cp, &tid);
     IOEXcp_set_raw_data(cp, data, len);
 
-    _data = IOEXcp_encode(cp, &_data_len);
-    IOEXcp_free(cp);
+    _data = IOEXcp_encode_reused(cp, &_data_len);
 
     if (!_data) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
@@ -2927,7 +4581,6 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
     tcb = (TransactedCallback*)rc_alloc(sizeof(TransactedCallback), NULL);
     if (!tcb) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
-        free(_data);
         return -1;
     }
 
@@ -2939,7 +4592,7 @@ int IOEX_invite_friend(IOEXCarrier *w, const char *to,
     deref(tcb);
 
     rc = dht_friend_message(&w->dht, friend_number, _data, _data_len);
-    free(_data);
+    carrier_wakeup(w);
 
     if (rc < 0) {
         IOEX_set_error(rc);
@@ -2956,9 +4609,10 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
     char *addr, *userid, *ext_name;
     uint32_t friend_number;
     int64_t tid;
+    IOEXCPStorage storage;
     IOEXCP *cp;
     int rc;
-    uint8_t *_data;
+    const uint8_t *_data;
     size_t _data_len;
 
     if (!w || !to || !*to || (status != 0 && !reason)
@@ -2971,11 +4625,6 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
     strcpy(addr, to);
     parse_address(addr, &userid, &ext_name);
 
-    if (!is_valid_key(userid)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-
     if (ext_name && strlen(ext_name) > IOEX_MAX_USER_NAME_LEN) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
@@ -2988,12 +4637,7 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
 
     rc = get_friend_number(w, userid, &friend_number);
     if (rc < 0) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-
-    if (!friends_exist(w->friends, friend_number)) {
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST));
+        IOEX_set_error(rc);
         return -1;
     }
 
@@ -3003,7 +4647,7 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
         return -1;
     }
 
-    cp = IOEXcp_create(IOEXCP_TYPE_INVITE_RESPONSE, ext_name);
+    cp = IOEXcp_init(&storage, IOEXCP_TYPE_INVITE_RESPONSE, ext_name);
     if (!cp) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
         return -1;
@@ -3016,8 +4660,7 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
     else
         IOEXcp_set_raw_data(cp, data, len);
 
-    _data = IOEXcp_encode(cp, &_data_len);
-    IOEXcp_free(cp);
+    _data = IOEXcp_encode_reused(cp, &_data_len);
 
     if (!_data) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
@@ -3025,7 +4668,7 @@ int IOEX_reply_friend_invite(IOEXCarrier *w, const char *to,
     }
 
     rc = dht_friend_message(&w->dht, friend_number, _data, _data_len);
-    free(_data);
+    carrier_wakeup(w);
 
     if (rc < 0) {
         IOEX_set_error(rc);
@@ -3136,7 +4779,7 @@ bool is_file_writable(const char *fullpath){
 
 int IOEX_get_files(IOEXCarrier *w, IOEXFilesIterateCallback *callback, void *context)
 {
-    ListIterator it;
+    HashtableIterator it;
     int rc;
 
     if (!w || !callback) {
@@ -3144,14 +4787,19 @@ int IOEX_get_files(IOEXCarrier *w, IOEXFilesIterateCallback *callback, void *con
         return -1;
     }
 
-    list_iterate(w->file_senders, &it);
-    while(list_iterator_has_next(&it)) {
+relist_senders:
+    file_trackers_iterate(w->file_senders, &it);
+    while(hashtable_iterator_has_next(&it)) {
         FileTracker *ft;
 
-        rc = list_iterator_next(&it, (void **)&ft);
+        rc = file_trackers_iterator_next(&it, &ft);
         if (rc == 0)
             break;
 
+        // Modified meanwhile, iterates again.
+        if (rc < 0)
+            goto relist_senders;
+
         IOEXFileInfo wfi;
 
         memcpy(&wfi, &ft->fi, sizeof(IOEXFileInfo));
@@ -3160,14 +4808,19 @@ int IOEX_get_files(IOEXCarrier *w, IOEXFilesIterateCallback *callback, void *con
         if (!callback(0, &wfi, context))
             return 0;
     }
-    list_iterate(w->file_receivers, &it);
-    while(list_iterator_has_next(&it)) {
+relist_receivers:
+    file_trackers_iterate(w->file_receivers, &it);
+    while(hashtable_iterator_has_next(&it)) {
         FileTracker *ft;
 
-        rc = list_iterator_next(&it, (void **)&ft);
+        rc = file_trackers_iterator_next(&it, &ft);
         if (rc == 0)
             break;
 
+        // Modified meanwhile, iterates again.
+        if (rc < 0)
+            goto relist_receivers;
+
         IOEXFileInfo wfi;
 
         memcpy(&wfi, &ft->fi, sizeof(IOEXFileInfo));
@@ -3184,16 +4837,24 @@ int IOEX_get_files(IOEXCarrier *w, IOEXFilesIterateCallback *callback, void *con
 }
 
 int IOEX_send_file_request(IOEXCarrier *w, const char *friendid, const char *fullpath)
+{
+    return IOEX_send_file_request_with_priority(w, friendid, fullpath,
+                                                IOEXFilePriority_Normal);
+}
+
+int IOEX_send_file_request_with_priority(IOEXCarrier *w, const char *friendid,
+                                         const char *fullpath,
+                                         IOEXFilePriority priority)
 {
     uint32_t friend_number;
     uint32_t file_number = UINT32_MAX;
+    struct stat st;
+    FileTracker *ft;
+    FriendInfo *fi;
 
     int rc;
-    if(!w || !friendid || !fullpath){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
-    if(!is_valid_key(friendid)){
+    if(!w || !friendid || !fullpath || priority < IOEXFilePriority_Low ||
+       priority > IOEXFilePriority_High){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
@@ -3202,19 +4863,61 @@ int IOEX_send_file_request(IOEXCarrier *w, const char *friendid, const char *ful
         return -1;
     }    
 
-    rc = get_friend_number(w, friendid, &friend_number);
+    rc = get_friend(w, friendid, &fi);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
     }
+    friend_number = fi->friend_number;
+
+    // Small files are sent first, the size ranks the file once accepted.
+    if(stat(fullpath, &st) < 0 || !S_ISREG(st.st_mode)){
+        deref(fi);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_INVALID));
+        return -1;
+    }
+
+    // Content hash as file id lets the friend resume and verify the file,
+    // it is offered once hashed on the worker.
+    if(fi->features & IOEXCP_FEATURE_FILE_HASH){
+        if(fi->info.status != IOEXConnectionStatus_Connected){
+            deref(fi);
+            IOEX_set_error(IOEX_DHT_ERROR(IOEXERR_FRIEND_OFFLINE));
+            return -1;
+        }
+        deref(fi);
+
+        ft = file_tracker_create();
+        if(!ft){
+            IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+            return -1;
+        }
+
+        file_tracker_set_fullpath(ft, fullpath);
+        ft->fi.friend_number = friend_number;
+        ft->priority = priority;
+
+        rc = fileio_hash(w->fileio, ft, fullpath);
+        deref(ft);
+        if(rc < 0){
+            IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+            return -1;
+        }
+
+        return 0;
+    }
+    deref(fi);
 
-    rc = dht_file_send_request(&w->dht, friend_number, fullpath, &file_number);
+    rc = dht_file_send_request(&w->dht, friend_number, fullpath, NULL,
+                               &file_number);
+    carrier_wakeup(w);
     if(rc < 0 || file_number == UINT32_MAX){
         IOEX_set_error(rc);
         return -1;
     }
 
-    rc = add_new_file_sender(w, friend_number, file_number, fullpath);
+    rc = add_new_file_sender(w, friend_number, file_number, fullpath,
+                             NULL, (uint64_t)st.st_size, priority);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3234,10 +4937,6 @@ int IOEX_send_file_seek(IOEXCarrier *w, const char *friendid, const char *filein
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -3255,9 +4954,11 @@ int IOEX_send_file_seek(IOEXCarrier *w, const char *friendid, const char *filein
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_INVALID));
         return -1;
     }
+    deref(receiver);
 
     start_position = strtoull(position, NULL, 10);
     rc = dht_file_send_seek(&w->dht, friend_number, file_number, start_position);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3271,26 +4972,24 @@ int IOEX_send_file_accept(IOEXCarrier *w, const char *friendid, const char *file
     uint32_t friend_number;
     uint32_t file_number;
     char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
+    FriendInfo *fi;
     int rc;
 
     if(!w || !friendid || !fileindex || !filename || !filepath){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
     }
     
-    rc = get_friend_number(w, friendid, &friend_number);
+    rc = get_friend(w, friendid, &fi);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
     }
+    friend_number = fi->friend_number;
 
     if(filepath[strlen(filepath)-1]=='/'){
         snprintf(fullpath, sizeof(fullpath), "%s%s", filepath, filename);
@@ -3300,6 +4999,7 @@ int IOEX_send_file_accept(IOEXCarrier *w, const char *friendid, const char *file
     }
 
     if(!is_file_writable(fullpath)){
+        deref(fi);
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_DENY));
         return -1;
     }
@@ -3307,17 +5007,49 @@ int IOEX_send_file_accept(IOEXCarrier *w, const char *friendid, const char *file
     file_number = strtoul(fileindex, NULL, 10);
     FileTracker *receiver = NULL;
     if((receiver = find_file_receiver(w, friend_number, file_number)) == NULL){
+        deref(fi);
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_TRACKER_INVALID));
         return -1;
     }
 
     rc = update_file_receiver_path(receiver, filename, filepath);
     if(rc < 0){
+        deref(fi);
+        deref(receiver);
         IOEX_set_error(rc);
         return -1;
     }
 
+    // Picks up where an interrupted transfer of the same file stopped.
+    uint64_t position = 0;
+    if(receiver->hashed){
+        position = fileio_resume_position(fullpath, receiver->file_id,
+                                          receiver->file_size);
+    }
+
+    // Over a session stream if both sides can, toxcore stays idle then.
+    SessionExtension *ext = (SessionExtension *)w->session;
+    if((fi->features & IOEXCP_FEATURE_FILE_STREAM) &&
+       ext && ext->file_receive_cb){
+        receiver->streamed = true;
+        if(ext->file_receive_cb(w, friendid, file_number, fullpath,
+                                receiver->file_size, position, ext) == 0){
+            deref(fi);
+            deref(receiver);
+            return 0;
+        }
+        receiver->streamed = false;
+    }
+    deref(fi);
+    deref(receiver);
+
+    if(position > 0 &&
+       dht_file_send_seek(&w->dht, friend_number, file_number, position) < 0)
+        vlogW("Carrier: Resume file %s from %llu error.", fullpath,
+              (unsigned long long)position);
+
     rc = dht_file_send_accept(&w->dht, friend_number, file_number);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3336,10 +5068,6 @@ int IOEX_send_file_reject(IOEXCarrier *w, const char *friendid, const char *file
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -3358,9 +5086,12 @@ int IOEX_send_file_reject(IOEXCarrier *w, const char *friendid, const char *file
         return -1;
     }
 
+    __atomic_store_n(&receiver->canceled, true, __ATOMIC_RELEASE);
     remove_file_receiver(w, receiver);
+    deref(receiver);
 
     rc = dht_file_send_reject(&w->dht, friend_number, file_number);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3379,10 +5110,6 @@ int IOEX_send_file_pause(IOEXCarrier *w, const char *friendid, const char *filei
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -3406,8 +5133,10 @@ int IOEX_send_file_pause(IOEXCarrier *w, const char *friendid, const char *filei
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_TRACKER_INVALID));
         return -1;
     }
+    deref(tracker);
 
     rc = dht_file_send_pause(&w->dht, friend_number, file_number);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3426,10 +5155,6 @@ int IOEX_send_file_resume(IOEXCarrier *w, const char *friendid, const char *file
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -3453,8 +5178,10 @@ int IOEX_send_file_resume(IOEXCarrier *w, const char *friendid, const char *file
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_FILE_TRACKER_INVALID));
         return -1;
     }
+    deref(tracker);
 
     rc = dht_file_send_resume(&w->dht, friend_number, file_number);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
@@ -3473,10 +5200,6 @@ int IOEX_send_file_cancel(IOEXCarrier *w, const char *friendid, const char *file
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
-    if(!is_valid_key(friendid)){
-        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
-        return -1;
-    }
     if(!w->is_ready){
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_NOT_READY));
         return -1;
@@ -3492,19 +5215,28 @@ int IOEX_send_file_cancel(IOEXCarrier *w, const char *friendid, const char *file
     FileTracker *tracker = NULL;
     if(is_sender(file_number)){
         tracker = find_file_sender(w, friend_number, file_number);
+        file_stream_cancel(w, tracker);
         remove_file_sender(w, tracker);
     }
     else {
         // Remove the file if we are receiver side
         char fullpath[IOEX_MAX_FULL_PATH_LEN + 1];
         tracker = find_file_receiver(w, friend_number, file_number);
+        if(tracker){
+            // Keeps the worker from writing the file again.
+            __atomic_store_n(&tracker->canceled, true, __ATOMIC_RELEASE);
+            file_stream_cancel(w, tracker);
+        }
         if(get_fullpath(tracker, fullpath)){
             unlink(fullpath);
+            fileio_journal_unlink(fullpath);
         }
         remove_file_receiver(w, tracker);
     }
+    deref(tracker);
 
     rc = dht_file_send_cancel(&w->dht, friend_number, file_number);
+    carrier_wakeup(w);
     if(rc < 0){
         IOEX_set_error(rc);
         return -1;
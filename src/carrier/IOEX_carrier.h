@@ -804,6 +804,29 @@ typedef struct IOEXCallbacks {
     void (*file_chunk_receive)(IOEXCarrier *carrier, const char *friendid, const uint32_t fileindex, 
                                const char *fullpath, const uint64_t position, const size_t length, 
                                void *context);
+
+    /**
+     * \~English
+     * An application-defined function that process errors found on a
+     * received file after its last chunk, such as a file that does not
+     * match the content hash offered by the sender.
+     *
+     * @param
+     *      carrier     [in] A handle to the Carrier node instance.
+     * @param
+     *      errcode     [in] The error code.
+     * @param
+     *      friendid    [in] The user id from who sent us the file.
+     * @param
+     *      fileindex   [in] The index of the file which is received.
+     * @param
+     *      fullpath    [in] The path with name of the local file.
+     * @param
+     *      context     [in] The application defined context data.
+     */
+    void (*file_receive_error)(IOEXCarrier *carrier, int errcode, const char *friendid,
+                               const uint32_t fileindex, const char *fullpath,
+                               void *context);
 } IOEXCallbacks;
 
 /**
@@ -929,6 +952,42 @@ void IOEX_kill(IOEXCarrier *carrier);
 CARRIER_API
 int IOEX_run(IOEXCarrier *carrier, int interval);
 
+/**
+ * \~English
+ * Get the file descriptor that becomes readable when the Carrier node has
+ * events to process, to embed the node into an application event loop
+ * instead of calling IOEX_run().
+ *
+ * @param
+ *      carrier     [in] A handle identifying the Carrier node instance.
+ *
+ * @return
+ *      The file descriptor, or -1 if an error occurred, and a specific
+ *      error code can be retrieved by calling IOEX_get_error().
+ */
+CARRIER_API
+int IOEX_get_fd(IOEXCarrier *carrier);
+
+/**
+ * \~English
+ * Process the events of the Carrier node once, the first call connects
+ * the node to Carrier network as IOEX_run() does. The application should
+ * call it again when the file descriptor returned by IOEX_get_fd() becomes
+ * readable, or when the returned interval elapses, whichever is first.
+ *
+ * After IOEX_kill() is called, no other functions can be called.
+ *
+ * @param
+ *      carrier     [in] A handle identifying the Carrier node instance.
+ *
+ * @return
+ *      The interval in milliseconds before the next call, or -1 if an
+ *      error occurred, and a specific error code can be retrieved by
+ *      calling IOEX_get_error().
+ */
+CARRIER_API
+int IOEX_process_events(IOEXCarrier *carrier);
+
 /******************************************************************************
  * Internal node information
  *****************************************************************************/
@@ -1303,6 +1362,10 @@ int IOEX_remove_friend(IOEXCarrier *carrier, const char *userid);
  * fragments.
  *
  * Message may not be empty or NULL.
+ *
+ * The message is queued and sent in order by the Carrier node thread, where
+ * small messages to the same friend may be packed into one network packet.
+ *
  * @param
  *      carrier     [in] A handle to the Carrier node instance.
  * @param
@@ -1313,7 +1376,7 @@ int IOEX_remove_friend(IOEXCarrier *carrier, const char *userid);
  *      len         [in] The message length in bytes.
  *
  * @return
- *      0 if the text message successfully sent.
+ *      0 if the text message successfully queued.
  *      Otherwise, return -1, and a specific error code can be
  *      retrieved by calling IOEX_get_error().
  */
@@ -1418,9 +1481,25 @@ int IOEX_reply_friend_invite(IOEXCarrier *carrier, const char *to,
  * File transmitting
  *****************************************************************************/
 
+/**
+ * \~English
+ * Priority of a file sent. Files accepted beyond the number sent at once,
+ * to a friend or overall, wait for their turn by priority, with the small
+ * ones first.
+ */
+typedef enum IOEXFilePriority {
+    IOEXFilePriority_Low = 0,
+    IOEXFilePriority_Normal,
+    IOEXFilePriority_High
+} IOEXFilePriority;
+
 /**
  * \~English
  * An application-defined function that process the file send request.
+ * If the friend supports it, the file is hashed first, so the friend can
+ * resume the transfer after reconnecting and verify the file received. The
+ * hash is taken in the background and the file offered once done, files
+ * offered to a friend going offline are offered again for an hour.
  *
  * @param
  *      carrier     [in] A handle to the Carrier node instance.
@@ -1436,9 +1515,34 @@ int IOEX_reply_friend_invite(IOEXCarrier *carrier, const char *to,
 CARRIER_API
 int IOEX_send_file_request(IOEXCarrier *carrier, const char *friendid, const char *filename);
 
+/**
+ * \~English
+ * Same as IOEX_send_file_request(), with the file sent at the given
+ * priority instead of IOEXFilePriority_Normal.
+ *
+ * @param
+ *      carrier     [in] A handle to the Carrier node instance.
+ * @param
+ *      friendid    [in] The user id from who send the file send request.
+ * @param
+ *      filename    [in] The name of file which is requested to be sent from friend.
+ * @param
+ *      priority    [in] The priority of the file among the files sent.
+ * @return
+ *      0 if the request successfully send to the friend.
+ *      Otherwise, return -1, and a specific error code can be
+ *      retrieved by calling IOEX_get_error().
+ */
+CARRIER_API
+int IOEX_send_file_request_with_priority(IOEXCarrier *carrier, const char *friendid,
+                                         const char *filename,
+                                         IOEXFilePriority priority);
+
 /**
  * \~English
  * An application-defined function that accepts a file send request.
+ * A transfer of the same file to the same path interrupted before is
+ * resumed from where it stopped.
  *
  * @param
  *      carrier     [in] A handle to the Carrier node instance.
@@ -1831,6 +1935,12 @@ int IOEX_get_files(IOEXCarrier *carrier, IOEXFilesIterateCallback *callback, voi
  */
 #define IOEXERR_FILE_TRACKER_INVALID                 0x29
 
+/**
+ * \~English
+ * Received file does not match the content hash of the sender.
+ */
+#define IOEXERR_FILE_CORRUPTED                       0x2A
+
 /**
  * \~English
  * Unknown error.
@@ -24,15 +24,20 @@
 #define __IOEX_CARRIER_IMPL_H__
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <crypto.h>
 #include <linkedhashtable.h>
 #include <linkedlist.h>
 
 #include "IOEX_carrier.h"
+#include "IOEX_filestream.h"
 
 #include "dht_callbacks.h"
 #include "dht.h"
+#include "friends.h"
+#include "fileio.h"
+#include "persistence.h"
 
 #define MAX_IPV4_ADDRESS_LEN (15)
 #define MAX_IPV6_ADDRESS_LEN (47)
@@ -66,9 +71,74 @@ typedef struct FriendEvent {
     IOEXFriendInfo fi;
 } FriendEvent;
 
-typedef struct FileTracker {
+typedef struct FileStreamEvent {
     ListEntry le;
+    char friendid[IOEX_MAX_ID_LEN + 1];
+    uint32_t fileindex;
+    IOEXFileStreamEvent event;
+    uint64_t position;
+    size_t length;
+    int errcode;
+} FileStreamEvent;
+
+typedef enum FileSendState {
+    FileSendState_Offered = 0,  // not accepted yet, or out of the schedule.
+    FileSendState_Active,
+    FileSendState_Pausing,      // paused once the chunks requested are sent.
+    FileSendState_Paused
+} FileSendState;
+
+typedef struct FileTracker {
+    HashEntry he;
+    uint64_t key;
     IOEXFileInfo fi;
+
+    /* Opened by the file I/O worker on first use, and only used there */
+    int fd;
+    bool open_requested;
+    bool canceled;
+    bool failed;
+
+    /* SHA256 of the content, also the toxcore file id, if hashed */
+    uint8_t file_id[FILEIO_FILE_ID_LEN];
+    uint64_t file_size;
+    bool hashed;
+    bool interrupted;   // Sender: friend went offline, offered again later.
+    uint64_t interrupted_at;
+    bool streamed;      // Data goes over a session stream, see IOEX_filestream.h.
+
+    /* Receiver: blocks on disk and hash state, kept by the worker */
+    FileJournal *journal;
+
+    /* Sender: scheduled with the others accepted, on the carrier thread */
+    ListEntry le;
+    FileSendState send_state;
+    int priority;
+    uint64_t seq;
+
+    /* Sender: chunks requested by toxcore, not sent yet */
+    uint64_t req_pos;
+    uint64_t req_end;
+    size_t req_chunk;
+
+    /* Sender: file data read by the worker, window then next in file order */
+    uint8_t *window;
+    uint64_t window_pos;
+    size_t window_len;
+    uint8_t *next;
+    size_t next_len;
+    bool reading;
+    bool eof;
+    uint64_t eof_pos;
+
+    /* Receiver: contiguous chunks gathered before handing them to the worker */
+    uint8_t *wbuf;
+    uint64_t wbuf_pos;
+    size_t wbuf_len;
+
+    /* Receiver: writes queued to the worker, under its lock */
+    size_t pending_writes;
+    bool write_throttled;
 } FileTracker;
 
 struct IOEXCarrier {
@@ -94,17 +164,46 @@ struct IOEXCarrier {
 
     List *friend_events; // for friend_added/removed.
     Hashtable *friends;
-
-    List *file_senders;
-    List *file_receivers;
+    Hashtable *friend_index; // friends by userid and public key.
+
+    pthread_mutex_t outq_lock;
+    List *outq_friends;  // friends with messages queued.
+    MessageBuffer outq_sending;
+
+    Hashtable *file_senders;
+    Hashtable *file_receivers;
+    FileIO *fileio;
+    List *file_stream_events; // reported by the stream transfer threads.
+
+    /* Senders accepted, served round robin */
+    List *file_sched;
+    uint64_t file_seq;
+    int file_reads;             // reads queued to the worker.
+    int file_sched_changed;     // set from any thread when senders go.
+    uint64_t file_expire_checked; // when interrupted senders were swept.
+
+    /* Snapshots of the persistent data, taken on the loop once changed */
+    Persistence *persistence;
+    int persistence_dirty;      // set from any thread on changes, atomically.
+    uint64_t persistence_due;   // when to take one, 0 if not due.
+    uint64_t persistence_taken; // when the last one was taken.
 
     Hashtable *tcallbacks;
     Hashtable *thistory;
 
     pthread_t main_thread;
 
+    /*
+     * Wakes the loop up when an API call leaves work for it. An eventfd,
+     * or the read and write ends of a pipe where there is none.
+     */
+    int wakeup_fd;
+    int wakeup_wfd;
+
     int running;
     int quit;
+    /* Driven by IOEX_process_events() instead of IOEX_run() */
+    int embedded;
 };
 
 typedef void (*friend_invite_callback)(IOEXCarrier *, const char *,
@@ -115,6 +214,10 @@ typedef struct SessionExtension {
     friend_invite_callback  friend_invite_cb;
     void                    *friend_invite_context;
 
+    file_receive_callback   file_receive_cb;
+    file_send_callback      file_send_cb;
+    file_cancel_callback    file_cancel_cb;
+
     uint8_t                 reserved[1];
 } SessionExtension;
 
@@ -0,0 +1,82 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __IOEX_FILESTREAM_H__
+#define __IOEX_FILESTREAM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Bulk file transfer over a session stream, set up once the receiver
+ * accepted a file offered through toxcore. The toxcore transfer stays idle
+ * meanwhile, and carries on from where the stream stopped if it fails.
+ */
+
+/* Friend invite extension of the stream requests */
+#define IOEX_FILESTREAM_EXTENSION       "file"
+
+typedef enum IOEXFileStreamEvent {
+    /* Sender: data stored by the receiver */
+    IOEXFileStreamEvent_Sent = 1,
+    /* Receiver: data verified and stored */
+    IOEXFileStreamEvent_Received,
+    IOEXFileStreamEvent_Completed,
+    /* The transfer goes on over toxcore from position */
+    IOEXFileStreamEvent_Failed
+} IOEXFileStreamEvent;
+
+/*
+ * Receiver: requests the stream to receive the file from position into
+ * fullpath. Returns 0 if requested, then the transfer is reported through
+ * IOEX_file_stream_notify(), or -1 to go on with toxcore.
+ */
+typedef int (*file_receive_callback)(IOEXCarrier *carrier, const char *friendid,
+                                     uint32_t fileindex, const char *fullpath,
+                                     uint64_t size, uint64_t position,
+                                     void *context);
+
+/*
+ * Sender: answers the stream request of the receiver, sdp included.
+ * Returns 0, or the error code the request is refused with.
+ */
+typedef int (*file_send_callback)(IOEXCarrier *carrier, const char *friendid,
+                                  uint32_t fileindex, const char *fullpath,
+                                  uint64_t position, const char *sdp, size_t len,
+                                  void *context);
+
+/*
+ * Stops the stream of a file canceled locally.
+ */
+typedef void (*file_cancel_callback)(IOEXCarrier *carrier, const char *friendid,
+                                     uint32_t fileindex, void *context);
+
+/*
+ * Reports a transfer event, from any thread. The events are handled on the
+ * carrier loop, in the order reported.
+ */
+CARRIER_API
+void IOEX_file_stream_notify(IOEXCarrier *carrier, const char *friendid,
+                             uint32_t fileindex, IOEXFileStreamEvent event,
+                             uint64_t position, size_t length, int errcode);
+
+#endif // __IOEX_FILESTREAM_H__
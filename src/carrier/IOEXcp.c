@@ -22,8 +22,10 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <vlog.h>
 #include <bitset.h>
@@ -49,6 +51,7 @@ struct IOEXCPUserInfo {
     const char *gender;
     const char *email;
     const char *region;
+    uint32_t features;
 };
 
 struct IOEXCPFriendReq {
@@ -64,6 +67,16 @@ struct IOEXCPFriendMsg {
     const uint8_t *msg;
 };
 
+struct IOEXCPFriendMsgs {
+    IOEXCP header;
+    size_t count;
+    // Messages of decoded batches are read from the received buffer.
+    IOEXcp_friendmsg_vec_t vec;
+    const char *exts[IOEXCP_MAX_BATCH_MESSAGES];
+    const uint8_t *msgs[IOEXCP_MAX_BATCH_MESSAGES];
+    size_t lens[IOEXCP_MAX_BATCH_MESSAGES];
+};
+
 struct IOEXCPInviteReq {
     IOEXCP header;
     int64_t tid;
@@ -82,17 +95,73 @@ struct IOEXCPInviteRsp {
 
 #pragma pack(pop)
 
+typedef char IOEXcp_storage_check[sizeof(struct IOEXCPFriendMsgs) <=
+                                  IOEXCP_STORAGE_SIZE ? 1 : -1];
+
+/*
+ * Builder and output arena kept by each encoding thread, so that steady
+ * encoding reuses the memory of previous packets.
+ */
+typedef struct IOEXcpEncoder {
+    flatcc_builder_t builder;
+    uint8_t *arena;
+    size_t arena_size;
+} IOEXcpEncoder;
+
+static pthread_once_t encoder_once = PTHREAD_ONCE_INIT;
+static pthread_key_t encoder_key;
+
+static void encoder_destroy(void *p)
+{
+    IOEXcpEncoder *enc = (IOEXcpEncoder *)p;
+
+    flatcc_builder_clear(&enc->builder);
+    if (enc->arena)
+        free(enc->arena);
+    free(enc);
+}
+
+static void encoder_key_create(void)
+{
+    (void)pthread_key_create(&encoder_key, encoder_destroy);
+}
+
+static IOEXcpEncoder *encoder_get(void)
+{
+    IOEXcpEncoder *enc;
+
+    pthread_once(&encoder_once, encoder_key_create);
+
+    enc = (IOEXcpEncoder *)pthread_getspecific(encoder_key);
+    if (enc)
+        return enc;
+
+    enc = (IOEXcpEncoder *)calloc(1, sizeof(IOEXcpEncoder));
+    if (!enc)
+        return NULL;
+
+    if (flatcc_builder_init(&enc->builder) != 0 ||
+            pthread_setspecific(encoder_key, enc) != 0) {
+        encoder_destroy(enc);
+        return NULL;
+    }
+
+    return enc;
+}
+
 #define pktinfo pkt.u.pkt_info
 #define pktfreq pkt.u.pkt_freq
 #define pktfmsg pkt.u.pkt_fmsg
 #define pktireq pkt.u.pkt_ireq
 #define pktirsp pkt.u.pkt_irsp
+#define pktfmsgs pkt.u.pkt_fmsgs
 
 #define tblinfo tbl.u.tbl_info
 #define tblfreq tbl.u.tbl_freq
 #define tblfmsg tbl.u.tbl_fmsg
 #define tblireq tbl.u.tbl_ireq
 #define tblirsp tbl.u.tbl_irsp
+#define tblfmsgs tbl.u.tbl_fmsgs
 
 struct IOEXcp_packet_t {
     union {
@@ -102,6 +171,7 @@ struct IOEXcp_packet_t {
         struct IOEXCPFriendMsg *pkt_fmsg;
         struct IOEXCPInviteReq *pkt_ireq;
         struct IOEXCPInviteRsp *pkt_irsp;
+        struct IOEXCPFriendMsgs *pkt_fmsgs;
     } u;
 };
 
@@ -112,12 +182,12 @@ struct IOEXcp_table_t {
         IOEXcp_friendmsg_table_t tbl_fmsg;
         IOEXcp_invitereq_table_t tbl_ireq;
         IOEXcp_invitersp_table_t tbl_irsp;
+        IOEXcp_friendmsgs_table_t tbl_fmsgs;
     } u;
 };
 
-IOEXCP *IOEXcp_create(uint8_t type, const char *ext_name)
+static size_t packet_size(uint8_t type)
 {
-    IOEXCP *cp;
     size_t len;
 
     switch(type) {
@@ -136,11 +206,26 @@ IOEXCP *IOEXcp_create(uint8_t type, const char *ext_name)
     case IOEXCP_TYPE_INVITE_RESPONSE:
         len = sizeof(struct IOEXCPInviteRsp);
         break;
+    case IOEXCP_TYPE_MESSAGE_BATCH:
+        len = sizeof(struct IOEXCPFriendMsgs);
+        break;
     default:
         assert(0);
-        return NULL;
+        return 0;
     }
 
+    return len;
+}
+
+IOEXCP *IOEXcp_create(uint8_t type, const char *ext_name)
+{
+    IOEXCP *cp;
+    size_t len;
+
+    len = packet_size(type);
+    if (!len)
+        return NULL;
+
     cp = (IOEXCP *)calloc(1, len);
     if (!cp)
         return NULL;
@@ -151,6 +236,26 @@ IOEXCP *IOEXcp_create(uint8_t type, const char *ext_name)
     return cp;
 }
 
+IOEXCP *IOEXcp_init(IOEXCPStorage *storage, uint8_t type, const char *ext_name)
+{
+    IOEXCP *cp;
+    size_t len;
+
+    assert(storage);
+
+    len = packet_size(type);
+    if (!len)
+        return NULL;
+
+    cp = (IOEXCP *)storage->bytes;
+    memset(cp, 0, len);
+
+    cp->type = type;
+    cp->ext  = ext_name;
+
+    return cp;
+}
+
 void IOEXcp_free(IOEXCP *cp)
 {
     if (cp)
@@ -452,6 +557,72 @@ const char *IOEXcp_get_reason(IOEXCP *cp)
     return reason;
 }
 
+uint32_t IOEXcp_get_features(IOEXCP *cp)
+{
+    struct IOEXcp_packet_t pkt;
+    uint32_t features = 0;
+
+    assert(cp);
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case IOEXCP_TYPE_USERINFO:
+        features = pktinfo->features;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    return features;
+}
+
+size_t IOEXcp_get_message_count(IOEXCP *cp)
+{
+    struct IOEXcp_packet_t pkt;
+
+    assert(cp);
+    assert(cp->type == IOEXCP_TYPE_MESSAGE_BATCH);
+
+    pkt.u.cp = cp;
+
+    return pktfmsgs->count;
+}
+
+const void *IOEXcp_get_message(IOEXCP *cp, size_t index, const char **ext,
+                               size_t *len)
+{
+    struct IOEXcp_packet_t pkt;
+
+    assert(cp);
+    assert(cp->type == IOEXCP_TYPE_MESSAGE_BATCH);
+    assert(ext && len);
+
+    pkt.u.cp = cp;
+
+    if (index >= pktfmsgs->count)
+        return NULL;
+
+    if (pktfmsgs->vec) {
+        IOEXcp_friendmsg_table_t msg;
+        flatbuffers_uint8_vec_t vec;
+
+        msg = IOEXcp_friendmsg_vec_at(pktfmsgs->vec, index);
+        vec = IOEXcp_friendmsg_msg(msg);
+
+        *ext = IOEXcp_friendmsg_ext_is_present(msg) ?
+               IOEXcp_friendmsg_ext(msg) : NULL;
+        *len = flatbuffers_uint8_vec_len(vec);
+
+        return *len ? vec : NULL;
+    }
+
+    *ext = pktfmsgs->exts[index];
+    *len = pktfmsgs->lens[index];
+
+    return pktfmsgs->msgs[index];
+}
+
 void IOEXcp_set_name(IOEXCP *cp, const char *name)
 {
     struct IOEXcp_packet_t pkt;
@@ -695,95 +866,152 @@ void IOEXcp_set_reason(IOEXCP *cp, const char *reason)
     }
 }
 
-uint8_t *IOEXcp_encode(IOEXCP *cp, size_t *encoded_len)
+void IOEXcp_set_features(IOEXCP *cp, uint32_t features)
+{
+    struct IOEXcp_packet_t pkt;
+
+    assert(cp);
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
+    case IOEXCP_TYPE_USERINFO:
+        pktinfo->features = features;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+int IOEXcp_add_message(IOEXCP *cp, const char *ext, const void *msg,
+                       size_t len)
+{
+    struct IOEXcp_packet_t pkt;
+
+    assert(cp);
+    assert(cp->type == IOEXCP_TYPE_MESSAGE_BATCH);
+    assert(msg);
+    assert(len > 0);
+
+    pkt.u.cp = cp;
+
+    if (pktfmsgs->count >= IOEXCP_MAX_BATCH_MESSAGES)
+        return -1;
+
+    pktfmsgs->exts[pktfmsgs->count] = ext;
+    pktfmsgs->msgs[pktfmsgs->count] = msg;
+    pktfmsgs->lens[pktfmsgs->count] = len;
+    pktfmsgs->count++;
+
+    return 0;
+}
+
+static int encode_packet(flatcc_builder_t *builder, IOEXCP *cp)
 {
     struct IOEXcp_packet_t pkt;
-    flatcc_builder_t builder;
     flatcc_builder_ref_t str;
     flatbuffers_uint8_vec_ref_t vec;
     flatbuffers_ref_t ref;
     IOEXcp_anybody_union_ref_t body;
-    uint8_t *encoded_data;
+    size_t i;
 
+    assert(builder);
     assert(cp);
-    assert(encoded_len);
 
     pkt.u.cp = cp;
 
-    flatcc_builder_init(&builder);
-
     switch(cp->type) {
     case IOEXCP_TYPE_USERINFO:
-        IOEXcp_userinfo_start(&builder);
+        IOEXcp_userinfo_start(builder);
         if (pktinfo->name) {
-            str = flatcc_builder_create_string_str(&builder, pktinfo->name);
-            IOEXcp_userinfo_name_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, pktinfo->name);
+            IOEXcp_userinfo_name_add(builder, str);
         }
-        str = flatcc_builder_create_string_str(&builder, pktinfo->descr);
-        IOEXcp_userinfo_descr_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->gender);
-        IOEXcp_userinfo_gender_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->phone);
-        IOEXcp_userinfo_phone_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->email);
-        IOEXcp_userinfo_email_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktinfo->region);
-        IOEXcp_userinfo_region_add(&builder, str);
-        IOEXcp_userinfo_avatar_add(&builder, pktinfo->has_avatar);
-        ref = IOEXcp_userinfo_end(&builder);
+        str = flatcc_builder_create_string_str(builder, pktinfo->descr);
+        IOEXcp_userinfo_descr_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->gender);
+        IOEXcp_userinfo_gender_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->phone);
+        IOEXcp_userinfo_phone_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->email);
+        IOEXcp_userinfo_email_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktinfo->region);
+        IOEXcp_userinfo_region_add(builder, str);
+        IOEXcp_userinfo_avatar_add(builder, pktinfo->has_avatar);
+        if (pktinfo->features)
+            IOEXcp_userinfo_features_add(builder, pktinfo->features);
+        ref = IOEXcp_userinfo_end(builder);
         break;
 
     case IOEXCP_TYPE_FRIEND_REQUEST:
-        IOEXcp_friendreq_start(&builder);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->name);
-        IOEXcp_friendreq_name_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->descr);
-        IOEXcp_friendreq_descr_add(&builder, str);
-        str = flatcc_builder_create_string_str(&builder, pktfreq->hello);
-        IOEXcp_friendreq_hello_add(&builder, str);
-        ref = IOEXcp_friendreq_end(&builder);
+        IOEXcp_friendreq_start(builder);
+        str = flatcc_builder_create_string_str(builder, pktfreq->name);
+        IOEXcp_friendreq_name_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktfreq->descr);
+        IOEXcp_friendreq_descr_add(builder, str);
+        str = flatcc_builder_create_string_str(builder, pktfreq->hello);
+        IOEXcp_friendreq_hello_add(builder, str);
+        ref = IOEXcp_friendreq_end(builder);
         break;
 
     case IOEXCP_TYPE_MESSAGE:
-        IOEXcp_friendmsg_start(&builder);
+        IOEXcp_friendmsg_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            IOEXcp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            IOEXcp_friendmsg_ext_add(builder, str);
         }
 
-        vec = flatbuffers_uint8_vec_create(&builder, pktfmsg->msg, pktfmsg->len);
-        IOEXcp_friendmsg_msg_add(&builder, vec);
-        ref = IOEXcp_friendmsg_end(&builder);
+        vec = flatbuffers_uint8_vec_create(builder, pktfmsg->msg, pktfmsg->len);
+        IOEXcp_friendmsg_msg_add(builder, vec);
+        ref = IOEXcp_friendmsg_end(builder);
+        break;
+
+    case IOEXCP_TYPE_MESSAGE_BATCH:
+        IOEXcp_friendmsgs_start(builder);
+        IOEXcp_friendmsgs_msgs_start(builder);
+        for (i = 0; i < pktfmsgs->count; i++) {
+            IOEXcp_friendmsgs_msgs_push_start(builder);
+            if (pktfmsgs->exts[i]) {
+                str = flatcc_builder_create_string_str(builder, pktfmsgs->exts[i]);
+                IOEXcp_friendmsg_ext_add(builder, str);
+            }
+            vec = flatbuffers_uint8_vec_create(builder, pktfmsgs->msgs[i],
+                                               pktfmsgs->lens[i]);
+            IOEXcp_friendmsg_msg_add(builder, vec);
+            IOEXcp_friendmsgs_msgs_push_end(builder);
+        }
+        IOEXcp_friendmsgs_msgs_end(builder);
+        ref = IOEXcp_friendmsgs_end(builder);
         break;
 
     case IOEXCP_TYPE_INVITE_REQUEST:
-        IOEXcp_invitereq_start(&builder);
+        IOEXcp_invitereq_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            IOEXcp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            IOEXcp_friendmsg_ext_add(builder, str);
         }
-        IOEXcp_invitereq_tid_add(&builder, pktireq->tid);
-        vec = flatbuffers_uint8_vec_create(&builder, pktireq->data, pktireq->len);
-        IOEXcp_invitereq_data_add(&builder, vec);
-        ref = IOEXcp_invitereq_end(&builder);
+        IOEXcp_invitereq_tid_add(builder, pktireq->tid);
+        vec = flatbuffers_uint8_vec_create(builder, pktireq->data, pktireq->len);
+        IOEXcp_invitereq_data_add(builder, vec);
+        ref = IOEXcp_invitereq_end(builder);
         break;
 
     case IOEXCP_TYPE_INVITE_RESPONSE:
-        IOEXcp_invitersp_start(&builder);
+        IOEXcp_invitersp_start(builder);
         if (cp->ext) {
-            str = flatcc_builder_create_string_str(&builder, cp->ext);
-            IOEXcp_friendmsg_ext_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, cp->ext);
+            IOEXcp_friendmsg_ext_add(builder, str);
         }
-        IOEXcp_invitersp_tid_add(&builder, pktirsp->tid);
-        IOEXcp_invitersp_status_add(&builder, pktirsp->status);
+        IOEXcp_invitersp_tid_add(builder, pktirsp->tid);
+        IOEXcp_invitersp_status_add(builder, pktirsp->status);
         if (pktirsp->status) {
-            str = flatcc_builder_create_string_str(&builder, pktirsp->reason);
-            IOEXcp_invitersp_reason_add(&builder, str);
+            str = flatcc_builder_create_string_str(builder, pktirsp->reason);
+            IOEXcp_invitersp_reason_add(builder, str);
         } else {
-            vec = flatbuffers_uint8_vec_create(&builder, pktirsp->data, pktirsp->len);
-            IOEXcp_invitersp_data_add(&builder, vec);
+            vec = flatbuffers_uint8_vec_create(builder, pktirsp->data, pktirsp->len);
+            IOEXcp_invitersp_data_add(builder, vec);
         }
-        ref = IOEXcp_invitersp_end(&builder);
+        ref = IOEXcp_invitersp_end(builder);
         break;
 
     default:
@@ -792,10 +1020,8 @@ uint8_t *IOEXcp_encode(IOEXCP *cp, size_t *encoded_len)
         break;
     }
 
-    if (!ref) {
-        flatcc_builder_clear(&builder);
-        return NULL;
-    }
+    if (!ref)
+        return -1;
 
     switch(cp->type) {
     case IOEXCP_TYPE_USERINFO:
@@ -813,64 +1039,142 @@ uint8_t *IOEXcp_encode(IOEXCP *cp, size_t *encoded_len)
     case IOEXCP_TYPE_INVITE_RESPONSE:
         body = IOEXcp_anybody_as_invitersp(ref);
         break;
+    case IOEXCP_TYPE_MESSAGE_BATCH:
+        body = IOEXcp_anybody_as_friendmsgs(ref);
+        break;
     default:
         assert(0);
-        return NULL;
+        return -1;
     }
 
-    IOEXcp_packet_start_as_root(&builder);
-    IOEXcp_packet_type_add(&builder, cp->type);
-    IOEXcp_packet_body_add(&builder, body);
-    if (!IOEXcp_packet_end_as_root(&builder)) {
-        flatcc_builder_clear(&builder);
+    IOEXcp_packet_start_as_root(builder);
+    IOEXcp_packet_type_add(builder, cp->type);
+    IOEXcp_packet_body_add(builder, body);
+    if (!IOEXcp_packet_end_as_root(builder))
+        return -1;
+
+    return 0;
+}
+
+uint8_t *IOEXcp_encode(IOEXCP *cp, size_t *encoded_len)
+{
+    IOEXcpEncoder *enc;
+    uint8_t *encoded_data = NULL;
+
+    assert(cp);
+    assert(encoded_len);
+
+    enc = encoder_get();
+    if (!enc)
         return NULL;
-    }
 
-    encoded_data = flatcc_builder_finalize_buffer(&builder, encoded_len);
-    flatcc_builder_clear(&builder);
+    if (encode_packet(&enc->builder, cp) == 0)
+        encoded_data = flatcc_builder_finalize_buffer(&enc->builder,
+                                                      encoded_len);
+    flatcc_builder_reset(&enc->builder);
 
     return encoded_data;
 }
 
-IOEXCP *IOEXcp_decode(const uint8_t *data, size_t len)
+const uint8_t *IOEXcp_encode_reused(IOEXCP *cp, size_t *encoded_len)
+{
+    IOEXcpEncoder *enc;
+    uint8_t *arena;
+    size_t len;
+
+    assert(cp);
+    assert(encoded_len);
+
+    enc = encoder_get();
+    if (!enc)
+        return NULL;
+
+    if (encode_packet(&enc->builder, cp) < 0) {
+        flatcc_builder_reset(&enc->builder);
+        return NULL;
+    }
+
+    len = flatcc_builder_get_buffer_size(&enc->builder);
+    if (len > enc->arena_size) {
+        arena = (uint8_t *)realloc(enc->arena, len);
+        if (!arena) {
+            flatcc_builder_reset(&enc->builder);
+            return NULL;
+        }
+
+        enc->arena = arena;
+        enc->arena_size = len;
+    }
+
+    flatcc_builder_copy_buffer(&enc->builder, enc->arena, len);
+    flatcc_builder_reset(&enc->builder);
+
+    *encoded_len = len;
+    return enc->arena;
+}
+
+ssize_t IOEXcp_encode_into(IOEXCP *cp, uint8_t *buf, size_t buf_len)
+{
+    IOEXcpEncoder *enc;
+    ssize_t len = -1;
+
+    assert(cp);
+    assert(buf);
+
+    enc = encoder_get();
+    if (!enc)
+        return -1;
+
+    if (encode_packet(&enc->builder, cp) == 0 &&
+            flatcc_builder_copy_buffer(&enc->builder, buf, buf_len))
+        len = (ssize_t)flatcc_builder_get_buffer_size(&enc->builder);
+
+    flatcc_builder_reset(&enc->builder);
+
+    return len;
+}
+
+static IOEXcp_packet_table_t decode_root(const uint8_t *data, size_t len,
+                                         uint8_t *type)
 {
-    IOEXCP *cp;
-    struct IOEXcp_packet_t pkt;
-    struct IOEXcp_table_t  tbl;
     IOEXcp_packet_table_t packet;
-    flatbuffers_uint8_vec_t vec;
-    uint8_t type;
 
     packet = IOEXcp_packet_as_root(data);
     if (!packet)
         return NULL;
 
-    type = IOEXcp_packet_type(packet);
-    switch(type) {
+    *type = IOEXcp_packet_type(packet);
+    switch(*type) {
     case IOEXCP_TYPE_USERINFO:
     case IOEXCP_TYPE_FRIEND_REQUEST:
     case IOEXCP_TYPE_MESSAGE:
     case IOEXCP_TYPE_INVITE_REQUEST:
     case IOEXCP_TYPE_INVITE_RESPONSE:
+    case IOEXCP_TYPE_MESSAGE_BATCH:
         break;
     default:
-        //TODO: clean resource for 'packet'; (how ?)
         return NULL;
     }
 
-    cp = IOEXcp_create(type, NULL);
-    if (!cp) {
-        //TODO: clean resource for 'packet'; (how ?)
+    if (!IOEXcp_packet_body_is_present(packet))
         return NULL;
-    }
-    pkt.u.cp = cp;
 
-    if (!IOEXcp_packet_body_is_present(packet)) {
-        IOEXcp_free(cp);
-        return NULL;
-    }
+    return packet;
+}
 
-    switch(type) {
+/*
+ * Fields refer to the received buffer, which must outlive the packet.
+ */
+static int decode_body(IOEXCP *cp, IOEXcp_packet_table_t packet)
+{
+    struct IOEXcp_packet_t pkt;
+    struct IOEXcp_table_t  tbl;
+    flatbuffers_uint8_vec_t vec;
+    IOEXcp_friendmsg_vec_t msgs;
+
+    pkt.u.cp = cp;
+
+    switch(cp->type) {
     case IOEXCP_TYPE_USERINFO:
         tblinfo = IOEXcp_packet_body(packet);
         if (IOEXcp_userinfo_name_is_present(tblinfo))
@@ -881,6 +1185,7 @@ IOEXCP *IOEXcp_decode(const uint8_t *data, size_t len)
         pktinfo->email  = IOEXcp_userinfo_email(tblinfo);
         pktinfo->region = IOEXcp_userinfo_region(tblinfo);
         pktinfo->has_avatar = IOEXcp_userinfo_avatar(tblinfo);
+        pktinfo->features = IOEXcp_userinfo_features(tblinfo);
         break;
 
     case IOEXCP_TYPE_FRIEND_REQUEST:
@@ -898,6 +1203,16 @@ IOEXCP *IOEXcp_decode(const uint8_t *data, size_t len)
             cp->ext = IOEXcp_friendmsg_ext(tblfmsg);
         break;
 
+    case IOEXCP_TYPE_MESSAGE_BATCH:
+        tblfmsgs = IOEXcp_packet_body(packet);
+        msgs = IOEXcp_friendmsgs_msgs(tblfmsgs);
+        if (IOEXcp_friendmsg_vec_len(msgs) > IOEXCP_MAX_BATCH_MESSAGES)
+            return -1;
+
+        pktfmsgs->vec = msgs;
+        pktfmsgs->count = IOEXcp_friendmsg_vec_len(msgs);
+        break;
+
     case IOEXCP_TYPE_INVITE_REQUEST:
         tblireq = IOEXcp_packet_body(packet);
         pktireq->tid = IOEXcp_invitereq_tid(tblireq);
@@ -926,5 +1241,47 @@ IOEXCP *IOEXcp_decode(const uint8_t *data, size_t len)
         break;
     }
 
+    return 0;
+}
+
+IOEXCP *IOEXcp_decode(const uint8_t *data, size_t len)
+{
+    IOEXcp_packet_table_t packet;
+    IOEXCP *cp;
+    uint8_t type;
+
+    packet = decode_root(data, len, &type);
+    if (!packet)
+        return NULL;
+
+    cp = IOEXcp_create(type, NULL);
+    if (!cp)
+        return NULL;
+
+    if (decode_body(cp, packet) < 0) {
+        IOEXcp_free(cp);
+        return NULL;
+    }
+
+    return cp;
+}
+
+IOEXCP *IOEXcp_decode_into(IOEXCPStorage *storage, const uint8_t *data,
+                           size_t len)
+{
+    IOEXcp_packet_table_t packet;
+    IOEXCP *cp;
+    uint8_t type;
+
+    assert(storage);
+
+    packet = decode_root(data, len, &type);
+    if (!packet)
+        return NULL;
+
+    cp = IOEXcp_init(storage, type, NULL);
+    if (!cp || decode_body(cp, packet) < 0)
+        return NULL;
+
     return cp;
 }
@@ -25,10 +25,19 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 #include "IOEX_carrier.h"
 
 typedef struct IOEXCP IOEXCP;
 
+/* Room for any packet, to keep short lived packets off the heap */
+#define IOEXCP_STORAGE_SIZE                    1024
+
+typedef union IOEXCPStorage {
+    uint8_t bytes[IOEXCP_STORAGE_SIZE];
+    void *align;
+} IOEXCPStorage;
+
 /* WMCP types */
 #define IOEXCP_TYPE_MIN                        1
 
@@ -40,11 +49,22 @@ typedef struct IOEXCP IOEXCP;
 #define IOEXCP_TYPE_MESSAGE                    33
 #define IOEXCP_TYPE_INVITE_REQUEST             34
 #define IOEXCP_TYPE_INVITE_RESPONSE            35
+#define IOEXCP_TYPE_MESSAGE_BATCH              36
 
 #define IOEXCP_TYPE_MAX                        95
 
+/* Features advertised in userinfo */
+#define IOEXCP_FEATURE_MESSAGE_BATCH           0x01
+#define IOEXCP_FEATURE_FILE_HASH               0x02  // file id is SHA256 of content
+#define IOEXCP_FEATURE_FILE_STREAM             0x04  // files over session streams
+
+#define IOEXCP_MAX_BATCH_MESSAGES              32
+
 IOEXCP *IOEXcp_create(uint8_t type, const char *ext_name);
 
+/* Packets set up in caller storage are not to be freed */
+IOEXCP *IOEXcp_init(IOEXCPStorage *storage, uint8_t type, const char *ext_name);
+
 void IOEXcp_free(IOEXCP *cp);
 
 int IOEXcp_get_type(IOEXCP *cp);
@@ -77,6 +97,13 @@ size_t IOEXcp_get_raw_data_length(IOEXCP *cp);
 
 const char *IOEXcp_get_reason(IOEXCP *cp);
 
+uint32_t IOEXcp_get_features(IOEXCP *cp);
+
+size_t IOEXcp_get_message_count(IOEXCP *cp);
+
+const void *IOEXcp_get_message(IOEXCP *cp, size_t index, const char **ext,
+                               size_t *len);
+
 void IOEXcp_set_name(IOEXCP *cp, const char *name);
 
 void IOEXcp_set_descr(IOEXCP *cp, const char *descr);
@@ -101,8 +128,22 @@ void IOEXcp_set_raw_data(IOEXCP *cp, const void *data, size_t len);
 
 void IOEXcp_set_reason(IOEXCP *cp, const char *reason);
 
+void IOEXcp_set_features(IOEXCP *cp, uint32_t features);
+
+int IOEXcp_add_message(IOEXCP *cp, const char *ext, const void *msg,
+                       size_t len);
+
 uint8_t *IOEXcp_encode(IOEXCP *cp, size_t *len);
 
+/* Valid until the next encoding on the same thread */
+const uint8_t *IOEXcp_encode_reused(IOEXCP *cp, size_t *len);
+
+ssize_t IOEXcp_encode_into(IOEXCP *cp, uint8_t *buf, size_t buf_len);
+
 IOEXCP *IOEXcp_decode(const uint8_t *buf, size_t len);
 
+/* Fields refer to buf, which must outlive the packet */
+IOEXCP *IOEXcp_decode_into(IOEXCPStorage *storage, const uint8_t *buf,
+                           size_t len);
+
 #endif /* __IOEXCPH__ */
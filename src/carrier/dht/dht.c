@@ -533,7 +533,20 @@ void notify_file_request_cb(Tox *tox, uint32_t friend_number, uint32_t real_file
                             const uint8_t *filename, size_t filename_length, void *context)
 {
     DHTCallbacks *cbs = (DHTCallbacks *)context;
-    cbs->notify_file_request(friend_number, real_filenumber, filename, file_size, cbs->context);
+    uint8_t file_id[DHT_FILE_ID_LENGTH];
+    char name[IOEX_MAX_FILE_NAME_LEN + 1];
+
+    if (!tox_file_get_file_id(tox, friend_number, real_filenumber, file_id, NULL))
+        memset(file_id, 0, sizeof(file_id));
+
+    // File name from toxcore is not null-terminated.
+    if (filename_length > IOEX_MAX_FILE_NAME_LEN)
+        filename_length = IOEX_MAX_FILE_NAME_LEN;
+    memcpy(name, filename, filename_length);
+    name[filename_length] = 0;
+
+    cbs->notify_file_request(friend_number, real_filenumber, file_id,
+                             (const uint8_t *)name, file_size, cbs->context);
 }
 
 static 
@@ -903,7 +916,7 @@ int dht_self_set_name(DHT *dht, uint8_t *name, size_t length)
     return 0;
 }
 
-int dht_self_set_desc(DHT *dht, uint8_t *desc, size_t length)
+int dht_self_set_desc(DHT *dht, const uint8_t *desc, size_t length)
 {
     Tox *tox = dht->tox;
     TOX_ERR_SET_INFO error;
@@ -1047,7 +1060,8 @@ int dht_get_random_tcp_relay(DHT *dht, char *tcp_relay, size_t buflen,
     return 0;
 }
 
-int dht_file_send_request(DHT *dht, uint32_t friend_number, const char *fullpath, uint32_t *filenum)
+int dht_file_send_request(DHT *dht, uint32_t friend_number, const char *fullpath,
+                          const uint8_t *file_id, uint32_t *filenum)
 {
     Tox *tox = dht->tox;
     char filename[IOEX_MAX_FILE_NAME_LEN + 1];
@@ -1071,7 +1085,7 @@ int dht_file_send_request(DHT *dht, uint32_t friend_number, const char *fullpath
         strncpy(filename, pch+1, sizeof(filename));
     }
 
-    *filenum = tox_file_send(tox, friend_number, TOX_FILE_KIND_DATA, filesize, 0, (uint8_t *)filename, 
+    *filenum = tox_file_send(tox, friend_number, TOX_FILE_KIND_DATA, filesize, file_id, (uint8_t *)filename, 
                              strlen(filename), &error);
     if(*filenum != UINT32_MAX) {
         vlogI("Sent file send request.");
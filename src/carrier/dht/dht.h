@@ -25,6 +25,8 @@
 
 #define DHT_PUBLIC_KEY_SIZE     32U
 #define DHT_ADDRESS_SIZE        (32U + sizeof(uint32_t) + sizeof(uint16_t))
+#define DHT_MAX_MESSAGE_LENGTH  1372U
+#define DHT_FILE_ID_LENGTH      32U
 
 typedef struct DHT DHT;
 
@@ -71,7 +73,7 @@ void dht_iterate(DHT *dht, void *context);
 
 int dht_self_set_name(DHT *dht, uint8_t *name, size_t length);
 
-int dht_self_set_desc(DHT *dht, uint8_t *status_msg, size_t length);
+int dht_self_set_desc(DHT *dht, const uint8_t *status_msg, size_t length);
 
 int dht_get_friend_number(DHT *dht, const uint8_t *public_key,
                           uint32_t *friend_number);
@@ -93,8 +95,11 @@ int dht_friend_delete(DHT *dht, uint32_t friend_number);
 int dht_get_random_tcp_relay(DHT *dht, char *tcp_relay, size_t buflen,
                              uint8_t *public_key);
 
+/*
+ * file_id identifies the file across sessions, a random one is used if NULL.
+ */
 int dht_file_send_request(DHT *dht, uint32_t friend_number, const char *fullpath,
-                          uint32_t *filenum);
+                          const uint8_t *file_id, uint32_t *filenum);
 
 int dht_file_send_accept(DHT *dht, uint32_t friend_number, const uint32_t file_number);
 
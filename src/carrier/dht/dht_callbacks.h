@@ -50,8 +50,8 @@ struct DHTCallbacks {
                                   size_t length, void *context);
 
     void (*notify_file_request)(uint32_t friend_number, uint32_t file_number, 
-                                const uint8_t *filename, uint64_t filesize, 
-                                void *context);
+                                const uint8_t *file_id, const uint8_t *filename,
+                                uint64_t filesize, void *context);
 
     void (*notify_file_accepted)(uint32_t friend_number, uint32_t file_number, 
                                  void *context);
@@ -0,0 +1,894 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <rc_mem.h>
+#include <vlog.h>
+#include <bitset.h>
+#include <crypto.h>
+
+#include "IOEX_carrier_impl.h"
+#include "fileio.h"
+
+struct FileIO {
+    pthread_t thread;
+    bool started;
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+
+    FileIOJob *queue_head;
+    FileIOJob *queue_tail;
+
+    FileIOJob *done_head;
+    FileIOJob *done_tail;
+
+    FileIOWakeup *wakeup;
+    void *context;
+};
+
+static void job_append(FileIOJob **head, FileIOJob **tail, FileIOJob *job)
+{
+    job->next = NULL;
+
+    if (*tail)
+        (*tail)->next = job;
+    else
+        *head = job;
+    *tail = job;
+}
+
+static FileIOJob *job_pop(FileIOJob **head, FileIOJob **tail)
+{
+    FileIOJob *job = *head;
+
+    if (job) {
+        *head = job->next;
+        if (!*head)
+            *tail = NULL;
+        job->next = NULL;
+    }
+
+    return job;
+}
+
+void fileio_job_free(FileIOJob *job)
+{
+    if (!job)
+        return;
+
+    deref(job->ft);
+
+    if (job->path)
+        free(job->path);
+
+    if (job->data)
+        free(job->data);
+
+    free(job);
+}
+
+#define JOURNAL_MAGIC           0x494f4a4e  // "IOJN"
+#define JOURNAL_VERSION         1
+#define JOURNAL_BLOCK_SIZE      FILEIO_READ_SIZE
+
+/*
+ * On-disk journal header, followed by the block bitmap as bitset words.
+ * Both stay in host byte order, the journal never leaves this host.
+ */
+typedef struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t file_id[FILEIO_FILE_ID_LEN];
+    uint64_t file_size;
+    uint32_t block_size;
+    uint32_t state_size;
+    uint64_t hashed;        // length of the data hashed into state.
+    Sha256State state;
+} JournalHeader;
+
+struct FileJournal {
+    int fd;
+    char *path;
+    JournalHeader hdr;
+    bitset *blocks;
+};
+
+static size_t journal_words(uint64_t file_size)
+{
+    size_t nblocks = (file_size + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE;
+
+    return (nblocks + 63) >> 6;
+}
+
+static char *journal_path(const char *path)
+{
+    size_t len = strlen(path) + sizeof(FILEIO_JOURNAL_SUFFIX);
+    char *jpath;
+
+    jpath = (char *)malloc(len);
+    if (jpath)
+        snprintf(jpath, len, "%s%s", path, FILEIO_JOURNAL_SUFFIX);
+
+    return jpath;
+}
+
+static bool journal_read(int fd, JournalHeader *hdr, const uint8_t *file_id,
+                         uint64_t size)
+{
+    ssize_t rc;
+
+    rc = pread(fd, hdr, sizeof(*hdr), 0);
+
+    return rc == (ssize_t)sizeof(*hdr) &&
+           hdr->magic == JOURNAL_MAGIC &&
+           hdr->version == JOURNAL_VERSION &&
+           hdr->block_size == JOURNAL_BLOCK_SIZE &&
+           hdr->state_size == sizeof(Sha256State) &&
+           hdr->file_size == size &&
+           hdr->hashed <= size &&
+           memcmp(hdr->file_id, file_id, FILEIO_FILE_ID_LEN) == 0;
+}
+
+void fileio_journal_free(FileJournal *journal)
+{
+    if (!journal)
+        return;
+
+    if (journal->fd >= 0)
+        close(journal->fd);
+
+    if (journal->path)
+        free(journal->path);
+
+    if (journal->blocks)
+        free(journal->blocks);
+
+    free(journal);
+}
+
+void fileio_journal_unlink(const char *path)
+{
+    char *jpath = journal_path(path);
+
+    if (jpath) {
+        unlink(jpath);
+        free(jpath);
+    }
+}
+
+/*
+ * Opens the journal of the file being received, picking up the one left by
+ * an interrupted transfer of the same file.
+ */
+static FileJournal *journal_open(FileTracker *ft, const char *path)
+{
+    FileJournal *journal;
+    size_t words = journal_words(ft->file_size);
+    ssize_t len = (ssize_t)(words * sizeof(uint64_t));
+
+    journal = (FileJournal *)calloc(1, sizeof(FileJournal));
+    if (!journal)
+        return NULL;
+
+    journal->path = journal_path(path);
+    journal->blocks = (bitset *)malloc(offsetof(bitset, bits) +
+                                       (words ? (size_t)len : sizeof(uint64_t)));
+    if (!journal->path || !journal->blocks) {
+        journal->fd = -1;
+        fileio_journal_free(journal);
+        return NULL;
+    }
+
+    bitset_init(journal->blocks,
+                (ft->file_size + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE);
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal->fd < 0) {
+        vlogW("Carrier: Open file journal %s error (%d).", journal->path, errno);
+        fileio_journal_free(journal);
+        return NULL;
+    }
+
+    if (journal_read(journal->fd, &journal->hdr, ft->file_id, ft->file_size) &&
+        pread(journal->fd, journal->blocks->bits, len,
+              sizeof(JournalHeader)) == len) {
+        vlogI("Carrier: Resume file %s, %llu bytes received.", path,
+              (unsigned long long)journal->hdr.hashed);
+        return journal;
+    }
+
+    memset(&journal->hdr, 0, sizeof(journal->hdr));
+    journal->hdr.magic = JOURNAL_MAGIC;
+    journal->hdr.version = JOURNAL_VERSION;
+    memcpy(journal->hdr.file_id, ft->file_id, FILEIO_FILE_ID_LEN);
+    journal->hdr.file_size = ft->file_size;
+    journal->hdr.block_size = JOURNAL_BLOCK_SIZE;
+    journal->hdr.state_size = sizeof(Sha256State);
+    sha256_init(&journal->hdr.state);
+    bitset_reset(journal->blocks);
+
+    if (ftruncate(journal->fd, 0) < 0 ||
+        pwrite(journal->fd, &journal->hdr, sizeof(JournalHeader), 0) !=
+            (ssize_t)sizeof(JournalHeader) ||
+        (len && pwrite(journal->fd, journal->blocks->bits, len,
+                       sizeof(JournalHeader)) != len)) {
+        vlogW("Carrier: Write file journal %s error (%d).", journal->path, errno);
+        fileio_journal_free(journal);
+        return NULL;
+    }
+
+    return journal;
+}
+
+static void journal_mark(FileJournal *journal, uint64_t from, uint64_t to,
+                        int *lo, int *hi)
+{
+    uint64_t first = (from + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE;
+    uint64_t last = to / JOURNAL_BLOCK_SIZE;
+    uint64_t b;
+
+    // The tail block is complete once data reaches the end of the file.
+    if (to >= journal->hdr.file_size)
+        last = bitset_size(journal->blocks);
+
+    for (b = first; b < last; b++) {
+        if (bitset_isset(journal->blocks, (int)b))
+            continue;
+
+        bitset_set(journal->blocks, (int)b);
+        if (*lo < 0 || (int)b < *lo)
+            *lo = (int)b;
+        if ((int)b > *hi)
+            *hi = (int)b;
+    }
+}
+
+/*
+ * Hashes file data already on disk, from what is hashed up to position.
+ */
+static int journal_hash_file(FileJournal *journal, int fd, uint64_t position)
+{
+    uint8_t *buf;
+    ssize_t rc;
+
+    buf = (uint8_t *)malloc(FILEIO_READ_SIZE);
+    if (!buf)
+        return -1;
+
+    while (journal->hdr.hashed < position) {
+        size_t len = position - journal->hdr.hashed;
+
+        if (len > FILEIO_READ_SIZE)
+            len = FILEIO_READ_SIZE;
+
+        rc = pread(fd, buf, len, (off_t)journal->hdr.hashed);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+
+        sha256_update(&journal->hdr.state, buf, rc);
+        journal->hdr.hashed += rc;
+    }
+
+    free(buf);
+    return journal->hdr.hashed == position ? 0 : -1;
+}
+
+/*
+ * Writes the header, and the bitmap words of blocks lo to hi if any.
+ */
+static void journal_store(FileJournal *journal, int lo, int hi)
+{
+    ssize_t len;
+
+    if (pwrite(journal->fd, &journal->hdr, sizeof(JournalHeader), 0) !=
+            (ssize_t)sizeof(JournalHeader))
+        goto error;
+
+    if (lo >= 0) {
+        lo >>= 6;
+        hi >>= 6;
+        len = (ssize_t)((hi - lo + 1) * sizeof(uint64_t));
+        if (pwrite(journal->fd, journal->blocks->bits + lo, len,
+                   sizeof(JournalHeader) + lo * sizeof(uint64_t)) != len)
+            goto error;
+    }
+
+    return;
+
+error:
+    vlogW("Carrier: Write file journal %s error (%d).", journal->path, errno);
+}
+
+static bool journal_has(FileJournal *journal, uint64_t from, uint64_t to)
+{
+    uint64_t b;
+
+    for (b = from / JOURNAL_BLOCK_SIZE; b * JOURNAL_BLOCK_SIZE < to; b++) {
+        if (!bitset_isset(journal->blocks, (int)b))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Records data just written; the data is also hashed if it goes on from the
+ * data hashed so far, possibly after some already on disk.
+ */
+static void journal_update(FileJournal *journal, int fd, const FileIOJob *job)
+{
+    uint64_t end = job->position + job->length;
+    uint64_t hashed;
+    int lo = -1, hi = -1;
+
+    if (job->position > journal->hdr.hashed &&
+        journal_has(journal, journal->hdr.hashed, job->position))
+        journal_hash_file(journal, fd, job->position);
+
+    hashed = journal->hdr.hashed;
+    if (job->position <= hashed && end > hashed) {
+        sha256_update(&journal->hdr.state, job->data + (hashed - job->position),
+                      end - hashed);
+        journal->hdr.hashed = end;
+
+        journal_mark(journal, hashed - hashed % JOURNAL_BLOCK_SIZE, end, &lo, &hi);
+    } else {
+        journal_mark(journal, job->position, end, &lo, &hi);
+    }
+
+    journal_store(journal, lo, hi);
+}
+
+/*
+ * Checks the whole file against its hash, then the journal is done with.
+ */
+static int journal_verify(FileTracker *ft)
+{
+    FileJournal *journal = ft->journal;
+    uint8_t digest[SHA256_BYTES];
+    int rc = 0;
+
+    if (journal_hash_file(journal, ft->fd, journal->hdr.file_size) < 0 ||
+        sha256_final(&journal->hdr.state, digest, sizeof(digest)) < 0 ||
+        memcmp(digest, journal->hdr.file_id, FILEIO_FILE_ID_LEN) != 0)
+        rc = EBADMSG;
+
+    unlink(journal->path);
+    fileio_journal_free(journal);
+    ft->journal = NULL;
+
+    return rc;
+}
+
+/*
+ * Records data written by someone else in the journal of the tracker, kept
+ * open for the records coming next and the writes of the worker if any.
+ */
+static void job_record(FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+    int lo = -1, hi = -1;
+
+    if (!ft->journal)
+        ft->journal = journal_open(ft, job->path);
+    if (!ft->journal)
+        return;
+
+    journal_mark(ft->journal, job->position, job->position + job->length,
+                 &lo, &hi);
+    journal_store(ft->journal, lo, hi);
+}
+
+uint64_t fileio_resume_position(const char *path, const uint8_t *file_id,
+                                uint64_t size)
+{
+    JournalHeader hdr;
+    uint64_t position = 0;
+    uint64_t word;
+    size_t i, words;
+    char *jpath;
+    int fd;
+
+    jpath = journal_path(path);
+    if (!jpath)
+        return 0;
+
+    fd = open(jpath, O_RDONLY | O_CLOEXEC);
+    free(jpath);
+    if (fd < 0)
+        return 0;
+
+    if (!journal_read(fd, &hdr, file_id, size))
+        goto out;
+
+    // Resumes from the first block missing, toxcore sends data in order.
+    words = journal_words(size);
+    for (i = 0; i < words; i++) {
+        if (pread(fd, &word, sizeof(word),
+                  sizeof(JournalHeader) + i * sizeof(word)) != sizeof(word))
+            break;
+
+        if (word != UINT64_MAX) {
+            position += (uint64_t)__builtin_ctzll(~word) * JOURNAL_BLOCK_SIZE;
+            break;
+        }
+
+        position += (uint64_t)64 * JOURNAL_BLOCK_SIZE;
+    }
+
+    // Receives the tail block again at least, to complete the transfer.
+    if (position >= size)
+        position = size > JOURNAL_BLOCK_SIZE ?
+                   (size - 1) / JOURNAL_BLOCK_SIZE * JOURNAL_BLOCK_SIZE : 0;
+
+out:
+    close(fd);
+    return position;
+}
+
+int fileio_hash_file(const char *path, uint8_t *digest, uint64_t *size)
+{
+    Sha256State state;
+    uint8_t *buf;
+    ssize_t rc;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    buf = (uint8_t *)malloc(FILEIO_READ_SIZE);
+    if (!buf) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    sha256_init(&state);
+    *size = 0;
+
+    while ((rc = read(fd, buf, FILEIO_READ_SIZE)) != 0) {
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        sha256_update(&state, buf, rc);
+        *size += rc;
+    }
+
+    free(buf);
+    close(fd);
+
+    if (rc < 0)
+        return -1;
+
+    sha256_final(&state, digest, FILEIO_FILE_ID_LEN);
+    return 0;
+}
+
+static int file_open(FileTracker *ft, const char *path, bool sender)
+{
+    if (sender)
+        ft->fd = open(path, O_RDONLY | O_CLOEXEC);
+    else if (ft->hashed)
+        // Read back as well, for data on disk the journal has yet to hash.
+        ft->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    else
+        ft->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (ft->fd < 0) {
+        vlogE("Carrier: Open file %s error (%d).", path, errno);
+        return -1;
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    if (sender)
+        posix_fadvise(ft->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // Without a journal the file is still received, but not resumable.
+    if (!sender && ft->hashed && !ft->journal)
+        ft->journal = journal_open(ft, path);
+
+    return 0;
+}
+
+static void job_read(FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+    size_t total = 0;
+    ssize_t rc;
+
+    while (total < job->length) {
+        rc = pread(ft->fd, job->data + total, job->length - total,
+                   (off_t)(job->position + total));
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            job->error = errno;
+            break;
+        }
+
+        if (rc == 0)
+            break;
+
+        total += rc;
+    }
+
+    job->length = total;
+}
+
+static void job_write(FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+    size_t total = 0;
+    ssize_t rc;
+
+    while (total < job->length) {
+        rc = pwrite(ft->fd, job->data + total, job->length - total,
+                    (off_t)(job->position + total));
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            job->error = errno;
+            break;
+        }
+
+        total += rc;
+    }
+
+    if (ft->journal && !job->error)
+        journal_update(ft->journal, ft->fd, job);
+}
+
+static void job_run(FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+
+    if (__atomic_load_n(&ft->canceled, __ATOMIC_ACQUIRE)) {
+        job->error = ECANCELED;
+        return;
+    }
+
+    if (job->type == FileIOType_Hash) {
+        if (fileio_hash_file(job->path, job->digest, &job->position) < 0)
+            job->error = errno ? errno : EIO;
+        return;
+    }
+
+    if (job->type == FileIOType_Record) {
+        job_record(job);
+        return;
+    }
+
+    if (ft->fd < 0) {
+        if (!job->path ||
+            file_open(ft, job->path, job->type == FileIOType_Read) < 0) {
+            job->error = job->path ? errno : EBADF;
+            return;
+        }
+    }
+
+    switch (job->type) {
+    case FileIOType_Read:
+        job_read(job);
+        break;
+
+    case FileIOType_Write:
+        job_write(job);
+        break;
+
+    case FileIOType_Finish:
+        if (ftruncate(ft->fd, (off_t)job->position) < 0)
+            job->error = errno;
+        else if (ft->journal)
+            job->error = journal_verify(ft);
+        break;
+
+    case FileIOType_Hash:
+    case FileIOType_Record:
+        // Never open the file of the tracker, done above.
+        break;
+    }
+}
+
+/*
+ * Once stopped, the writes and records still queued are done so no data
+ * received is lost, reads and hashes dropped, and nothing is reported to the
+ * carrier thread anymore.
+ */
+static void *fileio_worker(void *arg)
+{
+    FileIO *io = (FileIO *)arg;
+    FileIOJob *job;
+    FileTracker *ft;
+    bool stopping;
+    bool done;
+
+    pthread_mutex_lock(&io->lock);
+
+    for (;;) {
+        while (!io->queue_head && !io->stop)
+            pthread_cond_wait(&io->queued, &io->lock);
+
+        job = job_pop(&io->queue_head, &io->queue_tail);
+        if (!job)
+            break;
+
+        stopping = io->stop;
+        ft = job->ft;
+
+        pthread_mutex_unlock(&io->lock);
+        if (!stopping || job->type == FileIOType_Write ||
+                job->type == FileIOType_Finish ||
+                job->type == FileIOType_Record)
+            job_run(job);
+        pthread_mutex_lock(&io->lock);
+
+        if (job->type == FileIOType_Write) {
+            ft->pending_writes -= job->length;
+            if (ft->write_throttled &&
+                    ft->pending_writes < FILEIO_WRITE_LOW_WATER) {
+                ft->write_throttled = false;
+                job->drained = true;
+            }
+        }
+
+        // Only reads, hashes, drained transfers and failures are of
+        // interest to the carrier thread.
+        done = !stopping && (job->type == FileIOType_Read ||
+                             job->type == FileIOType_Hash || job->drained ||
+                             (job->error && job->error != ECANCELED));
+        if (done)
+            job_append(&io->done_head, &io->done_tail, job);
+
+        pthread_mutex_unlock(&io->lock);
+
+        if (done)
+            io->wakeup(io->context);
+        else
+            fileio_job_free(job);
+
+        pthread_mutex_lock(&io->lock);
+    }
+
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+static void fileio_destroy(void *p)
+{
+    FileIO *io = (FileIO *)p;
+    FileIOJob *job;
+
+    if (io->started) {
+        pthread_mutex_lock(&io->lock);
+        io->stop = true;
+        pthread_cond_broadcast(&io->queued);
+        pthread_mutex_unlock(&io->lock);
+
+        // Returns once the writes queued are done.
+        pthread_join(io->thread, NULL);
+    }
+
+    while ((job = job_pop(&io->queue_head, &io->queue_tail)) != NULL)
+        fileio_job_free(job);
+
+    while ((job = job_pop(&io->done_head, &io->done_tail)) != NULL)
+        fileio_job_free(job);
+
+    pthread_cond_destroy(&io->queued);
+    pthread_mutex_destroy(&io->lock);
+}
+
+FileIO *fileio_create(FileIOWakeup *wakeup, void *context)
+{
+    FileIO *io;
+    int rc;
+
+    io = (FileIO *)rc_zalloc(sizeof(FileIO), fileio_destroy);
+    if (!io) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->queued, NULL);
+
+    io->wakeup = wakeup;
+    io->context = context;
+
+    rc = pthread_create(&io->thread, NULL, fileio_worker, io);
+    if (rc != 0) {
+        vlogE("Carrier: Create file I/O thread error (%d).", rc);
+        deref(io);
+        errno = rc;
+        return NULL;
+    }
+
+    io->started = true;
+
+    return io;
+}
+
+static FileIOJob *job_create(FileIOType type, FileTracker *ft,
+                             const char *path, uint64_t position)
+{
+    FileIOJob *job;
+
+    job = (FileIOJob *)calloc(1, sizeof(FileIOJob));
+    if (!job)
+        return NULL;
+
+    if (path) {
+        job->path = strdup(path);
+        if (!job->path) {
+            free(job);
+            return NULL;
+        }
+    }
+
+    job->type = type;
+    job->ft = ref(ft);
+    job->position = position;
+
+    return job;
+}
+
+/*
+ * Never waits on the worker: returns 1 when a write got its transfer past
+ * the high water mark, so the caller holds the sender back instead.
+ */
+static int job_submit(FileIO *io, FileIOJob *job)
+{
+    FileTracker *ft = job->ft;
+    int rc = 0;
+
+    pthread_mutex_lock(&io->lock);
+
+    if (job->type == FileIOType_Write) {
+        ft->pending_writes += job->length;
+        if (!ft->write_throttled &&
+                ft->pending_writes > FILEIO_WRITE_HIGH_WATER) {
+            ft->write_throttled = true;
+            rc = 1;
+        }
+    }
+
+    job_append(&io->queue_head, &io->queue_tail, job);
+    pthread_cond_signal(&io->queued);
+
+    pthread_mutex_unlock(&io->lock);
+
+    return rc;
+}
+
+int fileio_read(FileIO *io, FileTracker *ft, const char *path,
+                uint64_t position)
+{
+    FileIOJob *job;
+
+    job = job_create(FileIOType_Read, ft, path, position);
+    if (!job)
+        return -1;
+
+    job->data = (uint8_t *)malloc(FILEIO_READ_SIZE);
+    if (!job->data) {
+        fileio_job_free(job);
+        return -1;
+    }
+
+    job->length = FILEIO_READ_SIZE;
+
+    job_submit(io, job);
+    return 0;
+}
+
+int fileio_write(FileIO *io, FileTracker *ft, const char *path,
+                 uint64_t position, uint8_t *data, size_t length)
+{
+    FileIOJob *job;
+
+    job = job_create(FileIOType_Write, ft, path, position);
+    if (!job) {
+        free(data);
+        return -1;
+    }
+
+    job->data = data;
+    job->length = length;
+
+    return job_submit(io, job);
+}
+
+int fileio_finish(FileIO *io, FileTracker *ft, uint64_t size)
+{
+    FileIOJob *job;
+
+    job = job_create(FileIOType_Finish, ft, NULL, size);
+    if (!job)
+        return -1;
+
+    job_submit(io, job);
+    return 0;
+}
+
+int fileio_record(FileIO *io, FileTracker *ft, const char *path,
+                  uint64_t position, size_t length)
+{
+    FileIOJob *job;
+
+    if (!ft->hashed || !length)
+        return 0;
+
+    job = job_create(FileIOType_Record, ft, path, position);
+    if (!job)
+        return -1;
+
+    job->length = length;
+
+    job_submit(io, job);
+    return 0;
+}
+
+int fileio_hash(FileIO *io, FileTracker *ft, const char *path)
+{
+    FileIOJob *job;
+
+    job = job_create(FileIOType_Hash, ft, path, 0);
+    if (!job)
+        return -1;
+
+    job_submit(io, job);
+    return 0;
+}
+
+FileIOJob *fileio_poll(FileIO *io)
+{
+    FileIOJob *job;
+
+    pthread_mutex_lock(&io->lock);
+    job = job_pop(&io->done_head, &io->done_tail);
+    pthread_mutex_unlock(&io->lock);
+
+    return job;
+}
@@ -0,0 +1,147 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * File transfer disk I/O, done by a worker thread so the carrier loop never
+ * waits on storage. Jobs of a tracker run in submission order; finished
+ * reads, and failed jobs, come back through fileio_poll() on the carrier
+ * thread, which is woken up when there are some.
+ *
+ * A file received from a friend offering its content hash as file id is
+ * journaled while it is written: the sidecar file next to it keeps a bitmap
+ * of the blocks on disk and the SHA256 state of the contiguous data written
+ * so far, so the transfer can be resumed after the friend reconnects, and the
+ * file verified once complete.
+ */
+
+#define FILEIO_READ_SIZE            (64 * 1024)
+
+/*
+ * Bytes of a transfer queued to the worker and not written yet: beyond the
+ * high water mark the transfer is to be paused, and it is reported drained
+ * once below the low one.
+ */
+#define FILEIO_WRITE_HIGH_WATER     (1024 * 1024)
+#define FILEIO_WRITE_LOW_WATER      (256 * 1024)
+
+#define FILEIO_FILE_ID_LEN          32
+#define FILEIO_JOURNAL_SUFFIX       ".ioexpart"
+
+typedef struct FileIO FileIO;
+
+typedef void FileIOWakeup(void *context);
+
+typedef enum FileIOType {
+    FileIOType_Read,
+    FileIOType_Write,
+    FileIOType_Finish,
+    FileIOType_Hash,
+    FileIOType_Record
+} FileIOType;
+
+typedef struct FileIOJob {
+    struct FileIOJob *next;
+    FileIOType type;
+    struct FileTracker *ft;
+    char *path;         // opens the file first if not NULL.
+    uint64_t position;
+    uint8_t *data;
+    size_t length;      // bytes actually read, once done.
+    int error;          // errno of the failure, 0 on success; EBADMSG if
+                        // the received file does not match its hash.
+    bool drained;       // write: the transfer went below the low water mark.
+    uint8_t digest[FILEIO_FILE_ID_LEN]; // hash: of the file, its size in
+                                        // position.
+} FileIOJob;
+
+typedef struct FileJournal FileJournal;
+
+FileIO *fileio_create(FileIOWakeup *wakeup, void *context);
+
+/*
+ * Reads FILEIO_READ_SIZE bytes at position; the tracker stays referenced
+ * until the job is freed.
+ */
+int fileio_read(FileIO *io, struct FileTracker *ft, const char *path,
+                uint64_t position);
+
+/*
+ * Writes data, which is taken over and freed by the worker. Returns 1 when
+ * the transfer passed the high water mark with it, the caller pauses the
+ * transfer then until a job of it comes back drained.
+ */
+int fileio_write(FileIO *io, struct FileTracker *ft, const char *path,
+                 uint64_t position, uint8_t *data, size_t length);
+
+/*
+ * Truncates the file to its final size once the writes before are done, and
+ * verifies it against the file id if journaled.
+ */
+int fileio_finish(FileIO *io, struct FileTracker *ft, uint64_t size);
+
+/*
+ * Records data written to the received file without going through the
+ * worker, so the journal resumes the transfer past it. The data is hashed
+ * from disk later on, once the data before it is. Does nothing unless the
+ * file is journaled.
+ */
+int fileio_record(FileIO *io, struct FileTracker *ft, const char *path,
+                  uint64_t position, size_t length);
+
+/*
+ * Hashes the file at path, the job comes back with its digest once done.
+ */
+int fileio_hash(FileIO *io, struct FileTracker *ft, const char *path);
+
+FileIOJob *fileio_poll(FileIO *io);
+
+void fileio_job_free(FileIOJob *job);
+
+void fileio_journal_free(FileJournal *journal);
+
+/*
+ * Removes the journal of a received file, if any.
+ */
+void fileio_journal_unlink(const char *path);
+
+
+/*
+ * Gets the position to resume receiving the file from, 0 if there is no
+ * journal of it matching file_id and size.
+ */
+uint64_t fileio_resume_position(const char *path, const uint8_t *file_id,
+                                uint64_t size);
+
+/*
+ * Hashes the whole file, blocking the caller, see fileio_hash() otherwise.
+ * Returns -1 and sets errno on failure.
+ */
+int fileio_hash_file(const char *path, uint8_t *digest, uint64_t *size);
+
+#endif /* __FILEIO_H__ */
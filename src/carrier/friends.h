@@ -25,30 +25,61 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <linkedhashtable.h>
+#include <linkedlist.h>
 
 #include "IOEX_carrier.h"
+#include "dht.h"
+
+typedef struct MessageBuffer {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+} MessageBuffer;
 
 typedef struct FriendInfo {
     HashEntry he;
+    HashEntry he_userid;
+    HashEntry he_key;
 
     uint32_t friend_number;
+    uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
+    uint32_t features;
     IOEXFriendInfo info;
+
+    /*
+     * Outbound messages queued by the API callers, guarded by the carrier
+     * outq_lock and sent from the carrier thread.
+     */
+    ListEntry outq_le;
+    int outq_pending;
+    MessageBuffer outq;
 } FriendInfo;
 
+static inline
+void friend_info_destroy(void *p)
+{
+    FriendInfo *fi = (FriendInfo *)p;
+
+    if (fi->outq.data)
+        free(fi->outq.data);
+}
+
 static
 int friendid_compare(const void *key1, size_t len1, const void *key2, size_t len2)
 {
     assert(key1 && sizeof(uint32_t) == len1);
     assert(key2 && sizeof(uint32_t) == len2);
 
-    return strcmp(key1, key2);
+    return memcmp(key1, key2, sizeof(uint32_t));
 }
 
 static inline
 Hashtable *friends_create(void)
 {
-    return hashtable_create(32, 1, NULL, friendid_compare);
+    return hashtable_create_rcu(32, NULL, friendid_compare);
 }
 
 static inline
@@ -120,4 +151,69 @@ int friends_iterator_has_next(HashtableIterator *iterator)
     return hashtable_iterator_has_next(iterator);
 }
 
+/*
+ * Index of friends by userid, and by public key, to resolve friends without
+ * decoding userids and asking DHT.
+ */
+static inline
+Hashtable *friend_index_create(void)
+{
+    return hashtable_create_rcu(32, NULL, NULL);
+}
+
+static inline
+void friend_index_put(Hashtable *index, FriendInfo *fi)
+{
+    assert(index);
+    assert(fi);
+
+    fi->he_userid.data = fi;
+    fi->he_userid.key = fi->info.user_info.userid;
+    fi->he_userid.keylen = strlen(fi->info.user_info.userid);
+
+    hashtable_put(index, &fi->he_userid);
+
+    fi->he_key.data = fi;
+    fi->he_key.key = fi->public_key;
+    fi->he_key.keylen = DHT_PUBLIC_KEY_SIZE;
+
+    hashtable_put(index, &fi->he_key);
+}
+
+static inline
+FriendInfo *friend_index_get(Hashtable *index, const char *userid)
+{
+    assert(index);
+    assert(userid);
+
+    return (FriendInfo *)hashtable_get(index, userid, strlen(userid));
+}
+
+static inline
+FriendInfo *friend_index_get_by_key(Hashtable *index, const uint8_t *public_key)
+{
+    assert(index);
+    assert(public_key);
+
+    return (FriendInfo *)hashtable_get(index, public_key, DHT_PUBLIC_KEY_SIZE);
+}
+
+static inline
+void friend_index_remove(Hashtable *index, FriendInfo *fi)
+{
+    FriendInfo *removed;
+
+    assert(index);
+    assert(fi);
+
+    removed = hashtable_remove(index, fi->info.user_info.userid,
+                               strlen(fi->info.user_info.userid));
+    if (removed)
+        deref(removed);
+
+    removed = hashtable_remove(index, fi->public_key, DHT_PUBLIC_KEY_SIZE);
+    if (removed)
+        deref(removed);
+}
+
 #endif /* __FRIENDINFOS_H__ */
@@ -0,0 +1,138 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FTRACKERS_H__
+#define __FTRACKERS_H__
+
+#include <stdint.h>
+#include <assert.h>
+
+#include <linkedhashtable.h>
+
+#include "IOEX_carrier_impl.h"
+
+static inline
+uint64_t file_tracker_key(uint32_t friend_number, uint32_t file_number)
+{
+    return ((uint64_t)friend_number << 32) | file_number;
+}
+
+static
+uint32_t ftkey_hash_code(const void *key, size_t keylen)
+{
+    uint64_t ftkey;
+
+    assert(key && keylen == sizeof(uint64_t));
+
+    ftkey = *(uint64_t *)key;
+
+    return (uint32_t)(ftkey >> 32) * 31 + (uint32_t)ftkey;
+}
+
+static
+int ftkey_compare(const void *key1, size_t len1, const void *key2, size_t len2)
+{
+    uint64_t ftkey1, ftkey2;
+
+    assert(key1 && len1 == sizeof(uint64_t));
+    assert(key2 && len2 == sizeof(uint64_t));
+
+    ftkey1 = *(uint64_t *)key1;
+    ftkey2 = *(uint64_t *)key2;
+
+    if (ftkey1 > ftkey2)
+        return 1;
+
+    if (ftkey1 < ftkey2)
+        return -1;
+
+    return 0;
+}
+
+static inline
+Hashtable *file_trackers_create(int capacity)
+{
+    return hashtable_create(capacity, 1, ftkey_hash_code, ftkey_compare);
+}
+
+static inline
+void file_trackers_put(Hashtable *trackers, FileTracker *ft)
+{
+    assert(trackers && ft);
+
+    ft->key = file_tracker_key(ft->fi.friend_number, ft->fi.file_index);
+
+    ft->he.data = ft;
+    ft->he.key = &ft->key;
+    ft->he.keylen = sizeof(ft->key);
+
+    hashtable_put(trackers, &ft->he);
+}
+
+static inline
+FileTracker *file_trackers_get(Hashtable *trackers, uint32_t friend_number,
+                               uint32_t file_number)
+{
+    uint64_t ftkey = file_tracker_key(friend_number, file_number);
+
+    assert(trackers);
+
+    return (FileTracker *)hashtable_get(trackers, &ftkey, sizeof(ftkey));
+}
+
+static inline
+FileTracker *file_trackers_remove(Hashtable *trackers, uint32_t friend_number,
+                                  uint32_t file_number)
+{
+    uint64_t ftkey = file_tracker_key(friend_number, file_number);
+
+    assert(trackers);
+
+    return (FileTracker *)hashtable_remove(trackers, &ftkey, sizeof(ftkey));
+}
+
+static inline
+HashtableIterator *file_trackers_iterate(Hashtable *trackers,
+                                         HashtableIterator *iterator)
+{
+    assert(trackers && iterator);
+
+    return hashtable_iterate(trackers, iterator);
+}
+
+static inline
+int file_trackers_iterator_next(HashtableIterator *iterator, FileTracker **ft)
+{
+    assert(iterator && ft);
+
+    return hashtable_iterator_next(iterator, NULL, NULL, (void **)ft);
+}
+
+static inline
+void file_trackers_clear(Hashtable *trackers)
+{
+    assert(trackers);
+
+    hashtable_clear(trackers);
+}
+
+#endif /* __FTRACKERS_H__ */
@@ -0,0 +1,543 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <rc_mem.h>
+#include <vlog.h>
+#include <crypto.h>
+
+#include "IOEX_carrier.h"
+#include "dht.h"
+#include "persistence.h"
+
+/*
+ * Log record: the sequence number (8 bytes), the type (2), the length of the
+ * payload (2) and the leading bytes of the SHA256 of all that and of the
+ * payload (8), in network byte order. The payload is the public key of the
+ * friend, followed by the label without its terminator for label records.
+ */
+#define RECORD_HEADER_SIZE          20
+#define RECORD_CHECKSUM_OFFSET      12
+#define RECORD_CHECKSUM_SIZE        8
+#define RECORD_MAX_PAYLOAD          (DHT_PUBLIC_KEY_SIZE + IOEX_MAX_USER_NAME_LEN)
+
+typedef struct LogRecord {
+    uint64_t seq;
+    PersistenceRecordType type;
+    uint8_t public_key[DHT_PUBLIC_KEY_SIZE];
+    char label[IOEX_MAX_USER_NAME_LEN + 1];
+} LogRecord;
+
+struct Persistence {
+    pthread_t thread;
+    bool started;
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t stored;
+
+    char *location;
+    char *filename;
+    char *journal_filename;
+    char *log_filename;
+
+    int log_fd;
+    off_t log_len;
+    uint64_t seq;           // of the next record.
+
+    /* Snapshot waiting for the writer */
+    uint8_t *pending;
+    size_t pending_len;
+    uint64_t pending_seq;
+
+    bool writing;
+    int error;              // errno of the last snapshot stored, 0 if done.
+};
+
+static void put_uint(uint8_t *pos, uint64_t val, int bytes)
+{
+    while (bytes-- > 0) {
+        pos[bytes] = (uint8_t)val;
+        val >>= 8;
+    }
+}
+
+static uint64_t get_uint(const uint8_t *pos, int bytes)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        val = (val << 8) | pos[i];
+
+    return val;
+}
+
+static char *path_join(const char *location, const char *filename,
+                       const char *suffix)
+{
+    char *path;
+
+    path = (char *)malloc(strlen(location) + strlen(filename) +
+                          strlen(suffix) + 2);
+    if (path)
+        sprintf(path, "%s/%s%s", location, filename, suffix);
+
+    return path;
+}
+
+static void record_checksum(const uint8_t *buf, size_t payload_len,
+                            uint8_t *sum)
+{
+    unsigned char digest[SHA256_BYTES];
+    Sha256State state;
+
+    sha256_init(&state);
+    sha256_update(&state, buf, RECORD_CHECKSUM_OFFSET);
+    sha256_update(&state, buf + RECORD_HEADER_SIZE, payload_len);
+    sha256_final(&state, digest, sizeof(digest));
+
+    memcpy(sum, digest, RECORD_CHECKSUM_SIZE);
+}
+
+static size_t record_encode(uint8_t *buf, const LogRecord *rec)
+{
+    size_t label_len = 0;
+    size_t payload_len;
+
+    if (rec->type == PersistenceRecord_Label)
+        label_len = strlen(rec->label);
+
+    payload_len = DHT_PUBLIC_KEY_SIZE + label_len;
+
+    put_uint(buf, rec->seq, 8);
+    put_uint(buf + 8, rec->type, 2);
+    put_uint(buf + 10, payload_len, 2);
+
+    memcpy(buf + RECORD_HEADER_SIZE, rec->public_key, DHT_PUBLIC_KEY_SIZE);
+    memcpy(buf + RECORD_HEADER_SIZE + DHT_PUBLIC_KEY_SIZE, rec->label,
+           label_len);
+
+    record_checksum(buf, payload_len, buf + RECORD_CHECKSUM_OFFSET);
+
+    return RECORD_HEADER_SIZE + payload_len;
+}
+
+/*
+ * Reads the next record. Returns its size, 0 at the end of the log, or -1
+ * if it is damaged.
+ */
+static ssize_t record_read(int fd, LogRecord *rec)
+{
+    uint8_t buf[RECORD_HEADER_SIZE + RECORD_MAX_PAYLOAD];
+    uint8_t sum[RECORD_CHECKSUM_SIZE];
+    size_t payload_len;
+    size_t label_len;
+    ssize_t rc;
+
+    rc = read(fd, buf, RECORD_HEADER_SIZE);
+    if (rc == 0)
+        return 0;
+    if (rc != RECORD_HEADER_SIZE)
+        return -1;
+
+    payload_len = (size_t)get_uint(buf + 10, 2);
+    if (payload_len < DHT_PUBLIC_KEY_SIZE || payload_len > RECORD_MAX_PAYLOAD)
+        return -1;
+
+    if (read(fd, buf + RECORD_HEADER_SIZE, payload_len) != (ssize_t)payload_len)
+        return -1;
+
+    record_checksum(buf, payload_len, sum);
+    if (memcmp(sum, buf + RECORD_CHECKSUM_OFFSET, RECORD_CHECKSUM_SIZE) != 0)
+        return -1;
+
+    rec->seq = get_uint(buf, 8);
+    rec->type = (PersistenceRecordType)get_uint(buf + 8, 2);
+    memcpy(rec->public_key, buf + RECORD_HEADER_SIZE, DHT_PUBLIC_KEY_SIZE);
+
+    label_len = payload_len - DHT_PUBLIC_KEY_SIZE;
+    memcpy(rec->label, buf + RECORD_HEADER_SIZE + DHT_PUBLIC_KEY_SIZE,
+           label_len);
+    rec->label[label_len] = 0;
+
+    return RECORD_HEADER_SIZE + payload_len;
+}
+
+/*
+ * Goes through the log from its start, calling cb with the records from seq
+ * on, and gets the end of the intact records and the number to append the
+ * next one with.
+ */
+static int log_scan(int fd, uint64_t seq, PersistenceReplayCallback *cb,
+                    void *context, off_t *end, uint64_t *next_seq)
+{
+    LogRecord rec;
+    off_t pos = 0;
+    ssize_t len;
+    int count = 0;
+
+    while ((len = record_read(fd, &rec)) > 0) {
+        pos += len;
+
+        if (next_seq && rec.seq >= *next_seq)
+            *next_seq = rec.seq + 1;
+
+        if (cb && rec.seq >= seq) {
+            cb(rec.type, rec.public_key,
+               rec.type == PersistenceRecord_Label ? rec.label : NULL,
+               context);
+            count++;
+        }
+    }
+
+    if (len < 0)
+        vlogW("Carrier: Persistence log damaged at offset %lld, "
+              "ignored from there.", (long long)pos);
+
+    if (end)
+        *end = pos;
+
+    return count;
+}
+
+int persistence_replay(const char *location, const char *filename,
+                       uint64_t seq, PersistenceReplayCallback *cb,
+                       void *context)
+{
+    char *path;
+    int fd;
+    int rc;
+
+    path = path_join(location, filename, PERSISTENCE_LOG_SUFFIX);
+    if (!path)
+        return -1;
+
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return -1;
+
+    rc = log_scan(fd, seq, cb, context, NULL, NULL);
+    close(fd);
+
+    return rc;
+}
+
+/*
+ * Writes the snapshot through the journal file, then syncs the directory so
+ * the rename survives a crash before the log it covers is dropped.
+ */
+static int snapshot_write(Persistence *p, uint8_t *buf, size_t len)
+{
+    ssize_t written;
+    int fd;
+    int rc;
+
+    sha256(buf + PERSISTENCE_HEADER_SIZE, len - PERSISTENCE_HEADER_SIZE,
+           buf + PERSISTENCE_HASH_OFFSET, SHA256_BYTES);
+
+    fd = open(p->journal_filename, O_RDWR | O_CREAT | O_TRUNC,
+              S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return errno;
+
+    written = write(fd, buf, len);
+    if (written != (ssize_t)len || fsync(fd) < 0) {
+        rc = written < 0 || written == (ssize_t)len ? errno : ENOSPC;
+        close(fd);
+        remove(p->journal_filename);
+        return rc;
+    }
+
+    close(fd);
+
+    remove(p->filename);
+    if (rename(p->journal_filename, p->filename) < 0)
+        return errno;
+
+    fd = open(p->location, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void *persistence_writer(void *arg)
+{
+    Persistence *p = (Persistence *)arg;
+    uint8_t *buf;
+    size_t len;
+    uint64_t seq;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        while (!p->pending && !p->stop)
+            pthread_cond_wait(&p->queued, &p->lock);
+
+        // The snapshot left when stopped is still written.
+        if (!p->pending)
+            break;
+
+        buf = p->pending;
+        len = p->pending_len;
+        seq = p->pending_seq;
+        p->pending = NULL;
+        p->writing = true;
+
+        pthread_mutex_unlock(&p->lock);
+
+        rc = snapshot_write(p, buf, len);
+        free(buf);
+
+        if (rc != 0)
+            vlogE("Carrier: Store persistence data error (%d).", rc);
+
+        pthread_mutex_lock(&p->lock);
+
+        // The data file covers the whole log, unless records were appended
+        // since the snapshot was taken.
+        if (rc == 0 && seq == p->seq && p->log_len > 0 &&
+                ftruncate(p->log_fd, 0) == 0)
+            p->log_len = 0;
+
+        p->error = rc;
+        p->writing = false;
+        pthread_cond_broadcast(&p->stored);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void persistence_destroy(void *arg)
+{
+    Persistence *p = (Persistence *)arg;
+
+    if (p->started) {
+        pthread_mutex_lock(&p->lock);
+        p->stop = true;
+        pthread_cond_signal(&p->queued);
+        pthread_mutex_unlock(&p->lock);
+
+        pthread_join(p->thread, NULL);
+    }
+
+    if (p->pending)
+        free(p->pending);
+
+    if (p->log_fd >= 0)
+        close(p->log_fd);
+
+    if (p->location)
+        free(p->location);
+
+    if (p->filename)
+        free(p->filename);
+
+    if (p->journal_filename)
+        free(p->journal_filename);
+
+    if (p->log_filename)
+        free(p->log_filename);
+
+    pthread_cond_destroy(&p->stored);
+    pthread_cond_destroy(&p->queued);
+    pthread_mutex_destroy(&p->lock);
+}
+
+Persistence *persistence_create(const char *location, const char *filename,
+                                uint64_t seq)
+{
+    Persistence *p;
+    int rc;
+
+    p = (Persistence *)rc_zalloc(sizeof(Persistence), persistence_destroy);
+    if (!p) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->queued, NULL);
+    pthread_cond_init(&p->stored, NULL);
+
+    p->log_fd = -1;
+    p->seq = seq;
+
+    p->location = strdup(location);
+    p->filename = path_join(location, filename, "");
+    p->journal_filename = path_join(location, filename, ".journal");
+    p->log_filename = path_join(location, filename, PERSISTENCE_LOG_SUFFIX);
+    if (!p->location || !p->filename || !p->journal_filename ||
+            !p->log_filename) {
+        deref(p);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p->log_fd = open(p->log_filename, O_RDWR | O_CREAT | O_APPEND,
+                     S_IRUSR | S_IWUSR);
+    if (p->log_fd < 0) {
+        rc = errno;
+        vlogE("Carrier: Open persistence log %s error (%d).",
+              p->log_filename, rc);
+        deref(p);
+        errno = rc;
+        return NULL;
+    }
+
+    log_scan(p->log_fd, 0, NULL, NULL, &p->log_len, &p->seq);
+
+    // Appends go after the last intact record.
+    if (ftruncate(p->log_fd, p->log_len) < 0) {
+        rc = errno;
+        vlogE("Carrier: Truncate persistence log error (%d).", rc);
+        deref(p);
+        errno = rc;
+        return NULL;
+    }
+
+    rc = pthread_create(&p->thread, NULL, persistence_writer, p);
+    if (rc != 0) {
+        vlogE("Carrier: Create persistence writer thread error (%d).", rc);
+        deref(p);
+        errno = rc;
+        return NULL;
+    }
+
+    p->started = true;
+
+    return p;
+}
+
+uint64_t persistence_seq(Persistence *p)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&p->lock);
+    seq = p->seq;
+    pthread_mutex_unlock(&p->lock);
+
+    return seq;
+}
+
+void persistence_store(Persistence *p, uint8_t *buf, size_t len,
+                       uint64_t seq)
+{
+    pthread_mutex_lock(&p->lock);
+
+    if (p->pending)
+        free(p->pending);
+
+    p->pending = buf;
+    p->pending_len = len;
+    p->pending_seq = seq;
+    pthread_cond_signal(&p->queued);
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+int persistence_flush(Persistence *p)
+{
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (p->pending || p->writing)
+        pthread_cond_wait(&p->stored, &p->lock);
+
+    rc = p->error;
+
+    pthread_mutex_unlock(&p->lock);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
+
+int persistence_log(Persistence *p, PersistenceRecordType type,
+                    const uint8_t *public_key, const char *label)
+{
+    uint8_t buf[RECORD_HEADER_SIZE + RECORD_MAX_PAYLOAD];
+    LogRecord rec;
+    size_t len;
+    ssize_t written;
+    int rc = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    memcpy(rec.public_key, public_key, DHT_PUBLIC_KEY_SIZE);
+
+    if (type == PersistenceRecord_Label && label) {
+        if (strlen(label) > IOEX_MAX_USER_NAME_LEN) {
+            errno = EINVAL;
+            return -1;
+        }
+        strcpy(rec.label, label);
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    rec.seq = p->seq;
+    len = record_encode(buf, &rec);
+
+    written = write(p->log_fd, buf, len);
+    if (written != (ssize_t)len || fsync(p->log_fd) < 0) {
+        rc = written < 0 || written == (ssize_t)len ? errno : ENOSPC;
+        // Cut a partial record off, the records after it would be lost.
+        if (ftruncate(p->log_fd, p->log_len) < 0)
+            vlogW("Carrier: Truncate persistence log error (%d).", errno);
+    } else {
+        p->log_len += len;
+        p->seq++;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    if (rc != 0) {
+        vlogE("Carrier: Append persistence log error (%d).", rc);
+        errno = rc;
+        return -1;
+    }
+
+    return 0;
+}
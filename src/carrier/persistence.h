@@ -0,0 +1,105 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PERSISTENCE_H__
+#define __PERSISTENCE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Persistent data storage off the carrier loop. The loop serializes its
+ * state into a snapshot buffer, which a writer thread seals with its hash
+ * and stores through the journal file, so the loop never waits on the disk.
+ *
+ * Friend and label changes are appended to a log next to the data file as
+ * they happen, costing a small record each rather than a whole snapshot.
+ * Each record carries a sequence number; a snapshot is stamped with the
+ * first number it does not cover, records from there on are replayed over
+ * it when loaded, and the log is dropped once a snapshot covers all of it.
+ */
+
+#define PERSISTENCE_LOG_SUFFIX      ".log"
+
+/*
+ * A snapshot starts with a header of this size, the SHA256 of everything
+ * past the header at PERSISTENCE_HASH_OFFSET and the 64-bit sequence stamp,
+ * in network byte order, at PERSISTENCE_SEQ_OFFSET.
+ */
+#define PERSISTENCE_HEADER_SIZE     256
+#define PERSISTENCE_HASH_OFFSET     16
+#define PERSISTENCE_SEQ_OFFSET      48
+
+typedef struct Persistence Persistence;
+
+typedef enum PersistenceRecordType {
+    PersistenceRecord_FriendAdded = 1,
+    PersistenceRecord_FriendRemoved,
+    PersistenceRecord_Label
+} PersistenceRecordType;
+
+typedef void PersistenceReplayCallback(PersistenceRecordType type,
+                                       const uint8_t *public_key,
+                                       const char *label, void *context);
+
+/*
+ * Replays the records of the log from seq on, stopping at the first one
+ * damaged. Returns the number of records replayed, or -1 if there is no log.
+ */
+int persistence_replay(const char *location, const char *filename,
+                       uint64_t seq, PersistenceReplayCallback *cb,
+                       void *context);
+
+/*
+ * Starts the writer for filename under location; seq is the stamp of the
+ * snapshot loaded, if any. A damaged tail of the log, left by a crash in the
+ * middle of an append, is cut off.
+ */
+Persistence *persistence_create(const char *location, const char *filename,
+                                uint64_t seq);
+
+/*
+ * Gets the sequence number to stamp a snapshot taken now with.
+ */
+uint64_t persistence_seq(Persistence *p);
+
+/*
+ * Hands a snapshot stamped with seq over to the writer, which hashes it and
+ * frees it once stored. A snapshot still waiting to be written is dropped
+ * for this one.
+ */
+void persistence_store(Persistence *p, uint8_t *buf, size_t len,
+                       uint64_t seq);
+
+/*
+ * Waits for the snapshot handed over last to be written.
+ */
+int persistence_flush(Persistence *p);
+
+/*
+ * Appends a record to the log and syncs it. The label is only used by
+ * PersistenceRecord_Label.
+ */
+int persistence_log(Persistence *p, PersistenceRecordType type,
+                    const uint8_t *public_key, const char *label);
+
+#endif /* __PERSISTENCE_H__ */
@@ -20,6 +20,7 @@
  * SOFTWARE.
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <sodium.h>
@@ -31,6 +32,9 @@
 #error Inappropriate SHA256_BYTES definition.
 #endif
 
+typedef char sha256_state_size_check[
+    sizeof(crypto_hash_sha256_state) <= sizeof(Sha256State) ? 1 : -1];
+
 #if NONCE_BYTES != crypto_box_NONCEBYTES
 #error Inappropriate NONCE_BYTES definition.
 #endif
@@ -76,6 +80,31 @@ ssize_t sha256(const void *data, size_t len, unsigned char *digest, size_t diges
     return crypto_hash_sha256_BYTES;
 }
 
+void sha256_init(Sha256State *state)
+{
+    assert(state);
+
+    crypto_hash_sha256_init((crypto_hash_sha256_state *)state);
+}
+
+void sha256_update(Sha256State *state, const void *data, size_t len)
+{
+    assert(state);
+
+    if (data && len)
+        crypto_hash_sha256_update((crypto_hash_sha256_state *)state, data, len);
+}
+
+ssize_t sha256_final(Sha256State *state, unsigned char *digest, size_t digestlen)
+{
+    if (!state || !digest || digestlen < crypto_hash_sha256_BYTES)
+        return -1;
+
+    crypto_hash_sha256_final((crypto_hash_sha256_state *)state, digest);
+
+    return crypto_hash_sha256_BYTES;
+}
+
 char *hmac_sha256a(const void *key, size_t keylen,
                    const void *msg, size_t msglen,
                    char *digest, size_t digestlen)
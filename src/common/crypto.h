@@ -80,6 +80,52 @@ char *sha256a(const void *data, size_t len, char *digest, size_t digestlen);
 COMMON_API
 ssize_t sha256(const void *data, size_t len, unsigned char *digest, size_t digestlen);
 
+/**
+ * Incremental SHA256 state. Plain memory, it can be saved and restored to
+ * go on hashing later.
+ */
+typedef struct Sha256State {
+    uint64_t opaque[16];
+} Sha256State;
+
+/**
+ * Start an incremental SHA256 digest.
+ *
+ * @param
+ *      state       [out] The digest state.
+ */
+COMMON_API
+void sha256_init(Sha256State *state);
+
+/**
+ * Add data to an incremental SHA256 digest.
+ *
+ * @param
+ *      state       [in] The digest state.
+ * @param
+ *      data        [in] The data buffer to be digest.
+ * @param
+ *      len         [in] The data length in the buffer.
+ */
+COMMON_API
+void sha256_update(Sha256State *state, const void *data, size_t len);
+
+/**
+ * Finish an incremental SHA256 digest.
+ *
+ * @param
+ *      state       [in] The digest state.
+ * @param
+ *      digest      [out] The digest result buffer, caller provided.
+ * @param
+ *      digestlen   [in] The digest buffer size.
+ *
+ * @return
+ *      The length of result digest bytes, or -1 if digest buffer too small.
+ */
+COMMON_API
+ssize_t sha256_final(Sha256State *state, unsigned char *digest, size_t digestlen);
+
 /**
  * Hash-based message authentication code with SHA256.
  *
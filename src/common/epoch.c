@@ -0,0 +1,287 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rc_mem.h"
+#include "epoch.h"
+
+/*
+ * Every thread that ever entered a read-side section owns a record, linked
+ * in a list that only grows; records of exited threads are reused.
+ *
+ * A record's state is (epoch << 1) | active. The global epoch advances only
+ * when all active readers have observed the current one, so an object
+ * retired at epoch e can't be seen by any reader once epoch e + 2 is
+ * reached.
+ */
+typedef struct epoch_record {
+    uint64_t            state;
+    int                 nesting;
+    int                 in_use;
+    struct epoch_record *next;
+} EpochRecord;
+
+typedef struct retired {
+    void                *ptr;
+    epoch_reclaim       *reclaim;
+    uint64_t            epoch;
+    struct retired      *next;
+} Retired;
+
+static uint64_t global_epoch;
+
+static EpochRecord *records;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+/* Retired objects in retirement order, so in epoch order too */
+static Retired *retired_head;
+static Retired *retired_tail;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ACTIVE          1
+
+static void record_release(void *data)
+{
+    EpochRecord *rec = (EpochRecord *)data;
+
+    rec->nesting = 0;
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_create(void)
+{
+    pthread_key_create(&record_key, record_release);
+}
+
+static EpochRecord *get_record(void)
+{
+    EpochRecord *rec;
+
+    pthread_once(&record_key_once, record_key_create);
+
+    rec = (EpochRecord *)pthread_getspecific(record_key);
+    if (rec)
+        return rec;
+
+    pthread_mutex_lock(&records_lock);
+
+    for (rec = records; rec; rec = rec->next) {
+        if (!rec->in_use)
+            break;
+    }
+
+    if (!rec) {
+        rec = (EpochRecord *)calloc(1, sizeof(EpochRecord));
+        if (!rec) {
+            pthread_mutex_unlock(&records_lock);
+            return NULL;
+        }
+
+        rec->next = records;
+        __atomic_store_n(&records, rec, __ATOMIC_RELEASE);
+    }
+
+    rec->in_use = 1;
+    rec->nesting = 0;
+
+    pthread_mutex_unlock(&records_lock);
+
+    pthread_setspecific(record_key, rec);
+
+    return rec;
+}
+
+int epoch_enter(void)
+{
+    EpochRecord *rec;
+    uint64_t epoch;
+
+    rec = get_record();
+    if (!rec)
+        return -1;
+
+    if (rec->nesting++ > 0)
+        return 0;
+
+    do {
+        epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&rec->state, (epoch << 1) | ACTIVE, __ATOMIC_RELAXED);
+        // Publishes the state before any read of the protected structures.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (epoch != __atomic_load_n(&global_epoch, __ATOMIC_RELAXED));
+
+    return 0;
+}
+
+void epoch_exit(void)
+{
+    EpochRecord *rec;
+
+    rec = (EpochRecord *)pthread_getspecific(record_key);
+    assert(rec && rec->nesting > 0);
+    if (!rec || rec->nesting <= 0)
+        return;
+
+    if (--rec->nesting == 0)
+        __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Called with retired_lock held, returns 1 if the epoch advanced */
+static int try_advance(void)
+{
+    EpochRecord *rec;
+    uint64_t epoch;
+    uint64_t state;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec;
+         rec = rec->next) {
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & ACTIVE) && (state >> 1) != epoch)
+            return 0;
+    }
+
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+void epoch_collect(void)
+{
+    Retired *ready = NULL;
+    Retired *last = NULL;
+    Retired *r;
+    uint64_t epoch;
+
+    pthread_mutex_lock(&retired_lock);
+
+    // Advances as far as the readers allow, so the objects retired last
+    // don't wait for later calls.
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    while (retired_tail && retired_tail->epoch + 2 > epoch && try_advance())
+        epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    while (retired_head && retired_head->epoch + 2 <= epoch) {
+        r = retired_head;
+        retired_head = r->next;
+        r->next = NULL;
+
+        if (last)
+            last->next = r;
+        else
+            ready = r;
+        last = r;
+    }
+
+    if (!retired_head)
+        retired_tail = NULL;
+
+    pthread_mutex_unlock(&retired_lock);
+
+    // Reclaim handlers may retire more objects, never hold the lock.
+    while (ready) {
+        r = ready;
+        ready = r->next;
+
+        r->reclaim(r->ptr);
+        free(r);
+    }
+}
+
+static void wait_grace_period(void)
+{
+    uint64_t target;
+
+    target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+
+    for (;;) {
+        pthread_mutex_lock(&retired_lock);
+        try_advance();
+        pthread_mutex_unlock(&retired_lock);
+
+        if (__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) >= target)
+            break;
+
+        sched_yield();
+    }
+}
+
+void epoch_retire(void *ptr, epoch_reclaim *reclaim)
+{
+    Retired *r;
+
+    assert(ptr && reclaim);
+    if (!ptr || !reclaim)
+        return;
+
+    r = (Retired *)malloc(sizeof(Retired));
+    if (!r) {
+        wait_grace_period();
+        reclaim(ptr);
+        return;
+    }
+
+    r->ptr = ptr;
+    r->reclaim = reclaim;
+    r->next = NULL;
+
+    pthread_mutex_lock(&retired_lock);
+
+    // Read after the object was unlinked by the caller.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    if (retired_tail)
+        retired_tail->next = r;
+    else
+        retired_head = r;
+    retired_tail = r;
+
+    pthread_mutex_unlock(&retired_lock);
+}
+
+static void deref_reclaim(void *data)
+{
+    deref(data);
+}
+
+void epoch_deref(void *data)
+{
+    if (data)
+        epoch_retire(data, deref_reclaim);
+}
+
+void epoch_synchronize(void)
+{
+    wait_grace_period();
+    epoch_collect();
+}
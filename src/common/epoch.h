@@ -0,0 +1,110 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <common_export.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Epoch based reclamation.
+ *
+ * Readers wrap their accesses to shared structures with epoch_enter() and
+ * epoch_exit(), without taking any lock. Writers unlink objects first, then
+ * hand them to epoch_retire(); the reclaim handler runs once every thread
+ * that might still see the object has left its read-side section.
+ */
+
+/**
+ * Defines the reclaim handler of a retired object
+ *
+ * @param
+ *      ptr     Pointer to retired object
+ */
+typedef void (epoch_reclaim)(void *ptr);
+
+/**
+ * Enter a read-side critical section. Sections can be nested.
+ *
+ * @return 0 on success, -1 if the per-thread state could not be allocated,
+ *      in which case the caller must not rely on the protection.
+ */
+COMMON_API
+int epoch_enter(void);
+
+/**
+ * Leave the read-side critical section entered by epoch_enter()
+ */
+COMMON_API
+void epoch_exit(void);
+
+/**
+ * Defer reclaiming an unlinked object until no reader can reference it.
+ * The reclaim handler is run by a later epoch_collect().
+ *
+ * @param
+ *      ptr         Object to reclaim
+ * @param
+ *      reclaim     Reclaim handler, called with ptr
+ *
+ * @note Must not be called from a read-side critical section.
+ */
+COMMON_API
+void epoch_retire(void *ptr, epoch_reclaim *reclaim);
+
+/**
+ * Drop a reference of a reference-counted memory object once no reader can
+ * reference it
+ *
+ * @param
+ *      data        Memory object
+ */
+COMMON_API
+void epoch_deref(void *data);
+
+/**
+ * Run the reclaim handlers of the retired objects no reader can reference
+ * any more, advancing the epoch as far as the readers allow. Handlers run
+ * on the calling thread, so it should not hold locks the handlers might
+ * take. Event loops call it every now and then, so objects retired last are
+ * reclaimed without waiting for more writes.
+ */
+COMMON_API
+void epoch_collect(void);
+
+/**
+ * Wait until every retired object has been reclaimed
+ *
+ * @note Must not be called from a read-side critical section.
+ */
+COMMON_API
+void epoch_synchronize(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __EPOCH_H__ */
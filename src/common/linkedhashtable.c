@@ -33,6 +33,7 @@
 #endif
 
 #include "rc_mem.h"
+#include "epoch.h"
 #include "linkedhashtable.h"
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -47,13 +48,58 @@ typedef struct hash_entry_i
     size_t              keylen;
     void *              data;
     uint32_t            hash_code;
-    struct hash_entry_i *next;
     struct hash_entry_i *lst_prev;
     struct hash_entry_i *lst_next;
 } HashEntry_i;
 
+typedef char hash_entry_size_check[sizeof(HashEntry_i) <= sizeof(HashEntry) ? 1 : -1];
+
+/*
+ * Open addressing with Robin Hood linear probing. Slots keep the hash code
+ * so probing rarely touches the entries, which stay embedded in the caller
+ * objects and linked in insertion order for iteration.
+ */
+typedef struct hash_slot {
+    uint32_t            hash_code;
+    HashEntry_i *       entry;
+} HashSlot;
+
+typedef struct hash_slots {
+    HashSlot *          slots;
+    size_t              capacity;   // power of 2
+    size_t              count;
+} HashSlots;
+
+#define MIN_CAPACITY            8
+
+/* Grow beyond 80% load */
+#define MAX_LOAD(capacity)      ((capacity) - ((capacity) >> 2) + ((capacity) >> 4))
+
+/*
+ * Growing moves this many slots from the previous table on each update, so
+ * it is done well before the new table fills, without a long stall.
+ */
+#define MIGRATE_STEPS           8
+
+/*
+ * Tables created by hashtable_create_rcu() are read without any lock, so
+ * writers never move published entries: removal leaves a tombstone, and the
+ * slot array is rebuilt into a new one, published atomically, when live
+ * entries and tombstones reach the load limit. Replaced slot arrays and the
+ * table's references to removed data are released by epoch_retire() after
+ * all readers have moved on.
+ */
+typedef struct rcu_slots {
+    size_t              capacity;   // power of 2
+    size_t              used;       // live entries and tombstones
+    HashEntry_i *       entries[];
+} RcuSlots;
+
+static HashEntry_i rcu_tombstone;
+
+#define TOMBSTONE               (&rcu_tombstone)
+
 struct hashtable {
-    size_t      capacity;
     size_t      count;
     int         mod_count;
     int         synced;
@@ -62,17 +108,29 @@ struct hashtable {
     HashFunc *hash_code;
     HashKeyCompare *key_compare;
 
+    HashSlots   table;
+    HashSlots   old_table;  // being migrated into table while growing.
+    size_t      migrate_idx;
+
+    int         rcu;
+    RcuSlots *  rcu_slots;
+
     HashEntry_i lst_head;
-    HashEntry_i *buckets[];
 };
 
+#define NOT_FOUND               ((size_t)-1)
+
+/* FNV-1a */
 static uint32_t default_hash_code(const void *key, size_t keylen)
 {
-    uint32_t h = 0;
-    int i;
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t h = 2166136261U;
+    size_t i;
 
-    for (i = 0; i < keylen; i++)
-        h = 31 * h + ((const char *)key)[i];
+    for (i = 0; i < keylen; i++) {
+        h ^= p[i];
+        h *= 16777619U;
+    }
 
     return h;
 }
@@ -86,24 +144,306 @@ static int default_key_compare(const void *key1, size_t len1,
     return memcmp(key1, key2, len1);
 }
 
+/*
+ * Spreads the hash codes, including those of user hash functions, over the
+ * low bits used as slot index.
+ */
+static inline uint32_t mix_hash(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static inline size_t slot_distance(const HashSlots *t, size_t idx,
+                                   uint32_t hash_code)
+{
+    return (idx - (hash_code & (t->capacity - 1))) & (t->capacity - 1);
+}
+
+static int slots_init(HashSlots *t, size_t capacity)
+{
+    t->slots = (HashSlot *)calloc(capacity, sizeof(HashSlot));
+    if (!t->slots)
+        return -1;
+
+    t->capacity = capacity;
+    t->count = 0;
+
+    return 0;
+}
+
+static void slots_free(HashSlots *t)
+{
+    if (t->slots)
+        free(t->slots);
+
+    memset(t, 0, sizeof(*t));
+}
+
+static size_t slots_find(Hashtable *htab, HashSlots *t, uint32_t hash_code,
+                         const void *key, size_t keylen)
+{
+    size_t mask;
+    size_t idx;
+    size_t dist;
+    HashSlot *slot;
+
+    if (!t->slots || !t->count)
+        return NOT_FOUND;
+
+    mask = t->capacity - 1;
+    idx = hash_code & mask;
+
+    for (dist = 0; ; dist++, idx = (idx + 1) & mask) {
+        slot = &t->slots[idx];
+
+        // Entries are ordered by probe distance, so ours would be here.
+        if (!slot->entry || slot_distance(t, idx, slot->hash_code) < dist)
+            return NOT_FOUND;
+
+        if (slot->hash_code == hash_code &&
+            htab->key_compare(slot->entry->key, slot->entry->keylen,
+                              key, keylen) == 0)
+            return idx;
+    }
+}
+
+static void slots_insert(HashSlots *t, uint32_t hash_code, HashEntry_i *entry)
+{
+    size_t mask = t->capacity - 1;
+    size_t idx = hash_code & mask;
+    size_t dist = 0;
+    size_t slot_dist;
+    HashSlot cur;
+    HashSlot tmp;
+
+    assert(t->count < t->capacity);
+
+    cur.hash_code = hash_code;
+    cur.entry = entry;
+
+    for (;; dist++, idx = (idx + 1) & mask) {
+        if (!t->slots[idx].entry) {
+            t->slots[idx] = cur;
+            break;
+        }
+
+        // Takes the place of entries closer to their home slot.
+        slot_dist = slot_distance(t, idx, t->slots[idx].hash_code);
+        if (slot_dist < dist) {
+            tmp = t->slots[idx];
+            t->slots[idx] = cur;
+            cur = tmp;
+            dist = slot_dist;
+        }
+    }
+
+    t->count++;
+}
+
+static void slots_delete(HashSlots *t, size_t idx)
+{
+    size_t mask = t->capacity - 1;
+    size_t next;
+
+    // Shifts the following entries back instead of leaving tombstones.
+    for (;;) {
+        next = (idx + 1) & mask;
+        if (!t->slots[next].entry ||
+            slot_distance(t, next, t->slots[next].hash_code) == 0)
+            break;
+
+        t->slots[idx] = t->slots[next];
+        idx = next;
+    }
+
+    t->slots[idx].entry = NULL;
+    t->slots[idx].hash_code = 0;
+    t->count--;
+}
+
+static void hashtable_migrate(Hashtable *htab, size_t steps)
+{
+    HashSlots *old = &htab->old_table;
+    HashSlot *slot;
+
+    if (!old->slots)
+        return;
+
+    while (steps-- > 0 && old->count > 0) {
+        slot = &old->slots[htab->migrate_idx];
+
+        if (slot->entry) {
+            // Deleting may shift the next entry into this slot.
+            slots_insert(&htab->table, slot->hash_code, slot->entry);
+            slots_delete(old, htab->migrate_idx);
+        } else {
+            htab->migrate_idx = (htab->migrate_idx + 1) & (old->capacity - 1);
+        }
+    }
+
+    if (old->count == 0) {
+        slots_free(old);
+        htab->migrate_idx = 0;
+    }
+}
+
+static int hashtable_reserve(Hashtable *htab)
+{
+    HashSlots grown;
+
+    if (htab->table.count + 1 <= MAX_LOAD(htab->table.capacity))
+        return 0;
+
+    // Still growing, finish it before growing again.
+    if (htab->old_table.slots)
+        hashtable_migrate(htab, (size_t)-1);
+
+    if (slots_init(&grown, htab->table.capacity * 2) < 0)
+        return htab->table.count + 1 < htab->table.capacity ? 0 : -1;
+
+    htab->old_table = htab->table;
+    htab->table = grown;
+    htab->migrate_idx = 0;
+
+    return 0;
+}
+
+static RcuSlots *rcu_slots_alloc(size_t capacity)
+{
+    RcuSlots *t;
+
+    t = (RcuSlots *)calloc(1, sizeof(RcuSlots) +
+                              sizeof(HashEntry_i *) * capacity);
+    if (!t)
+        return NULL;
+
+    t->capacity = capacity;
+    t->used = 0;
+
+    return t;
+}
+
+static void rcu_slots_free(void *t)
+{
+    free(t);
+}
+
+/*
+ * Safe without the lock, from readers in an epoch read-side section.
+ */
+static HashEntry_i *rcu_slots_find(Hashtable *htab, RcuSlots *t,
+                                   uint32_t hash_code,
+                                   const void *key, size_t keylen,
+                                   size_t *index)
+{
+    size_t mask = t->capacity - 1;
+    size_t idx = hash_code & mask;
+    HashEntry_i *entry;
+
+    for (;; idx = (idx + 1) & mask) {
+        entry = __atomic_load_n(&t->entries[idx], __ATOMIC_ACQUIRE);
+        if (!entry)
+            return NULL;
+
+        if (entry != TOMBSTONE && entry->hash_code == hash_code &&
+            htab->key_compare(entry->key, entry->keylen, key, keylen) == 0) {
+            if (index)
+                *index = idx;
+            return entry;
+        }
+    }
+}
+
+static void rcu_slots_insert(RcuSlots *t, HashEntry_i *entry)
+{
+    size_t mask = t->capacity - 1;
+    size_t idx = entry->hash_code & mask;
+
+    assert(t->used < t->capacity);
+
+    while (t->entries[idx] && t->entries[idx] != TOMBSTONE)
+        idx = (idx + 1) & mask;
+
+    if (!t->entries[idx])
+        t->used++;
+
+    // Entry fields must be visible before the entry itself.
+    __atomic_store_n(&t->entries[idx], entry, __ATOMIC_RELEASE);
+}
+
+static size_t round_capacity(size_t capacity);
+
+static int rcu_reserve(Hashtable *htab)
+{
+    RcuSlots *t = htab->rcu_slots;
+    RcuSlots *rebuilt;
+    HashEntry_i *entry;
+
+    if (t->used + 1 <= MAX_LOAD(t->capacity))
+        return 0;
+
+    // Drops the tombstones, and grows if still over half loaded.
+    rebuilt = rcu_slots_alloc(round_capacity((htab->count + 1) * 2));
+    if (!rebuilt)
+        return t->used + 1 < t->capacity ? 0 : -1;
+
+    for (entry = htab->lst_head.lst_next; entry != &htab->lst_head;
+         entry = entry->lst_next)
+        rcu_slots_insert(rebuilt, entry);
+
+    __atomic_store_n(&htab->rcu_slots, rebuilt, __ATOMIC_RELEASE);
+    epoch_retire(t, rcu_slots_free);
+
+    return 0;
+}
+
 static void hashtable_destroy(void *htab);
 
-Hashtable *hashtable_create(size_t capacity, int synced,
-                            HashFunc *hash_code,
-                            HashKeyCompare *key_compare)
+static size_t round_capacity(size_t capacity)
+{
+    size_t n = MIN_CAPACITY;
+
+    while (MAX_LOAD(n) < capacity)
+        n <<= 1;
+
+    return n;
+}
+
+static Hashtable *hashtable_create_i(size_t capacity, int synced, int rcu,
+                                     HashFunc *hash_code,
+                                     HashKeyCompare *key_compare)
 {
     Hashtable *htab;
 
     if (!capacity)
         capacity = 128;
 
-    htab = (Hashtable *)rc_zalloc(sizeof(Hashtable)
-                + sizeof(HashEntry_i *) * capacity, hashtable_destroy);
+    htab = (Hashtable *)rc_zalloc(sizeof(Hashtable), hashtable_destroy);
     if (!htab) {
         errno = ENOMEM;
         return NULL;
     }
 
+    if (rcu) {
+        htab->rcu = 1;
+        htab->rcu_slots = rcu_slots_alloc(round_capacity(capacity));
+        if (!htab->rcu_slots) {
+            deref(htab);
+            errno = ENOMEM;
+            return NULL;
+        }
+    } else if (slots_init(&htab->table, round_capacity(capacity)) < 0) {
+        deref(htab);
+        errno = ENOMEM;
+        return NULL;
+    }
+
     if (synced) {
 #if defined(_WIN32) || defined(_WIN64)
         InitializeSRWLock(&htab->lock);
@@ -115,7 +455,6 @@ Hashtable *hashtable_create(size_t capacity, int synced,
 #endif
     }
 
-    htab->capacity = capacity;
     htab->count = 0;
     htab->mod_count = 0;
     htab->synced = synced;
@@ -129,6 +468,19 @@ Hashtable *hashtable_create(size_t capacity, int synced,
     return htab;
 }
 
+Hashtable *hashtable_create(size_t capacity, int synced,
+                            HashFunc *hash_code,
+                            HashKeyCompare *key_compare)
+{
+    return hashtable_create_i(capacity, synced, 0, hash_code, key_compare);
+}
+
+Hashtable *hashtable_create_rcu(size_t capacity, HashFunc *hash_code,
+                                HashKeyCompare *key_compare)
+{
+    return hashtable_create_i(capacity, 1, 1, hash_code, key_compare);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
@@ -196,7 +548,44 @@ static void hashtable_clear_i(Hashtable *htab)
         deref(cur->data);
     }
 
-    memset(htab->buckets, 0, sizeof(HashEntry_i *) * htab->capacity);
+    if (htab->table.slots)
+        memset(htab->table.slots, 0, sizeof(HashSlot) * htab->table.capacity);
+    htab->table.count = 0;
+
+    slots_free(&htab->old_table);
+    htab->migrate_idx = 0;
+
+    htab->lst_head.lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev = &htab->lst_head;
+
+    htab->count = 0;
+    htab->mod_count++;
+}
+
+static void rcu_clear(Hashtable *htab)
+{
+    RcuSlots *t = htab->rcu_slots;
+    RcuSlots *cleared;
+    HashEntry_i *entry;
+    size_t i;
+
+    if (htab->count == 0)
+        return;
+
+    cleared = rcu_slots_alloc(t->capacity);
+    if (cleared) {
+        __atomic_store_n(&htab->rcu_slots, cleared, __ATOMIC_RELEASE);
+        epoch_retire(t, rcu_slots_free);
+    } else {
+        for (i = 0; i < t->capacity; i++) {
+            if (t->entries[i])
+                __atomic_store_n(&t->entries[i], TOMBSTONE, __ATOMIC_RELEASE);
+        }
+    }
+
+    for (entry = htab->lst_head.lst_next; entry != &htab->lst_head;
+         entry = entry->lst_next)
+        epoch_deref(entry->data);
 
     htab->lst_head.lst_next = &htab->lst_head;
     htab->lst_head.lst_prev = &htab->lst_head;
@@ -208,12 +597,14 @@ static void hashtable_clear_i(Hashtable *htab)
 static void hashtable_destroy(void *htab)
 {
     int synced;
+    int rcu;
     rwlock_t lock;
 
     if (!htab)
         return;
 
     synced = ((Hashtable *)htab)->synced;
+    rcu = ((Hashtable *)htab)->rcu;
 
     if (synced) {
         lock = ((Hashtable *)htab)->lock;
@@ -226,6 +617,9 @@ static void hashtable_destroy(void *htab)
     }
 
     hashtable_clear_i(htab);
+    slots_free(&((Hashtable *)htab)->table);
+    if (((Hashtable *)htab)->rcu_slots)
+        free(((Hashtable *)htab)->rcu_slots);
     memset(htab, 0, sizeof(Hashtable));
 
     if (synced) {
@@ -236,57 +630,125 @@ static void hashtable_destroy(void *htab)
         pthread_rwlock_destroy(&lock);
 #endif
     }
+
+    // Data removed before is still retired, reclaimed before going on.
+    if (rcu)
+        epoch_synchronize();
 }
 
-static void hashtable_add(Hashtable *htab, HashEntry *entry)
+/*
+ * Returns the slot holding key, looking in the previous table too while
+ * growing.
+ */
+static HashSlot *hashtable_get_slot(Hashtable *htab, const void *key,
+                                    size_t keylen, HashSlots **table)
 {
-    HashEntry_i *ent = (HashEntry_i *)entry;
-    int idx;
     uint32_t hash_code;
+    size_t idx;
 
-    hash_code = htab->hash_code(ent->key, ent->keylen);
-    idx = hash_code % htab->capacity;
+    hash_code = mix_hash(htab->hash_code(key, keylen));
 
-    ent->hash_code = hash_code;
-    ent->next = htab->buckets[idx];
+    idx = slots_find(htab, &htab->table, hash_code, key, keylen);
+    if (idx != NOT_FOUND) {
+        if (table)
+            *table = &htab->table;
+        return &htab->table.slots[idx];
+    }
 
-    /* Add new entry to linked list tail */
-    ent->lst_prev = htab->lst_head.lst_prev;
-    ent->lst_next = &htab->lst_head;
-    htab->lst_head.lst_prev->lst_next = ent;
-    htab->lst_head.lst_prev = ent;
+    idx = slots_find(htab, &htab->old_table, hash_code, key, keylen);
+    if (idx != NOT_FOUND) {
+        if (table)
+            *table = &htab->old_table;
+        return &htab->old_table.slots[idx];
+    }
 
-    htab->buckets[idx] = ent;
+    return NULL;
+}
+
+/*
+ * Called with the write lock held.
+ */
+static int rcu_put(Hashtable *htab, HashEntry_i *new_entry)
+{
+    HashEntry_i *old_entry;
+    uint32_t hash_code;
+    size_t idx;
+
+    hash_code = mix_hash(htab->hash_code(new_entry->key, new_entry->keylen));
+
+    old_entry = rcu_slots_find(htab, htab->rcu_slots, hash_code,
+                               new_entry->key, new_entry->keylen, &idx);
+    if (old_entry) {
+        new_entry->hash_code = hash_code;
+        new_entry->lst_prev = old_entry->lst_prev;
+        new_entry->lst_next = old_entry->lst_next;
+
+        new_entry->lst_prev->lst_next = new_entry;
+        new_entry->lst_next->lst_prev = new_entry;
+
+        ref(new_entry->data);
+        __atomic_store_n(&htab->rcu_slots->entries[idx], new_entry,
+                         __ATOMIC_RELEASE);
+
+        // Readers may still be holding the replaced entry.
+        epoch_deref(old_entry->data);
+        return 0;
+    }
+
+    if (rcu_reserve(htab) < 0)
+        return -1;
+
+    new_entry->hash_code = hash_code;
+
+    new_entry->lst_prev = htab->lst_head.lst_prev;
+    new_entry->lst_next = &htab->lst_head;
+    htab->lst_head.lst_prev->lst_next = new_entry;
+    htab->lst_head.lst_prev = new_entry;
+
+    ref(new_entry->data);
+    rcu_slots_insert(htab->rcu_slots, new_entry);
 
     htab->count++;
+
+    return 0;
 }
 
-static HashEntry_i **hashtable_get_entry(Hashtable *htab,
-                                      const void *key, size_t keylen)
+/*
+ * Lookup without lock for tables created by hashtable_create_rcu(). The
+ * returned data is referenced, or NULL if absent. Sets *done to 0 when the
+ * epoch section can't be entered, then the caller falls back to the lock.
+ */
+static void *rcu_get(Hashtable *htab, const void *key, size_t keylen,
+                     int *done)
 {
-    HashEntry_i **entry;
-    int idx;
+    RcuSlots *t;
+    HashEntry_i *entry;
     uint32_t hash_code;
+    void *val = NULL;
 
-    hash_code = htab->hash_code(key, keylen);
-    idx = hash_code % htab->capacity;
-    entry = &htab->buckets[idx];
+    if (epoch_enter() < 0) {
+        *done = 0;
+        return NULL;
+    }
 
-    while (*entry) {
-        if ((*entry)->hash_code == hash_code &&
-            htab->key_compare((*entry)->key, (*entry)->keylen, key, keylen) == 0)
-            return entry;
+    hash_code = mix_hash(htab->hash_code(key, keylen));
 
-        entry = &(*entry)->next;
-    }
+    t = __atomic_load_n(&htab->rcu_slots, __ATOMIC_ACQUIRE);
+    entry = rcu_slots_find(htab, t, hash_code, key, keylen, NULL);
+    if (entry)
+        val = ref(entry->data);
 
-    return NULL;
+    epoch_exit();
+
+    *done = 1;
+    return val;
 }
 
 void *hashtable_put(Hashtable *htab, HashEntry *entry)
 {
-    HashEntry_i **ent;
+    HashSlot *slot;
     HashEntry_i *new_entry = (HashEntry_i *)entry;
+    HashEntry_i *old_entry;
 
     assert(htab && entry && entry->key && entry->keylen && entry->data);
     if (!htab || !entry || !entry->key || !entry->keylen || !entry->data) {
@@ -296,22 +758,57 @@ void *hashtable_put(Hashtable *htab, HashEntry *entry)
 
     hashtable_wlock(htab);
 
-    ref(entry->data);
+    if (htab->rcu) {
+        if (rcu_put(htab, new_entry) < 0) {
+            hashtable_wunlock(htab);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        htab->mod_count++;
+        hashtable_wunlock(htab);
+
+        epoch_collect();
+        return entry->data;
+    }
+
+    hashtable_migrate(htab, MIGRATE_STEPS);
 
-    ent = hashtable_get_entry(htab, entry->key, entry->keylen);
-    if (ent) {
-        new_entry->next = (*ent)->next;
-        new_entry->lst_prev = (*ent)->lst_prev;
-        new_entry->lst_next = (*ent)->lst_next;
-        new_entry->hash_code = (*ent)->hash_code;
+    slot = hashtable_get_slot(htab, entry->key, entry->keylen, NULL);
+    if (slot) {
+        // Replaces the entry in place, keeping its iteration order.
+        old_entry = slot->entry;
+
+        new_entry->hash_code = old_entry->hash_code;
+        new_entry->lst_prev = old_entry->lst_prev;
+        new_entry->lst_next = old_entry->lst_next;
 
         new_entry->lst_prev->lst_next = new_entry;
         new_entry->lst_next->lst_prev = new_entry;
 
-        deref((*ent)->data);
-        *ent = new_entry;
+        slot->entry = new_entry;
+
+        ref(new_entry->data);
+        deref(old_entry->data);
     } else {
-        hashtable_add(htab, entry);
+        if (hashtable_reserve(htab) < 0) {
+            hashtable_wunlock(htab);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        new_entry->hash_code = mix_hash(htab->hash_code(new_entry->key,
+                                                        new_entry->keylen));
+        slots_insert(&htab->table, new_entry->hash_code, new_entry);
+
+        /* Add new entry to linked list tail */
+        new_entry->lst_prev = htab->lst_head.lst_prev;
+        new_entry->lst_next = &htab->lst_head;
+        htab->lst_head.lst_prev->lst_next = new_entry;
+        htab->lst_head.lst_prev = new_entry;
+
+        ref(new_entry->data);
+        htab->count++;
     }
 
     htab->mod_count++;
@@ -323,8 +820,10 @@ void *hashtable_put(Hashtable *htab, HashEntry *entry)
 
 void *hashtable_get(Hashtable *htab, const void *key, size_t keylen)
 {
-    HashEntry_i **entry;
+    HashSlot *slot;
+    HashEntry_i *entry;
     void *val;
+    int done;
 
     assert(htab && key && keylen);
     if (!htab || !key || !keylen) {
@@ -332,19 +831,32 @@ void *hashtable_get(Hashtable *htab, const void *key, size_t keylen)
         return NULL;
     }
 
+    if (htab->rcu) {
+        val = rcu_get(htab, key, keylen, &done);
+        if (done)
+            return val;
+    }
+
     hashtable_rlock(htab);
 
-    entry = hashtable_get_entry(htab, key, keylen);
-    val = entry ? ref((*entry)->data) : NULL;
+    if (htab->rcu) {
+        entry = rcu_slots_find(htab, htab->rcu_slots,
+                               mix_hash(htab->hash_code(key, keylen)),
+                               key, keylen, NULL);
+        val = entry ? ref(entry->data) : NULL;
+    } else {
+        slot = hashtable_get_slot(htab, key, keylen, NULL);
+        val = slot ? ref(slot->entry->data) : NULL;
+    }
 
     hashtable_runlock(htab);
 
     return val;
-
 }
 
 int hashtable_exist(Hashtable *htab, const void *key, size_t keylen)
 {
+    void *val;
     int exist;
 
     assert(htab && key && keylen);
@@ -353,8 +865,14 @@ int hashtable_exist(Hashtable *htab, const void *key, size_t keylen)
         return 0;
     }
 
+    if (htab->rcu) {
+        val = hashtable_get(htab, key, keylen);
+        deref(val);
+        return val != NULL;
+    }
+
     hashtable_rlock(htab);
-    exist = hashtable_get_entry(htab, key, keylen) != NULL;
+    exist = hashtable_get_slot(htab, key, keylen, NULL) != NULL;
     hashtable_runlock(htab);
 
     return exist;
@@ -373,8 +891,10 @@ int hashtable_is_empty(Hashtable *htab)
 
 void *hashtable_remove(Hashtable *htab, const void *key, size_t keylen)
 {
-    HashEntry_i **entry;
+    HashSlots *table;
+    HashSlot *slot;
     HashEntry_i *to_remove;
+    size_t idx;
     void *val = NULL;
 
     assert(htab && key && keylen);
@@ -385,11 +905,23 @@ void *hashtable_remove(Hashtable *htab, const void *key, size_t keylen)
 
     hashtable_wlock(htab);
 
-    entry = hashtable_get_entry(htab, key, keylen);
-    if (entry) {
-        to_remove = *entry;
-        *entry = (*entry)->next;
+    if (htab->rcu) {
+        to_remove = rcu_slots_find(htab, htab->rcu_slots,
+                                   mix_hash(htab->hash_code(key, keylen)),
+                                   key, keylen, &idx);
+        if (to_remove)
+            __atomic_store_n(&htab->rcu_slots->entries[idx], TOMBSTONE,
+                             __ATOMIC_RELEASE);
+    } else {
+        hashtable_migrate(htab, MIGRATE_STEPS);
+
+        slot = hashtable_get_slot(htab, key, keylen, &table);
+        to_remove = slot ? slot->entry : NULL;
+        if (slot)
+            slots_delete(table, slot - table->slots);
+    }
 
+    if (to_remove) {
         /* Remove entry from linkedlist */
         to_remove->lst_prev->lst_next = to_remove->lst_next;
         to_remove->lst_next->lst_prev = to_remove->lst_prev;
@@ -398,12 +930,19 @@ void *hashtable_remove(Hashtable *htab, const void *key, size_t keylen)
         // Pass reference to caller
         val = to_remove->data;
 
+        // Keeps the entry alive for readers that may still be holding it.
+        if (htab->rcu)
+            epoch_deref(ref(val));
+
         htab->count--;
         htab->mod_count++;
     }
 
     hashtable_wunlock(htab);
 
+    if (htab->rcu)
+        epoch_collect();
+
     return val;
 }
 
@@ -416,8 +955,16 @@ void hashtable_clear(Hashtable *htab)
     }
 
     hashtable_wlock(htab);
-    hashtable_clear_i(htab);
+    if (htab->rcu)
+        rcu_clear(htab);
+    else
+        hashtable_clear_i(htab);
     hashtable_wunlock(htab);
+
+    // Reclaims outside the lock, destructors may use the table again.
+    // Tables are cleared on shutdown, nothing is left behind then.
+    if (htab->rcu)
+        epoch_synchronize();
 }
 
 typedef struct HashtableIterator_i {
@@ -52,6 +52,18 @@ Hashtable *hashtable_create(size_t capacity, int synced,
                             HashFunc *hash_code,
                             HashKeyCompare *key_compare);
 
+/*
+ * Creates a synced table for read-mostly use: lookups take no lock, writers
+ * only exclude each other and iterators. Data removed or replaced stays
+ * referenced by the table until concurrent lookups are done with it (see
+ * epoch.h), so an entry must not be put into a table again before then.
+ * Clearing or destroying the table waits for all of that data to be
+ * released, so neither is done from a read-side section.
+ */
+COMMON_API
+Hashtable *hashtable_create_rcu(size_t capacity, HashFunc *hash_code,
+                                HashKeyCompare *key_compare);
+
 COMMON_API
 void *hashtable_put(Hashtable *htab, HashEntry *entry);
 
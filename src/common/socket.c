@@ -122,17 +122,64 @@ SOCKET socket_connect(const char *host, const char *port)
     return sock;
 }
 
+SOCKET socket_connect_nonblock(const char *host, const char *port)
+{
+    SOCKET sock = INVALID_SOCKET;
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    struct addrinfo *p;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0)
+        return INVALID_SOCKET;
+
+    for (p = ai; p; p = p->ai_next) {
+        sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sock == INVALID_SOCKET)
+            continue;
+
+        if (socket_set_nonblock(sock) != 0) {
+            socket_close(sock);
+            sock = INVALID_SOCKET;
+            continue;
+        }
+
+        if (connect(sock, p->ai_addr, p->ai_addrlen) != 0) {
+#if defined(_WIN32) || defined(_WIN64)
+            if (socket_errno() != WSAEWOULDBLOCK) {
+#else
+            if (socket_errno() != EINPROGRESS) {
+#endif
+                socket_close(sock);
+                sock = INVALID_SOCKET;
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    freeaddrinfo(ai);
+    return sock;
+}
+
 int socket_set_nonblock(SOCKET s)
 {
-#if 0
 #if defined(_WIN32) || defined (_WIN64)
     u_long mode = 1;
     return ioctlsocket(s, FIONBIO, &mode);
 #else
-    return fcntl(s, F_SETFL, O_NONBLOCK, 1);
-#endif
-#else
-    return 0;
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
 #endif
 }
 
@@ -54,6 +54,13 @@ SOCKET socket_create(int type, const char *host, const char *port);
 COMMON_API
 SOCKET socket_connect(const char *host, const char *port);
 
+/*
+ * Start connecting a non-blocking socket, the connection completes or
+ * fails once the socket is writable.
+ */
+COMMON_API
+SOCKET socket_connect_nonblock(const char *host, const char *port);
+
 COMMON_API
 int socket_close(SOCKET s);
 
@@ -446,13 +446,21 @@ typedef enum IOEXStreamState {
     IOEXStreamState_failed
 } IOEXStreamState;
 
+/**
+ * \~English
+ * Seconds a UDP portforwarding flow is kept without traffic.
+ */
+#define IOEX_UDP_FLOW_IDLE_TIMEOUT      60
+
 /**
  * \~English
  * Portforwarding supported protocols.
  */
 typedef enum PortForwardingProtocol {
     /** TCP protocol. */
-    PortForwardingProtocol_TCP = 1
+    PortForwardingProtocol_TCP = 1,
+    /** UDP protocol. */
+    PortForwardingProtocol_UDP = 2
 } PortForwardingProtocol;
 
 /**
@@ -667,6 +675,15 @@ typedef struct IOEXStreamCallbacks {
  */
 #define IOEX_STREAM_PORT_FORWARDING      0x10
 
+/**
+ * Multipath option, indicates the stream would be bonded over several ICE
+ * components, each with its own nominated candidate pair. Data would be
+ * striped across the alive paths by measured round-trip time, and moved
+ * away from a path which stops responding. This option should bitwise
+ * with 'Reliable' option.
+ */
+#define IOEX_STREAM_MULTIPATH            0x20
+
 /**
  * \~English
  * Add a new stream to session.
@@ -699,6 +716,8 @@ typedef struct IOEXStreamCallbacks {
  *                         Multiplexing mode.
  *                       - IOEX_STREAM_PORT_FORWARDING
  *                         Support portforwarding over multiplexing.
+ *                       - IOEX_STREAM_MULTIPATH
+ *                         Bond reliable stream over multiple paths.
  *
  * @param
  *      callbacks   [in] The Application defined callback functions in
@@ -774,6 +793,113 @@ int IOEX_session_add_service(IOEXSession *session, const char *service,
 CARRIER_API
 void IOEX_session_remove_service(IOEXSession *session, const char *service);
 
+/**
+ * \~English
+ * The number of buckets of the first byte latency histogram, with upper
+ * bounds of 1, 5, 10, 50, 100, 500 and 1000 milliseconds, and the last
+ * bucket for the rest.
+ */
+#define IOEX_PORTFORWARDING_LATENCY_BUCKETS     8
+
+/**
+ * \~English
+ * Portforwarding statistics, of a service added to the session, or of a
+ * portforwarding opened on a stream.
+ */
+typedef struct IOEXPortForwardingStats {
+    /**
+     * \~English
+     * The service name.
+     */
+    const char *service;
+    /**
+     * \~English
+     * The protocol of the service.
+     */
+    PortForwardingProtocol protocol;
+    /**
+     * \~English
+     * The stream ID of the portforwarding, or 0 for a service.
+     */
+    int stream;
+    /**
+     * \~English
+     * The portforwarding ID, or 0 for a service.
+     */
+    int portforwarding;
+    /**
+     * \~English
+     * The connections, or UDP flows, forwarded so far.
+     */
+    uint64_t connections;
+    /**
+     * \~English
+     * The connections failed to open, or closed by an error.
+     */
+    uint64_t failed_connections;
+    /**
+     * \~English
+     * The connections forwarded currently.
+     */
+    uint64_t active_connections;
+    /**
+     * \~English
+     * The bytes read from the local sockets and sent to the remote peer.
+     */
+    uint64_t bytes_sent;
+    /**
+     * \~English
+     * The bytes received from the remote peer for the local sockets.
+     */
+    uint64_t bytes_received;
+    /**
+     * \~English
+     * The histogram of the latency from accepting a connection, or from
+     * connecting to the service, to the first byte of the response.
+     */
+    uint64_t first_byte_latency[IOEX_PORTFORWARDING_LATENCY_BUCKETS];
+} IOEXPortForwardingStats;
+
+/**
+ * \~English
+ * An application-defined function that iterate the portforwarding
+ * statistics.
+ *
+ * @param
+ *      stats       [in] A pointer to IOEXPortForwardingStats structure,
+ *                       or NULL after the last one.
+ * @param
+ *      context     [in] The application defined context data.
+ *
+ * @return
+ *      Return true to continue iterate, false to stop iterate.
+ */
+typedef bool IOEXPortForwardingStatsCallback(const IOEXPortForwardingStats *stats,
+                                             void *context);
+
+/**
+ * \~English
+ * Get the portforwarding statistics of each service added to the session,
+ * then of each portforwarding opened on the session streams.
+ *
+ * @param
+ *      session     [in] The handle to the IOEXSession.
+ * @param
+ *      callback    [in] A pointer to IOEXPortForwardingStatsCallback
+ *                       function.
+ * @param
+ *      context     [in] The application defined context data.
+ *
+ * @return
+ *      0 on success, or -1 if an error occurred.
+ *      The specific error code can be retrieved by calling
+ *      IOEX_get_error().
+ */
+CARRIER_API
+int IOEX_session_get_portforwarding_stats(IOEXSession *session,
+                        IOEXPortForwardingStatsCallback *callback,
+                        void *context);
+
 /**
  * \~English
  * Get the carrier stream type.
@@ -976,7 +1102,10 @@ int IOEX_stream_resume_channel(IOEXSession *session, int stream, int channel);
  * \~English
  * Open a portforwarding to remote service over multiplexing.
  *
- * If the stream is not multiplexing this function will fail.
+ * If the stream is not multiplexing this function will fail. TCP
+ * portforwarding needs a reliable stream, UDP portforwarding works over
+ * both, each local source address being forwarded over its own channel
+ * until idle for IOEX_UDP_FLOW_IDLE_TIMEOUT seconds.
  *
  * @param
  *      session     [in] The handle to the IOEXSession.
@@ -21,6 +21,7 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
@@ -28,6 +29,7 @@
 #include <unistd.h>
 #endif
 
+#include <rc_mem.h>
 #include <vlog.h>
 
 #include "socket.h"
@@ -36,100 +38,357 @@
 int fdset_init(FdSet *fdset)
 {
     int rc;
+#ifdef __linux__
+    struct epoll_event ev;
+#endif
 
-    rc = pthread_rwlock_init(&fdset->lock, NULL);
+    // On failure the partially initialized set is cleaned by fdset_destroy.
+    fdset->zombies = NULL;
+    fdset->zombie_cnt = 0;
+    fdset->zombie_cap = 0;
+    fdset->event = INVALID_SOCKET;
+#ifdef __linux__
+    fdset->epfd = -1;
+#endif
+
+    rc = pthread_mutex_init(&fdset->lock, NULL);
     if (rc != 0)
         return ENOMEM;
 
-    FD_ZERO(&fdset->rfds);
 #ifdef __linux__
+    fdset->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (fdset->epfd < 0)
+        return errno;
+
     fdset->event = eventfd(0, 0);
 #else
+    FD_ZERO(&fdset->rfds);
+    FD_ZERO(&fdset->wfds);
+    memset(fdset->entries, 0, sizeof(fdset->entries));
+
     fdset->event = eventfd(&fdset->efd, 0, 0);
 #endif
 
-    if (fdset->event < 0)
+    if (fdset->event < 0) {
+        fdset->event = INVALID_SOCKET;
         return socket_errno();
+    }
+
+#ifdef __linux__
+    // Wakeup event is the only registration without entry.
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
 
+    if (epoll_ctl(fdset->epfd, EPOLL_CTL_ADD, fdset->event, &ev) < 0)
+        return errno;
+#else
     FD_SET(fdset->event, &fdset->rfds);
+    fdset->maxfd = fdset->event;
+#endif
 
     return 0;
 }
 
-int fdset_add_socket(FdSet *fdset, SOCKET socket)
+int fdset_add(FdSet *fdset, SOCKET socket, FdSetEntry *entry,
+              int type, void *data, void *context)
 {
-    int rc;
+    int rc = 0;
+#ifdef __linux__
+    struct epoll_event ev;
+#endif
+
+    assert(entry && data);
 
-    if (socket == INVALID_SOCKET)
+    if (socket == INVALID_SOCKET || !entry || !data)
         return EINVAL;
 
-    rc = pthread_rwlock_wrlock(&fdset->lock);
-    if (rc != 0) {
-        vlogE("Session: Lock fdset error:%d.", rc);
-        return EDEADLK;
+    pthread_mutex_lock(&fdset->lock);
+
+    if (entry->added) {
+        pthread_mutex_unlock(&fdset->lock);
+        return 0;
     }
 
-    if (!FD_ISSET(socket, &fdset->rfds)) {
+    entry->data = data;
+    entry->context = context;
+    entry->type = type;
+    entry->events = FDSET_READ;
+    entry->revents = 0;
+
+#ifdef __linux__
+    // Takes effect in a running epoll_wait, no wakeup needed.
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = entry;
+
+    if (epoll_ctl(fdset->epfd, EPOLL_CTL_ADD, socket, &ev) < 0)
+        rc = errno;
+#else
+    if (socket >= FD_SETSIZE) {
+        rc = EINVAL;
+    } else {
         FD_SET(socket, &fdset->rfds);
+        fdset->entries[socket] = entry;
+        if (socket > fdset->maxfd)
+            fdset->maxfd = socket;
+
         fdset_wakeup(fdset);
     }
+#endif
 
-    pthread_rwlock_unlock(&fdset->lock);
-    return 0;
+    if (rc == 0) {
+        entry->added = 1;
+        ref(data);
+        if (context)
+            ref(context);
+    } else {
+        vlogE("Session: Add socket %d to fdset error:%d.", (int)socket, rc);
+    }
+
+    pthread_mutex_unlock(&fdset->lock);
+    return rc;
 }
 
-int fdset_remove_socket(FdSet *fdset, SOCKET socket)
+int fdset_modify(FdSet *fdset, SOCKET socket, FdSetEntry *entry, int events)
 {
-    int rc;
+    int rc = 0;
+#ifdef __linux__
+    struct epoll_event ev;
+#endif
 
-    if (socket == INVALID_SOCKET)
+    assert(entry);
+
+    if (socket == INVALID_SOCKET || !entry)
         return EINVAL;
 
-    rc = pthread_rwlock_wrlock(&fdset->lock);
-    if (rc != 0) {
-        vlogE("Session: Lock fdset error:%d.", rc);
-        return EDEADLK;
+    pthread_mutex_lock(&fdset->lock);
+
+    if (!entry->added || entry->events == events) {
+        pthread_mutex_unlock(&fdset->lock);
+        return 0;
     }
 
-    if (FD_ISSET(socket, &fdset->rfds)) {
+#ifdef __linux__
+    // Re-arms the edge, readiness already there is reported again.
+    ev.events = EPOLLET;
+    if (events & FDSET_READ)
+        ev.events |= EPOLLIN;
+    if (events & FDSET_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = entry;
+
+    if (epoll_ctl(fdset->epfd, EPOLL_CTL_MOD, socket, &ev) < 0)
+        rc = errno;
+#else
+    if (events & FDSET_READ)
+        FD_SET(socket, &fdset->rfds);
+    else
         FD_CLR(socket, &fdset->rfds);
-        fdset_wakeup(fdset);
+
+    if (events & FDSET_WRITE)
+        FD_SET(socket, &fdset->wfds);
+    else
+        FD_CLR(socket, &fdset->wfds);
+
+    fdset_wakeup(fdset);
+#endif
+
+    if (rc == 0)
+        entry->events = events;
+    else
+        vlogE("Session: Modify socket %d in fdset error:%d.", (int)socket, rc);
+
+    pthread_mutex_unlock(&fdset->lock);
+    return rc;
+}
+
+int fdset_remove(FdSet *fdset, SOCKET socket, FdSetEntry *entry)
+{
+    assert(entry);
+
+    if (socket == INVALID_SOCKET || !entry)
+        return EINVAL;
+
+    pthread_mutex_lock(&fdset->lock);
+
+    if (!entry->added) {
+        pthread_mutex_unlock(&fdset->lock);
+        return 0;
     }
 
-    pthread_rwlock_unlock(&fdset->lock);
+#ifdef __linux__
+    epoll_ctl(fdset->epfd, EPOLL_CTL_DEL, socket, NULL);
+#else
+    FD_CLR(socket, &fdset->rfds);
+    FD_CLR(socket, &fdset->wfds);
+    fdset->entries[socket] = NULL;
+
+    fdset_wakeup(fdset);
+#endif
+
+    entry->added = 0;
+
+    /*
+     * The waiting thread may be dispatching this entry right now, so the
+     * owner is released on its next wait.
+     */
+    if (fdset->zombie_cnt + 2 > fdset->zombie_cap) {
+        int cap = fdset->zombie_cap ? fdset->zombie_cap * 2 : 16;
+        void **zombies;
+
+        zombies = (void **)realloc(fdset->zombies, cap * sizeof(void *));
+        if (!zombies) {
+            // Leak the owner rather than releasing it in use.
+            vlogE("Session: Remove socket %d from fdset out of memory.",
+                  (int)socket);
+            pthread_mutex_unlock(&fdset->lock);
+            return ENOMEM;
+        }
+
+        fdset->zombies = zombies;
+        fdset->zombie_cap = cap;
+    }
+
+    // Owner first, its destructor may still use the context.
+    fdset->zombies[fdset->zombie_cnt++] = entry->data;
+    if (entry->context)
+        fdset->zombies[fdset->zombie_cnt++] = entry->context;
+
+    pthread_mutex_unlock(&fdset->lock);
     return 0;
 }
 
-int fdset_copy(FdSet *fdset, fd_set *dest)
+static void fdset_release_zombies(FdSet *fdset)
 {
-    int rc;
+    void **zombies;
+    int cnt;
+    int i;
+
+    pthread_mutex_lock(&fdset->lock);
+    zombies = fdset->zombies;
+    cnt = fdset->zombie_cnt;
+
+    fdset->zombies = NULL;
+    fdset->zombie_cnt = 0;
+    fdset->zombie_cap = 0;
+    pthread_mutex_unlock(&fdset->lock);
+
+    // Outside the lock, destructors may close sockets of their own.
+    for (i = 0; i < cnt; i++)
+        deref(zombies[i]);
+
+    if (zombies)
+        free(zombies);
+}
+
+int fdset_wait(FdSet *fdset, FdSetEntry **ready, int max, int timeout)
+{
+    int nfds;
+    int n = 0;
+#ifdef __linux__
+    struct epoll_event events[FDSET_MAX_EVENTS];
+    int i;
+#else
+    fd_set rfds;
+    fd_set wfds;
+    SOCKET maxfd;
+    SOCKET fd;
+    struct timeval tv;
+#endif
+
+    assert(ready && max > 0);
+
+    fdset_release_zombies(fdset);
 
-    FD_ZERO(dest);
+#ifdef __linux__
+    if (max > FDSET_MAX_EVENTS)
+        max = FDSET_MAX_EVENTS;
+
+    nfds = epoll_wait(fdset->epfd, events, max, timeout);
+    if (nfds < 0)
+        return -1;
+
+    for (i = 0; i < nfds; i++) {
+        FdSetEntry *entry = (FdSetEntry *)events[i].data.ptr;
+
+        if (!entry) {
+            fdset_drop_wakeup(fdset);
+            continue;
+        }
 
-    rc = pthread_rwlock_rdlock(&fdset->lock);
-    if (rc != 0) {
-        vlogE("Session: Lock fdset error:%d.", rc);
-        return EDEADLK;
+        entry->revents = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            entry->revents |= FDSET_READ;
+        if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            entry->revents |= FDSET_WRITE;
+
+        ready[n++] = entry;
     }
+#else
+    pthread_mutex_lock(&fdset->lock);
+    memcpy(&rfds, &fdset->rfds, sizeof(fd_set));
+    memcpy(&wfds, &fdset->wfds, sizeof(fd_set));
+    maxfd = fdset->maxfd;
+    pthread_mutex_unlock(&fdset->lock);
 
-    memcpy(dest, &fdset->rfds, sizeof(fd_set));
-    pthread_rwlock_unlock(&fdset->lock);
-    return 0;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    nfds = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
+    if (nfds <= 0)
+        return nfds;
+
+    if (FD_ISSET(fdset->event, &rfds)) {
+        fdset_drop_wakeup(fdset);
+        nfds--;
+    }
+
+    pthread_mutex_lock(&fdset->lock);
+    for (fd = 0; fd <= maxfd && nfds > 0 && n < max; fd++) {
+        int revents = 0;
+
+        if (fd == fdset->event)
+            continue;
+
+        if (FD_ISSET(fd, &rfds)) {
+            revents |= FDSET_READ;
+            nfds--;
+        }
+
+        if (FD_ISSET(fd, &wfds)) {
+            revents |= FDSET_WRITE;
+            nfds--;
+        }
+
+        if (revents && fdset->entries[fd]) {
+            fdset->entries[fd]->revents = revents;
+            ready[n++] = fdset->entries[fd];
+        }
+    }
+    pthread_mutex_unlock(&fdset->lock);
+#endif
+
+    return n;
 }
 
 void fdset_destroy(FdSet *fdset)
 {
-#ifdef __linux__
     SOCKET fd = fdset->event;
-#endif
+
     fdset->event = INVALID_SOCKET;
 
-#ifdef __linux
+    fdset_release_zombies(fdset);
+
+#ifdef __linux__
     if (fd != INVALID_SOCKET)
         close(fd);
+
+    if (fdset->epfd >= 0)
+        close(fdset->epfd);
+    fdset->epfd = -1;
 #else
-    eventfd_close(&fdset->efd);
+    if (fd != INVALID_SOCKET)
+        eventfd_close(&fdset->efd);
 #endif
 
-    pthread_rwlock_destroy(&fdset->lock);
+    pthread_mutex_destroy(&fdset->lock);
 }
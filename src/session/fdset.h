@@ -27,6 +27,7 @@
 #include <sys/select.h>
 #ifdef __linux__
 #include <sys/eventfd.h>
+#include <sys/epoll.h>
 #endif
 
 #include "socket.h"
@@ -36,9 +37,53 @@
 extern "C" {
 #endif
 
+/*
+ * Linux uses edge-triggered epoll: a ready socket is reported once, so it
+ * has to be read until EAGAIN. Other platforms fall back to select, level
+ * triggered and limited to FD_SETSIZE.
+ */
+#ifdef __linux__
+#define FDSET_EDGE_TRIGGERED        1
+#else
+#define FDSET_EDGE_TRIGGERED        0
+#endif
+
+#define FDSET_MAX_EVENTS            64
+
+/* Readiness a registered socket is waited for */
+#define FDSET_READ                  0x01
+#define FDSET_WRITE                 0x02
+
+/*
+ * Registration of a socket, embedded in the object owning it. The owner,
+ * and the optional context it is dispatched to, are referenced while
+ * registered and handed back as is when ready, there is no lookup by socket.
+ */
+typedef struct FdSetEntry {
+    void *data;
+    void *context;
+    int type;
+    int events;
+    int revents;
+    int added;
+} FdSetEntry;
+
 typedef struct FdSet {
-    pthread_rwlock_t lock;
+    pthread_mutex_t lock;
+
+    /* Owners removed since the last wait, released by the waiting thread */
+    void **zombies;
+    int zombie_cnt;
+    int zombie_cap;
+
+#ifdef __linux__
+    int epfd;
+#else
     fd_set rfds;
+    fd_set wfds;
+    SOCKET maxfd;
+    FdSetEntry *entries[FD_SETSIZE];
+#endif
 
     SOCKET event;
 #ifndef __linux__
@@ -48,11 +93,24 @@ typedef struct FdSet {
 
 int fdset_init(FdSet *fdset);
 
-int fdset_add_socket(FdSet *fdset, SOCKET socket);
+/*
+ * Registered for FDSET_READ, the interest set of an added socket is
+ * changed with fdset_modify.
+ */
+int fdset_add(FdSet *fdset, SOCKET socket, FdSetEntry *entry,
+              int type, void *data, void *context);
+
+int fdset_modify(FdSet *fdset, SOCKET socket, FdSetEntry *entry, int events);
 
-int fdset_remove_socket(FdSet *fdset, SOCKET socket);
+int fdset_remove(FdSet *fdset, SOCKET socket, FdSetEntry *entry);
 
-int fdset_copy(FdSet *fdset, fd_set *dest);
+/*
+ * Wait for ready sockets, up to timeout milliseconds. Returns the number
+ * of entries stored in ready, which stay valid until the next call, with
+ * revents set. Errors and hangups are reported as both FDSET_READ and
+ * FDSET_WRITE. A wakeup returns 0, and -1 with errno set on error.
+ */
+int fdset_wait(FdSet *fdset, FdSetEntry **ready, int max, int timeout);
 
 void fdset_destroy(FdSet *fdset);
 
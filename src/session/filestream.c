@@ -0,0 +1,859 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <rc_mem.h>
+#include <linkedlist.h>
+#include <crypto.h>
+#include <vlog.h>
+
+#include "IOEX_session.h"
+#include "session.h"
+#include "filestream.h"
+
+/*
+ * Frames are a header and the payload of length bytes:
+ *
+ *   type(1) reserved(3) length(4) position(8), in network byte order.
+ *
+ * Data:  SHA256 of the block, then the block at position.
+ * End:   no more data, position is the file size.
+ * Ack:   the receiver stored the data up to position.
+ * Done:  the receiver completed the file.
+ */
+#define FRAME_HEADER_LEN            16
+
+enum {
+    FrameType_Data = 1,
+    FrameType_End,
+    FrameType_Ack,
+    FrameType_Done
+};
+
+/* Received data buffered at most, a window of data frames */
+#define RECV_BUFFER_MAX     (FILESTREAM_WINDOW + \
+        (FILESTREAM_WINDOW / FILESTREAM_BLOCK_SIZE + 1) * \
+        (FRAME_HEADER_LEN + SHA256_BYTES + FILESTREAM_BLOCK_SIZE))
+
+struct FileStreams {
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    List *streams;
+};
+
+typedef struct Frame {
+    int type;
+    uint32_t length;
+    uint64_t position;
+} Frame;
+
+typedef struct FileStream {
+    FileStreams *streams;
+    IOEXCarrier *carrier;
+    IOEXSession *session;
+    int stream;
+    bool sender;
+
+    char friendid[IOEX_MAX_ID_LEN + 1];
+    uint32_t fileindex;
+    char *path;
+    int fd;
+    uint64_t size;
+    uint64_t position;  // sent, or stored by the receiver.
+    uint64_t acked;     // sender: stored by the receiver.
+    bool done;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    IOEXStreamState state;
+    bool stop;
+    int error;
+
+    // Received, from roff to rlen.
+    uint8_t *rbuf;
+    size_t roff;
+    size_t rlen;
+    size_t rcap;
+
+    ListEntry le;
+} FileStream;
+
+static void filestreams_destroy(void *p)
+{
+    FileStreams *fss = (FileStreams *)p;
+
+    if (fss->streams)
+        deref(fss->streams);
+
+    pthread_cond_destroy(&fss->idle);
+    pthread_mutex_destroy(&fss->lock);
+}
+
+FileStreams *filestreams_create(void)
+{
+    FileStreams *fss;
+
+    fss = (FileStreams *)rc_zalloc(sizeof(FileStreams), filestreams_destroy);
+    if (!fss)
+        return NULL;
+
+    pthread_mutex_init(&fss->lock, NULL);
+    pthread_cond_init(&fss->idle, NULL);
+
+    fss->streams = list_create(0, NULL);
+    if (!fss->streams) {
+        deref(fss);
+        return NULL;
+    }
+
+    return fss;
+}
+
+static void filestream_stop(FileStream *fs)
+{
+    pthread_mutex_lock(&fs->lock);
+    fs->stop = true;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+void filestreams_stop(FileStreams *fss)
+{
+    ListIterator it;
+    FileStream *fs;
+
+    pthread_mutex_lock(&fss->lock);
+
+    list_iterate(fss->streams, &it);
+    while (list_iterator_has_next(&it)) {
+        if (list_iterator_next(&it, (void **)&fs) != 1)
+            break;
+
+        filestream_stop(fs);
+        deref(fs);
+    }
+
+    while (!list_is_empty(fss->streams))
+        pthread_cond_wait(&fss->idle, &fss->lock);
+
+    pthread_mutex_unlock(&fss->lock);
+}
+
+static void filestream_destroy(void *p)
+{
+    FileStream *fs = (FileStream *)p;
+
+    if (fs->fd >= 0)
+        close(fs->fd);
+
+    if (fs->session)
+        deref(fs->session);
+
+    if (fs->streams)
+        deref(fs->streams);
+
+    if (fs->path)
+        free(fs->path);
+
+    if (fs->rbuf)
+        free(fs->rbuf);
+
+    pthread_cond_destroy(&fs->cond);
+    pthread_mutex_destroy(&fs->lock);
+}
+
+static void frame_encode(uint8_t *buf, int type, uint32_t length,
+                         uint64_t position)
+{
+    int i;
+
+    buf[0] = (uint8_t)type;
+    buf[1] = buf[2] = buf[3] = 0;
+
+    for (i = 0; i < 4; i++)
+        buf[4 + i] = (uint8_t)(length >> (24 - i * 8));
+
+    for (i = 0; i < 8; i++)
+        buf[8 + i] = (uint8_t)(position >> (56 - i * 8));
+}
+
+static void frame_decode(const uint8_t *buf, Frame *frame)
+{
+    int i;
+
+    frame->type = buf[0];
+
+    frame->length = 0;
+    for (i = 0; i < 4; i++)
+        frame->length = (frame->length << 8) | buf[4 + i];
+
+    frame->position = 0;
+    for (i = 0; i < 8; i++)
+        frame->position = (frame->position << 8) | buf[8 + i];
+}
+
+/*
+ * Writes in pieces the stream takes, blocking until all is sent.
+ */
+static int stream_send(FileStream *fs, const uint8_t *data, size_t len)
+{
+    ssize_t rc;
+    size_t n;
+
+    while (len > 0) {
+        if (fs->stop)
+            return IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+
+        n = len < IOEX_MAX_USER_DATA_LEN ? len : IOEX_MAX_USER_DATA_LEN;
+        rc = IOEX_stream_write(fs->session, fs->stream, data, n);
+        if (rc < 0)
+            return IOEX_get_error();
+
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int send_frame(FileStream *fs, int type, uint64_t position)
+{
+    uint8_t hdr[FRAME_HEADER_LEN];
+
+    frame_encode(hdr, type, 0, position);
+    return stream_send(fs, hdr, sizeof(hdr));
+}
+
+/*
+ * Takes the next frame received with its payload, if complete. Called with
+ * the lock held.
+ */
+static bool next_frame(FileStream *fs, Frame *frame, uint8_t *payload,
+                       size_t size)
+{
+    size_t avail = fs->rlen - fs->roff;
+
+    if (avail < FRAME_HEADER_LEN)
+        return false;
+
+    frame_decode(fs->rbuf + fs->roff, frame);
+    if (frame->length > size) {
+        fs->error = IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+        return false;
+    }
+
+    if (avail < FRAME_HEADER_LEN + frame->length)
+        return false;
+
+    if (frame->length)
+        memcpy(payload, fs->rbuf + fs->roff + FRAME_HEADER_LEN, frame->length);
+
+    fs->roff += FRAME_HEADER_LEN + frame->length;
+    if (fs->roff == fs->rlen)
+        fs->roff = fs->rlen = 0;
+
+    return true;
+}
+
+/*
+ * Waits for the stream to connect. Called with the lock held.
+ */
+static int wait_connected(FileStream *fs)
+{
+    struct timeval now;
+    struct timespec deadline;
+    int rc = 0;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + FILESTREAM_CONNECT_TIMEOUT;
+    deadline.tv_nsec = now.tv_usec * 1000;
+
+    while (!fs->stop && !fs->error && rc != ETIMEDOUT &&
+           fs->state < IOEXStreamState_connected)
+        rc = pthread_cond_timedwait(&fs->cond, &fs->lock, &deadline);
+
+    if (fs->stop || fs->error)
+        return -1;
+
+    if (fs->state != IOEXStreamState_connected) {
+        fs->error = IOEX_SYS_ERROR(ETIMEDOUT);
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool stream_failed(FileStream *fs)
+{
+    if (fs->state > IOEXStreamState_connected && !fs->error)
+        fs->error = IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+
+    return fs->stop || fs->error;
+}
+
+static void stream_state_changed(IOEXSession *ws, int stream,
+                                 IOEXStreamState state, void *context)
+{
+    FileStream *fs = (FileStream *)context;
+
+    vlogD("Session: File stream %u to %s state %d.", fs->fileindex,
+          fs->friendid, state);
+
+    pthread_mutex_lock(&fs->lock);
+    fs->state = state;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/*
+ * The window keeps what is buffered here bounded, the thread is woken up to
+ * take it.
+ */
+static void stream_data(IOEXSession *ws, int stream, const void *data,
+                        size_t len, void *context)
+{
+    FileStream *fs = (FileStream *)context;
+
+    pthread_mutex_lock(&fs->lock);
+
+    if (fs->roff && fs->rlen + len > fs->rcap) {
+        memmove(fs->rbuf, fs->rbuf + fs->roff, fs->rlen - fs->roff);
+        fs->rlen -= fs->roff;
+        fs->roff = 0;
+    }
+
+    if (fs->rlen + len > fs->rcap) {
+        size_t cap = fs->rcap ? fs->rcap * 2 : 64 * 1024;
+        uint8_t *p;
+
+        while (cap < fs->rlen + len)
+            cap *= 2;
+
+        p = cap <= RECV_BUFFER_MAX ? (uint8_t *)realloc(fs->rbuf, cap) : NULL;
+        if (!p) {
+            vlogE("Session: File stream %u from %s overflowed.", fs->fileindex,
+                  fs->friendid);
+            fs->error = IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+            pthread_cond_broadcast(&fs->cond);
+            pthread_mutex_unlock(&fs->lock);
+            return;
+        }
+
+        fs->rbuf = p;
+        fs->rcap = cap;
+    }
+
+    memcpy(fs->rbuf + fs->rlen, data, len);
+    fs->rlen += len;
+
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+static IOEXStreamCallbacks stream_callbacks = {
+    .state_changed = stream_state_changed,
+    .stream_data = stream_data
+};
+
+/*
+ * Takes the acknowledgements received. Called with the lock held.
+ */
+static void take_acks(FileStream *fs)
+{
+    Frame frame;
+
+    while (next_frame(fs, &frame, NULL, 0)) {
+        if (frame.type == FrameType_Ack && frame.position > fs->acked &&
+            frame.position <= fs->position)
+            fs->acked = frame.position;
+        else if (frame.type == FrameType_Done && frame.position == fs->size)
+            fs->done = true;
+        else
+            fs->error = IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+    }
+}
+
+static void notify_sent(FileStream *fs, uint64_t *notified)
+{
+    if (fs->acked > *notified) {
+        IOEX_file_stream_notify(fs->carrier, fs->friendid, fs->fileindex,
+                                IOEXFileStreamEvent_Sent, *notified,
+                                (size_t)(fs->acked - *notified), 0);
+        *notified = fs->acked;
+    }
+}
+
+static int filestream_send_file(FileStream *fs)
+{
+    size_t bufsz = FRAME_HEADER_LEN + SHA256_BYTES + FILESTREAM_BLOCK_SIZE;
+    uint64_t notified = fs->position;
+    uint8_t *buf;
+    ssize_t rc = 0;
+
+    buf = (uint8_t *)malloc(bufsz);
+    if (!buf)
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fs->fd, (off_t)fs->position, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    while (fs->position < fs->size) {
+        size_t len = FILESTREAM_BLOCK_SIZE;
+        size_t total = 0;
+
+        if (fs->size - fs->position < len)
+            len = (size_t)(fs->size - fs->position);
+
+        pthread_mutex_lock(&fs->lock);
+        take_acks(fs);
+        while (!stream_failed(fs) &&
+               fs->position - fs->acked + len > FILESTREAM_WINDOW) {
+            pthread_cond_wait(&fs->cond, &fs->lock);
+            take_acks(fs);
+        }
+        rc = stream_failed(fs) ? -1 : 0;
+        pthread_mutex_unlock(&fs->lock);
+
+        if (rc < 0)
+            break;
+
+        notify_sent(fs, &notified);
+
+#if defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(fs->fd, (off_t)(fs->position + len),
+                      FILESTREAM_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+#endif
+
+        while (total < len) {
+            rc = pread(fs->fd, buf + FRAME_HEADER_LEN + SHA256_BYTES + total,
+                       len - total, (off_t)(fs->position + total));
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc <= 0)
+                break;
+            total += rc;
+        }
+
+        if (total < len) {
+            vlogE("Session: Read file %s error (%d).", fs->path, errno);
+            fs->error = IOEX_SYS_ERROR(rc < 0 ? errno : EIO);
+            break;
+        }
+
+        frame_encode(buf, FrameType_Data, SHA256_BYTES + len, fs->position);
+        sha256(buf + FRAME_HEADER_LEN + SHA256_BYTES, len,
+               buf + FRAME_HEADER_LEN, SHA256_BYTES);
+
+        rc = stream_send(fs, buf, FRAME_HEADER_LEN + SHA256_BYTES + len);
+        if (rc < 0) {
+            fs->error = (int)rc;
+            break;
+        }
+
+        fs->position += len;
+    }
+
+    free(buf);
+
+    if (fs->error || fs->stop)
+        return -1;
+
+    rc = send_frame(fs, FrameType_End, fs->size);
+    if (rc < 0) {
+        fs->error = (int)rc;
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    take_acks(fs);
+    while (!fs->done && !stream_failed(fs)) {
+        pthread_cond_wait(&fs->cond, &fs->lock);
+        take_acks(fs);
+    }
+    rc = fs->done ? 0 : -1;
+    pthread_mutex_unlock(&fs->lock);
+
+    notify_sent(fs, &notified);
+    return (int)rc;
+}
+
+static int store_block(FileStream *fs, const Frame *frame, const uint8_t *payload)
+{
+    uint8_t digest[SHA256_BYTES];
+    const uint8_t *data = payload + SHA256_BYTES;
+    size_t len = frame->length - SHA256_BYTES;
+    size_t total = 0;
+    ssize_t rc;
+
+    if (frame->position != fs->position || len == 0 ||
+        fs->position + len > fs->size)
+        return IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+
+    if (sha256(data, len, digest, sizeof(digest)) < 0 ||
+        memcmp(digest, payload, SHA256_BYTES) != 0) {
+        vlogE("Session: File %s block at %llu corrupted.", fs->path,
+              (unsigned long long)frame->position);
+        return IOEX_GENERAL_ERROR(IOEXERR_FILE_CORRUPTED);
+    }
+
+    while (total < len) {
+        rc = pwrite(fs->fd, data + total, len - total,
+                    (off_t)(frame->position + total));
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            vlogE("Session: Write file %s error (%d).", fs->path, errno);
+            return IOEX_SYS_ERROR(errno);
+        }
+        total += rc;
+    }
+
+    fs->position += len;
+
+    IOEX_file_stream_notify(fs->carrier, fs->friendid, fs->fileindex,
+                            IOEXFileStreamEvent_Received, frame->position,
+                            len, 0);
+
+    return send_frame(fs, FrameType_Ack, fs->position);
+}
+
+static int filestream_receive_file(FileStream *fs)
+{
+    uint8_t *payload;
+    Frame frame;
+    int rc = 0;
+
+    payload = (uint8_t *)malloc(SHA256_BYTES + FILESTREAM_BLOCK_SIZE);
+    if (!payload)
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+
+    for (;;) {
+        bool got = false;
+
+        pthread_mutex_lock(&fs->lock);
+        while (!stream_failed(fs) &&
+               !(got = next_frame(fs, &frame, payload,
+                                  SHA256_BYTES + FILESTREAM_BLOCK_SIZE)))
+            pthread_cond_wait(&fs->cond, &fs->lock);
+        pthread_mutex_unlock(&fs->lock);
+
+        if (!got) {
+            rc = -1;
+            break;
+        }
+
+        if (frame.type == FrameType_Data && frame.length > SHA256_BYTES) {
+            rc = store_block(fs, &frame, payload);
+        } else if (frame.type == FrameType_End &&
+                   frame.position == fs->size && fs->position == fs->size) {
+            if (ftruncate(fs->fd, (off_t)fs->size) < 0)
+                rc = IOEX_SYS_ERROR(errno);
+            break;
+        } else {
+            rc = IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+        }
+
+        if (rc < 0) {
+            fs->error = rc;
+            break;
+        }
+    }
+
+    free(payload);
+    return rc;
+}
+
+static void *filestream_routine(void *arg)
+{
+    FileStream *fs = (FileStream *)arg;
+    FileStreams *fss = fs->streams;
+    int rc;
+
+    pthread_mutex_lock(&fs->lock);
+    rc = wait_connected(fs);
+    pthread_mutex_unlock(&fs->lock);
+
+    if (rc == 0) {
+        vlogI("Session: File %s %s %s from %llu over session stream.",
+              fs->path, fs->sender ? "to" : "from", fs->friendid,
+              (unsigned long long)fs->position);
+
+        rc = fs->sender ? filestream_send_file(fs) : filestream_receive_file(fs);
+    }
+
+    if (rc == 0) {
+        // The sender completes once told, so the receiver goes first.
+        IOEX_file_stream_notify(fs->carrier, fs->friendid, fs->fileindex,
+                                IOEXFileStreamEvent_Completed, fs->size, 0, 0);
+
+        if (!fs->sender && send_frame(fs, FrameType_Done, fs->size) < 0)
+            vlogW("Session: File %s done not sent to %s.", fs->path,
+                  fs->friendid);
+    } else if (!fs->stop) {
+        // Toxcore carries on from the data stored by the receiver.
+        IOEX_file_stream_notify(fs->carrier, fs->friendid, fs->fileindex,
+                                IOEXFileStreamEvent_Failed,
+                                fs->sender ? fs->acked : fs->position, 0,
+                                fs->error);
+    }
+
+    vlogD("Session: File stream %u with %s %s (0x%x).", fs->fileindex,
+          fs->friendid, rc == 0 ? "completed" : "failed", fs->error);
+
+    // A late response to the request leaves the session alone.
+    filestream_stop(fs);
+    IOEX_session_close(fs->session);
+
+    pthread_mutex_lock(&fss->lock);
+    deref(list_remove_entry(fss->streams, &fs->le));
+    pthread_cond_broadcast(&fss->idle);
+    pthread_mutex_unlock(&fss->lock);
+
+    deref(fs);
+    return NULL;
+}
+
+static FileStream *filestream_create(IOEXCarrier *w, const char *friendid,
+                                     uint32_t fileindex, const char *fullpath,
+                                     bool sender, FileStreams *fss)
+{
+    FileStream *fs;
+
+    fs = (FileStream *)rc_zalloc(sizeof(FileStream), filestream_destroy);
+    if (!fs) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+
+    fs->fd = -1;
+    fs->carrier = w;
+    fs->sender = sender;
+    fs->fileindex = fileindex;
+    fs->streams = ref(fss);
+    strcpy(fs->friendid, friendid);
+
+    fs->path = strdup(fullpath);
+    if (!fs->path) {
+        deref(fs);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return NULL;
+    }
+
+    if (sender)
+        fs->fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    else
+        fs->fd = open(fullpath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fs->fd < 0) {
+        vlogE("Session: Open file %s error (%d).", fullpath, errno);
+        deref(fs);
+        IOEX_set_error(IOEX_SYS_ERROR(errno));
+        return NULL;
+    }
+
+    fs->session = IOEX_session_new(w, friendid);
+    if (!fs->session) {
+        deref(fs);
+        return NULL;
+    }
+    // Held until the stream is destroyed, session callbacks refer to it.
+    ref(fs->session);
+    fs->session->extension = IOEX_FILESTREAM_EXTENSION;
+
+    fs->stream = IOEX_session_add_stream(fs->session, IOEXStreamType_application,
+                                         IOEX_STREAM_RELIABLE,
+                                         &stream_callbacks, fs);
+    if (fs->stream < 0) {
+        IOEX_session_close(fs->session);
+        deref(fs);
+        return NULL;
+    }
+
+    return fs;
+}
+
+static int filestream_start(FileStream *fs)
+{
+    FileStreams *fss = fs->streams;
+    pthread_t thread;
+    int rc;
+
+    pthread_mutex_lock(&fss->lock);
+
+    fs->le.data = fs;
+    list_add(fss->streams, &fs->le);
+
+    rc = pthread_create(&thread, NULL, filestream_routine, ref(fs));
+    if (rc != 0) {
+        deref(list_remove_entry(fss->streams, &fs->le));
+        pthread_mutex_unlock(&fss->lock);
+        deref(fs);
+        IOEX_set_error(IOEX_SYS_ERROR(rc));
+        return -1;
+    }
+
+    pthread_detach(thread);
+    pthread_mutex_unlock(&fss->lock);
+
+    return 0;
+}
+
+static void request_complete(IOEXSession *ws, int status, const char *reason,
+                             const char *sdp, size_t len, void *context)
+{
+    FileStream *fs = (FileStream *)context;
+    int rc = status;
+
+    pthread_mutex_lock(&fs->lock);
+
+    if (!fs->stop && status == 0) {
+        rc = IOEX_session_start(ws, sdp, len);
+        if (rc < 0)
+            rc = IOEX_get_error();
+    }
+
+    if (rc != 0 && !fs->stop) {
+        vlogW("Session: File stream %u with %s refused: %s (0x%x).",
+              fs->fileindex, fs->friendid, reason ? reason : "", rc);
+        fs->error = rc;
+        pthread_cond_broadcast(&fs->cond);
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+    deref(fs);
+}
+
+int filestream_receive(IOEXCarrier *w, const char *friendid, uint32_t fileindex,
+                       const char *fullpath, uint64_t size, uint64_t position,
+                       void *context)
+{
+    SessionExtension *ext = (SessionExtension *)context;
+    char header[32];
+    FileStream *fs;
+    int rc;
+
+    fs = filestream_create(w, friendid, fileindex, fullpath, false,
+                           ext->file_streams);
+    if (!fs)
+        return -1;
+
+    fs->size = size;
+    fs->position = position;
+
+    // The sender knows the file by its own index, we tell ours.
+    sprintf(header, "%u %llu\n", fileindex, (unsigned long long)position);
+    rc = session_send_request(fs->session, header, request_complete, ref(fs));
+    if (rc < 0) {
+        IOEX_session_close(fs->session);
+        deref(fs);  // of the request.
+        deref(fs);
+        return -1;
+    }
+
+    rc = filestream_start(fs);
+    if (rc < 0) {
+        filestream_stop(fs);
+        IOEX_session_close(fs->session);
+    }
+
+    deref(fs);
+    return rc;
+}
+
+int filestream_send(IOEXCarrier *w, const char *friendid, uint32_t fileindex,
+                    const char *fullpath, uint64_t position, const char *sdp,
+                    size_t len, void *context)
+{
+    SessionExtension *ext = (SessionExtension *)context;
+    struct stat st;
+    FileStream *fs;
+    int rc;
+
+    fs = filestream_create(w, friendid, fileindex, fullpath, true,
+                           ext->file_streams);
+    if (!fs)
+        return IOEX_get_error();
+
+    if (fstat(fs->fd, &st) < 0 || (uint64_t)st.st_size < position) {
+        IOEX_session_close(fs->session);
+        deref(fs);
+        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS);
+    }
+
+    fs->size = (uint64_t)st.st_size;
+    fs->position = position;
+    fs->acked = position;
+
+    if (IOEX_session_reply_request(fs->session, 0, NULL) < 0 ||
+        IOEX_session_start(fs->session, sdp, len) < 0 ||
+        filestream_start(fs) < 0) {
+        rc = IOEX_get_error();
+        IOEX_session_close(fs->session);
+        deref(fs);
+        return rc;
+    }
+
+    deref(fs);
+    return 0;
+}
+
+void filestream_cancel(IOEXCarrier *w, const char *friendid, uint32_t fileindex,
+                       void *context)
+{
+    SessionExtension *ext = (SessionExtension *)context;
+    FileStreams *fss = ext->file_streams;
+    ListIterator it;
+    FileStream *fs;
+
+    if (!fss)
+        return;
+
+    pthread_mutex_lock(&fss->lock);
+
+    list_iterate(fss->streams, &it);
+    while (list_iterator_has_next(&it)) {
+        if (list_iterator_next(&it, (void **)&fs) != 1)
+            break;
+
+        if (fs->fileindex == fileindex && strcmp(fs->friendid, friendid) == 0)
+            filestream_stop(fs);
+
+        deref(fs);
+    }
+
+    pthread_mutex_unlock(&fss->lock);
+}
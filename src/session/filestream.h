@@ -0,0 +1,60 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FILESTREAM_H__
+#define __FILESTREAM_H__
+
+#include "IOEX_carrier.h"
+#include "IOEX_filestream.h"
+
+/*
+ * Files sent over a reliable session stream, in blocks each with its SHA256
+ * so the receiver stores verified data only. The receiver acknowledges the
+ * blocks stored, which bounds the data in flight.
+ */
+#define FILESTREAM_BLOCK_SIZE       (256 * 1024)
+#define FILESTREAM_WINDOW           (4 * 1024 * 1024)
+
+#define FILESTREAM_CONNECT_TIMEOUT  30 /* seconds */
+
+typedef struct FileStreams FileStreams;
+
+FileStreams *filestreams_create(void);
+
+/*
+ * Stops the transfers and waits for them to be done with their sessions.
+ */
+void filestreams_stop(FileStreams *streams);
+
+int filestream_receive(IOEXCarrier *carrier, const char *friendid,
+                       uint32_t fileindex, const char *fullpath,
+                       uint64_t size, uint64_t position, void *context);
+
+int filestream_send(IOEXCarrier *carrier, const char *friendid,
+                    uint32_t fileindex, const char *fullpath,
+                    uint64_t position, const char *sdp, size_t len,
+                    void *context);
+
+void filestream_cancel(IOEXCarrier *carrier, const char *friendid,
+                       uint32_t fileindex, void *context);
+
+#endif /* __FILESTREAM_H__ */
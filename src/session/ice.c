@@ -24,6 +24,13 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <pthread.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#if defined(__linux__)
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 
 #ifdef __APPLE__
 #pragma GCC diagnostic push
@@ -44,6 +51,7 @@
 #include <time_util.h>
 #include <base58.h>
 #include <vlog.h>
+#include <epoch.h>
 
 #include "flex_buffer.h"
 #include "IOEX_session.h"
@@ -56,10 +64,50 @@
 #define MAX_HOST_CANDIDATES 4
 #define KA_INTERVAL         25
 
+#define PATH_PROBE_INTERVAL             1000    /* 1 second */
+#define PATH_TIMEOUT_INTERVAL           3000    /* 3 seconds */
+#define PATH_DEFAULT_RTT                100000  /* 100 ms in microseconds */
+
+#define NETMON_POLL_INTERVAL            2000    /* 2 seconds */
+#define NETMON_SETTLE_INTERVAL          200     /* 200 ms */
+#define RESTART_POLL_INTERVAL           50      /* 50 ms */
+#define RESTART_TIMEOUT_INTERVAL        10000   /* 10 seconds */
+#define RESTART_SDP_MAX_LEN             2048
+
+/* SDP session attribute telling the peer understands ICE restart */
+#define SDP_MIGRATE_ATTR                "migrate"
+
+#define RESTART_TIMER_ID                0x00200000
+#define NETMON_TIMER_ID                 0x00400000
+
 enum {
     PKT_SHUTDOWN = 0,
     PKT_KEEPALIVE,
-    PKT_DATA
+    PKT_DATA,
+    PKT_PROBE,
+    PKT_PROBE_ACK
+};
+
+/* Session wide ICE restart state */
+enum {
+    RESTART_NONE = 0,
+    RESTART_GATHERING,      /* Local network changed, gathering for offer */
+    RESTART_OFFERED,        /* Offer sent, waiting for the answer */
+    RESTART_ANSWERING,      /* Gathering to answer the offer from peer */
+    RESTART_CONNECTING,     /* Negotiating on the new transports */
+    RESTART_REFUSED         /* Offer refused by peer */
+};
+
+/* Restart progress of each stream's next transport */
+enum {
+    PHASE_NONE = 0,
+    PHASE_GATHERING,
+    PHASE_GATHERED,
+    PHASE_READY,
+    PHASE_CONNECTING,
+    PHASE_CONNECTED,
+    PHASE_FAILED,
+    PHASE_COUNT
 };
 
 typedef struct {
@@ -183,6 +231,10 @@ static int ice_worker_routine(void *arg)
 
     while (!worker->quit) {
         handle_events(worker, 500, NULL);
+
+        // Port forwardings removed meanwhile are released once lookups
+        // are done.
+        epoch_collect();
     }
 
     deref(worker);
@@ -502,12 +554,15 @@ void ice_worker_schedule_timer(TransportWorker *base, Timer *tmr,
     IceWorker *worker = (IceWorker *)base;
     struct PjTimer *timer = (struct PjTimer *)tmr;
     unsigned long interval;
+    unsigned long now;
     pj_time_val delay;
 
     assert(timer);
     assert(worker);
 
-    interval = (long)(next - (get_monotonic_time() / 1000));
+    // A deadline already passed fires on the next poll.
+    now = (unsigned long)(get_monotonic_time() / 1000);
+    interval = next > now ? next - now : 0;
 
     delay.sec = interval / 1000;
     delay.msec = interval % 1000;
@@ -634,16 +689,184 @@ int ice_worker_create(IOEXTransport *transport, IceTransportOptions *opts,
     return 0;
 }
 
+/*
+ * Fingerprint of the IPv4 addresses of all interfaces up, which the host
+ * candidates are gathered from. Addresses are hashed one by one and summed,
+ * so the interface order does not matter.
+ */
+static uint32_t ice_interfaces_fingerprint(void)
+{
+    struct ifaddrs *ifa_list;
+    struct ifaddrs *ifa;
+    uint32_t fingerprint = 0;
+
+    if (getifaddrs(&ifa_list) < 0)
+        return 0;
+
+    for (ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+        const uint8_t *addr;
+        uint32_t hash = 2166136261U;
+        size_t i;
+
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET ||
+                (ifa->ifa_flags & IFF_UP) == 0 ||
+                (ifa->ifa_flags & IFF_LOOPBACK) != 0)
+            continue;
+
+        addr = (const uint8_t *)&((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+        for (i = 0; i < sizeof(struct in_addr); i++)
+            hash = (hash ^ addr[i]) * 16777619U;
+
+        fingerprint += hash;
+    }
+
+    freeifaddrs(ifa_list);
+
+    return fingerprint;
+}
+
+static bool ice_session_restart_callback(void *user_data);
+
+static inline
+void ice_session_schedule_restart(IceSession *session, unsigned long delay)
+{
+    if (session->restart_timer)
+        ice_worker_schedule_timer(session->base.worker, session->restart_timer,
+                                  (get_monotonic_time() / 1000) + delay);
+}
+
+static bool ice_session_netmon_callback(void *user_data)
+{
+    IceSession *session = (IceSession *)user_data;
+    uint32_t fingerprint;
+
+    fingerprint = ice_interfaces_fingerprint();
+    if (fingerprint != session->netmon_fingerprint) {
+        session->netmon_fingerprint = fingerprint;
+
+        // No address at all, wait for the next interface to come up.
+        if (fingerprint) {
+            vlogI("Session: Local network changed, restart ICE to %s.",
+                  session->base.to);
+
+            pthread_mutex_lock(&session->restart_lock);
+            session->restart_again = 1;
+            ice_session_schedule_restart(session, 0);
+            pthread_mutex_unlock(&session->restart_lock);
+        }
+    }
+
+    // Without netlink notifications the interfaces have to be polled.
+    return session->netmon_key == NULL;
+}
+
+#if defined(__linux__)
+static
+void ice_on_netlink_read(pj_ioqueue_key_t *key, pj_ioqueue_op_key_t *op,
+                         pj_ssize_t bytes)
+{
+    IceSession *session = (IceSession *)pj_ioqueue_get_user_data(key);
+    pj_ssize_t len;
+
+    // Addresses come and go in bursts, let them settle before checking.
+    if (session->netmon_timer)
+        ice_worker_schedule_timer(session->base.worker, session->netmon_timer,
+                    (get_monotonic_time() / 1000) + NETMON_SETTLE_INTERVAL);
+
+    len = (pj_ssize_t)sizeof(session->netmon_buf);
+    pj_ioqueue_recv(key, op, session->netmon_buf, &len, PJ_IOQUEUE_ALWAYS_ASYNC);
+}
+
+static pj_status_t ice_session_netmon_register(IceSession *session)
+{
+    IceWorker *worker = (IceWorker *)session_get_worker(&session->base);
+    struct sockaddr_nl addr;
+    pj_ioqueue_callback cb;
+    pj_status_t status;
+    pj_ssize_t len;
+    int sockfd;
+
+    sockfd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (sockfd < 0)
+        return pj_get_netos_error();
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        status = pj_get_netos_error();
+        close(sockfd);
+        return status;
+    }
+
+    memset(&cb, 0, sizeof(cb));
+    cb.on_read_complete = ice_on_netlink_read;
+
+    status = pj_ioqueue_register_sock(worker->pool, worker->cfg.stun_cfg.ioqueue,
+                                      sockfd, session, &cb, &session->netmon_key);
+    if (status != PJ_SUCCESS) {
+        close(sockfd);
+        return status;
+    }
+
+    pj_ioqueue_op_key_init(&session->netmon_op, sizeof(session->netmon_op));
+
+    len = (pj_ssize_t)sizeof(session->netmon_buf);
+    status = pj_ioqueue_recv(session->netmon_key, &session->netmon_op,
+                             session->netmon_buf, &len, PJ_IOQUEUE_ALWAYS_ASYNC);
+    if (status != PJ_SUCCESS && status != PJ_EPENDING) {
+        pj_ioqueue_unregister(session->netmon_key);
+        session->netmon_key = NULL;
+        return status;
+    }
+
+    return PJ_SUCCESS;
+}
+#endif
+
 static int ice_session_init(IOEXSession *base)
 {
     IceSession *session = (IceSession *)base;
     IceTransport *transport = (IceTransport *)session_get_transport(base);
+#if defined(__linux__)
+    pj_status_t status;
+#endif
+    int rc;
 
     prepare_thread_context(transport);
 
     pj_create_random_string(session->ufrag, PJ_ICE_UFRAG_LEN);
     pj_create_random_string(session->pwd, PJ_ICE_UFRAG_LEN);
 
+    rc = ice_worker_create_timer(base->worker, RESTART_TIMER_ID,
+                                 RESTART_POLL_INTERVAL,
+                                 ice_session_restart_callback,
+                                 session, &session->restart_timer);
+    if (rc != 0) {
+        vlogE("Session: ICE session create restart timer error: %08X.", rc);
+        return rc;
+    }
+
+#if defined(__linux__)
+    status = ice_session_netmon_register(session);
+    if (status != PJ_SUCCESS)
+        vlogW("Session: ICE session can not watch network changes: %s, "
+              "polling instead.", ice_strerror(status));
+#endif
+
+    session->netmon_fingerprint = ice_interfaces_fingerprint();
+
+    rc = ice_worker_create_timer(base->worker, NETMON_TIMER_ID,
+                                 NETMON_POLL_INTERVAL,
+                                 ice_session_netmon_callback,
+                                 session, &session->netmon_timer);
+    if (rc != 0) {
+        vlogE("Session: ICE session create network monitor timer error: %08X.",
+              rc);
+        return rc;
+    }
+
     vlogD("Session: ICE session initialized.");
 
     return 0;
@@ -656,6 +879,20 @@ static void ice_session_destroy(void *p)
 
     prepare_thread_context(transport);
 
+    if (session->netmon_key)
+        pj_ioqueue_unregister(session->netmon_key);
+
+    if (session->netmon_timer)
+        ice_worker_destroy_timer(session->base.worker, session->netmon_timer);
+
+    if (session->restart_timer)
+        ice_worker_destroy_timer(session->base.worker, session->restart_timer);
+
+    if (session->restart_sdp)
+        free(session->restart_sdp);
+
+    pthread_mutex_destroy(&session->restart_lock);
+
     // Call base destructor
     session_base_destroy(p);
 
@@ -699,10 +936,41 @@ static void notify_state_changed(StreamHandler *handler, int state)
 
 }
 
+/*
+ * Completion of the next transport being restarted. Only the progress is
+ * recorded here, the restart timer drives the next step so no session lock
+ * is taken under the transport lock.
+ */
+static void ice_handler_on_restart_complete(IceHandler *handler,
+                                            pj_ice_strans_op op,
+                                            pj_status_t status)
+{
+    int id = handler->base.stream->id;
+
+    if (op == PJ_ICE_STRANS_OP_INIT &&
+            handler->restart_phase == PHASE_GATHERING) {
+        if (status != PJ_SUCCESS)
+            vlogE("Stream: %d ICE restart gathering error (0x%x)", id,
+                  IOEX_ICE_ERROR(status));
+
+        handler->restart_phase = (status == PJ_SUCCESS) ? PHASE_GATHERED
+                                                        : PHASE_FAILED;
+    } else if (op == PJ_ICE_STRANS_OP_NEGOTIATION &&
+            handler->restart_phase == PHASE_CONNECTING) {
+        if (status != PJ_SUCCESS)
+            vlogE("Stream: %d ICE restart negotiation error (0x%x)", id,
+                  IOEX_ICE_ERROR(status));
+
+        handler->restart_phase = (status == PJ_SUCCESS) ? PHASE_CONNECTED
+                                                        : PHASE_FAILED;
+    }
+}
+
 static void stream_on_ice_complete(pj_ice_strans *ice_st, pj_ice_strans_op op,
                                    pj_status_t status)
 {
     IceStream *stream;
+    IceHandler *handler;
     int state;
 
     pj_grp_lock_t *lock = pj_ice_strans_get_grp_lock(ice_st);
@@ -715,6 +983,13 @@ static void stream_on_ice_complete(pj_ice_strans *ice_st, pj_ice_strans_op op,
         return;
     }
 
+    handler = (IceHandler *)stream->handler;
+    if (handler->restart_phase != PHASE_NONE && ice_st != handler->st) {
+        ice_handler_on_restart_complete(handler, op, status);
+        pj_grp_lock_release(lock);
+        return;
+    }
+
     if (op == PJ_ICE_STRANS_OP_INIT) {
         if (status == PJ_SUCCESS) {
             state = IOEXStreamState_initialized;
@@ -749,10 +1024,78 @@ const char *state_name[] = {
     "failed"
 };
 
+static int ice_handler_write_packet(IceHandler *handler, int comp, IcePacket *packet);
+
+static inline
+void ice_path_update_rtt(IcePath *path, uint64_t sample)
+{
+    if (sample > UINT32_MAX)
+        sample = UINT32_MAX;
+
+    // Smoothed as TCP does, with a gain of 1/8.
+    path->srtt = (uint32_t)((7 * (uint64_t)path->srtt + sample) / 8);
+}
+
+static inline
+bool ice_path_is_alive(IcePath *path, const struct timeval *now)
+{
+    long interval;
+
+    interval = (long)(now->tv_sec - path->last_rx.tv_sec) * 1000 +
+               (long)(now->tv_usec - path->last_rx.tv_usec) / 1000;
+
+    return interval < PATH_TIMEOUT_INTERVAL;
+}
+
+/*
+ * Pick the ICE component to carry the next packet. Alive paths are served
+ * in the order of their virtual finish time, which grows with the bytes sent
+ * weighted by the path RTT, so each path carries bytes in inverse proportion
+ * to its RTT. Paths which stopped receiving anything are skipped.
+ */
+static int ice_handler_select_path(IceHandler *handler, size_t len)
+{
+    struct timeval now;
+    IcePath *path;
+    uint64_t start;
+    uint64_t best = 0;
+    int comp = 0;
+    unsigned int i;
+
+    if (handler->path_cnt <= 1)
+        return 1;
+
+    gettimeofday(&now, NULL);
+
+    for (i = 0; i < handler->path_cnt; i++) {
+        path = &handler->paths[i];
+        if (!ice_path_is_alive(path, &now))
+            continue;
+
+        start = path->vtime > handler->path_vclock ?
+                path->vtime : handler->path_vclock;
+        if (!comp || start < best) {
+            comp = (int)i + 1;
+            best = start;
+        }
+    }
+
+    // No path alive, stay on the first one until the stream times out.
+    if (!comp)
+        return 1;
+
+    path = &handler->paths[comp - 1];
+    handler->path_vclock = best;
+    path->vtime = best + (uint64_t)len * path->srtt;
+
+    return comp;
+}
+
 static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         pj_size_t size, const pj_sockaddr_t *src_addr, unsigned src_addr_len)
 {
     IceStream *stream;
+    IceHandler *handler;
     IcePacket *packet;
     char addr[128];
 
@@ -784,7 +1127,7 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
     packet = (IcePacket *)data;
     packet->len = ntohs(packet->len);
     if (packet->version != 0 || packet->len + sizeof(IcePacket) != size ||
-            packet->pkttype < PKT_SHUTDOWN || packet->pkttype > PKT_DATA) {
+            packet->pkttype < PKT_SHUTDOWN || packet->pkttype > PKT_PROBE_ACK) {
         vlogW("Stream: %d ICE component %d received invalid data from %s, ignore.",
               stream->base.id, comp,
               pj_sockaddr_print(src_addr, addr, sizeof(addr), 3));
@@ -792,9 +1135,27 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
         return;
     }
 
+    handler = (IceHandler *)stream->handler;
+    if (comp >= 1 && comp <= handler->path_cnt)
+        gettimeofday(&handler->paths[comp - 1].last_rx, NULL);
+
     if (packet->pkttype == PKT_SHUTDOWN) {
         vlogD("Stream: %d ICE stream closed by remote.", stream->base.id);
         notify_state_changed(stream->handler, IOEXStreamState_closed);
+    } else if (packet->pkttype == PKT_PROBE) {
+        // Echo the probe back on the same path.
+        packet->version = 0;
+        packet->pkttype = PKT_PROBE_ACK;
+        ice_handler_write_packet(handler, (int)comp, packet);
+    } else if (packet->pkttype == PKT_PROBE_ACK) {
+        if (packet->len == sizeof(uint64_t) && comp >= 1 &&
+                comp <= handler->path_cnt) {
+            uint64_t sent;
+
+            memcpy(&sent, packet->data, sizeof(sent));
+            ice_path_update_rtt(&handler->paths[comp - 1],
+                                get_monotonic_time() - sent);
+        }
     } else if (packet->pkttype == PKT_KEEPALIVE) {
         vlogD("Stream: %d ICE stream receive keep-alive.", stream->base.id);
 
@@ -815,6 +1176,20 @@ static void stream_on_rx_data(pj_ice_strans *ice_st, unsigned comp, void *data,
     pj_grp_lock_release(lock);
 }
 
+static void ice_handler_cancel_restart(IceHandler *handler)
+{
+    if (handler->next_st) {
+        if (pj_ice_strans_has_sess(handler->next_st))
+            pj_ice_strans_stop_ice(handler->next_st);
+
+        pj_ice_strans_destroy(handler->next_st);
+        handler->next_st = NULL;
+    }
+
+    memset(&handler->next_remote, 0, sizeof(handler->next_remote));
+    handler->restart_phase = PHASE_NONE;
+}
+
 static void ice_handler_destroy(void *p)
 {
     IceHandler *handler = (IceHandler *)p;
@@ -834,6 +1209,11 @@ static void ice_handler_destroy(void *p)
         pj_ice_strans_destroy(handler->st);
     }
 
+    ice_handler_cancel_restart(handler);
+
+    if (handler->retired_st)
+        pj_ice_strans_destroy(handler->retired_st);
+
     vlogD("Stream: %d ICE handler destroyed.", handler->base.stream->id);
 }
 
@@ -845,6 +1225,7 @@ static int ice_handler_init(StreamHandler *base)
     IceTransport *transport = (IceTransport *)stream_get_transport(base->stream);
     pj_ice_strans_cb cbs;
     pj_status_t status;
+    unsigned int i;
 
     prepare_thread_context(transport);
 
@@ -855,8 +1236,12 @@ static int ice_handler_init(StreamHandler *base)
     // in the callback of pj-nath.
     ref(base->stream);
 
-    status = pj_ice_strans_create(NULL, &worker->cfg, 1, base->stream, &cbs,
-                                  &handler->st);
+    handler->path_cnt = base->stream->multipath ? ICE_MAX_PATHS : 1;
+    for (i = 0; i < handler->path_cnt; i++)
+        handler->paths[i].srtt = PATH_DEFAULT_RTT;
+
+    status = pj_ice_strans_create(NULL, &worker->cfg, handler->path_cnt,
+                                  base->stream, &cbs, &handler->st);
     if (status != PJ_SUCCESS) {
         deref(base->stream);
         vlogE("Stream: %d ICE handler init failed: %s.",
@@ -869,13 +1254,13 @@ static int ice_handler_init(StreamHandler *base)
     return 0;
 }
 
-static int ice_handler_write_packet(IceHandler *handler, int comp, IcePacket *packet);
-
 static bool ice_stream_keepalive_callback(void *user_data)
 {
     IceStream *stream = (IceStream *)user_data;
+    IceHandler *handler;
     struct timeval now;
     long interval;
+    int i;
 
     if (stream->base.state < IOEXStreamState_connected)
         return true;
@@ -911,6 +1296,21 @@ static bool ice_stream_keepalive_callback(void *user_data)
         ice_handler_write_packet((IceHandler *)stream->handler, 1, &packet);
     }
 
+    // Probe every path of multipath stream to measure its RTT.
+    handler = (IceHandler *)stream->handler;
+    for (i = 1; handler->path_cnt > 1 && i <= handler->path_cnt; i++) {
+        char buf[sizeof(IcePacket) + sizeof(uint64_t)];
+        IcePacket *probe = (IcePacket *)buf;
+        uint64_t timestamp = get_monotonic_time();
+
+        probe->version = 0;
+        probe->pkttype = PKT_PROBE;
+        probe->len = sizeof(timestamp);
+        memcpy(probe->data, &timestamp, sizeof(timestamp));
+
+        ice_handler_write_packet(handler, i, probe);
+    }
+
     return true;
 }
 
@@ -964,6 +1364,7 @@ static int ice_handler_start(StreamHandler *base)
     pj_status_t status;
     pj_str_t rufrag;
     pj_str_t rpwd;
+    unsigned int i;
     int rc;
 
     assert(handler->remote.cand_cnt > 0 && handler->remote.comp_cnt > 0);
@@ -977,7 +1378,8 @@ static int ice_handler_start(StreamHandler *base)
     }
 
     rc = ice_worker_create_timer(session->base.worker, stream->base.id | 0x00010000,
-                                 10000, ice_stream_keepalive_callback,
+                                 handler->path_cnt > 1 ? PATH_PROBE_INTERVAL : 10000,
+                                 ice_stream_keepalive_callback,
                                  stream, &stream->keepalive_timer);
     if (rc != 0) {
         vlogE("Stream: %d ICE handler create keep-alive timer error: %08X.",
@@ -990,6 +1392,9 @@ static int ice_handler_start(StreamHandler *base)
     gettimeofday(&stream->local_timestamp, NULL);
     gettimeofday(&stream->remote_timestamp, NULL);
 
+    for (i = 0; i < handler->path_cnt; i++)
+        handler->paths[i].last_rx = stream->remote_timestamp;
+
     status = pj_ice_strans_start_ice(handler->st,
                                      pj_cstr(&rufrag, handler->remote.ufrag),
                                      pj_cstr(&rpwd, handler->remote.pwd),
@@ -1050,6 +1455,10 @@ static void ice_handler_stop(StreamHandler *base, int error)
         stream->keepalive_timer = NULL;
     }
 
+    pthread_mutex_lock(&session->restart_lock);
+    ice_handler_cancel_restart(handler);
+    pthread_mutex_unlock(&session->restart_lock);
+
     if (pj_ice_strans_has_sess(handler->st)) {
         pj_ice_strans_stop_ice(handler->st);
 
@@ -1112,7 +1521,8 @@ ssize_t ice_handler_write(StreamHandler *base, FlexBuffer *buf)
     packet->pkttype = PKT_DATA;
     packet->len = len;
 
-    rc = ice_handler_write_packet(handler, 1, packet);
+    rc = ice_handler_write_packet(handler, ice_handler_select_path(handler, len),
+                                  packet);
     if (rc != 0) {
         vlogE("Stream: %d ICE handler write date error %d.",
               base->stream->id, rc);
@@ -1209,11 +1619,22 @@ static void ice_stream_lock(IOEXStream *base)
     IceStream *stream = (IceStream *)base;
     IceHandler *handler = (IceHandler *)stream->handler;
     IceTransport *transport = (IceTransport *)stream_get_transport(base);
+    pj_ice_strans *st;
     pj_grp_lock_t *lock;
 
     prepare_thread_context(transport);
-    lock = pj_ice_strans_get_grp_lock(handler->st);
-    pj_grp_lock_acquire(lock);
+
+    for (;;) {
+        st = handler->st;
+        lock = pj_ice_strans_get_grp_lock(st);
+        pj_grp_lock_acquire(lock);
+
+        if (st == handler->st)
+            break;
+
+        // Transport switched by ICE restart while waiting, lock the new one.
+        pj_grp_lock_release(lock);
+    }
 }
 
 static void ice_stream_unlock(IOEXStream *base)
@@ -1228,8 +1649,15 @@ static void ice_stream_unlock(IOEXStream *base)
     pj_grp_lock_release(lock);
 }
 
-static int ice_session_apply_remote_sdp(IOEXSession *base,
-                                        const char *sdp, size_t len)
+/*
+ * A restart SDP only renegotiates the transports being restarted: the
+ * credentials and candidates of their peer go to next_remote, made current
+ * once switched to. The streams themselves, the peer and its nonce stay as
+ * agreed on at connect.
+ */
+static int ice_session_parse_remote_sdp(IOEXSession *base,
+                                        const char *sdp, size_t len,
+                                        bool restart)
 {
     IceSession *session = (IceSession *)base;
     IceWorker  *worker  = (IceWorker *)session_get_worker(base);
@@ -1244,7 +1672,7 @@ static int ice_session_apply_remote_sdp(IOEXSession *base,
     int media_index;
     int i;
     int rc;
-    int fmt, ops = 0;
+    int fmt, ops;
 
     assert(base && sdp && len);
 
@@ -1265,12 +1693,15 @@ static int ice_session_apply_remote_sdp(IOEXSession *base,
         return IOEX_GENERAL_ERROR(IOEXERR_INVALID_SDP);
     }
 
-    rc = (int)base58_decode(p_sdp->origin.user.ptr, p_sdp->origin.user.slen,
-                            base->peer_pubkey, sizeof(base->peer_pubkey));
-    if (rc < 0) {
-        vlogE("Session: Parse peer public key error.");
-        pj_pool_release(pool);
-        return IOEX_GENERAL_ERROR(IOEXERR_INVALID_SDP);
+    if (!restart) {
+        rc = (int)base58_decode(p_sdp->origin.user.ptr,
+                                p_sdp->origin.user.slen,
+                                base->peer_pubkey, sizeof(base->peer_pubkey));
+        if (rc < 0) {
+            vlogE("Session: Parse peer public key error.");
+            pj_pool_release(pool);
+            return IOEX_GENERAL_ERROR(IOEXERR_INVALID_SDP);
+        }
     }
 
     for (i = 0; i < p_sdp->attr_count; i++) {
@@ -1280,9 +1711,11 @@ static int ice_session_apply_remote_sdp(IOEXSession *base,
             pwd = p_sdp->attr[i]->value;
         else if (pj_strcmp2(&p_sdp->attr[i]->name, "nonce") == 0)
             nonce = p_sdp->attr[i]->value;
+        else if (pj_strcmp2(&p_sdp->attr[i]->name, SDP_MIGRATE_ATTR) == 0)
+            session->restart_capable = 1;
     }
 
-    if (nonce.ptr && session->role != PJ_ICE_SESS_ROLE_CONTROLLING)
+    if (!restart && nonce.ptr && session->role != PJ_ICE_SESS_ROLE_CONTROLLING)
         crypto_nonce_from_str(base->nonce, nonce.ptr, nonce.slen);
 
 rescan:
@@ -1293,6 +1726,7 @@ rescan:
         int cand_index = 0;
         IceStream *stream;
         IceHandler *handler;
+        IceRemote *remote;
 
         rc = list_iterator_next(&iterator, (void **)&stream);
         if (rc == 0)
@@ -1303,33 +1737,47 @@ rescan:
 
         handler = (IceHandler *)stream->handler;
 
-        if (media_index >= p_sdp->media_count) {
-            stream->base.deactivate = 1;
-            vlogD("Session: ICE stream %d deactivated.", stream->base.id);
-            deref(stream);
-            continue;
+        if (restart) {
+            // Left without candidates, the restart of the stream fails.
+            if (!handler->next_st || media_index >= p_sdp->media_count) {
+                media_index++;
+                deref(stream);
+                continue;
+            }
+
+            remote = &handler->next_remote;
+        } else {
+            if (media_index >= p_sdp->media_count) {
+                stream->base.deactivate = 1;
+                vlogD("Session: ICE stream %d deactivated.", stream->base.id);
+                deref(stream);
+                continue;
+            }
+
+            remote = &handler->remote;
         }
 
-        memset(&handler->remote, 0, sizeof(handler->remote));
+        memset(remote, 0, sizeof(*remote));
 
         pjmedia_sdp_media *media = p_sdp->media[media_index];
         pjmedia_sdp_conn *conn = media->conn;
 
         if (ufrag.ptr)
-            strncpy(handler->remote.ufrag, ufrag.ptr, ufrag.slen);
+            strncpy(remote->ufrag, ufrag.ptr, ufrag.slen);
         if (pwd.ptr)
-            strncpy(handler->remote.pwd, pwd.ptr, pwd.slen);
+            strncpy(remote->pwd, pwd.ptr, pwd.slen);
 
         if ((pj_strchr(&conn->addr, ':')-conn->addr.ptr) <= conn->addr.slen)
             af = pj_AF_INET6();
         else
             af = pj_AF_INET();
 
-        pj_sockaddr_init(af, &handler->remote.def_addr[0],
+        pj_sockaddr_init(af, &remote->def_addr[0],
                          &conn->addr, media->desc.port);
 
         fmt = atoi(media->desc.fmt[0].ptr);
 
+        ops = 0;
         if (stream->base.unencrypt)
             ops |= IOEX_STREAM_PLAIN;
         if (stream->base.multiplexing)
@@ -1338,6 +1786,16 @@ rescan:
             ops |= IOEX_STREAM_RELIABLE;
         if (stream->base.portforwarding)
             ops |= IOEX_STREAM_PORT_FORWARDING;
+        if (stream->base.multipath)
+            ops |= IOEX_STREAM_MULTIPATH;
+
+        if (restart && ops != fmt) {
+            vlogD("ICE: Stream %d restart options mismatch.", stream->base.id);
+            memset(remote, 0, sizeof(*remote));
+            media_index++;
+            deref(stream);
+            continue;
+        }
 
         if (ops != fmt) {
             stream->base.deactivate = 1;
@@ -1347,12 +1805,30 @@ rescan:
             continue;
         }
 
+        if (!restart) {
+            stream->base.compact_mux = 0;
+            stream->base.early_data = 0;
+        }
+
         for (i = 0; i < media->attr_count; i++) {
+            if (restart && pj_strcmp2(&media->attr[i]->name, "candidate") != 0)
+                continue;
+
+            if (pj_strcmp2(&media->attr[i]->name, "mux-compact") == 0) {
+                stream->base.compact_mux = stream->base.multiplexing;
+                continue;
+            }
+
+            if (pj_strcmp2(&media->attr[i]->name, "mux-early-data") == 0) {
+                stream->base.early_data = stream->base.multiplexing;
+                continue;
+            }
+
             if (pj_strcmp2(&media->attr[i]->name, "candidate") == 0) {
                 int comp_id, prio, port, rport;
                 int cnt;
                 char foundation[32], transport[12], ipaddr[80], type[32], raddr[80];
-                pj_ice_sess_cand *cand = &handler->remote.cand[cand_index];
+                pj_ice_sess_cand *cand = &remote->cand[cand_index];
 
                 cnt = sscanf(media->attr[i]->value.ptr,
                              "%32s %d %12s %d %80s %d typ %32s raddr %80s rport %d",
@@ -1366,7 +1842,7 @@ rescan:
                              raddr,
                              &rport);
                 if (cnt != 7 && cnt != 9) {
-                    memset(&handler->remote, 0, sizeof(handler->remote));
+                    memset(remote, 0, sizeof(*remote));
                     pj_pool_release(pool);
                     deref(stream);
                     return IOEX_GENERAL_ERROR(IOEXERR_INVALID_SDP);
@@ -1381,7 +1857,7 @@ rescan:
                 else if (strcmp(type, "prflx")==0)
                     cand->type = PJ_ICE_CAND_TYPE_PRFLX;
                 else {
-                    memset(&handler->remote, 0, sizeof(handler->remote));
+                    memset(remote, 0, sizeof(*remote));
                     pj_pool_release(pool);
                     deref(stream);
                     return IOEX_GENERAL_ERROR(IOEXERR_INVALID_SDP);
@@ -1403,13 +1879,18 @@ rescan:
                     pj_sockaddr_init(af, &cand->rel_addr, &str_rpaddr, (pj_uint16_t)rport);
                 }
 
-                if (comp_id > handler->remote.comp_cnt) {
-                    handler->remote.comp_cnt = comp_id;
+                if (comp_id > remote->comp_cnt) {
+                    remote->comp_cnt = comp_id;
                 }
 
-                handler->remote.cand_cnt = ++cand_index;
+                remote->cand_cnt = ++cand_index;
             }
         }
+
+        // Other components fall back to the default address before ICE runs.
+        for (i = 1; i < remote->comp_cnt && i < PJ_ICE_MAX_COMP; i++)
+            remote->def_addr[i] = remote->def_addr[0];
+
         media_index++;
         deref(stream);
     }
@@ -1419,6 +1900,12 @@ rescan:
     return 0;
 }
 
+static int ice_session_apply_remote_sdp(IOEXSession *base,
+                                        const char *sdp, size_t len)
+{
+    return ice_session_parse_remote_sdp(base, sdp, len, false);
+}
+
 #define pj_str(s)       pj_str((char *)(s))
 
 static const char *stream_type_str[] = {
@@ -1447,10 +1934,12 @@ static int ice_session_encode_local_sdp(IOEXSession *base,
     pjmedia_sdp_attr ufrag_attr;
     pjmedia_sdp_attr pwd_attr;
     pjmedia_sdp_attr nonce_attr;
+    pjmedia_sdp_attr migrate_attr;
+    pjmedia_sdp_attr restart_attr;
     ListIterator iterator;
     int index = 0;
     int rc;
-    int ops = 0;
+    int ops;
     char str_ops[8];
 
     assert(base && sdp && len);
@@ -1518,11 +2007,33 @@ static int ice_session_encode_local_sdp(IOEXSession *base,
         }
     }
 
+    // ICE restart capability, ignored by old peers.
+    migrate_attr.name = pj_str(SDP_MIGRATE_ATTR);
+    migrate_attr.value = pj_str("");
+
+    status = pjmedia_sdp_session_add_attr(&sdp_session, &migrate_attr);
+    if (status != PJ_SUCCESS) {
+        pj_pool_release(pool);
+        return IOEX_ICE_ERROR(status);
+    }
+
+    if (session->restart_state != RESTART_NONE) {
+        restart_attr.name = pj_str(SDP_RESTART_ATTR);
+        restart_attr.value = pj_str("");
+
+        status = pjmedia_sdp_session_add_attr(&sdp_session, &restart_attr);
+        if (status != PJ_SUCCESS) {
+            pj_pool_release(pool);
+            return IOEX_ICE_ERROR(status);
+        }
+    }
+
 rescan:
     list_iterate(base->streams, &iterator);
     while (list_iterator_has_next(&iterator)) {
         IceStream *stream;
         IceHandler *handler;
+        pj_ice_strans *st;
         pjmedia_sdp_media *media;
         pjmedia_sdp_conn *conn;
         pj_ice_sess_cand cand[PJ_ICE_ST_MAX_CAND];
@@ -1538,13 +2049,16 @@ rescan:
 
         handler = (IceHandler *)stream->handler;
 
-        if ((!handler->st) || !pj_ice_strans_has_sess(handler->st)) {
+        // Describe the next transport while ICE restarting.
+        st = handler->next_st ? handler->next_st : handler->st;
+
+        if ((!st) || !pj_ice_strans_has_sess(st)) {
             pj_pool_release(pool);
             deref(stream);
             return IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
         }
 
-        ncomps = pj_ice_strans_get_running_comp_cnt(handler->st);
+        ncomps = pj_ice_strans_get_running_comp_cnt(st);
         if (!ncomps) {
             pj_pool_release(pool);
             deref(stream);
@@ -1556,7 +2070,7 @@ rescan:
         // Media descriptions (m=)
         media->desc.media = pj_str(stream_type_str[stream->base.type]);
 
-        status = pj_ice_strans_get_def_cand(handler->st, 1, &cand[0]);
+        status = pj_ice_strans_get_def_cand(st, 1, &cand[0]);
         if (status != PJ_SUCCESS) {
             pj_pool_release(pool);
             deref(stream);
@@ -1567,6 +2081,7 @@ rescan:
         media->desc.transport = pj_str("UDP");
         media->desc.fmt_count = 1;
 
+        ops = 0;
         if (stream->base.unencrypt)
             ops |= IOEX_STREAM_PLAIN;
         if (stream->base.multiplexing)
@@ -1575,6 +2090,8 @@ rescan:
             ops |= IOEX_STREAM_RELIABLE;
         if (stream->base.portforwarding)
             ops |= IOEX_STREAM_PORT_FORWARDING;
+        if (stream->base.multipath)
+            ops |= IOEX_STREAM_MULTIPATH;
         sprintf(str_ops, "%d", ops);
 
         pj_strdup2_with_null(pool, &media->desc.fmt[0], str_ops);
@@ -1587,6 +2104,32 @@ rescan:
         pj_strdup2_with_null(pool, &conn->addr, str_addr);
         media->conn = conn;
 
+        // Compact multiplexer header capability, ignored by old peers.
+        if (stream->base.multiplexing) {
+            pjmedia_sdp_attr *mux_attr;
+
+            mux_attr = pj_pool_calloc(pool, 1, sizeof(pjmedia_sdp_attr));
+            mux_attr->name = pj_str("mux-compact");
+
+            status = pjmedia_sdp_media_add_attr(media, mux_attr);
+            if (status != PJ_SUCCESS) {
+                pj_pool_release(pool);
+                deref(stream);
+                return IOEX_ICE_ERROR(status);
+            }
+
+            // Channel data before the open confirmation, ignored likewise.
+            mux_attr = pj_pool_calloc(pool, 1, sizeof(pjmedia_sdp_attr));
+            mux_attr->name = pj_str("mux-early-data");
+
+            status = pjmedia_sdp_media_add_attr(media, mux_attr);
+            if (status != PJ_SUCCESS) {
+                pj_pool_release(pool);
+                deref(stream);
+                return IOEX_ICE_ERROR(status);
+            }
+        }
+
         for (i = 0; i < ncomps; i++) {
             int j;
             unsigned cand_cnt = PJ_ARRAY_SIZE(cand);
@@ -1595,7 +2138,7 @@ rescan:
 
             memset(cand, 0, sizeof(cand));
 
-            status = pj_ice_strans_enum_cands(handler->st, i+1, &cand_cnt, cand);
+            status = pj_ice_strans_enum_cands(st, i+1, &cand_cnt, cand);
             if(status != PJ_SUCCESS) {
                 pj_pool_release(pool);
                 deref(stream);
@@ -1665,6 +2208,447 @@ rescan:
     return rc;
 }
 
+static int ice_handler_regather(IceHandler *handler)
+{
+    IOEXStream *stream = handler->base.stream;
+    IceWorker  *worker  = (IceWorker *)stream_get_worker(stream);
+    pj_ice_strans_cb cbs;
+    pj_status_t status;
+
+    if (handler->retired_st) {
+        pj_ice_strans_destroy(handler->retired_st);
+        handler->retired_st = NULL;
+    }
+
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.on_ice_complete = stream_on_ice_complete;
+    cbs.on_rx_data = stream_on_rx_data;
+
+    // Gathering may complete inside create, so the phase goes first.
+    handler->restart_phase = PHASE_GATHERING;
+
+    status = pj_ice_strans_create(NULL, &worker->cfg, handler->path_cnt,
+                                  stream, &cbs, &handler->next_st);
+    if (status != PJ_SUCCESS) {
+        handler->next_st = NULL;
+        handler->restart_phase = PHASE_NONE;
+        vlogE("Stream: %d ICE restart create transport failed: %s.",
+              stream->id, ice_strerror(status));
+        return IOEX_ICE_ERROR(status);
+    }
+
+    return 0;
+}
+
+static void ice_handler_restart_init(IceHandler *handler)
+{
+    IceSession *session = (IceSession *)stream_get_session(handler->base.stream);
+    pj_status_t status;
+    pj_str_t ufrag;
+    pj_str_t pwd;
+
+    ufrag = pj_str(session->ufrag);
+    pwd = pj_str(session->pwd);
+
+    status = pj_ice_strans_init_ice(handler->next_st, session->role,
+                                    &ufrag, &pwd);
+    if (status != PJ_SUCCESS) {
+        vlogE("Stream: %d ICE restart init failed: %s.",
+              handler->base.stream->id, ice_strerror(status));
+        handler->restart_phase = PHASE_FAILED;
+        return;
+    }
+
+    handler->restart_phase = PHASE_READY;
+}
+
+static void ice_handler_restart_start(IceHandler *handler)
+{
+    pj_status_t status;
+    pj_str_t rufrag;
+    pj_str_t rpwd;
+
+    if (handler->base.stream->deactivate || !handler->next_remote.cand_cnt) {
+        handler->restart_phase = PHASE_FAILED;
+        return;
+    }
+
+    handler->restart_phase = PHASE_CONNECTING;
+
+    status = pj_ice_strans_start_ice(handler->next_st,
+                                     pj_cstr(&rufrag, handler->next_remote.ufrag),
+                                     pj_cstr(&rpwd, handler->next_remote.pwd),
+                                     handler->next_remote.cand_cnt,
+                                     handler->next_remote.cand);
+    if (status != PJ_SUCCESS) {
+        vlogE("Stream: %d ICE restart negotiation failed: %s.",
+              handler->base.stream->id, ice_strerror(status));
+        handler->restart_phase = PHASE_FAILED;
+    }
+}
+
+/*
+ * Make the negotiated transport current, with its peer. The stream lock is
+ * the group lock of the current transport, so switching under the old lock
+ * guarantees no holder of the stream lock observes the change.
+ */
+static void ice_handler_switch_transport(IceHandler *handler)
+{
+    IceStream *stream = (IceStream *)handler->base.stream;
+    pj_grp_lock_t *lock;
+    struct timeval now;
+    unsigned int i;
+
+    lock = pj_ice_strans_get_grp_lock(handler->st);
+    pj_grp_lock_acquire(lock);
+
+    handler->retired_st = handler->st;
+    handler->st = handler->next_st;
+    handler->next_st = NULL;
+    handler->remote = handler->next_remote;
+    memset(&handler->next_remote, 0, sizeof(handler->next_remote));
+    handler->restart_phase = PHASE_NONE;
+
+    gettimeofday(&now, NULL);
+    stream->remote_timestamp = now;
+
+    for (i = 0; i < handler->path_cnt; i++) {
+        handler->paths[i].last_rx = now;
+        handler->paths[i].vtime = 0;
+    }
+    handler->path_vclock = 0;
+
+    pj_grp_lock_release(lock);
+
+    pj_ice_strans_stop_ice(handler->retired_st);
+
+    vlogI("Stream: %d ICE transport migrated.", stream->base.id);
+}
+
+enum {
+    RESTART_ACTION_UPDATE,
+    RESTART_ACTION_START,
+    RESTART_ACTION_SWITCH,
+    RESTART_ACTION_CANCEL
+};
+
+/*
+ * Apply the restart action to all streams being restarted, and count them
+ * by phase after the action.
+ */
+static void ice_session_restart_walk(IceSession *session, int action,
+                                     int counts[PHASE_COUNT])
+{
+    ListIterator iterator;
+    int rc;
+
+rewalk:
+    memset(counts, 0, sizeof(int) * PHASE_COUNT);
+
+    list_iterate(session->base.streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+        IceHandler *handler;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rewalk;
+
+        handler = (IceHandler *)stream->handler;
+
+        if (handler->next_st) {
+            switch (action) {
+            case RESTART_ACTION_UPDATE:
+                if (handler->restart_phase == PHASE_GATHERED)
+                    ice_handler_restart_init(handler);
+                break;
+
+            case RESTART_ACTION_START:
+                if (handler->restart_phase == PHASE_READY)
+                    ice_handler_restart_start(handler);
+                break;
+
+            case RESTART_ACTION_SWITCH:
+                if (handler->restart_phase == PHASE_CONNECTED)
+                    ice_handler_switch_transport(handler);
+                break;
+
+            case RESTART_ACTION_CANCEL:
+                ice_handler_cancel_restart(handler);
+                break;
+            }
+        }
+
+        counts[handler->restart_phase]++;
+        deref(stream);
+    }
+}
+
+static int ice_session_begin_restart(IceSession *session)
+{
+    ListIterator iterator;
+    int count = 0;
+    int rc;
+
+    if (!session->restart_capable)
+        return IOEX_GENERAL_ERROR(IOEXERR_NOT_IMPLEMENTED);
+
+    session->restart_state = session->restart_sdp ? RESTART_ANSWERING
+                                                  : RESTART_GATHERING;
+    session->restart_again = 0;
+    session->restart_deadline = (get_monotonic_time() / 1000) +
+                                RESTART_TIMEOUT_INTERVAL;
+
+    // New credentials tell the peer ICE restarted.
+    pj_create_random_string(session->ufrag, PJ_ICE_UFRAG_LEN);
+    pj_create_random_string(session->pwd, PJ_ICE_UFRAG_LEN);
+
+reregather:
+    list_iterate(session->base.streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        IceStream *stream;
+        IceHandler *handler;
+
+        rc = list_iterator_next(&iterator, (void **)&stream);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto reregather;
+
+        handler = (IceHandler *)stream->handler;
+
+        if (stream->base.state != IOEXStreamState_connected ||
+                handler->stopping || handler->next_st) {
+            deref(stream);
+            continue;
+        }
+
+        rc = ice_handler_regather(handler);
+        deref(stream);
+
+        if (rc < 0)
+            return rc;
+
+        count++;
+    }
+
+    return count > 0 ? 0 : IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+}
+
+static int ice_session_send_restart(IceSession *session, bool answer)
+{
+    char sdp[RESTART_SDP_MAX_LEN];
+    int rc;
+
+    rc = ice_session_encode_local_sdp(&session->base, sdp, sizeof(sdp));
+    if (rc < 0) {
+        vlogE("Session: Encode ICE restart SDP failed(0x%x).", rc);
+        return rc;
+    }
+    // IMPORTANT: add terminal null
+    sdp[rc] = 0;
+
+    return session_send_restart(&session->base, answer, sdp, rc + 1);
+}
+
+/*
+ * Drives ICE restart on the worker thread, so transports are only created,
+ * started and switched here. Kicked by the network monitor and signaling,
+ * and polled while the new transports are gathering or negotiating.
+ */
+static bool ice_session_restart_callback(void *user_data)
+{
+    IceSession *session = (IceSession *)user_data;
+    IceTransport *transport = (IceTransport *)session_get_transport(&session->base);
+    int counts[PHASE_COUNT];
+    int rc;
+
+    prepare_thread_context(transport);
+
+    pthread_mutex_lock(&session->restart_lock);
+
+    if (session->restart_state == RESTART_NONE) {
+        if (!session->restart_sdp && !session->restart_again)
+            goto out;
+
+        rc = ice_session_begin_restart(session);
+        if (rc < 0) {
+            vlogD("Session: ICE session can not restart (0x%x).", rc);
+            goto failed;
+        }
+    }
+
+    if (session->restart_state == RESTART_REFUSED)
+        goto failed;
+
+    if ((get_monotonic_time() / 1000) >= session->restart_deadline) {
+        vlogW("Session: ICE restart to %s timeout.", session->base.to);
+        goto failed;
+    }
+
+    ice_session_restart_walk(session, RESTART_ACTION_UPDATE, counts);
+    if (counts[PHASE_FAILED])
+        goto failed;
+
+    switch (session->restart_state) {
+    case RESTART_GATHERING:
+        if (counts[PHASE_GATHERING])
+            break;
+
+        rc = ice_session_send_restart(session, false);
+        if (rc < 0)
+            goto failed;
+
+        session->restart_state = RESTART_OFFERED;
+        break;
+
+    case RESTART_OFFERED:
+    case RESTART_ANSWERING:
+        if (!session->restart_sdp || counts[PHASE_GATHERING])
+            break;
+
+        rc = ice_session_parse_remote_sdp(&session->base, session->restart_sdp,
+                                          session->restart_sdp_len, true);
+        free(session->restart_sdp);
+        session->restart_sdp = NULL;
+
+        if (rc < 0) {
+            vlogE("Session: Apply ICE restart SDP failed(0x%x).", rc);
+            goto failed;
+        }
+
+        ice_session_restart_walk(session, RESTART_ACTION_START, counts);
+        if (counts[PHASE_FAILED])
+            goto failed;
+
+        if (session->restart_state == RESTART_ANSWERING) {
+            rc = ice_session_send_restart(session, true);
+            if (rc < 0)
+                goto failed;
+        }
+
+        session->restart_state = RESTART_CONNECTING;
+        break;
+
+    case RESTART_CONNECTING:
+        if (counts[PHASE_CONNECTING])
+            break;
+
+        ice_session_restart_walk(session, RESTART_ACTION_SWITCH, counts);
+        session->restart_state = RESTART_NONE;
+
+        vlogI("Session: ICE restart to %s completed.", session->base.to);
+        break;
+    }
+
+    goto out;
+
+failed:
+    if (session->restart_state == RESTART_ANSWERING)
+        session_send_restart(&session->base, true, NULL, 0);
+
+    ice_session_restart_walk(session, RESTART_ACTION_CANCEL, counts);
+
+    if (session->restart_sdp) {
+        free(session->restart_sdp);
+        session->restart_sdp = NULL;
+    }
+
+    session->restart_state = RESTART_NONE;
+    vlogW("Session: ICE restart to %s failed.", session->base.to);
+
+out:
+    if (session->restart_state != RESTART_NONE)
+        ice_session_schedule_restart(session, RESTART_POLL_INTERVAL);
+    else if (session->restart_again)
+        ice_session_schedule_restart(session, 0);
+
+    pthread_mutex_unlock(&session->restart_lock);
+
+    return false;
+}
+
+static bool ice_session_match_peer(IceSession *session, const char *sdp)
+{
+    char tmp[64];
+    size_t tmplen = sizeof(tmp);
+    char origin[72];
+    char *pk;
+
+    pk = base58_encode(session->base.peer_pubkey,
+                       sizeof(session->base.peer_pubkey), tmp, &tmplen);
+    if (!pk)
+        return false;
+
+    snprintf(origin, sizeof(origin), "o=%s ", pk);
+    return strstr(sdp, origin) != NULL;
+}
+
+static int ice_session_restart(IOEXSession *base, bool answer,
+                               const char *sdp, size_t len)
+{
+    IceSession *session = (IceSession *)base;
+    IceTransport *transport = (IceTransport *)session_get_transport(base);
+    char *remote_sdp = NULL;
+    int rc = 0;
+
+    prepare_thread_context(transport);
+
+    if (sdp) {
+        remote_sdp = (char *)malloc(len + 1);
+        if (!remote_sdp)
+            return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+
+        memcpy(remote_sdp, sdp, len);
+        remote_sdp[len] = 0;
+
+        if (!answer && !ice_session_match_peer(session, remote_sdp)) {
+            free(remote_sdp);
+            return IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
+        }
+    }
+
+    pthread_mutex_lock(&session->restart_lock);
+
+    if (answer) {
+        if (session->restart_state != RESTART_OFFERED || session->restart_sdp)
+            rc = IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
+        else if (!remote_sdp)
+            session->restart_state = RESTART_REFUSED;
+    } else if (session->restart_state != RESTART_NONE &&
+               (session->role == PJ_ICE_SESS_ROLE_CONTROLLING ||
+                session->restart_state > RESTART_OFFERED)) {
+        // Both sides restarting at once, the controlling agent's offer wins.
+        rc = IOEX_GENERAL_ERROR(IOEXERR_BUSY);
+    } else if (session->restart_state != RESTART_NONE) {
+        session->restart_state = RESTART_ANSWERING;
+    }
+
+    if (rc == 0) {
+        if (remote_sdp) {
+            if (session->restart_sdp)
+                free(session->restart_sdp);
+
+            session->restart_sdp = remote_sdp;
+            session->restart_sdp_len = len;
+            remote_sdp = NULL;
+        }
+
+        ice_session_schedule_restart(session, 0);
+    }
+
+    pthread_mutex_unlock(&session->restart_lock);
+
+    if (remote_sdp)
+        free(remote_sdp);
+
+    return rc;
+}
+
 static int ice_handler_create(IceStream *stream, StreamHandler **handler)
 {
     IceHandler *h;
@@ -1731,7 +2715,9 @@ static int ice_transport_create_session(IOEXTransport *base, IOEXSession **sessi
     s->base.set_offer = ice_session_set_offer;
     s->base.encode_local_sdp = ice_session_encode_local_sdp;
     s->base.apply_remote_sdp = ice_session_apply_remote_sdp;
+    s->base.restart = ice_session_restart;
 
+    pthread_mutex_init(&s->restart_lock, NULL);
 
     vlogD("Session: ICE session created");
 
@@ -84,6 +84,23 @@ typedef struct IceSession {
     pj_ice_sess_role    role;
     char                ufrag[PJ_ICE_UFRAG_LEN+1];
     char                pwd[PJ_ICE_UFRAG_LEN+1];
+
+    /* ICE restart after the local network changed */
+    pthread_mutex_t     restart_lock;
+    int                 restart_capable;
+    int                 restart_state;
+    int                 restart_again;
+    uint64_t            restart_deadline;
+    char                *restart_sdp;
+    size_t              restart_sdp_len;
+    Timer               *restart_timer;
+
+    /* Local network interface monitor */
+    uint32_t            netmon_fingerprint;
+    Timer               *netmon_timer;
+    pj_ioqueue_key_t    *netmon_key;
+    pj_ioqueue_op_key_t netmon_op;
+    char                netmon_buf[4096];
 } IceSession;
 
 typedef struct IceStream {
@@ -95,21 +112,47 @@ typedef struct IceStream {
     Timer               *keepalive_timer;
 } IceStream;
 
+#define ICE_MAX_PATHS       2
+
+typedef struct IcePath {
+    struct timeval      last_rx;
+    uint32_t            srtt;       /* Smoothed RTT in microseconds */
+    uint64_t            vtime;      /* Virtual finish time for striping */
+} IcePath;
+
+typedef struct IceRemote {
+    char                ufrag[80];
+    char                pwd[80];
+    unsigned int        comp_cnt;
+    pj_sockaddr         def_addr[PJ_ICE_MAX_COMP];
+    unsigned int        cand_cnt;
+    pj_ice_sess_cand    cand[PJ_ICE_ST_MAX_CAND];
+} IceRemote;
+
 typedef struct IceHandler {
     StreamHandler       base;
 
     pj_ice_strans       *st;
 
     int                 stopping;
-        
-    struct {
-        char            ufrag[80];
-        char            pwd[80];
-        unsigned int    comp_cnt;
-        pj_sockaddr     def_addr[PJ_ICE_MAX_COMP];
-        unsigned int    cand_cnt;
-        pj_ice_sess_cand    cand[PJ_ICE_ST_MAX_CAND];
-    } remote;
+
+    /*
+     * ICE restart: the next transport gathers and negotiates while st keeps
+     * carrying traffic, then replaces st. The retired one is kept until the
+     * next restart or handler destroy, late writers may still refer to it.
+     */
+    pj_ice_strans       *next_st;
+    pj_ice_strans       *retired_st;
+    int                 restart_phase;
+    /* Peer of next_st, made current together with it */
+    IceRemote           next_remote;
+
+    /* One path per ICE component, only multipath streams have more */
+    unsigned int        path_cnt;
+    IcePath             paths[ICE_MAX_PATHS];
+    uint64_t            path_vclock;
+
+    IceRemote           remote;
 } IceHandler;
 
 int ice_transport_create(IOEXTransport **transport);
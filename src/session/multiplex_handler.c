@@ -39,6 +39,9 @@
 #define KEEPALIVE_INTERVAL              30000
 #define KEEPALIVE_TIMEOUT_INTERVAL      130000
 
+#define CHECKPOINT_INTERVAL             1000
+#define CHECKPOINT_MAX_PER_POLL         256
+
 #define PROTOCOL_HEAD_LEN       8
 
 #pragma pack(push, 1)
@@ -54,6 +57,36 @@ typedef struct ProtocolBuffer {
 
 #pragma pack(pop)
 
+/*
+ * Compact (v2) protocol header, used when both peers announced the
+ * capability in SDP:
+ *
+ * +-------------+--------+----------------+-----------------+-------------+
+ * | type|flags  | option | local id       | remote id       | payload len |
+ * | 1 byte      | 1 byte | varint         | varint          | varint      |
+ * +-------------+--------+----------------+-----------------+-------------+
+ *               ^ only with COMPACT_FLAG_OPTION
+ *                                         ^ only with COMPACT_FLAG_REMOTE_ID
+ *
+ * Varints are little-endian base-128, so channel ids and payload lengths
+ * below 128 take a single byte.
+ */
+#define COMPACT_TYPE_MASK           0x0F
+#define COMPACT_FLAG_OPTION         0x10
+#define COMPACT_FLAG_REMOTE_ID      0x20
+#define COMPACT_FLAGS_MASK          (COMPACT_FLAG_OPTION | COMPACT_FLAG_REMOTE_ID)
+
+#define VARINT16_MAX_LEN            3
+#define COMPACT_HEAD_MAX_LEN        (2 + VARINT16_MAX_LEN * 3)
+
+typedef struct PacketHeader {
+    uint8_t type;
+    uint8_t option;
+    uint16_t local_channel_id;
+    uint16_t remote_channel_id;
+    uint16_t payload_len;
+} PacketHeader;
+
 #define IDS_HEAP(channel_ids) ((IdsHeap *)&channel_ids)
 
 #define HANDLER(mux) ((MultiplexHandler *)((char *)mux - sizeof(StreamHandler)))
@@ -98,8 +131,28 @@ static int multiplex_handler_start(StreamHandler *base)
     if (rc != 0)
         return rc;
 
+    /* Remote SDP has been applied, the header format is settled now. */
+    handler->compact = (base->stream->compact_mux != 0);
+    handler->early_data = (base->stream->early_data != 0) &&
+                          stream_is_reliable(base->stream);
+
     if (!stream_is_reliable(base->stream)) {
-        rc = multiplex_handler_create_timer(handler, KEEPALIVE_INTERVAL,
+        pthread_mutexattr_t attr;
+
+        handler->deadlines = timer_heap_create(64);
+        if (!handler->deadlines)
+            return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+
+        // Held by the deadline callback around its own rescheduling.
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&handler->deadlines_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        timer_heap_set_lock(handler->deadlines, &handler->deadlines_lock, true);
+        timer_heap_set_max_timed_out_per_poll(handler->deadlines,
+                                              CHECKPOINT_MAX_PER_POLL);
+
+        rc = multiplex_handler_create_timer(handler, CHECKPOINT_INTERVAL,
                                     multiplex_handler_checkpoint, handler);
         if (rc < 0)
             return rc;
@@ -132,6 +185,11 @@ static void multiplex_handler_stop(StreamHandler *base, int error)
 
     multiplex_handler_destroy_timer(handler);
 
+    if (handler->deadlines) {
+        timer_heap_destroy(handler->deadlines);
+        handler->deadlines = NULL;
+    }
+
     if (handler->worker)
         handler->worker->stop(handler->worker);
 
@@ -251,13 +309,159 @@ static const char *PacketTypeNames[] = {
     "Close"
 };
 
+static inline
+size_t varint16_encode(uint8_t *p, uint16_t value)
+{
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        p[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[len++] = (uint8_t)value;
+
+    return len;
+}
+
+/*
+ * Return the number of bytes consumed, 0 if more data is needed, or -1
+ * if the varint overflows 16 bits.
+ */
+static inline
+ssize_t varint16_decode(const uint8_t *p, size_t len, uint16_t *value)
+{
+    uint32_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len && i < VARINT16_MAX_LEN; i++) {
+        v |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            if (v > UINT16_MAX)
+                return -1;
+
+            *value = (uint16_t)v;
+            return (ssize_t)(i + 1);
+        }
+    }
+
+    return i < VARINT16_MAX_LEN ? 0 : -1;
+}
+
+static inline
+size_t multiplex_handler_head_max_len(MultiplexHandler *handler)
+{
+    return handler->compact ? COMPACT_HEAD_MAX_LEN : PROTOCOL_HEAD_LEN;
+}
+
+/*
+ * Decode the protocol header at the begining of data without touching it.
+ * Return the header length, 0 if the header is incomplete, or -1 if the
+ * header is invalid.
+ */
+static
+ssize_t multiplex_handler_decode_header(MultiplexHandler *handler,
+                                        const uint8_t *data, size_t len,
+                                        PacketHeader *hdr)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    uint8_t flags;
+    ssize_t rc;
+
+    if (!handler->compact) {
+        const ProtocolBuffer *pb = (const ProtocolBuffer *)data;
+
+        if (len < PROTOCOL_HEAD_LEN)
+            return 0;
+
+        hdr->type = pb->type;
+        hdr->option = pb->option;
+        hdr->local_channel_id = ntohs(pb->local_channel_id);
+        hdr->remote_channel_id = ntohs(pb->remote_channel_id);
+        hdr->payload_len = ntohs(pb->payload_len);
+        return PROTOCOL_HEAD_LEN;
+    }
+
+    if (p == end)
+        return 0;
+
+    hdr->type = *p & COMPACT_TYPE_MASK;
+    flags = *p++ & ~COMPACT_TYPE_MASK;
+    if (flags & ~COMPACT_FLAGS_MASK)
+        return -1;
+
+    hdr->option = 0;
+    if (flags & COMPACT_FLAG_OPTION) {
+        if (p == end)
+            return 0;
+        hdr->option = *p++;
+    }
+
+    rc = varint16_decode(p, end - p, &hdr->local_channel_id);
+    if (rc <= 0)
+        return rc;
+    p += rc;
+
+    hdr->remote_channel_id = 0;
+    if (flags & COMPACT_FLAG_REMOTE_ID) {
+        rc = varint16_decode(p, end - p, &hdr->remote_channel_id);
+        if (rc <= 0)
+            return rc;
+        p += rc;
+    }
+
+    rc = varint16_decode(p, end - p, &hdr->payload_len);
+    if (rc <= 0)
+        return rc;
+    p += rc;
+
+    return p - data;
+}
+
+static
+size_t multiplex_handler_encode_header(MultiplexHandler *handler,
+                                       const PacketHeader *hdr, uint8_t *data)
+{
+    uint8_t *p = data;
+
+    if (!handler->compact) {
+        ProtocolBuffer *pb = (ProtocolBuffer *)data;
+
+        pb->type = hdr->type;
+        pb->option = hdr->option;
+        pb->local_channel_id = htons(hdr->local_channel_id);
+        pb->remote_channel_id = htons(hdr->remote_channel_id);
+        pb->payload_len = htons(hdr->payload_len);
+        return PROTOCOL_HEAD_LEN;
+    }
+
+    *p = hdr->type;
+    if (hdr->option)
+        *p |= COMPACT_FLAG_OPTION;
+    if (hdr->remote_channel_id)
+        *p |= COMPACT_FLAG_REMOTE_ID;
+    p++;
+
+    if (hdr->option)
+        *p++ = hdr->option;
+
+    p += varint16_encode(p, hdr->local_channel_id);
+    if (hdr->remote_channel_id)
+        p += varint16_encode(p, hdr->remote_channel_id);
+    p += varint16_encode(p, hdr->payload_len);
+
+    return p - data;
+}
+
 static
 int multiplex_handler_send_packet(MultiplexHandler *handler,
                         uint8_t type, uint8_t option,
                         uint16_t local_channel_id, uint16_t remote_channel_id,
                         FlexBuffer *buf)
 {
-    ProtocolBuffer *pb;
+    PacketHeader hdr;
+    uint8_t head[COMPACT_HEAD_MAX_LEN];
+    size_t head_len;
     size_t len;
     ssize_t sent;
 
@@ -270,15 +474,30 @@ int multiplex_handler_send_packet(MultiplexHandler *handler,
         buf = flex_buffer(FLEX_PADDING_LEN, FLEX_PADDING_LEN);
 
     len = flex_buffer_size(buf);
-    flex_buffer_backward_offset(buf, sizeof(ProtocolBuffer));
 
-    pb = (ProtocolBuffer *)flex_buffer_mutable_ptr(buf);
-
-    pb->type = type;
-    pb->option = option;
-    pb->local_channel_id = htons(remote_channel_id);
-    pb->remote_channel_id = htons(local_channel_id);
-    pb->payload_len = htons((uint16_t)len);
+    /*
+     * The local channel id of the sender is the remote channel id of
+     * the receiver, and vice versa.
+     */
+    hdr.type = type;
+    hdr.option = option;
+    hdr.local_channel_id = remote_channel_id;
+    hdr.remote_channel_id = local_channel_id;
+    hdr.payload_len = (uint16_t)len;
+
+    /*
+     * Only the open and confirmation packets, and the early packets before
+     * the confirmation, need to tell the receiver the channel id of the
+     * sender.
+     */
+    if (handler->compact && type != PacketType_ChannelOpen &&
+            type != PacketType_ChannelOpenConfirmation &&
+            hdr.local_channel_id != 0)
+        hdr.remote_channel_id = 0;
+
+    head_len = multiplex_handler_encode_header(handler, &hdr, head);
+    flex_buffer_backward_offset(buf, head_len);
+    memcpy(flex_buffer_mutable_ptr(buf), head, head_len);
 
     sent = handler->base.next->write(handler->base.next, buf);
     if (sent < 0)
@@ -336,6 +555,13 @@ void notify_channel_resume(Channel *ch)
         ch->callbacks->channel_resume(ch, ch->callbacks->context);
 }
 
+static inline
+void notify_channel_writable(Channel *ch)
+{
+    if (ch->callbacks->channel_writable)
+        ch->callbacks->channel_writable(ch, ch->callbacks->context);
+}
+
 static inline
 void update_remote_timestamp(Channel *ch)
 {
@@ -343,58 +569,190 @@ void update_remote_timestamp(Channel *ch)
     ch->last_activity = ch->remote_timestamp;
 }
 
+static void channel_accounting_clear(ChannelAccounting *acct)
+{
+    if (!acct->owner)
+        return;
+
+    if (acct->counted)
+        __sync_sub_and_fetch(&acct->counters->active_connections, 1);
+    deref(acct->owner);
+}
+
 static void channel_destroy(void *p)
 {
     Channel *ch = (Channel *)p;
 
+    if (ch->type == ChannelType_TCP_PortForwarding) {
+        TcpChannel *tch = (TcpChannel *)ch;
+        SendChunk *chunk;
+
+        while ((chunk = tch->sendq_head) != NULL) {
+            tch->sendq_head = chunk->next;
+            free(chunk);
+        }
+
+        channel_accounting_clear(&tch->acct);
+        pthread_mutex_destroy(&tch->sendq_lock);
+    } else if (ch->type == ChannelType_UDP_PortForwarding) {
+        UdpChannel *uch = (UdpChannel *)ch;
+        SendChunk *chunk;
+
+        while ((chunk = uch->pending_head) != NULL) {
+            uch->pending_head = chunk->next;
+            free(chunk);
+        }
+
+        // The socket of an accepted flow belongs to its portforwarding.
+        if (!uch->addrlen && uch->sock != INVALID_SOCKET)
+            socket_close(uch->sock);
+
+        if (uch->pf)
+            deref(uch->pf);
+
+        channel_accounting_clear(&uch->acct);
+        pthread_mutex_destroy(&uch->lock);
+    }
+
     if (ch->id && ch->mux)
         ids_heap_free(IDS_HEAP(ch->mux->channel_ids), ch->id);
 }
 
+static inline
+long timeval_elapsed_ms(const struct timeval *now, const struct timeval *then)
+{
+    return (long)(now->tv_sec - then->tv_sec) * 1000 +
+           (long)(now->tv_usec - then->tv_usec) / 1000;
+}
+
+/*
+ * Milliseconds from now until the earliest of the channel's data timeout,
+ * keep-alive timeout and keep-alive deadlines.
+ */
+static long channel_next_deadline(Channel *ch, const struct timeval *now)
+{
+    long delay;
+    long next;
+
+    delay = KEEPALIVE_TIMEOUT_INTERVAL -
+            timeval_elapsed_ms(now, &ch->remote_timestamp);
+
+    next = KEEPALIVE_INTERVAL - timeval_elapsed_ms(now, &ch->local_timestamp);
+    if (next < delay)
+        delay = next;
+
+    if (ch->timeout) {
+        next = ch->timeout * 1000L - timeval_elapsed_ms(now, &ch->last_activity);
+        if (next < delay)
+            delay = next;
+    }
+
+    return delay > 0 ? delay : 0;
+}
+
+static void channel_deadline_expired(timer_heap_t *ht, timer_entry_t *entry);
+
+/* Entry id of a deadline unscheduled, never to be scheduled again */
+#define DEADLINE_CANCELED       (-1)
+
+/*
+ * The deadline entry holds a reference to the channel while it is in the
+ * heap. Activity on the channel only updates its timestamps, the entry is
+ * moved forward lazily when it expires.
+ */
+static
+void multiplex_handler_schedule_channel(MultiplexHandler *handler, Channel *ch,
+                                        long delay)
+{
+    time_val_t tv;
+
+    if (!handler->deadlines)
+        return;
+
+    tv.sec = delay / 1000;
+    tv.msec = delay % 1000;
+
+    ref(ch);
+    if (timer_heap_schedule(handler->deadlines, &ch->deadline, &tv) != 0)
+        deref(ch);
+}
+
+static inline
+void multiplex_handler_unschedule_channel(MultiplexHandler *handler, Channel *ch)
+{
+    if (handler->deadlines &&
+        timer_heap_cancel_if_active(handler->deadlines, &ch->deadline,
+                                    DEADLINE_CANCELED) == 1)
+        deref(ch);
+}
+
+static inline
+void multiplex_handler_add_channel(MultiplexHandler *handler, Channel *ch)
+{
+    struct timeval now;
+
+    channels_put(handler->channels, ch);
+
+    if (handler->deadlines) {
+        gettimeofday(&now, NULL);
+        timer_entry_init(&ch->deadline, ch->id, handler, channel_deadline_expired);
+        multiplex_handler_schedule_channel(handler, ch,
+                                           channel_next_deadline(ch, &now));
+    }
+}
+
+static inline
+void multiplex_handler_remove_channel(MultiplexHandler *handler, Channel *ch)
+{
+    multiplex_handler_unschedule_channel(handler, ch);
+
+    if (ch->remote_id <= MAX_CHANNEL_ID &&
+            handler->early_channels[ch->remote_id] == ch->id)
+        handler->early_channels[ch->remote_id] = 0;
+
+    channels_remove(handler->channels, ch->id);
+}
+
 /* For dgram mode underlying transport */
 static
 void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
 {
-    ProtocolBuffer *pb;
+    PacketHeader hdr;
+    ssize_t head_len;
     Channel *ch;
     int cid;
     bool ok = true;
     int rc;
 
     assert(handler);
-    assert(buf && flex_buffer_size(buf) >= PROTOCOL_HEAD_LEN);
+    assert(buf && flex_buffer_size(buf));
 
-    if (flex_buffer_size(buf) < PROTOCOL_HEAD_LEN) {
+    head_len = multiplex_handler_decode_header(handler, flex_buffer_ptr(buf),
+                                               flex_buffer_size(buf), &hdr);
+    if (head_len <= 0 ||
+            flex_buffer_size(buf) != (hdr.payload_len + (size_t)head_len) ||
+            hdr.type < PacketType_ChannelOpen ||
+            hdr.type > PacketType_ChannelClose) {
         vlogW("Stream: %d multiplex handler got invalid packet, ignore.",
               handler->base.stream->id);
         return;
     }
 
-    pb = (ProtocolBuffer *)flex_buffer_mutable_ptr(buf);
-    pb->local_channel_id = ntohs(pb->local_channel_id);
-    pb->remote_channel_id = ntohs(pb->remote_channel_id);
-    pb->payload_len = ntohs(pb->payload_len);
+    flex_buffer_forward_offset(buf, (size_t)head_len);
 
-    if (flex_buffer_size(buf) != (pb->payload_len + PROTOCOL_HEAD_LEN)) {
-        vlogW("Stream: %d multiplex handler got invalid packet, ignore.",
-              handler->base.stream->id);
-        return;
-    }
-
-    if (pb->remote_channel_id == 0 && pb->local_channel_id == 0
-            && pb->type == PacketType_ChannelData) {
-        flex_buffer_forward_offset(buf, sizeof(ProtocolBuffer));
+    if (hdr.remote_channel_id == 0 && hdr.local_channel_id == 0
+            && hdr.type == PacketType_ChannelData) {
         handler->base.prev->on_data(handler->base.prev, buf);
         return;
     }
 
     vlogT("Stream: %d multiplex handler[%d] receive packet[%s] with %d bytes payload.",
-          handler->base.stream->id, pb->local_channel_id,
-          PacketTypeNames[pb->type], pb->payload_len);
+          handler->base.stream->id, hdr.local_channel_id,
+          PacketTypeNames[hdr.type], hdr.payload_len);
 
-    if (pb->type == PacketType_ChannelOpen) {
+    if (hdr.type == PacketType_ChannelOpen) {
         size_t size;
-        ChannelType type = pb->option;
+        ChannelType type = hdr.option;
 
         if (type == ChannelType_UDP_PortForwarding) {
             if (!handler->worker) {
@@ -441,24 +799,45 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
         ch->mux = handler;
         ch->callbacks = &handler->callbacks[type];
         ch->type = type;
+        if (type == ChannelType_TCP_PortForwarding) {
+            pthread_mutex_init(&((TcpChannel *)ch)->sendq_lock, NULL);
+        } else if (type == ChannelType_UDP_PortForwarding) {
+            ((UdpChannel *)ch)->sock = INVALID_SOCKET;
+            pthread_mutex_init(&((UdpChannel *)ch)->lock, NULL);
+        }
         ch->id = (uint16_t)cid;
-        ch->remote_id = pb->remote_channel_id;
+        ch->remote_id = hdr.remote_channel_id;
         ch->status = ChannelStatus_Opening;
         update_remote_timestamp(ch);
 
-        channels_put(handler->channels, ch);
+        multiplex_handler_add_channel(handler, ch);
     } else {
-        ch = channels_get(handler->channels, pb->local_channel_id);
+        cid = hdr.local_channel_id;
+
+        // Early packet, sent before the confirmation reached the sender.
+        if (cid == 0 && handler->early_data &&
+                hdr.remote_channel_id <= MAX_CHANNEL_ID &&
+                (hdr.type == PacketType_ChannelData ||
+                 hdr.type == PacketType_ChannelClose))
+            cid = handler->early_channels[hdr.remote_channel_id];
+
+        ch = cid ? channels_get(handler->channels, cid) : NULL;
+        if (ch && hdr.local_channel_id == 0 &&
+                ch->remote_id != hdr.remote_channel_id) {
+            deref(ch);
+            ch = NULL;
+        }
+
         if (!ch) {
             vlogW("Stream: %d multiplex handler unknown channel %d, ignore.",
-                  handler->base.stream->id, (int)pb->local_channel_id);
+                  handler->base.stream->id, (int)hdr.local_channel_id);
             return;
         }
     }
 
-    switch (pb->type) {
+    switch (hdr.type) {
     case PacketType_ChannelOpen:
-        ok = notify_channel_open(ch, pb->payload_len ? pb->payload : NULL);
+        ok = notify_channel_open(ch, hdr.payload_len ? (const char *)flex_buffer_ptr(buf) : NULL);
 
         cid = ok ? ch->id : 0;
         rc = multiplex_handler_send_packet(handler,
@@ -469,8 +848,11 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
             if (ok)
                 notify_channel_close(ch, CloseReason_Error);
 
-            channels_remove(handler->channels, ch->id);
+            multiplex_handler_remove_channel(handler, ch);
         } else {
+            if (handler->early_data && ch->remote_id <= MAX_CHANNEL_ID)
+                handler->early_channels[ch->remote_id] = ch->id;
+
             ch->status = ChannelStatus_Open;
             notify_channel_opened(ch);
             update_remote_timestamp(ch);
@@ -487,15 +869,15 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
             return;
         }
 
-        if (pb->remote_channel_id != 0) {
+        if (hdr.remote_channel_id != 0) {
             ch->status = ChannelStatus_Open;
-            ch->remote_id = pb->remote_channel_id;
+            ch->remote_id = hdr.remote_channel_id;
 
             notify_channel_opened(ch);
             update_remote_timestamp(ch);
         } else {
             notify_channel_close(ch, CloseReason_Error);
-            channels_remove(handler->channels, ch->id);
+            multiplex_handler_remove_channel(handler, ch);
         }
 
         deref(ch);
@@ -510,11 +892,10 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
             return;
         }
 
-        flex_buffer_forward_offset(buf, sizeof(ProtocolBuffer));
         ok = notify_channel_data(ch, buf);
         if (!ok) {
             notify_channel_close(ch, CloseReason_Error);
-            channels_remove(handler->channels, ch->id);
+            multiplex_handler_remove_channel(handler, ch);
         } else {
             update_remote_timestamp(ch);
         }
@@ -557,7 +938,7 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
 
     case PacketType_ChannelClose:
         notify_channel_close(ch, CloseReason_Normal);
-        channels_remove(handler->channels, ch->id);
+        multiplex_handler_remove_channel(handler, ch);
         deref(ch);
         break;
 
@@ -569,40 +950,81 @@ void multiplex_handler_notify_packet(MultiplexHandler *handler, FlexBuffer *buf)
     }
 }
 
+static void multiplex_handler_close_channels(MultiplexHandler *handler,
+                                             CloseReason reason);
+
+/*
+ * No frame after an invalid header on a stream can be located any more, so
+ * the channels are closed and the stream reported failed, rather than going
+ * on with a misaligned byte stream.
+ */
+static
+void multiplex_handler_framing_error(MultiplexHandler *handler)
+{
+    vlogE("Stream: %d multiplex handler got invalid packet, close stream.",
+          handler->base.stream->id);
+
+    handler->broken = true;
+    flex_buffer_reset(&handler->incomplete_buf, FLEX_PADDING_LEN);
+
+    multiplex_handler_close_channels(handler, CloseReason_Error);
+    handler->base.prev->on_state_changed(handler->base.prev,
+                                         IOEXStreamState_failed);
+}
+
 /* For stream mode underlying transport */
 static
 void multiplex_handler_notify_data(MultiplexHandler *handler, FlexBuffer *buf)
 {
-    ProtocolBuffer *pb;
-    size_t payload_len;
+    PacketHeader hdr;
+    FlexBuffer frame;
+    ssize_t head_len;
+    size_t frame_len;
+    size_t held;
     size_t append;
 
     assert(handler);
     assert(buf && flex_buffer_size(buf));
 
-    while (flex_buffer_size(buf) != 0) {
-        if (flex_buffer_size(&handler->incomplete_buf) + flex_buffer_size(buf) < PROTOCOL_HEAD_LEN) {
-            flex_buffer_append(&handler->incomplete_buf, buf);
+    /*
+     * Complete the partial frame left over from the previous data first,
+     * only this part of the data needs to be copied.
+     */
+    held = flex_buffer_size(&handler->incomplete_buf);
+    if (held > 0) {
+        append = held < multiplex_handler_head_max_len(handler) ?
+                 multiplex_handler_head_max_len(handler) - held : 0;
+        if (append > flex_buffer_size(buf))
+            append = flex_buffer_size(buf);
+
+        flex_buffer_append2(&handler->incomplete_buf, buf, append);
+        flex_buffer_forward_offset(buf, append);
+
+        head_len = multiplex_handler_decode_header(handler,
+                            flex_buffer_ptr(&handler->incomplete_buf),
+                            flex_buffer_size(&handler->incomplete_buf), &hdr);
+        if (head_len < 0) {
+            multiplex_handler_framing_error(handler);
             return;
         }
 
-        if (flex_buffer_size(&handler->incomplete_buf) < PROTOCOL_HEAD_LEN) {
-            append = PROTOCOL_HEAD_LEN - flex_buffer_size(&handler->incomplete_buf);
-            flex_buffer_append2(&handler->incomplete_buf, buf, append);
-            flex_buffer_forward_offset(buf, append);
-        }
+        if (head_len == 0)
+            return;
 
-        pb = (ProtocolBuffer *)flex_buffer_mutable_ptr(&handler->incomplete_buf);
-        payload_len = (size_t)ntohs(pb->payload_len);
+        frame_len = hdr.payload_len + (size_t)head_len;
+        held = flex_buffer_size(&handler->incomplete_buf);
 
-        if ((payload_len + PROTOCOL_HEAD_LEN) >
-                (flex_buffer_size(&handler->incomplete_buf) + flex_buffer_size(buf))) {
-            flex_buffer_append(&handler->incomplete_buf, buf);
-            return;
-        }
+        if (frame_len <= held) {
+            /* Give back the bytes copied beyond the end of the frame. */
+            flex_buffer_backward_offset(buf, held - frame_len);
+            flex_buffer_set_size(&handler->incomplete_buf, frame_len);
+        } else {
+            append = frame_len - held;
+            if (append > flex_buffer_size(buf)) {
+                flex_buffer_append(&handler->incomplete_buf, buf);
+                return;
+            }
 
-        if ((payload_len + PROTOCOL_HEAD_LEN) > flex_buffer_size(&handler->incomplete_buf)) {
-            append = payload_len + PROTOCOL_HEAD_LEN - flex_buffer_size(&handler->incomplete_buf);
             flex_buffer_append2(&handler->incomplete_buf, buf, append);
             flex_buffer_forward_offset(buf, append);
         }
@@ -610,6 +1032,37 @@ void multiplex_handler_notify_data(MultiplexHandler *handler, FlexBuffer *buf)
         multiplex_handler_notify_packet(handler, &handler->incomplete_buf);
         flex_buffer_reset(&handler->incomplete_buf, FLEX_PADDING_LEN);
     }
+
+    /*
+     * Dispatch the complete frames directly from the incoming buffer
+     * through sub-buffer views over each frame.
+     */
+    while (flex_buffer_size(buf) > 0) {
+        head_len = multiplex_handler_decode_header(handler, flex_buffer_ptr(buf),
+                                                   flex_buffer_size(buf), &hdr);
+        if (head_len < 0) {
+            multiplex_handler_framing_error(handler);
+            return;
+        }
+
+        if (head_len == 0)
+            break;
+
+        frame_len = hdr.payload_len + (size_t)head_len;
+        if (frame_len > flex_buffer_size(buf))
+            break;
+
+        flex_buffer_init(&frame, buf->buffer, flex_buffer_offset(buf) + frame_len,
+                         flex_buffer_offset(buf));
+        flex_buffer_set_size(&frame, frame_len);
+
+        multiplex_handler_notify_packet(handler, &frame);
+        flex_buffer_forward_offset(buf, frame_len);
+    }
+
+    /* Buffer the trailing partial frame only. */
+    if (flex_buffer_size(buf) > 0)
+        flex_buffer_append(&handler->incomplete_buf, buf);
 }
 
 static void multiplex_handler_close_channels(MultiplexHandler *handler,
@@ -631,6 +1084,7 @@ reclose:
             goto reclose;
 
         channels_iterator_remove(&it);
+        multiplex_handler_unschedule_channel(handler, ch);
 
         notify_channel_close(ch, reason);
         deref(ch);
@@ -680,6 +1134,12 @@ int multiplex_handler_open_channel(Multiplexer *mux, ChannelType type,
     ch->mux = handler;
     ch->callbacks = &handler->callbacks[type];
     ch->type = type;
+    if (type == ChannelType_TCP_PortForwarding) {
+        pthread_mutex_init(&((TcpChannel *)ch)->sendq_lock, NULL);
+    } else if (type == ChannelType_UDP_PortForwarding) {
+        ((UdpChannel *)ch)->sock = INVALID_SOCKET;
+        pthread_mutex_init(&((UdpChannel *)ch)->lock, NULL);
+    }
     ch->id = (uint16_t)cid;
     ch->remote_id = 0;
     ch->status = ChannelStatus_Opening;
@@ -688,14 +1148,20 @@ int multiplex_handler_open_channel(Multiplexer *mux, ChannelType type,
 
     va_start(ap, timeout);
     if (type == ChannelType_UDP_PortForwarding) {
-        // TODO:
+        UdpChannel *uch = (UdpChannel *)ch;
+        const struct sockaddr *addr;
+
+        uch->sock = va_arg(ap, SOCKET);
+        addr = va_arg(ap, const struct sockaddr *);
+        uch->addrlen = va_arg(ap, socklen_t);
+        memcpy(&uch->addr, addr, uch->addrlen);
     } else if (type == ChannelType_TCP_PortForwarding) {
         TcpChannel *tch = (TcpChannel *)ch;
         tch->sock = va_arg(ap, SOCKET);
     }
     va_end(ap);
 
-    channels_put(handler->channels, ch);
+    multiplex_handler_add_channel(handler, ch);
 
     if (cookie)
         buf = flex_buffer_from(FLEX_PADDING_LEN, cookie, strlen(cookie) + 1);
@@ -704,13 +1170,14 @@ int multiplex_handler_open_channel(Multiplexer *mux, ChannelType type,
 
     rc = multiplex_handler_send_packet(handler, PacketType_ChannelOpen, type,
                                        ch->id, ch->remote_id, buf);
-    deref(ch);
-
     if (rc < 0) {
-        channels_remove(handler->channels, cid);
+        multiplex_handler_remove_channel(handler, ch);
+        deref(ch);
         return rc;
     }
 
+    deref(ch);
+
     return (int)cid;
 }
 
@@ -727,14 +1194,15 @@ static int multiplex_handler_close_channel(Multiplexer *mux, int cid)
         return IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
 
     // Remote channel id being 0 means the channel opened by local, and
-    // still not received confirmed packet from remote peer.
-    if (ch->remote_id != 0)
+    // still not received confirmed packet from remote peer. With early
+    // data the peer finds it by the local channel id.
+    if (ch->remote_id != 0 || handler->early_data)
         multiplex_handler_send_packet(handler, PacketType_ChannelClose, 0,
                                       ch->id, ch->remote_id, NULL);
 
     notify_channel_close(ch, CloseReason_Normal);
 
-    channels_remove(handler->channels, cid);
+    multiplex_handler_remove_channel(handler, ch);
     deref(ch);
 
     return 0;
@@ -744,6 +1212,7 @@ static
 int multiplex_handler_write_channel(Multiplexer *mux, int cid, FlexBuffer *buf)
 {
     MultiplexHandler *handler = HANDLER(mux);
+    uint16_t remote_id;
     Channel *ch;
     int rc;
 
@@ -758,19 +1227,19 @@ int multiplex_handler_write_channel(Multiplexer *mux, int cid, FlexBuffer *buf)
     if (!ch)
         return IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
 
-    if (ch->status != ChannelStatus_Open &&
-        ch->status != ChannelStatus_Pending) {
-        deref(ch);
-        return IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
-    }
+    // The confirmation may update it meanwhile on the transport thread.
+    remote_id = ch->remote_id;
 
-    if (ch->remote_id == 0) {
+    if (ch->status == ChannelStatus_Opening && handler->early_data) {
+        // Early data, follows the open packet on the reliable stream.
+    } else if ((ch->status != ChannelStatus_Open &&
+                ch->status != ChannelStatus_Pending) || remote_id == 0) {
         deref(ch);
         return IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE);
     }
 
     rc = multiplex_handler_send_packet(handler, PacketType_ChannelData, 0,
-                                       ch->id, ch->remote_id, buf);
+                                       ch->id, remote_id, buf);
 
     if (rc >= 0) {
         gettimeofday(&ch->local_timestamp, NULL);
@@ -853,68 +1322,74 @@ static int multiplex_handler_resume_channel(Multiplexer *mux, int cid)
     return rc;
 }
 
-static bool multiplex_handler_checkpoint(void *user_data)
+static void channel_deadline_expired(timer_heap_t *ht, timer_entry_t *entry)
 {
-    MultiplexHandler *handler = (MultiplexHandler *)user_data;
-    Channel *ch;
-
-    HashtableIterator it;
+    MultiplexHandler *handler = (MultiplexHandler *)entry->user_data;
+    Channel *ch = (Channel *)((char *)entry - offsetof(Channel, deadline));
+    Channel *cur;
     struct timeval now;
-    int interval;
     int rc;
 
-    if (!handler)
-        return false;
-
-    vlogT("Stream: %d multiplex handler Checkpoint", handler->base.stream->id);
+    /* The channel was removed while its deadline was being fired. */
+    cur = channels_get(handler->channels, ch->id);
+    if (cur != ch) {
+        if (cur)
+            deref(cur);
+        deref(ch);
+        return;
+    }
+    deref(cur);
 
-rescan:
     gettimeofday(&now, NULL);
-    channels_iterate(handler->channels, &it);
-    while (channels_iterator_has_next(&it)) {
-        rc = channels_iterator_next(&it, &ch);
 
+    /* Data timeout */
+    if (ch->timeout &&
+            timeval_elapsed_ms(&now, &ch->last_activity) >= ch->timeout * 1000L) {
+        notify_channel_close(ch, CloseReason_Timeout);
+        channels_remove(handler->channels, ch->id);
+        deref(ch);
+        return;
+    }
+
+    /* Keep-alive timeout */
+    if (timeval_elapsed_ms(&now, &ch->remote_timestamp) >= KEEPALIVE_TIMEOUT_INTERVAL) {
+        notify_channel_close(ch, CloseReason_Timeout);
+        channels_remove(handler->channels, ch->id);
+        deref(ch);
+        return;
+    }
+
+    /* Keep-alive */
+    if (timeval_elapsed_ms(&now, &ch->local_timestamp) >= KEEPALIVE_INTERVAL) {
+        rc = multiplex_handler_send_packet(handler, PacketType_ChannelKeepAlive,
+                                           0, ch->id, ch->remote_id, NULL);
         if (rc == 0)
-            break;
+            ch->local_timestamp = now;
+    }
 
-        if (rc == -1)
-            goto rescan;
-
-        /* Data timeout */
-        if (ch->timeout) {
-            interval = (int)((now.tv_sec - ch->last_activity.tv_sec) * 1000) +
-                       (int)((now.tv_usec - ch->last_activity.tv_usec) / 1000);
-            if (interval >= (ch->timeout * 1000)) {
-                notify_channel_close(ch, CloseReason_Timeout);
-                channels_iterator_remove(&it);
-                deref(ch);
-                continue;
-            }
-        }
+    /*
+     * Hand the reference held by the expired entry over to the new one,
+     * unless the channel was unscheduled meanwhile. Checked under the heap
+     * lock, which unscheduling takes too.
+     */
+    pthread_mutex_lock(&handler->deadlines_lock);
+    if (ch->deadline.id != DEADLINE_CANCELED)
+        multiplex_handler_schedule_channel(handler, ch,
+                                           channel_next_deadline(ch, &now));
+    pthread_mutex_unlock(&handler->deadlines_lock);
 
-        /* Keep-alive timeout */
-        interval = (int)((now.tv_sec - ch->remote_timestamp.tv_sec) * 1000) +
-                   (int)((now.tv_usec - ch->remote_timestamp.tv_usec) / 1000);
-        if (interval >= KEEPALIVE_TIMEOUT_INTERVAL) {
-            notify_channel_close(ch, CloseReason_Timeout);
-            channels_iterator_remove(&it);
-            deref(ch);
-            continue;
-        }
+    deref(ch);
+}
 
-        /* Keep-alive */
-        interval = (int)((now.tv_sec - ch->local_timestamp.tv_sec) * 1000) +
-                   (int)((now.tv_usec - ch->local_timestamp.tv_usec) / 1000);
-        if (interval >= KEEPALIVE_INTERVAL) {
-            rc = multiplex_handler_send_packet(handler, PacketType_ChannelKeepAlive,
-                                               0, ch->id, ch->remote_id, NULL);
+static bool multiplex_handler_checkpoint(void *user_data)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)user_data;
 
-            if (rc == 0)
-                ch->local_timestamp = now;
-        }
+    if (!handler)
+        return false;
 
-        deref(ch);
-    }
+    if (handler->deadlines)
+        timer_heap_poll(handler->deadlines, NULL);
 
     return true;
 }
@@ -926,7 +1401,8 @@ int multiplex_handler_open_portforwarding(Multiplexer *mux,
     MultiplexHandler *handler = HANDLER(mux);
 
     assert(service && *service);
-    assert(protocol == PortForwardingProtocol_TCP);
+    assert(protocol == PortForwardingProtocol_TCP ||
+           protocol == PortForwardingProtocol_UDP);
     assert(host && *host && port && *port);
 
     if (!handler->worker)
@@ -948,6 +1424,20 @@ int multiplex_handler_close_portforwarding(Multiplexer *mux, int portforwarding)
     return 0;
 }
 
+static
+bool multiplex_handler_portforwarding_stats(Multiplexer *mux,
+                        IOEXPortForwardingStatsCallback *callback, void *context)
+{
+    MultiplexHandler *handler = HANDLER(mux);
+
+    assert(callback);
+
+    if (!handler->worker)
+        return true;
+
+    return handler->worker->stats(handler->worker, callback, context);
+}
+
 static
 ssize_t multiplex_handler_write(StreamHandler *base, FlexBuffer *buf)
 {
@@ -972,12 +1462,42 @@ void multiplex_handler_on_data(StreamHandler *base, FlexBuffer *buf)
     vlogT("Stream: %d multiplex handler received %zu bytes data.",
           base->stream->id, flex_buffer_size(buf));
 
+    if (handler->broken)
+        return;
+
     if (stream_is_reliable(base->stream))
         multiplex_handler_notify_data(handler, buf);
     else
         multiplex_handler_notify_packet(handler, buf);
 }
 
+static
+void multiplex_handler_on_writable(StreamHandler *base)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)base;
+    HashtableIterator it;
+
+rewritable:
+    channels_iterate(handler->channels, &it);
+    while (channels_iterator_has_next(&it)) {
+        Channel *ch;
+        int rc;
+
+        rc = channels_iterator_next(&it, &ch);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rewritable;
+
+        notify_channel_writable(ch);
+        deref(ch);
+    }
+
+    if (base->prev->on_writable)
+        base->prev->on_writable(base->prev);
+}
+
 static
 void multiplex_handler_on_state_changed(StreamHandler *base, int state)
 {
@@ -986,6 +1506,10 @@ void multiplex_handler_on_state_changed(StreamHandler *base, int state)
     assert(base);
     assert(base->prev);
 
+    // Already reported failed on the framing error.
+    if (handler->broken)
+        return;
+
     if (state >= IOEXStreamState_closed) { //TODO:
         CloseReason reason;
 
@@ -1004,6 +1528,9 @@ void multiplex_handler_destroy(void *p)
 
     multiplex_handler_destroy_timer(handler);
 
+    if (handler->deadlines)
+        timer_heap_destroy(handler->deadlines);
+
     if (handler->worker)
         deref(handler->worker);
 
@@ -1043,6 +1570,7 @@ int multiplex_handler_create(IOEXStream *s, MultiplexHandler **handler)
     _handler->base.write = multiplex_handler_write;
     _handler->base.on_data = multiplex_handler_on_data;
     _handler->base.on_state_changed = multiplex_handler_on_state_changed;
+    _handler->base.on_writable = multiplex_handler_on_writable;
 
     _handler->mux.channel.open = multiplex_handler_open_channel;
     _handler->mux.channel.close = multiplex_handler_close_channel;
@@ -1072,6 +1600,7 @@ int multiplex_handler_create(IOEXStream *s, MultiplexHandler **handler)
     if (s->portforwarding) {
         _handler->mux.portforwarding.open = multiplex_handler_open_portforwarding;
         _handler->mux.portforwarding.close = multiplex_handler_close_portforwarding;
+        _handler->mux.portforwarding.stats = multiplex_handler_portforwarding_stats;
 
         rc = portforwarding_worker_create(_handler, &_handler->worker);
         if (rc < 0) {
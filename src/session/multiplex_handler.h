@@ -29,10 +29,12 @@
 #include <linkedhashtable.h>
 #include <linkedlist.h>
 #include <ids_heap.h>
+#include <timerheap.h>
 
 #include "bitset.h"
 #include "socket.h"
 #include "flex_buffer.h"
+#include "fdset.h"
 #include "session.h"
 #include "IOEX_session.h"
 
@@ -70,6 +72,8 @@ typedef struct ChannelCallbacks {
     bool (*channel_data)   (Channel *ch, FlexBuffer *buf, void *context);
     void (*channel_pending)(Channel *ch, void *context);
     void (*channel_resume) (Channel *ch, void *context);
+    /* The stream has room again after running low */
+    void (*channel_writable)(Channel *ch, void *context);
 
     void *context;
 } ChannelCallbacks;
@@ -89,6 +93,8 @@ struct Multiplexer {
         int (*open)  (Multiplexer *, const char *service, int protocol,
                       const char *host, const char *port);
         int (*close) (Multiplexer *, int portforwarding);
+        bool (*stats)(Multiplexer *, IOEXPortForwardingStatsCallback *callback,
+                      void *context);
     } portforwarding;
 };
 
@@ -105,6 +111,24 @@ typedef struct MultiplexHandler {
 
     Timer *timer;
 
+    /* Per-channel keepalive and idle deadlines, polled by timer */
+    timer_heap_t *deadlines;
+    pthread_mutex_t deadlines_lock;
+
+    /* Use the compact (v2) protocol header, negotiated through SDP */
+    bool compact;
+
+    /*
+     * Channel data may be sent before the open confirmation, negotiated
+     * through SDP. The peer then addresses it by its own channel id, and
+     * early_channels maps that id to the local one.
+     */
+    bool early_data;
+    uint16_t early_channels[MAX_CHANNEL_ID + 1];
+
+    /* The byte stream lost its framing, data after is dropped */
+    bool broken;
+
     FlexBuffer incomplete_buf;
     char __buffer[0];
 } MultiplexHandler;
@@ -133,19 +157,88 @@ struct Channel {
 
     int timeout;
 
+    timer_entry_t deadline;
+
     HashEntry he;
 };
 
+/*
+ * Portforwarding accounting of a channel, to the counters of the service
+ * or portforwarding owning them. The owner is referenced.
+ */
+typedef struct ChannelAccounting {
+    struct PortForwardingCounters *counters;
+    void *owner;
+    struct timeval started;
+    /* Accepted by a portforwarding, otherwise connected to a service */
+    bool accepted;
+    /* A connection once used, pre-opened channels are not until then */
+    bool counted;
+    bool responded;
+} ChannelAccounting;
+
+/* Data for the local socket it has not accepted yet */
+typedef struct SendChunk {
+    struct SendChunk *next;
+    size_t len;
+    size_t offset;
+    char data[0];
+} SendChunk;
+
 typedef struct TcpChannel {
     Channel base;
     SOCKET sock;
+    FdSetEntry fde;
+
+    /* Whether the peer lets the local socket be read */
+    bool reading;
+    /* Not read until the stream has room for a frame again */
+    bool blocked;
+    /* Connecting to the service, data is queued until connected */
+    bool connecting;
+    /* Pre-opened, without a local socket yet */
+    bool idle;
+    bool closed;
+
+    pthread_mutex_t sendq_lock;
+    SendChunk *sendq_head;
+    SendChunk *sendq_tail;
+    size_t sendq_len;
+    /* Peer pended by the send queue reaching its high water mark */
+    bool sendq_pended;
+
+    ChannelAccounting acct;
 } TcpChannel;
 
 typedef struct UdpChannel {
     Channel base;
+    SOCKET sock;
+    FdSetEntry fde;
 
+    /*
+     * Portforwarding the flow was accepted by, sending from its socket to
+     * addr. NULL on the service side, where the socket is connected.
+     */
+    struct PortForwarding *pf;
     struct sockaddr_storage addr;
     socklen_t addrlen;
+    HashEntry flow_he;
+
+    pthread_mutex_t lock;
+    /* Datagrams read before the channel is opened */
+    SendChunk *pending_head;
+    SendChunk *pending_tail;
+    int pending_cnt;
+    bool opened;
+    bool closed;
+    /* When the flow was accepted, bounds the wait for the open */
+    struct timeval accepted;
+
+    /* Under the lock, as datagrams are read and written on two threads */
+    struct timeval last_active;
+    /* Idle deadline in the heap of the portforwarding worker */
+    timer_entry_t flow_deadline;
+    ChannelAccounting acct;
 } UdpChannel;
 
 void multiplex_handler_set_channel_callbacks(MultiplexHandler *handler,
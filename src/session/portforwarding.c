@@ -21,9 +21,12 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #ifdef __linux__
 #include <sys/eventfd.h>
@@ -43,62 +46,306 @@
 #include "multiplex_handler.h"
 #include "portforwardings.h"
 #include "portforwarding.h"
+#include "udpflows.h"
+
+#define LOOP_WAIT_TIMEOUT               5000 /* 5 seconds */
+
+/*
+ * Bounds of the data queued for a local socket: the peer is pended at the
+ * high water mark and resumed below the low one. Data still in flight when
+ * pended may exceed the high mark, up to the hard limit.
+ */
+#define SENDQ_HIGH_WATER                (256 * 1024)
+#define SENDQ_LOW_WATER                 (64 * 1024)
+#define SENDQ_MAX_LEN                   (4 * SENDQ_HIGH_WATER)
+
+/* Datagrams of a new UDP flow held until its channel is opened */
+#define UDP_PENDING_MAX                 8
+
+/*
+ * The open of a flow is not retransmitted over an unreliable stream, a flow
+ * still not opened by then is closed rather than dropping all it gets.
+ */
+#define UDP_FLOW_OPEN_TIMEOUT           10000 /* 10 seconds */
+
+#define UDP_FLOW_SWEEP_INTERVAL         5000 /* 5 seconds */
+#define UDP_FLOW_SWEEP_MAX              64
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                    0
+#endif
+
+/* Owners of the sockets registered to the loop fdset */
+enum {
+    FdSetEntry_Channel = 1,
+    FdSetEntry_PortForwarding
+};
+
+/* Upper bounds of the first byte latency buckets, in milliseconds */
+static const long latency_bounds[IOEX_PORTFORWARDING_LATENCY_BUCKETS - 1] = {
+    1, 5, 10, 50, 100, 500, 1000
+};
+
+static inline void counter_add(uint64_t *counter, uint64_t value)
+{
+    __sync_add_and_fetch(counter, value);
+}
 
 static
-bool tcp_portforwarding_channel_open(Channel *ch, const char *cookie,
-                                     void *context)
+void channel_accounting_init(ChannelAccounting *acct, void *owner,
+                             PortForwardingCounters *counters, bool accepted)
+{
+    if (acct->owner)
+        return;
+
+    acct->owner = ref(owner);
+    acct->counters = counters;
+    acct->accepted = accepted;
+}
+
+/* Called with the channel locked, on the first use of the connection. */
+static void channel_accounting_begin(ChannelAccounting *acct)
+{
+    if (!acct->owner || acct->counted)
+        return;
+
+    acct->counted = true;
+    gettimeofday(&acct->started, NULL);
+
+    counter_add(&acct->counters->connections, 1);
+    counter_add(&acct->counters->active_connections, 1);
+}
+
+static
+void channel_accounting_start(ChannelAccounting *acct, void *owner,
+                              PortForwardingCounters *counters, bool accepted)
+{
+    channel_accounting_init(acct, owner, counters, accepted);
+    channel_accounting_begin(acct);
+}
+
+static void channel_accounting_respond(ChannelAccounting *acct)
+{
+    struct timeval now;
+    long elapsed;
+    int i;
+
+    acct->responded = true;
+
+    gettimeofday(&now, NULL);
+    elapsed = (long)(now.tv_sec - acct->started.tv_sec) * 1000 +
+              (long)(now.tv_usec - acct->started.tv_usec) / 1000;
+
+    for (i = 0; i < IOEX_PORTFORWARDING_LATENCY_BUCKETS - 1; i++) {
+        if (elapsed < latency_bounds[i])
+            break;
+    }
+
+    counter_add(&acct->counters->first_byte_latency[i], 1);
+}
+
+/* Read from the local socket, the response of a service connected to. */
+static inline void channel_accounting_sent(ChannelAccounting *acct, size_t bytes)
+{
+    if (!acct->counted)
+        return;
+
+    counter_add(&acct->counters->bytes_sent, bytes);
+    if (!acct->accepted && !acct->responded)
+        channel_accounting_respond(acct);
+}
+
+/* For the local socket, the response to a connection accepted. */
+static inline
+void channel_accounting_received(ChannelAccounting *acct, size_t bytes)
+{
+    if (!acct->counted)
+        return;
+
+    counter_add(&acct->counters->bytes_received, bytes);
+    if (acct->accepted && !acct->responded)
+        channel_accounting_respond(acct);
+}
+
+static inline void channel_accounting_fail(ChannelAccounting *acct)
+{
+    if (acct->counted)
+        counter_add(&acct->counters->failed_connections, 1);
+}
+
+void portforwarding_counters_read(PortForwardingCounters *counters,
+                                  IOEXPortForwardingStats *stats)
+{
+    int i;
+
+    stats->connections = __sync_add_and_fetch(&counters->connections, 0);
+    stats->failed_connections =
+                __sync_add_and_fetch(&counters->failed_connections, 0);
+    stats->active_connections =
+                __sync_add_and_fetch(&counters->active_connections, 0);
+    stats->bytes_sent = __sync_add_and_fetch(&counters->bytes_sent, 0);
+    stats->bytes_received = __sync_add_and_fetch(&counters->bytes_received, 0);
+
+    for (i = 0; i < IOEX_PORTFORWARDING_LATENCY_BUCKETS; i++)
+        stats->first_byte_latency[i] =
+                __sync_add_and_fetch(&counters->first_byte_latency[i], 0);
+}
+
+static inline bool socket_would_block(void)
+{
+    int error = socket_errno();
+
+    return error == EAGAIN || error == EWOULDBLOCK;
+}
+
+/* Called with the send queue locked. */
+static
+void tcp_channel_update_events(MultiplexHandler *handler, TcpChannel *tch)
+{
+    int events = 0;
+
+    if (!tch->fde.added)
+        return;
+
+    // Writable once connected, or on the connection failure.
+    if (tch->connecting)
+        events = FDSET_WRITE;
+    else {
+        if (tch->reading && !tch->blocked)
+            events |= FDSET_READ;
+        if (tch->sendq_head)
+            events |= FDSET_WRITE;
+    }
+
+    fdset_modify(&handler->worker->loop->fdset, tch->sock, &tch->fde, events);
+}
+
+/*
+ * Called with the send queue locked. Starts reading the local socket,
+ * once the channel has one and is opened, or is opening with early data.
+ */
+static
+void tcp_channel_watch(MultiplexHandler *handler, TcpChannel *tch)
+{
+    if (tch->closed || tch->sock == INVALID_SOCKET || tch->fde.added)
+        return;
+
+    tch->reading = true;
+    fdset_add(&handler->worker->loop->fdset, tch->sock, &tch->fde,
+              FdSetEntry_Channel, tch, handler);
+    tcp_channel_update_events(handler, tch);
+}
+
+/*
+ * Called with the send queue locked. Sends queued data until the socket
+ * is full, returns -1 on socket error.
+ */
+static int tcp_channel_flush(TcpChannel *tch)
+{
+    SendChunk *chunk;
+    ssize_t rc;
+
+    while ((chunk = tch->sendq_head) != NULL) {
+        rc = send(tch->sock, chunk->data + chunk->offset,
+                  chunk->len - chunk->offset, MSG_NOSIGNAL);
+        if (rc < 0)
+            return socket_would_block() ? 0 : -1;
+
+        chunk->offset += rc;
+        tch->sendq_len -= rc;
+
+        if (chunk->offset < chunk->len)
+            return 0;
+
+        tch->sendq_head = chunk->next;
+        if (!tch->sendq_head)
+            tch->sendq_tail = NULL;
+
+        free(chunk);
+    }
+
+    return 0;
+}
+
+static
+Service *portforwarding_get_service(MultiplexHandler *handler, Channel *ch,
+                                    const char *cookie, int protocol)
 {
-    MultiplexHandler *handler = (MultiplexHandler *)context;
     IOEXStream *s = handler->base.stream;
     Hashtable *services;
     Service *svc;
-    SOCKET sock;
-
-    assert(handler);
-    assert(ch);
-    assert(ch->type == ChannelType_TCP_PortForwarding);
-    assert(cookie && *cookie);
 
     if (!cookie) {
         vlogE("Stream: %d portforwarding channel %d open missing cookie.",
               s->id, ch->id);
-        return false;
+        return NULL;
     }
 
     services = s->session->portforwarding.services;
     if (!services) {
         vlogE("Stream: %d portforwarding channel has no services supplied.",
               s->id);
-        return false;
+        return NULL;
     }
 
     svc = services_get(services, cookie);
     if (!svc) {
         vlogE("Stream: %d portforwarding channel with unknown service %s.",
               s->id, cookie);
-        return false;
+        return NULL;
     }
 
-    if (svc->protocol != PortForwardingProtocol_TCP) {
+    if (svc->protocol != protocol) {
+        vlogE("Stream: %d portforwarding channel open with service %s(%d) "
+              "of other protocol.", s->id, cookie, svc->protocol);
         deref(svc);
-        vlogE("Stream: %d portforwarding channel open with non-TCP "
-              "service %s(%d).", s->id, cookie, svc->protocol);
-        return false;
+        return NULL;
     }
 
-    sock = socket_connect(svc->host, svc->port);
-    deref(svc);
+    return svc;
+}
+
+static
+bool tcp_portforwarding_channel_open(Channel *ch, const char *cookie,
+                                     void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    IOEXStream *s = handler->base.stream;
+    Service *svc;
+    SOCKET sock;
+
+    assert(handler);
+    assert(ch);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+    assert(cookie && *cookie);
+
+    svc = portforwarding_get_service(handler, ch, cookie,
+                                     PortForwardingProtocol_TCP);
+    if (!svc)
+        return false;
+
+    // Confirmed without waiting, the data meanwhile is queued.
+    sock = socket_connect_nonblock(svc->host, svc->port);
 
     if (sock == INVALID_SOCKET) {
+        counter_add(&svc->counters.failed_connections, 1);
+        deref(svc);
         vlogE("Stream: %d portforwarding channel %d can not connect to"
               " service %s.", s->id, ch->id, cookie);
         return false;
     } else {
-        vlogD("Stream: %d portforwarding channel %d connect to service %s.",
+        vlogD("Stream: %d portforwarding channel %d connecting to service %s.",
               s->id, ch->id, cookie);
     }
 
     ((TcpChannel *)ch)->sock = sock;
+    ((TcpChannel *)ch)->connecting = true;
+
+    // The peer may be keeping the channel idle for a connection to come,
+    // it is counted once data goes either way.
+    channel_accounting_init(&((TcpChannel *)ch)->acct, svc, &svc->counters,
+                            false);
+    deref(svc);
 
     return true;
 }
@@ -106,6 +353,7 @@ bool tcp_portforwarding_channel_open(Channel *ch, const char *cookie,
 static void tcp_portforwarding_channel_opened(Channel *ch, void *context)
 {
     MultiplexHandler *handler = (MultiplexHandler *)context;
+    TcpChannel *tch = (TcpChannel *)ch;
 
     assert(handler);
     assert(handler->worker);
@@ -115,7 +363,11 @@ static void tcp_portforwarding_channel_opened(Channel *ch, void *context)
     vlogD("Stream: %d portforwarding channel %d opened.",
           handler->base.stream->id, ch->id);
 
-    fdset_add_socket(&handler->worker->fdset, ((TcpChannel *)ch)->sock);
+    // Watched already when opening with early data, and not at all when
+    // pre-opened without a local socket yet.
+    pthread_mutex_lock(&tch->sendq_lock);
+    tcp_channel_watch(handler, tch);
+    pthread_mutex_unlock(&tch->sendq_lock);
 }
 
 static const char *reason_names[] = {
@@ -131,260 +383,1378 @@ void tcp_portforwarding_channel_close(Channel *ch, CloseReason reason,
     MultiplexHandler *handler = (MultiplexHandler *)context;
     TcpChannel *tch = (TcpChannel *)ch;
 
-    assert(handler);
-    assert(handler->worker);
-    assert(ch);
-    assert(ch->type == ChannelType_TCP_PortForwarding);
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+
+    vlogD("Stream: %d portforwarding channel %d closed with %s.",
+          handler->base.stream->id, ch->id, reason_names[reason]);
+
+    pthread_mutex_lock(&tch->sendq_lock);
+    tch->closed = true;
+    if (reason != CloseReason_Normal)
+        channel_accounting_fail(&tch->acct);
+    if (tch->fde.added)
+        fdset_remove(&handler->worker->loop->fdset, tch->sock, &tch->fde);
+    pthread_mutex_unlock(&tch->sendq_lock);
+
+    if (tch->sock != INVALID_SOCKET)
+        socket_close(tch->sock);
+}
+
+/*
+ * Runs on the transport thread, so the local socket is never waited on:
+ * what it does not accept now is queued and sent once it is writable.
+ */
+static
+bool tcp_portforwarding_channel_data(Channel *ch, FlexBuffer *buf, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    TcpChannel *tch = (TcpChannel *)ch;
+    SendChunk *chunk;
+    char addr[SOCKET_ADDR_MAX_LEN];
+    size_t len = flex_buffer_size(buf);
+    bool pend = false;
+
+    assert(ch);
+    assert(handler->worker);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+    assert(buf && flex_buffer_size(buf));
+
+    if (!buf || !flex_buffer_size(buf))
+        return true;
+
+    pthread_mutex_lock(&tch->sendq_lock);
+
+    channel_accounting_begin(&tch->acct);
+    channel_accounting_received(&tch->acct, len);
+
+    // Send directly unless earlier data is still queued, or the local
+    // socket is not connected or attached yet.
+    while (!tch->sendq_head && !tch->connecting &&
+           tch->sock != INVALID_SOCKET && flex_buffer_size(buf) > 0) {
+        ssize_t rc;
+
+        rc = send(tch->sock, flex_buffer_ptr(buf), flex_buffer_size(buf),
+                  MSG_NOSIGNAL);
+        if (rc < 0 && socket_would_block())
+            break;
+
+        if (rc <= 0) {
+            pthread_mutex_unlock(&tch->sendq_lock);
+            vlogE("Stream: %d portwarding channel %d send to %s error %d.",
+                  handler->base.stream->id, ch->id,
+                  socket_remote_name(tch->sock, addr, sizeof(addr)),
+                  socket_errno());
+            return false;
+        }
+
+        flex_buffer_forward_offset(buf, rc);
+    }
+
+    if (flex_buffer_size(buf) > 0) {
+        if (tch->sendq_len + flex_buffer_size(buf) > SENDQ_MAX_LEN) {
+            pthread_mutex_unlock(&tch->sendq_lock);
+            vlogE("Stream: %d portwarding channel %d send queue overflow.",
+                  handler->base.stream->id, ch->id);
+            return false;
+        }
+
+        chunk = (SendChunk *)malloc(sizeof(SendChunk) + flex_buffer_size(buf));
+        if (!chunk) {
+            pthread_mutex_unlock(&tch->sendq_lock);
+            vlogE("Stream: %d portwarding channel %d out of memory.",
+                  handler->base.stream->id, ch->id);
+            return false;
+        }
+
+        chunk->next = NULL;
+        chunk->len = flex_buffer_size(buf);
+        chunk->offset = 0;
+        memcpy(chunk->data, flex_buffer_ptr(buf), chunk->len);
+
+        if (tch->sendq_tail) {
+            tch->sendq_tail->next = chunk;
+        } else {
+            tch->sendq_head = chunk;
+            tcp_channel_update_events(handler, tch);
+        }
+
+        tch->sendq_tail = chunk;
+        tch->sendq_len += chunk->len;
+
+        if (!tch->sendq_pended && tch->sendq_len >= SENDQ_HIGH_WATER) {
+            tch->sendq_pended = true;
+            pend = true;
+        }
+    }
+
+    pthread_mutex_unlock(&tch->sendq_lock);
+
+    if (pend) {
+        vlogD("Stream: %d portforwarding channel %d send queue full, pend peer.",
+              handler->base.stream->id, ch->id);
+        handler->mux.channel.pend(&handler->mux, ch->id);
+    }
+
+    vlogT("Stream: %d portforwarding channel %d send %zu bytes.",
+           handler->base.stream->id, ch->id, len);
+
+    return true;
+}
+
+static
+void tcp_portforwarding_channel_pending(Channel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    TcpChannel *tch = (TcpChannel *)ch;
+
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+
+    // Stop reading only, queued data is still sent to the local socket.
+    pthread_mutex_lock(&tch->sendq_lock);
+    tch->reading = false;
+    tcp_channel_update_events(handler, tch);
+    pthread_mutex_unlock(&tch->sendq_lock);
+}
+
+static
+void tcp_portforwarding_channel_resume(Channel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    TcpChannel *tch = (TcpChannel *)ch;
+
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+
+    pthread_mutex_lock(&tch->sendq_lock);
+    tch->reading = true;
+    tcp_channel_update_events(handler, tch);
+    pthread_mutex_unlock(&tch->sendq_lock);
+}
+
+static
+void tcp_portforwarding_channel_writable(Channel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    TcpChannel *tch = (TcpChannel *)ch;
+
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_TCP_PortForwarding);
+
+    pthread_mutex_lock(&tch->sendq_lock);
+    if (tch->blocked) {
+        tch->blocked = false;
+        tcp_channel_update_events(handler, tch);
+    }
+    pthread_mutex_unlock(&tch->sendq_lock);
+}
+
+static ChannelCallbacks tcp_portforwarding_callbacks = {
+    .channel_open = tcp_portforwarding_channel_open,
+    .channel_opened = tcp_portforwarding_channel_opened,
+    .channel_data = tcp_portforwarding_channel_data,
+    .channel_pending = tcp_portforwarding_channel_pending,
+    .channel_resume = tcp_portforwarding_channel_resume,
+    .channel_writable = tcp_portforwarding_channel_writable,
+    .channel_close = tcp_portforwarding_channel_close,
+    .context = NULL
+};
+
+/*
+ * Gets the number of segments the reliable transport takes without waiting.
+ * With no room for one, the channel stops reading rather than waiting in
+ * the write on the loop shared with other sessions, until the transport
+ * has room again. The room is checked again once blocked, so the writable
+ * call back coming in meanwhile is not missed.
+ */
+static
+int tcp_channel_send_room(MultiplexHandler *handler, TcpChannel *ch)
+{
+    StreamHandler *next = handler->base.next;
+    int nsegs;
+
+    if (!next->send_space)
+        return PORTFORWARDING_RX_SEGMENTS;
+
+    nsegs = (int)(next->send_space(next) / PORTFORWARDING_RX_SEGMENT_LEN);
+    if (nsegs == 0) {
+        pthread_mutex_lock(&ch->sendq_lock);
+        ch->blocked = true;
+        tcp_channel_update_events(handler, ch);
+        pthread_mutex_unlock(&ch->sendq_lock);
+
+        nsegs = (int)(next->send_space(next) / PORTFORWARDING_RX_SEGMENT_LEN);
+        if (nsegs > 0)
+            tcp_portforwarding_channel_writable(&ch->base, handler);
+    }
+
+    return nsegs < PORTFORWARDING_RX_SEGMENTS ? nsegs :
+                                                PORTFORWARDING_RX_SEGMENTS;
+}
+
+/*
+ * Reads as much as the reliable transport takes without waiting by one
+ * readv into the loop segments, then sends each segment as a frame in
+ * place. Edge triggered readiness is reported only once, so the socket is
+ * read until drained, or until the channel is pended or closed meanwhile.
+ */
+static
+void handle_tcp_portforwarding_channel_read(TcpChannel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    PortForwardingLoop *loop = handler->worker->loop;
+    struct iovec iov[PORTFORWARDING_RX_SEGMENTS];
+    FlexBuffer frame;
+    ssize_t bytes;
+    ssize_t left;
+    size_t len;
+    int nsegs;
+    int rc;
+    int i;
+
+    do {
+        nsegs = tcp_channel_send_room(handler, ch);
+        if (nsegs == 0)
+            break;
+
+        for (i = 0; i < nsegs; i++) {
+            iov[i].iov_base = loop->rx_segments[i] + FLEX_PADDING_LEN;
+            iov[i].iov_len = IOEX_MAX_USER_DATA_LEN;
+        }
+
+        bytes = readv(ch->sock, iov, nsegs);
+        if (bytes < 0 && socket_would_block())
+            break;
+
+        if (bytes <= 0) {
+            // Channel socket closed.
+            // TODO: Error close
+            if (bytes < 0)
+                channel_accounting_fail(&ch->acct);
+            handler->mux.channel.close(&handler->mux, ch->base.id);
+            break;
+        }
+
+        if (!ch->acct.counted) {
+            pthread_mutex_lock(&ch->sendq_lock);
+            channel_accounting_begin(&ch->acct);
+            pthread_mutex_unlock(&ch->sendq_lock);
+        }
+        channel_accounting_sent(&ch->acct, bytes);
+
+        for (i = 0, left = bytes; left > 0; i++, left -= len) {
+            len = left < IOEX_MAX_USER_DATA_LEN ? left : IOEX_MAX_USER_DATA_LEN;
+
+            flex_buffer_init(&frame, loop->rx_segments[i],
+                             PORTFORWARDING_RX_SEGMENT_LEN, FLEX_PADDING_LEN);
+            flex_buffer_set_size(&frame, len);
+
+            rc = handler->mux.channel.write(&handler->mux, ch->base.id, &frame);
+            if (rc < 0) {
+                // The data read is lost, the forwarded stream can't go on.
+                vlogE("Stream: %d portforwarding channel %d write error (0x%x).",
+                      handler->base.stream->id, ch->base.id, rc);
+                channel_accounting_fail(&ch->acct);
+                handler->mux.channel.close(&handler->mux, ch->base.id);
+                return;
+            }
+        }
+
+        // Short read, the socket is drained and new data raises a new edge.
+        if (bytes < (ssize_t)nsegs * IOEX_MAX_USER_DATA_LEN)
+            break;
+    } while (FDSET_EDGE_TRIGGERED && ch->reading && ch->fde.added);
+}
+
+static
+void handle_tcp_portforwarding_channel_write(TcpChannel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    bool resume = false;
+    bool connected = false;
+    int rc;
+
+    pthread_mutex_lock(&ch->sendq_lock);
+
+    if (ch->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        rc = getsockopt(ch->sock, SOL_SOCKET, SO_ERROR, (void *)&error, &len);
+        if (rc < 0 || error != 0) {
+            channel_accounting_fail(&ch->acct);
+            pthread_mutex_unlock(&ch->sendq_lock);
+            vlogE("Stream: %d portwarding channel %d connect to service "
+                  "error %d.", handler->base.stream->id, ch->base.id,
+                  rc < 0 ? socket_errno() : error);
+            handler->mux.channel.close(&handler->mux, ch->base.id);
+            return;
+        }
+
+        ch->connecting = false;
+        connected = true;
+    }
+
+    rc = tcp_channel_flush(ch);
+    if (rc == 0) {
+        if (!ch->sendq_head || connected)
+            tcp_channel_update_events(handler, ch);
+
+        if (ch->sendq_pended && ch->sendq_len <= SENDQ_LOW_WATER) {
+            ch->sendq_pended = false;
+            resume = true;
+        }
+    }
+
+    pthread_mutex_unlock(&ch->sendq_lock);
+
+    if (rc < 0) {
+        vlogE("Stream: %d portwarding channel %d send error %d.",
+              handler->base.stream->id, ch->base.id, socket_errno());
+        handler->mux.channel.close(&handler->mux, ch->base.id);
+        return;
+    }
+
+    if (resume) {
+        vlogD("Stream: %d portforwarding channel %d send queue drained, "
+              "resume peer.", handler->base.stream->id, ch->base.id);
+        handler->mux.channel.resume(&handler->mux, ch->base.id);
+    }
+}
+
+/*
+ * Accounts the connection accepted on its channel, and starts reading it
+ * when opened, or opening with early data. Otherwise it is watched once
+ * the channel is opened.
+ */
+static
+void portforwarding_accepted(MultiplexHandler *handler, PortForwarding *pf,
+                             int cid)
+{
+    TcpChannel *tch;
+
+    tch = (TcpChannel *)channels_get(handler->channels, cid);
+    if (!tch)
+        return;
+
+    pthread_mutex_lock(&tch->sendq_lock);
+    channel_accounting_start(&tch->acct, pf, &pf->counters, true);
+    if (tch->base.status != ChannelStatus_Opening || handler->early_data)
+        tcp_channel_watch(handler, tch);
+    pthread_mutex_unlock(&tch->sendq_lock);
+
+    deref(tch);
+}
+
+/*
+ * Keeps channels opened ahead for the portforwarding, so a connection
+ * accepted has the peer connected to the service already. The slots are
+ * reserved under the lock and the channels opened without it, as the open
+ * sends to the stream.
+ */
+static
+void portforwarding_fill_idle_channels(MultiplexHandler *handler,
+                                       PortForwarding *pf)
+{
+    TcpChannel *tch;
+    int cid;
+
+    for (;;) {
+        pthread_mutex_lock(&pf->lock);
+        if (pf->nidle + pf->nopening >= PORTFORWARDING_IDLE_CHANNELS) {
+            pthread_mutex_unlock(&pf->lock);
+            break;
+        }
+        pf->nopening++;
+        pthread_mutex_unlock(&pf->lock);
+
+        cid = handler->mux.channel.open(&handler->mux,
+                        ChannelType_TCP_PortForwarding, pf->service, 0,
+                        INVALID_SOCKET);
+        if (cid > 0) {
+            tch = (TcpChannel *)channels_get(handler->channels, cid);
+            if (tch) {
+                pthread_mutex_lock(&tch->sendq_lock);
+                tch->idle = !tch->closed;
+                pthread_mutex_unlock(&tch->sendq_lock);
+                deref(tch);
+            } else {
+                cid = 0;
+            }
+        }
+
+        pthread_mutex_lock(&pf->lock);
+        pf->nopening--;
+        if (cid > 0) {
+            gettimeofday(&pf->idle_since[pf->nidle], NULL);
+            pf->idle_channels[pf->nidle++] = cid;
+        }
+        pthread_mutex_unlock(&pf->lock);
+
+        if (cid <= 0)
+            break;
+    }
+}
+
+/* Returns the idle channel the socket is attached to, or 0 if none. */
+static
+int portforwarding_take_idle_channel(MultiplexHandler *handler,
+                                     PortForwarding *pf, SOCKET sock)
+{
+    TcpChannel *tch;
+    int cid = 0;
+
+    pthread_mutex_lock(&pf->lock);
+
+    while (!cid && pf->nidle > 0) {
+        cid = pf->idle_channels[--pf->nidle];
+
+        // The peer may have closed it meanwhile, and its id been reused.
+        tch = (TcpChannel *)channels_get(handler->channels, cid);
+        if (!tch || tch->base.type != ChannelType_TCP_PortForwarding) {
+            if (tch)
+                deref(tch);
+            cid = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&tch->sendq_lock);
+        if (tch->idle && !tch->closed) {
+            tch->idle = false;
+            tch->sock = sock;
+        } else {
+            cid = 0;
+        }
+        pthread_mutex_unlock(&tch->sendq_lock);
+
+        deref(tch);
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+
+    return cid;
+}
+
+static
+void handle_tcp_portofrwarding(PortForwarding *pf, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    SOCKET sock;
+    int cid;
+
+    do {
+        sock = accept(pf->sock, NULL, NULL);
+        if (sock < 0) {
+            if (!socket_would_block())
+                vlogE("Stream: %d portforwarding accept error.",
+                      handler->base.stream->id);
+            return;
+        }
+
+        // Never block the transport thread, nor the shared loop.
+        if (socket_set_nonblock(sock) < 0) {
+            vlogE("Stream: %d portforwarding set non-blocking error:%d.",
+                  handler->base.stream->id, socket_errno());
+            socket_close(sock);
+            continue;
+        }
+
+        cid = portforwarding_take_idle_channel(handler, pf, sock);
+        if (cid > 0) {
+            vlogD("Stream: %d portforwarding take idle channel %d for new "
+                  "TCP connection.", handler->base.stream->id, cid);
+        } else {
+            cid = handler->mux.channel.open(&handler->mux,
+                            ChannelType_TCP_PortForwarding, pf->service, 0,
+                            sock);
+            if (cid <= 0) {
+                vlogE("Stream: %d portforwarding create channel for new TCP connection failed.",
+                      handler->base.stream->id);
+                counter_add(&pf->counters.failed_connections, 1);
+                socket_close(sock);
+                continue;
+            }
+
+            vlogD("Stream: %d portforwarding create channel %d for new TCP connection.",
+                  handler->base.stream->id, cid);
+        }
+
+        pthread_mutex_lock(&pf->lock);
+        gettimeofday(&pf->last_accepted, NULL);
+        pthread_mutex_unlock(&pf->lock);
+
+        // Data is sent right behind the open packet with early data.
+        portforwarding_accepted(handler, pf, cid);
+        portforwarding_fill_idle_channels(handler, pf);
+    } while (FDSET_EDGE_TRIGGERED && pf->fde.added);
+}
+
+/* Called with the lock of the flow held. */
+static inline void udp_channel_touch(UdpChannel *uch)
+{
+    gettimeofday(&uch->last_active, NULL);
+}
+
+static void udp_flow_deadline_expired(timer_heap_t *ht, timer_entry_t *entry);
+
+/* Entry id of a flow deadline unscheduled, never to be scheduled again */
+#define FLOW_DEADLINE_CANCELED  (-1)
+
+/*
+ * The deadline entry holds a reference to the flow while it is in the heap.
+ * Datagrams only touch the flow, the entry is moved forward lazily when it
+ * expires.
+ */
+static
+void udp_flow_schedule(PortForwardingWorker *worker, UdpChannel *uch,
+                       long delay)
+{
+    time_val_t tv;
+
+    if (!worker->flow_deadlines)
+        return;
+
+    tv.sec = delay / 1000;
+    tv.msec = delay % 1000;
+
+    ref(uch);
+    if (timer_heap_schedule(worker->flow_deadlines, &uch->flow_deadline,
+                            &tv) != 0)
+        deref(uch);
+}
+
+static inline
+void udp_flow_unschedule(PortForwardingWorker *worker, UdpChannel *uch)
+{
+    if (worker->flow_deadlines &&
+        timer_heap_cancel_if_active(worker->flow_deadlines,
+                                    &uch->flow_deadline,
+                                    FLOW_DEADLINE_CANCELED) == 1)
+        deref(uch);
+}
+
+/* Called with the lock of the flow held, once the flow is set up. */
+static inline
+void udp_flow_start(PortForwardingWorker *worker, UdpChannel *uch)
+{
+    timer_entry_init(&uch->flow_deadline, uch->base.id, worker,
+                     udp_flow_deadline_expired);
+    udp_flow_schedule(worker, uch, uch->pf ? UDP_FLOW_OPEN_TIMEOUT :
+                                   IOEX_UDP_FLOW_IDLE_TIMEOUT * 1000L);
+}
+
+/*
+ * Service side of a flow: the datagrams from the peer are sent through a
+ * socket connected to the service, and its replies read back from it.
+ */
+static
+bool udp_portforwarding_channel_open(Channel *ch, const char *cookie,
+                                     void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    UdpChannel *uch = (UdpChannel *)ch;
+    IOEXStream *s = handler->base.stream;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    Service *svc;
+    SOCKET sock;
+    int rc;
+
+    assert(handler);
+    assert(ch);
+    assert(ch->type == ChannelType_UDP_PortForwarding);
+
+    svc = portforwarding_get_service(handler, ch, cookie,
+                                     PortForwardingProtocol_UDP);
+    if (!svc)
+        return false;
+
+    rc = socket_addr_from_name(svc->host, svc->port, SOCK_DGRAM,
+                               (struct sockaddr *)&addr, &addrlen);
+    if (rc != 0) {
+        counter_add(&svc->counters.failed_connections, 1);
+        deref(svc);
+        vlogE("Stream: %d portforwarding channel %d can not resolve"
+              " service %s.", s->id, ch->id, cookie);
+        return false;
+    }
+
+    sock = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET ||
+            connect(sock, (struct sockaddr *)&addr, addrlen) != 0 ||
+            socket_set_nonblock(sock) < 0) {
+        vlogE("Stream: %d portforwarding channel %d can not connect to"
+              " service %s (%d).", s->id, ch->id, cookie, socket_errno());
+        if (sock != INVALID_SOCKET)
+            socket_close(sock);
+        counter_add(&svc->counters.failed_connections, 1);
+        deref(svc);
+        return false;
+    }
+
+    vlogD("Stream: %d portforwarding channel %d connect to UDP service %s.",
+          s->id, ch->id, cookie);
+
+    uch->sock = sock;
+
+    pthread_mutex_lock(&uch->lock);
+    udp_channel_touch(uch);
+    udp_flow_start(handler->worker, uch);
+    pthread_mutex_unlock(&uch->lock);
+
+    channel_accounting_start(&uch->acct, svc, &svc->counters, false);
+    deref(svc);
+
+    return true;
+}
+
+static void udp_portforwarding_channel_opened(Channel *ch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    UdpChannel *uch = (UdpChannel *)ch;
+    SendChunk *chunk;
+    FlexBuffer buf;
+
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_UDP_PortForwarding);
+
+    vlogD("Stream: %d portforwarding channel %d opened.",
+          handler->base.stream->id, ch->id);
+
+    // Accepted flows, with a source address, are read from the socket of
+    // their portforwarding; it may not be attached to the flow yet.
+    if (!uch->addrlen)
+        fdset_add(&handler->worker->loop->fdset, uch->sock, &uch->fde,
+                  FdSetEntry_Channel, ch, handler);
+
+    // Sent under the lock to keep them ahead of the datagrams read later.
+    pthread_mutex_lock(&uch->lock);
+
+    while ((chunk = uch->pending_head) != NULL) {
+        uch->pending_head = chunk->next;
+
+        flex_buffer_init(&buf, chunk->data, chunk->len, chunk->offset);
+        flex_buffer_set_size(&buf, chunk->len - chunk->offset);
+        handler->mux.channel.write(&handler->mux, ch->id, &buf);
+
+        free(chunk);
+    }
+
+    uch->pending_tail = NULL;
+    uch->pending_cnt = 0;
+    uch->opened = true;
+
+    pthread_mutex_unlock(&uch->lock);
+}
+
+static
+void udp_portforwarding_channel_close(Channel *ch, CloseReason reason,
+                                      void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    UdpChannel *uch = (UdpChannel *)ch;
+
+    assert(handler);
+    assert(handler->worker);
+    assert(ch);
+    assert(ch->type == ChannelType_UDP_PortForwarding);
+
+    vlogD("Stream: %d portforwarding channel %d closed with %s.",
+          handler->base.stream->id, ch->id, reason_names[reason]);
+
+    pthread_mutex_lock(&uch->lock);
+    uch->closed = true;
+    if (reason != CloseReason_Normal)
+        channel_accounting_fail(&uch->acct);
+    pthread_mutex_unlock(&uch->lock);
+
+    udp_flow_unschedule(handler->worker, uch);
+
+    // The socket is closed by the channel destructor, not in use anymore.
+    if (uch->addrlen) {
+        if (uch->pf)
+            udpflows_remove(uch->pf->flows, (struct sockaddr *)&uch->addr,
+                            uch->addrlen);
+    } else if (uch->sock != INVALID_SOCKET)
+        fdset_remove(&handler->worker->loop->fdset, uch->sock, &uch->fde);
+}
+
+/*
+ * Datagrams are never waited for nor queued: what the local socket does
+ * not take right now is dropped, as on any UDP path.
+ */
+static
+bool udp_portforwarding_channel_data(Channel *ch, FlexBuffer *buf, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    UdpChannel *uch = (UdpChannel *)ch;
+    ssize_t rc;
+
+    assert(ch);
+    assert(ch->type == ChannelType_UDP_PortForwarding);
+    assert(buf);
+
+    if (!buf || !flex_buffer_size(buf))
+        return true;
+
+    if (uch->addrlen)
+        rc = sendto(uch->sock, flex_buffer_ptr(buf), flex_buffer_size(buf),
+                    MSG_NOSIGNAL, (struct sockaddr *)&uch->addr, uch->addrlen);
+    else
+        rc = send(uch->sock, flex_buffer_ptr(buf), flex_buffer_size(buf),
+                  MSG_NOSIGNAL);
+
+    if (rc < 0) {
+        int error = socket_errno();
+
+        if (!socket_would_block() && error != ENOBUFS &&
+                error != ECONNREFUSED) {
+            vlogE("Stream: %d portwarding channel %d send datagram error %d.",
+                  handler->base.stream->id, ch->id, error);
+            return false;
+        }
+
+        vlogT("Stream: %d portwarding channel %d dropped datagram (%d).",
+              handler->base.stream->id, ch->id, error);
+    }
+
+    pthread_mutex_lock(&uch->lock);
+    if (rc >= 0)
+        channel_accounting_received(&uch->acct, (size_t)rc);
+    udp_channel_touch(uch);
+    pthread_mutex_unlock(&uch->lock);
+
+    return true;
+}
+
+static ChannelCallbacks udp_portforwarding_callbacks = {
+    .channel_open = udp_portforwarding_channel_open,
+    .channel_opened = udp_portforwarding_channel_opened,
+    .channel_data = udp_portforwarding_channel_data,
+    .channel_close = udp_portforwarding_channel_close,
+    .context = NULL
+};
+
+/* Forward a datagram read into a loop segment over the channel of its flow. */
+static
+void udp_channel_forward(MultiplexHandler *handler, UdpChannel *uch,
+                         FlexBuffer *buf)
+{
+    SendChunk *chunk;
+    size_t len = flex_buffer_size(buf);
+
+    pthread_mutex_lock(&uch->lock);
+
+    if (uch->closed) {
+        pthread_mutex_unlock(&uch->lock);
+        return;
+    }
+
+    udp_channel_touch(uch);
+    channel_accounting_sent(&uch->acct, len);
+
+    if (uch->opened) {
+        pthread_mutex_unlock(&uch->lock);
+        handler->mux.channel.write(&handler->mux, uch->base.id, buf);
+        return;
+    }
+
+    if (uch->pending_cnt >= UDP_PENDING_MAX) {
+        pthread_mutex_unlock(&uch->lock);
+        vlogT("Stream: %d portforwarding channel %d not opened, "
+              "dropped datagram.", handler->base.stream->id, uch->base.id);
+        return;
+    }
+
+    // Keep room for the frame header, it is sent in place once opened.
+    chunk = (SendChunk *)malloc(sizeof(SendChunk) + FLEX_PADDING_LEN + len);
+    if (!chunk) {
+        pthread_mutex_unlock(&uch->lock);
+        return;
+    }
+
+    chunk->next = NULL;
+    chunk->offset = FLEX_PADDING_LEN;
+    chunk->len = FLEX_PADDING_LEN + len;
+    memcpy(chunk->data + FLEX_PADDING_LEN, flex_buffer_ptr(buf), len);
+
+    if (uch->pending_tail)
+        uch->pending_tail->next = chunk;
+    else
+        uch->pending_head = chunk;
+    uch->pending_tail = chunk;
+    uch->pending_cnt++;
+
+    pthread_mutex_unlock(&uch->lock);
+}
+
+/* Returns the datagram length, 0 for an oversized one, or -1. */
+static
+ssize_t udp_recv(SOCKET sock, char *segment, struct sockaddr_storage *addr,
+                 socklen_t *addrlen)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t bytes;
+
+    iov.iov_base = segment + FLEX_PADDING_LEN;
+    iov.iov_len = IOEX_MAX_USER_DATA_LEN;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr ? sizeof(*addr) : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    bytes = recvmsg(sock, &msg, 0);
+    if (bytes < 0)
+        return -1;
+
+    if (addrlen)
+        *addrlen = msg.msg_namelen;
+
+    return (msg.msg_flags & MSG_TRUNC) ? 0 : bytes;
+}
+
+/* Service replies of a flow, read until drained. */
+static
+void handle_udp_portforwarding_channel_read(UdpChannel *uch, void *context)
+{
+    MultiplexHandler *handler = (MultiplexHandler *)context;
+    char *segment = handler->worker->loop->rx_segments[0];
+    FlexBuffer buf;
+    ssize_t bytes;
+
+    while (uch->fde.added) {
+        bytes = udp_recv(uch->sock, segment, NULL, NULL);
+        if (bytes < 0) {
+            // Refused by the service earlier, the flow stays.
+            if (socket_errno() == ECONNREFUSED)
+                continue;
+
+            if (!socket_would_block())
+                vlogE("Stream: %d portforwarding channel %d recv error %d.",
+                      handler->base.stream->id, uch->base.id, socket_errno());
+            break;
+        }
+
+        if (bytes == 0) {
+            vlogW("Stream: %d portforwarding channel %d dropped oversized "
+                  "datagram.", handler->base.stream->id, uch->base.id);
+            continue;
+        }
+
+        flex_buffer_init(&buf, segment, PORTFORWARDING_RX_SEGMENT_LEN,
+                         FLEX_PADDING_LEN);
+        flex_buffer_set_size(&buf, bytes);
 
-    vlogD("Stream: %d portforwarding channel %d closed with %s.",
-          handler->base.stream->id, ch->id, reason_names[reason]);
+        pthread_mutex_lock(&uch->lock);
+        udp_channel_touch(uch);
+        channel_accounting_sent(&uch->acct, (size_t)bytes);
+        pthread_mutex_unlock(&uch->lock);
 
-    fdset_remove_socket(&handler->worker->fdset, tch->sock);
-    socket_close(tch->sock);
+        handler->mux.channel.write(&handler->mux, uch->base.id, &buf);
+    }
 }
 
+/*
+ * Datagrams to a UDP portforwarding, each source address being a flow over
+ * its own channel. The channel of a new flow is opened on the first one.
+ */
 static
-bool tcp_portforwarding_channel_data(Channel *ch, FlexBuffer *buf, void *context)
+void handle_udp_portforwarding(PortForwarding *pf, void *context)
 {
     MultiplexHandler *handler = (MultiplexHandler *)context;
-    SOCKET sock;
-    char addr[SOCKET_ADDR_MAX_LEN];
-    size_t len = flex_buffer_size(buf);
+    char *segment = handler->worker->loop->rx_segments[0];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    FlexBuffer buf;
+    UdpChannel *uch;
+    ssize_t bytes;
+    int cid;
 
-    assert(ch);
-    assert(handler->worker);
-    assert(ch->type == ChannelType_TCP_PortForwarding);
-    assert(buf && flex_buffer_size(buf));
+    while (pf->fde.added) {
+        bytes = udp_recv(pf->sock, segment, &addr, &addrlen);
+        if (bytes < 0) {
+            if (!socket_would_block())
+                vlogE("Stream: %d portforwarding recv error %d.",
+                      handler->base.stream->id, socket_errno());
+            break;
+        }
 
-    if (!buf || !flex_buffer_size(buf))
-        return true;
+        if (bytes == 0) {
+            vlogW("Stream: %d portforwarding dropped oversized datagram.",
+                  handler->base.stream->id);
+            continue;
+        }
 
-    sock = ((TcpChannel *)ch)->sock;
+        flex_buffer_init(&buf, segment, PORTFORWARDING_RX_SEGMENT_LEN,
+                         FLEX_PADDING_LEN);
+        flex_buffer_set_size(&buf, bytes);
+
+        uch = udpflows_get(pf->flows, (struct sockaddr *)&addr, addrlen);
+        if (!uch) {
+            cid = handler->mux.channel.open(&handler->mux,
+                            ChannelType_UDP_PortForwarding, pf->service, 0,
+                            pf->sock, (struct sockaddr *)&addr, addrlen);
+            if (cid <= 0) {
+                vlogE("Stream: %d portforwarding create channel for new UDP "
+                      "flow failed.", handler->base.stream->id);
+                continue;
+            }
 
-    while (flex_buffer_size(buf) > 0) {
-        ssize_t rc;
+            uch = (UdpChannel *)channels_get(handler->channels, cid);
+            if (!uch)
+                continue;
 
-        rc = send(sock, flex_buffer_ptr(buf), flex_buffer_size(buf), 0);
-        if (rc <= 0) {
-            vlogE("Stream: %d portwarding channel %d send to %s error %d.",
-                  handler->base.stream->id, ch->id,
-                  socket_remote_name(sock, addr, sizeof(addr)), socket_errno());
-            return false;
+            // Under the lock, a flow closed meanwhile is never added.
+            pthread_mutex_lock(&uch->lock);
+            if (!uch->closed) {
+                uch->pf = (PortForwarding *)ref(pf);
+                gettimeofday(&uch->accepted, NULL);
+                udpflows_put(pf->flows, uch);
+                channel_accounting_start(&uch->acct, pf, &pf->counters, true);
+                udp_flow_start(handler->worker, uch);
+            }
+            pthread_mutex_unlock(&uch->lock);
+
+            vlogD("Stream: %d portforwarding create channel %d for new UDP "
+                  "flow.", handler->base.stream->id, cid);
         }
 
-        flex_buffer_forward_offset(buf, rc);
+        udp_channel_forward(handler, uch, &buf);
+        deref(uch);
     }
+}
 
-    vlogT("Stream: %d portforwarding channel %d send to %s %zu bytes.",
-           handler->base.stream->id, ch->id,
-           socket_remote_name(sock, addr, sizeof(addr)), len);
-
-    return true;
+static inline
+long timeval_elapsed_ms(const struct timeval *now, const struct timeval *then)
+{
+    return (long)(now->tv_sec - then->tv_sec) * 1000 +
+           (long)(now->tv_usec - then->tv_usec) / 1000;
 }
 
+/*
+ * Closes the idle channels of the portforwarding unused since the timeout,
+ * the oldest first in the pool as the newest are taken.
+ */
 static
-void tcp_portforwarding_channel_pending(Channel *ch, void *context)
+void portforwarding_expire_idle_channels(MultiplexHandler *handler,
+                                         PortForwarding *pf,
+                                         const struct timeval *now)
 {
-    MultiplexHandler *handler = (MultiplexHandler *)context;
+    int cids[PORTFORWARDING_IDLE_CHANNELS];
+    TcpChannel *tch;
+    bool idle;
+    int n = 0;
+    int i;
+
+    pthread_mutex_lock(&pf->lock);
+    while (n < pf->nidle && timeval_elapsed_ms(now, &pf->idle_since[n]) >=
+                            PORTFORWARDING_IDLE_TIMEOUT) {
+        cids[n] = pf->idle_channels[n];
+        n++;
+    }
+    if (n > 0) {
+        pf->nidle -= n;
+        memmove(pf->idle_channels, pf->idle_channels + n,
+                pf->nidle * sizeof(int));
+        memmove(pf->idle_since, pf->idle_since + n,
+                pf->nidle * sizeof(struct timeval));
+    }
+    pthread_mutex_unlock(&pf->lock);
 
-    assert(handler);
-    assert(handler->worker);
-    assert(ch);
-    assert(ch->type == ChannelType_TCP_PortForwarding);
+    for (i = 0; i < n; i++) {
+        tch = (TcpChannel *)channels_get(handler->channels, cids[i]);
+        if (!tch)
+            continue;
+
+        pthread_mutex_lock(&tch->sendq_lock);
+        idle = tch->base.type == ChannelType_TCP_PortForwarding && tch->idle;
+        pthread_mutex_unlock(&tch->sendq_lock);
+        deref(tch);
 
-    fdset_remove_socket(&handler->worker->fdset, ((TcpChannel *)ch)->sock);
+        if (idle) {
+            vlogD("Stream: %d portforwarding idle channel %d expired.",
+                  handler->base.stream->id, cids[i]);
+            handler->mux.channel.close(&handler->mux, cids[i]);
+        }
+    }
 }
 
+/*
+ * Idle channels are expired, and the pools of the portforwardings still
+ * accepting refilled, so one failing to open on accept is retried.
+ */
 static
-void tcp_portforwarding_channel_resume(Channel *ch, void *context)
+void portforwarding_worker_sweep_idle_channels(PortForwardingWorker *worker,
+                                               const struct timeval *now)
 {
-    MultiplexHandler *handler = (MultiplexHandler *)context;
+    HashtableIterator it;
+    PortForwarding *pf;
+    bool active;
+    int rc;
 
-    assert(handler);
-    assert(handler->worker);
-    assert(ch);
-    assert(ch->type == ChannelType_TCP_PortForwarding);
+resweep:
+    portforwardings_iterate(worker->portforwardings, &it);
+    while (portforwardings_iterator_has_next(&it)) {
+        rc = portforwardings_iterator_next(&it, &pf);
+        if (rc == 0)
+            break;
 
-    fdset_add_socket(&handler->worker->fdset, ((TcpChannel *)ch)->sock);
-}
+        if (rc < 0)
+            goto resweep;
 
-static ChannelCallbacks tcp_portforwarding_callbacks = {
-    .channel_open = tcp_portforwarding_channel_open,
-    .channel_opened = tcp_portforwarding_channel_opened,
-    .channel_data = tcp_portforwarding_channel_data,
-    .channel_pending = tcp_portforwarding_channel_pending,
-    .channel_resume = tcp_portforwarding_channel_resume,
-    .channel_close = tcp_portforwarding_channel_close,
-    .context = NULL
-};
+        if (pf->protocol == PortForwardingProtocol_TCP) {
+            portforwarding_expire_idle_channels(worker->mux, pf, now);
 
-static
-void handle_tcp_portforwarding_channel(TcpChannel *ch, void *context)
-{
-    MultiplexHandler *handler = (MultiplexHandler *)context;
-    FlexBuffer *buf;
-    ssize_t bytes;
+            pthread_mutex_lock(&pf->lock);
+            active = timeval_elapsed_ms(now, &pf->last_accepted) <
+                     PORTFORWARDING_IDLE_TIMEOUT;
+            pthread_mutex_unlock(&pf->lock);
 
-    buf = flex_buffer(FLEX_BUFFER_MAX_LEN, FLEX_PADDING_LEN);
-    bytes = recv(ch->sock, flex_buffer_mutable_ptr(buf),
-                 IOEX_MAX_USER_DATA_LEN, 0);
-    if (bytes <= 0) {
-        // Channel socket closed.
-        // TODO: Error close
-        handler->mux.channel.close(&handler->mux, ch->base.id);
-    } else {
-        flex_buffer_set_size(buf, bytes);
-        handler->mux.channel.write(&handler->mux, ch->base.id, buf); //TODO: check error.
+            if (active)
+                portforwarding_fill_idle_channels(worker->mux, pf);
+        }
+
+        deref(pf);
     }
 }
 
-static
-void handle_tcp_portofrwarding(PortForwarding *pf, void *context)
+/*
+ * Flows are closed once idle, on the transport thread as the close by the
+ * peer. Both the accepted and the service side of a flow are expired, and
+ * accepted flows the open of which got no answer. A flow still in use is
+ * scheduled again for the rest of its timeout.
+ */
+static void udp_flow_deadline_expired(timer_heap_t *ht, timer_entry_t *entry)
 {
-    MultiplexHandler *handler = (MultiplexHandler *)context;
-    SOCKET sock;
-    int cid;
+    PortForwardingWorker *worker = (PortForwardingWorker *)entry->user_data;
+    UdpChannel *uch = (UdpChannel *)((char *)entry -
+                                     offsetof(UdpChannel, flow_deadline));
+    MultiplexHandler *handler = worker->mux;
+    struct timeval now;
+    long delay;
+    bool closed;
+
+    (void)ht;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&uch->lock);
+    closed = uch->closed;
+    delay = IOEX_UDP_FLOW_IDLE_TIMEOUT * 1000L -
+            timeval_elapsed_ms(&now, &uch->last_active);
+    if (uch->pf && !uch->opened) {
+        long wait = UDP_FLOW_OPEN_TIMEOUT -
+                    timeval_elapsed_ms(&now, &uch->accepted);
+        if (wait < delay)
+            delay = wait;
+    }
+    pthread_mutex_unlock(&uch->lock);
 
-    sock = accept(pf->sock, NULL, NULL);
-    if (sock < 0) {
-        vlogE("Stream: %d portforwarding accept error.", handler->base.stream->id);
+    if (!closed && delay <= 0) {
+        vlogD("Stream: %d portforwarding channel %d UDP flow expired.",
+              handler->base.stream->id, uch->base.id);
+        handler->mux.channel.close(&handler->mux, uch->base.id);
+        deref(uch);
         return;
     }
 
-    cid = handler->mux.channel.open(&handler->mux, ChannelType_TCP_PortForwarding,
-                                    pf->service, 0, sock);
-    if (cid <= 0) {
-        vlogE("Stream: %d portforwarding create channel for new TCP connection failed.",
-              handler->base.stream->id);
-        socket_close(sock);
-    } else {
-        vlogD("Stream: %d portforwarding create channel %d for new TCP connection.",
-              handler->base.stream->id, cid);
-    }
+    // As for the channel deadlines, the reference of the expired entry is
+    // handed over unless the flow was unscheduled meanwhile.
+    pthread_mutex_lock(&worker->flow_deadlines_lock);
+    if (!closed && uch->flow_deadline.id != FLOW_DEADLINE_CANCELED)
+        udp_flow_schedule(worker, uch, delay);
+    pthread_mutex_unlock(&worker->flow_deadlines_lock);
+
+    deref(uch);
 }
 
-static void *worker_routine(void *arg)
+static bool portforwarding_worker_sweep_flows(void *user_data)
 {
-    fd_set rfds;
-    int nfds;
-    struct timeval timeout;
-    HashtableIterator it;
-    int rc;
+    PortForwardingWorker *worker = (PortForwardingWorker *)user_data;
+    struct timeval now;
 
-    MultiplexHandler *handler = (MultiplexHandler *)arg;
-    PortForwardingWorker *wk = handler->worker;
+    if (worker->flow_deadlines)
+        timer_heap_poll(worker->flow_deadlines, NULL);
 
-    assert(handler);
-    assert(wk);
+    gettimeofday(&now, NULL);
+    portforwarding_worker_sweep_idle_channels(worker, &now);
+
+    return true;
+}
 
-    ref(handler);
+/*
+ * The handler is referenced by the entries ready, so it outlives the
+ * dispatch even when its session is closed on another thread meanwhile.
+ */
+static void *loop_routine(void *arg)
+{
+    PortForwardingLoop *loop = (PortForwardingLoop *)arg;
+    FdSetEntry *ready[FDSET_MAX_EVENTS];
+    int nfds;
+    int i;
 
-    timerclear(&timeout);
-    wk->running = 1;
-    while (wk->running) {
-        if(!timerisset(&timeout))
-            timeout.tv_sec = 5;
+    assert(loop);
 
-        fdset_copy(&wk->fdset, &rfds);
-        nfds = select(FD_SETSIZE, &rfds, NULL, NULL, &timeout);
+    while (loop->running) {
+        nfds = fdset_wait(&loop->fdset, ready, FDSET_MAX_EVENTS,
+                          LOOP_WAIT_TIMEOUT);
         if (nfds < 0) {
             int error = socket_errno();
 
-            if (error == EBADF)
+            if (error == EBADF || error == EINTR)
                 continue;
 
-            if (error != EINTR)
-                vlogE("Stream: %d portforwarding select error:%d.",
-                      handler->base.stream->id, socket_errno());
-
+            vlogE("Session: portforwarding loop %d wait error:%d.",
+                  loop->index, error);
             break;
         }
 
-        if (nfds == 0)
-            continue;
+        // Only the sockets ready are visited, owners come with the entries.
+        for (i = 0; i < nfds; i++) {
+            FdSetEntry *entry = ready[i];
+            MultiplexHandler *handler = (MultiplexHandler *)entry->context;
+
+            // Removed while handling the entries before.
+            if (!entry->added)
+                continue;
+
+            // Worker stopped, its sockets are being unregistered.
+            if (!handler->worker || !handler->worker->running)
+                continue;
 
-        if (nfds > 0 && FD_ISSET(wk->fdset.event, &rfds)) {
-            FD_CLR(wk->fdset.event, &rfds);
-            nfds--;
+            if (entry->type == FdSetEntry_Channel) {
+                Channel *ch = (Channel *)entry->data;
+                int revents = entry->revents & entry->events;
+
+                if (ch->type == ChannelType_TCP_PortForwarding) {
+                    if (revents & FDSET_WRITE)
+                        handle_tcp_portforwarding_channel_write(
+                                            (TcpChannel *)ch, handler);
+
+                    if ((revents & FDSET_READ) && entry->added)
+                        handle_tcp_portforwarding_channel_read(
+                                            (TcpChannel *)ch, handler);
+                } else if (ch->type == ChannelType_UDP_PortForwarding) {
+                    if (revents & FDSET_READ)
+                        handle_udp_portforwarding_channel_read(
+                                            (UdpChannel *)ch, handler);
+                }
+            } else if (entry->type == FdSetEntry_PortForwarding) {
+                PortForwarding *pf = (PortForwarding *)entry->data;
 
-            fdset_drop_wakeup(&wk->fdset);
+                if (pf->protocol == PortForwardingProtocol_TCP)
+                    handle_tcp_portofrwarding(pf, handler);
+                else if (pf->protocol == PortForwardingProtocol_UDP)
+                    handle_udp_portforwarding(pf, handler);
+            }
         }
+    }
 
-rescan_channels:
-        channels_iterate(handler->channels, &it);
-        while (nfds > 0 && channels_iterator_has_next(&it)) {
-            Channel *ch;
+    vlogD("Session: portforwarding loop %d exited.", loop->index);
+    return NULL;
+}
 
-            rc = channels_iterator_next(&it, &ch);
-            if (rc == 0)
-                break;
+static
+void portforwarding_pool_destroy(void *p)
+{
+    PortForwardingPool *pool = (PortForwardingPool *)p;
+    int i;
 
-            if (rc < 0)
-                goto rescan_channels;
+    for (i = 0; i < pool->nloops; i++) {
+        PortForwardingLoop *loop = &pool->loops[i];
+
+        if (loop->running) {
+            loop->running = 0;
+            fdset_wakeup(&loop->fdset);
+            pthread_join(loop->thread, NULL);
+        }
 
-            if (ch->type == ChannelType_UDP_PortForwarding) {
-                //TODO;
+        fdset_destroy(&loop->fdset);
+    }
 
-            } else if (ch->type == ChannelType_TCP_PortForwarding) {
-                TcpChannel *tch = (TcpChannel *)ch;
-                if (FD_ISSET(tch->sock, &rfds)) {
-                    FD_CLR(tch->sock, &rfds);
-                    nfds--;
+    vlogD("Session: portforwarding pool destroyed.");
+}
 
-                    handle_tcp_portforwarding_channel(tch, handler);
-                }
-            }
+static
+int portforwarding_pool_create(PortForwardingPool **pool)
+{
+    PortForwardingPool *_pool;
+    long nprocs;
+    int rc;
+    int i;
 
-            deref(ch);
-        }
+    _pool = (PortForwardingPool *)rc_zalloc(sizeof(PortForwardingPool),
+                                            portforwarding_pool_destroy);
+    if (!_pool)
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
 
-rescan_portforwardings:
-        portforwardings_iterate(wk->portforwardings, &it);
-        while (nfds > 0 && portforwardings_iterator_has_next(&it)) {
-            PortForwarding *pf;
+    nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs < 1)
+        nprocs = 1;
+    else if (nprocs > MAX_PORTFORWARDING_LOOPS)
+        nprocs = MAX_PORTFORWARDING_LOOPS;
 
-            rc = portforwardings_iterator_next(&it, &pf);
-            if (rc == 0)
-                break;
+    for (i = 0; i < (int)nprocs; i++) {
+        PortForwardingLoop *loop = &_pool->loops[i];
 
-            if (rc < 0)
-                goto rescan_portforwardings;
+        loop->index = i;
 
-            if (!FD_ISSET(pf->sock, &rfds)) {
-                deref(pf);
-                continue;
-            }
+        rc = fdset_init(&loop->fdset);
+        if (rc != 0) {
+            deref(_pool);
+            return IOEX_SYS_ERROR(rc);
+        }
 
-            if (pf->protocol == PortForwardingProtocol_TCP) {
-                handle_tcp_portofrwarding(pf, handler);
-            }
+        // Counted before starting, destroy cleans up the fdset anyway.
+        _pool->nloops++;
 
-            FD_CLR(pf->sock, &rfds);
-            nfds--;
-            deref(pf);
+        loop->running = 1;
+        rc = pthread_create(&loop->thread, NULL, loop_routine, loop);
+        if (rc != 0) {
+            loop->running = 0;
+            deref(_pool);
+            return IOEX_SYS_ERROR(rc);
         }
     }
 
-    wk->running = 0;
-    deref(handler);
+    vlogD("Session: portforwarding pool created with %d loops.",
+          _pool->nloops);
 
-    return NULL;
+    *pool = _pool;
+    return 0;
+}
+
+/*
+ * All sessions of the session extension share one pool, created with the
+ * first portforwarding worker. Streams of a session are kept on one loop.
+ */
+static
+PortForwardingLoop *portforwarding_pool_get_loop(IOEXSession *ws)
+{
+    static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+    SessionExtension *ext = ws->transport->ext;
+    PortForwardingPool *pool;
+    int rc = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    if (!ext->portforwarding_pool)
+        rc = portforwarding_pool_create(&ext->portforwarding_pool);
+    pool = ext->portforwarding_pool;
+    pthread_mutex_unlock(&pool_lock);
+
+    if (rc < 0) {
+        vlogE("Session: Create portforwarding pool error (0x%x).", rc);
+        return NULL;
+    }
+
+    return &pool->loops[((uintptr_t)ws >> 4) % pool->nloops];
 }
 
 static
 int portforwarding_worker_start(PortForwardingWorker *worker)
 {
+    pthread_mutexattr_t attr;
+    TransportWorker *wk;
     int rc;
+
     assert(worker);
 
-    rc = pthread_create(&worker->thread, NULL, worker_routine, worker->mux);
+    worker->flow_deadlines = timer_heap_create(64);
+    if (!worker->flow_deadlines)
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+
+    // Held by the deadline callback around its own rescheduling.
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&worker->flow_deadlines_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    timer_heap_set_lock(worker->flow_deadlines, &worker->flow_deadlines_lock,
+                        true);
+    timer_heap_set_max_timed_out_per_poll(worker->flow_deadlines,
+                                          UDP_FLOW_SWEEP_MAX);
+
+    wk = stream_get_worker(worker->mux->base.stream);
+    rc = wk->create_timer(wk, worker->mux->base.stream->id | 0x00120000,
+                          UDP_FLOW_SWEEP_INTERVAL,
+                          portforwarding_worker_sweep_flows, worker,
+                          &worker->sweep_timer);
+    if (rc < 0)
+        return rc;
+
+    worker->running = 1;
+
+    vlogD("Stream: %d portforwarding worker started on loop %d.",
+          worker->mux->base.stream->id, worker->loop->index);
 
-    vlogD("Stream: %d portforwarding worker started %s.",
-          worker->mux->base.stream->id, (rc == 0 ? "success" : "failed"));
+    return 0;
+}
+
+static
+void portforwarding_worker_destroy_timer(PortForwardingWorker *worker)
+{
+    TransportWorker *wk;
+
+    if (!worker->sweep_timer)
+        return;
+
+    wk = stream_get_worker(worker->mux->base.stream);
+    wk->destroy_timer(wk, worker->sweep_timer);
+    worker->sweep_timer = NULL;
+}
+
+/* The flows unscheduled themselves as their channels closed. */
+static
+void portforwarding_worker_destroy_deadlines(PortForwardingWorker *worker)
+{
+    if (!worker->flow_deadlines)
+        return;
+
+    timer_heap_destroy(worker->flow_deadlines);
+    worker->flow_deadlines = NULL;
+}
+
+static
+void portforwarding_worker_unregister(PortForwardingWorker *worker)
+{
+    HashtableIterator it;
+    int rc;
+
+reremove:
+    portforwardings_iterate(worker->portforwardings, &it);
+    while (portforwardings_iterator_has_next(&it)) {
+        PortForwarding *pf;
+
+        rc = portforwardings_iterator_next(&it, &pf);
+        if (rc == 0)
+            break;
+
+        if (rc < 0)
+            goto reremove;
 
-    return (rc != 0) ? IOEX_SYS_ERROR(rc) : 0;
+        fdset_remove(&worker->loop->fdset, pf->sock, &pf->fde);
+        deref(pf);
+    }
 }
 
+/*
+ * Never blocks: the sockets are unregistered from the shared loop, which
+ * drops its references to the handler on the next wait. Channel sockets
+ * were unregistered when the channels closed.
+ */
 static
 void portforwarding_worker_stop(PortForwardingWorker *worker)
 {
@@ -392,9 +1762,9 @@ void portforwarding_worker_stop(PortForwardingWorker *worker)
 
     worker->running = 0;
 
-    fdset_wakeup(&worker->fdset);
-
-    pthread_join(worker->thread, NULL); //TODO: may be blocked.
+    portforwarding_worker_destroy_timer(worker);
+    portforwarding_worker_destroy_deadlines(worker);
+    portforwarding_worker_unregister(worker);
 
     vlogD("Stream: %d portforwarding worker stoped.",
           worker->mux->base.stream->id);
@@ -406,8 +1776,13 @@ void portforwarding_destroy(void *p)
     PortForwarding *pf = (PortForwarding *)p;
     assert(pf);
 
+    if (pf->flows)
+        deref(pf->flows);
+
     if (pf->sock != INVALID_SOCKET)
         socket_close(pf->sock);
+
+    pthread_mutex_destroy(&pf->lock);
 }
 
 static
@@ -420,7 +1795,8 @@ int portforwarding_open(PortForwardingWorker *worker, const char *service,
 
     assert(worker);
     assert(service);
-    assert(protocol == PortForwardingProtocol_TCP);
+    assert(protocol == PortForwardingProtocol_TCP ||
+           protocol == PortForwardingProtocol_UDP);
     assert(host && port);
 
     pf = (PortForwarding *)rc_zalloc(sizeof(PortForwarding) + strlen(service) + 1,
@@ -428,6 +1804,9 @@ int portforwarding_open(PortForwardingWorker *worker, const char *service,
     if (!pf)
         return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
 
+    pthread_mutex_init(&pf->lock, NULL);
+    gettimeofday(&pf->last_accepted, NULL);
+
     type = protocol == PortForwardingProtocol_TCP ? SOCK_STREAM : SOCK_DGRAM;
     pf->sock = socket_create(type, host, port);
 
@@ -442,6 +1821,19 @@ int portforwarding_open(PortForwardingWorker *worker, const char *service,
             deref(pf);
             return IOEX_SYS_ERROR(socket_errno());
         }
+
+    } else {
+        pf->flows = udpflows_create(32);
+        if (!pf->flows) {
+            deref(pf);
+            return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
+        }
+    }
+
+    // Drained by accepting or receiving until EAGAIN.
+    if (socket_set_nonblock(pf->sock) < 0) {
+        deref(pf);
+        return IOEX_SYS_ERROR(socket_errno());
     }
 
     id = ids_heap_alloc((IdsHeap *)&worker->pf_ids);
@@ -457,12 +1849,87 @@ int portforwarding_open(PortForwardingWorker *worker, const char *service,
     strcpy(pf->service, service);
 
     portforwardings_put(worker->portforwardings, pf);
-    fdset_add_socket(&worker->fdset, pf->sock);
+
+    // Even the first connection has a channel opened ahead.
+    if (protocol == PortForwardingProtocol_TCP)
+        portforwarding_fill_idle_channels(worker->mux, pf);
+
+    fdset_add(&worker->loop->fdset, pf->sock, &pf->fde,
+              FdSetEntry_PortForwarding, pf, worker->mux);
     deref(pf);
 
     return id;
 }
 
+/* Flows accepted by the portforwarding send from its socket, close first. */
+static
+void portforwarding_close_flows(PortForwardingWorker *worker,
+                                PortForwarding *pf)
+{
+    HashtableIterator it;
+    int cids[UDP_FLOW_SWEEP_MAX];
+    int ncids;
+    int rc;
+    int i;
+
+    do {
+        ncids = 0;
+
+reclose:
+        udpflows_iterate(pf->flows, &it);
+        while (udpflows_iterator_has_next(&it) && ncids < UDP_FLOW_SWEEP_MAX) {
+            UdpChannel *uch;
+
+            rc = udpflows_iterator_next(&it, &uch);
+            if (rc == 0)
+                break;
+
+            if (rc < 0) {
+                ncids = 0;
+                goto reclose;
+            }
+
+            cids[ncids++] = uch->base.id;
+            deref(uch);
+        }
+
+        for (i = 0; i < ncids; i++)
+            worker->mux->mux.channel.close(&worker->mux->mux, cids[i]);
+    } while (ncids == UDP_FLOW_SWEEP_MAX);
+}
+
+static
+void portforwarding_close_idle_channels(PortForwardingWorker *worker,
+                                        PortForwarding *pf)
+{
+    MultiplexHandler *handler = worker->mux;
+    int cids[PORTFORWARDING_IDLE_CHANNELS];
+    TcpChannel *tch;
+    bool idle;
+    int n;
+    int i;
+
+    pthread_mutex_lock(&pf->lock);
+    n = pf->nidle;
+    memcpy(cids, pf->idle_channels, n * sizeof(int));
+    pf->nidle = 0;
+    pthread_mutex_unlock(&pf->lock);
+
+    for (i = 0; i < n; i++) {
+        tch = (TcpChannel *)channels_get(handler->channels, cids[i]);
+        if (!tch)
+            continue;
+
+        pthread_mutex_lock(&tch->sendq_lock);
+        idle = tch->base.type == ChannelType_TCP_PortForwarding && tch->idle;
+        pthread_mutex_unlock(&tch->sendq_lock);
+        deref(tch);
+
+        if (idle)
+            handler->mux.channel.close(&handler->mux, cids[i]);
+    }
+}
+
 static
 void portforwarding_close(PortForwardingWorker *worker, int pfid)
 {
@@ -475,7 +1942,14 @@ void portforwarding_close(PortForwardingWorker *worker, int pfid)
     if (pf) {
         assert(pf->sock != INVALID_SOCKET);
 
-        fdset_remove_socket(&worker->fdset, pf->sock);
+        if (pf->flows)
+            portforwarding_close_flows(worker, pf);
+
+        fdset_remove(&worker->loop->fdset, pf->sock, &pf->fde);
+
+        if (pf->protocol == PortForwardingProtocol_TCP)
+            portforwarding_close_idle_channels(worker, pf);
+
         socket_close(pf->sock);
         pf->sock = INVALID_SOCKET;
 
@@ -485,17 +1959,60 @@ void portforwarding_close(PortForwardingWorker *worker, int pfid)
     }
 }
 
+static
+bool portforwarding_worker_stats(PortForwardingWorker *worker,
+                        IOEXPortForwardingStatsCallback *callback, void *context)
+{
+    IOEXPortForwardingStats stats;
+    HashtableIterator it;
+    PortForwarding *pf;
+    int rc;
+
+    assert(worker);
+    assert(callback);
+
+restats:
+    portforwardings_iterate(worker->portforwardings, &it);
+    while (portforwardings_iterator_has_next(&it)) {
+        rc = portforwardings_iterator_next(&it, &pf);
+        if (rc == 0)
+            break;
+
+        if (rc < 0)
+            goto restats;
+
+        memset(&stats, 0, sizeof(stats));
+        stats.service = pf->service;
+        stats.protocol = pf->protocol;
+        stats.stream = worker->mux->base.stream->id;
+        stats.portforwarding = pf->id;
+        portforwarding_counters_read(&pf->counters, &stats);
+
+        if (!callback(&stats, context)) {
+            deref(pf);
+            return false;
+        }
+
+        deref(pf);
+    }
+
+    return true;
+}
+
 static
 void portforwarding_worker_destroy(void *p)
 {
     PortForwardingWorker *wk = (PortForwardingWorker *)p;
+
     assert(wk);
 
+    portforwarding_worker_destroy_timer(wk);
+    portforwarding_worker_destroy_deadlines(wk);
+
     if (wk->portforwardings)
         deref(wk->portforwardings);
 
     ids_heap_destroy((IdsHeap *)&wk->pf_ids);
-    fdset_destroy(&wk->fdset);
 
     vlogD("Stream: %d portforwarding worker destroyed.",
           wk->mux->base.stream->id);
@@ -517,11 +2034,12 @@ int portforwarding_worker_create(MultiplexHandler *handler,
     wk->stop  = portforwarding_worker_stop;
     wk->open  = portforwarding_open;
     wk->close = portforwarding_close;
+    wk->stats = portforwarding_worker_stats;
 
-    rc = fdset_init(&wk->fdset);
-    if (rc != 0) {
+    wk->loop = portforwarding_pool_get_loop(handler->base.stream->session);
+    if (!wk->loop) {
         deref(wk);
-        return IOEX_SYS_ERROR(rc);
+        return IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY);
     }
 
     wk->portforwardings = portforwardings_create(8);
@@ -539,6 +2057,9 @@ int portforwarding_worker_create(MultiplexHandler *handler,
     multiplex_handler_set_channel_callbacks(handler,
                         ChannelType_TCP_PortForwarding,
                         &tcp_portforwarding_callbacks, handler);
+    multiplex_handler_set_channel_callbacks(handler,
+                        ChannelType_UDP_PortForwarding,
+                        &udp_portforwarding_callbacks, handler);
 
     vlogD("Stream: %d portforwarding worker created.", handler->base.stream->id);
 
@@ -29,21 +29,55 @@
 #include "udp_eventfd.h"
 #endif
 
+#include <sys/time.h>
+
 #include <linkedhashtable.h>
 #include <ids_heap.h>
+#include <timerheap.h>
 #include <socket.h>
 
 #include "fdset.h"
+#include "flex_buffer.h"
+#include "IOEX_session.h"
 
 #define MAX_PORTFORWARDING_ID           64
+#define MAX_PORTFORWARDING_LOOPS        8
+
+/*
+ * Segments a channel socket is read into by one readv, each with room in
+ * front for the frame header so it is sent in place.
+ */
+#define PORTFORWARDING_RX_SEGMENTS      32
+#define PORTFORWARDING_RX_SEGMENT_LEN   (FLEX_PADDING_LEN + IOEX_MAX_USER_DATA_LEN)
+
+/* Channels kept opened ahead of connections to a TCP portforwarding */
+#define PORTFORWARDING_IDLE_CHANNELS    2
+
+/*
+ * Each holds a connection to the service open on the peer, so channels are
+ * closed once unused this long, and not refilled while nothing is accepted.
+ */
+#define PORTFORWARDING_IDLE_TIMEOUT     60000 /* 60 seconds */
 
 typedef struct IOEXSession IOEXSession;
 
+/* Updated atomically, from the transport thread and the loop threads */
+typedef struct PortForwardingCounters {
+    uint64_t connections;
+    uint64_t failed_connections;
+    uint64_t active_connections;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t first_byte_latency[IOEX_PORTFORWARDING_LATENCY_BUCKETS];
+} PortForwardingCounters;
+
 typedef struct Service {
     const char *name;
     int protocol;
     const char *host;
     const char *port;
+    /* Of the connections forwarded to the service */
+    PortForwardingCounters counters;
     HashEntry he;
     char data[1];
 } Service;
@@ -52,12 +86,31 @@ typedef struct PortForwardingWorker PortForwardingWorker;
 
 typedef struct MultiplexHandler MultiplexHandler;
 
+/* Event loop thread shared by the workers of sessions sharded to it */
+typedef struct PortForwardingLoop {
+    FdSet fdset;
+    pthread_t thread;
+    int running;
+    int index;
+
+    char rx_segments[PORTFORWARDING_RX_SEGMENTS][PORTFORWARDING_RX_SEGMENT_LEN];
+} PortForwardingLoop;
+
+struct PortForwardingPool {
+    int nloops;
+    PortForwardingLoop loops[MAX_PORTFORWARDING_LOOPS];
+};
+
 struct PortForwardingWorker {
     MultiplexHandler *mux;
-    FdSet fdset;
+    PortForwardingLoop *loop;
 
-    pthread_t thread;
     int running;
+    /* Expires idle UDP flows and refills idle channels, on the transport thread */
+    Timer *sweep_timer;
+    /* Idle deadlines of the UDP flows, polled by the sweep timer */
+    timer_heap_t *flow_deadlines;
+    pthread_mutex_t flow_deadlines_lock;
 
     Hashtable *portforwardings;
     IdsHeapDecl(pf_ids, MAX_PORTFORWARDING_ID);
@@ -69,12 +122,30 @@ struct PortForwardingWorker {
                   const char *service, int protocol,
                   const char *host, const char *port);
     void (*close)(PortForwardingWorker *worker, int pfid);
+    bool (*stats)(PortForwardingWorker *worker,
+                  IOEXPortForwardingStatsCallback *callback, void *context);
 };
 
 typedef struct PortForwarding {
     int id;
     int protocol;
     SOCKET sock;
+    FdSetEntry fde;
+
+    /* UDP flows by source address */
+    Hashtable *flows;
+
+    /* Of the connections accepted */
+    PortForwardingCounters counters;
+
+    /* Pre-opened channels, taken by the connections accepted */
+    pthread_mutex_t lock;
+    int idle_channels[PORTFORWARDING_IDLE_CHANNELS];
+    struct timeval idle_since[PORTFORWARDING_IDLE_CHANNELS];
+    int nidle;
+    /* Being opened, with the lock released */
+    int nopening;
+    struct timeval last_accepted;
 
     HashEntry he;
 
@@ -83,4 +154,6 @@ typedef struct PortForwarding {
 
 int portforwarding_worker_create(MultiplexHandler *mux, PortForwardingWorker **wk);
 
+void portforwarding_counters_read(PortForwardingCounters *counters,
+                                  IOEXPortForwardingStats *stats);
 #endif /* __PORTFORWARDING_H__ */
@@ -47,8 +47,8 @@ int portforwardings_key_compare(const void *key1, size_t len1,
 static inline
 Hashtable *portforwardings_create(int capacity)
 {
-    return hashtable_create(capacity, 1, portforwardings_hash_code,
-                            portforwardings_key_compare);
+    return hashtable_create_rcu(capacity, portforwardings_hash_code,
+                                portforwardings_key_compare);
 }
 
 static inline
@@ -40,6 +40,8 @@ typedef struct ReliableHandler {
 
     PseudoTcpSocket *sock;
     int sock_closed; // TODO: check same as pseudo_tcp_socket_is_closed()
+    /* send_space() ran low, the prev handler waits for on_writable() */
+    int want_writable;
 
     uint64_t last_clock_timeout;
     Timer *clock;
@@ -420,10 +422,29 @@ ssize_t reliable_handler_write(StreamHandler *base, FlexBuffer *buf)
     return len;
 }
 
+static
+size_t reliable_handler_send_space(StreamHandler *base)
+{
+    ReliableHandler *handler = (ReliableHandler *)base;
+    size_t space;
+
+    assert(base);
+    assert(handler->sock);
+
+    reliable_handler_lock(handler);
+    space = pseudo_tcp_socket_get_available_send_space(handler->sock);
+    if (space < HANDLER_SEND_SPACE_LOW)
+        handler->want_writable = 1;
+    reliable_handler_unlock(handler);
+
+    return space;
+}
+
 static
 void reliable_handler_on_rx_data(StreamHandler *base, FlexBuffer *buf)
 {
     ReliableHandler *handler = (ReliableHandler *)base;
+    int writable = 0;
 
     vlogT("Stream: %d reliable handler received %zu bytes data.",
           base->stream->id, flex_buffer_size(buf));
@@ -436,9 +457,20 @@ void reliable_handler_on_rx_data(StreamHandler *base, FlexBuffer *buf)
         vlogD("Stream: %d pseudo TCP socket got destroyed.", base->stream->id);
     } else {
         reliable_handler_adjust_clock(handler);
+
+        // Acknowledgements free the send buffer up.
+        if (handler->want_writable &&
+                pseudo_tcp_socket_get_available_send_space(handler->sock) >=
+                HANDLER_SEND_SPACE_LOW) {
+            handler->want_writable = 0;
+            writable = 1;
+        }
     }
 
     reliable_handler_unlock(handler);
+
+    if (writable && base->prev->on_writable)
+        base->prev->on_writable(base->prev);
 }
 
 static
@@ -497,6 +529,7 @@ int reliable_handler_create(IOEXStream *s, StreamHandler **handler)
     _handler->base.write   = reliable_handler_write;
     _handler->base.on_data = reliable_handler_on_rx_data;
     _handler->base.on_state_changed = reliable_handler_on_state_changed;
+    _handler->base.send_space = reliable_handler_send_space;
 
     vlogD("Stream: %d reliable handler created.", s->id);
 
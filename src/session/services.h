@@ -80,4 +80,24 @@ void services_clear(Hashtable *htab)
     return hashtable_clear(htab);
 }
 
+static inline
+HashtableIterator *services_iterate(Hashtable *htab,
+                                    HashtableIterator *iterator)
+{
+    return hashtable_iterate(htab, iterator);
+}
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+static inline
+int services_iterator_next(HashtableIterator *iterator, Service **svc)
+{
+    return hashtable_iterator_next(iterator, NULL, NULL, (void **)svc);
+}
+
+static inline
+int services_iterator_has_next(HashtableIterator *iterator)
+{
+    return hashtable_iterator_has_next(iterator);
+}
+
 #endif /* __SERVICES_H__ */
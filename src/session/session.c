@@ -34,6 +34,7 @@
 #include "IOEX_session.h"
 #include "IOEX_turnserver.h"
 #include "portforwarding.h"
+#include "filestream.h"
 #include "services.h"
 #include "session.h"
 #include "socket.h"
@@ -57,6 +58,52 @@ bool IOEX_session_jni_onload(void *vm, void *reserved)
 }
 #endif
 
+/*
+ * The peer moved to another network and asks to restart ICE on one of the
+ * running sessions. The request never reaches the application, the session
+ * which owns the peer key in the SDP answers it once gathering completed.
+ */
+static void session_restart_from_peer(SessionExtension *ext, const char *from,
+                                      const char *sdp, size_t len)
+{
+    ListIterator it;
+    char *ext_to;
+    int rc = IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST);
+
+relookup:
+    list_iterate(ext->sessions, &it);
+    while (list_iterator_has_next(&it)) {
+        IOEXSession *ws;
+        int next;
+
+        next = list_iterator_next(&it, (void **)&ws);
+        if (next == 0)
+            break;
+
+        if (next == -1)
+            goto relookup;
+
+        if (ws->restart && strcmp(ws->to, from) == 0)
+            rc = ws->restart(ws, false, sdp, len - 1);
+        deref(ws);
+
+        if (rc != IOEX_GENERAL_ERROR(IOEXERR_NOT_EXIST))
+            break;
+    }
+
+    if (rc == 0)
+        return;
+
+    vlogW("Session: Can not restart session with %s (0x%x).", from, rc);
+
+    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(extension_name) + 2);
+    strcpy(ext_to, from);
+    strcat(ext_to, ":");
+    strcat(ext_to, extension_name);
+
+    IOEX_reply_friend_invite(ext->carrier, ext_to, rc, "Restart refused", NULL, 0);
+}
+
 static void friend_invite(IOEXCarrier *w, const char *from, const char *sdp,
                           size_t len, void *context)
 {
@@ -70,6 +117,11 @@ static void friend_invite(IOEXCarrier *w, const char *from, const char *sdp,
 
     vlogD("Session: Session request from %s with SDP %.*s", from, (int)len, sdp);
 
+    if (len > 0 && sdp[len - 1] == 0 && strstr(sdp, "a=" SDP_RESTART_ATTR)) {
+        session_restart_from_peer(ext, from, sdp, len);
+        return;
+    }
+
     if (ext->request_callback)
         ext->request_callback(w, from, sdp, len, ext->context);
 }
@@ -83,6 +135,15 @@ static void extension_destroy(void *p)
     if (ext->transport)
         remove_transport(ext->transport);
 
+    if (ext->sessions)
+        deref(ext->sessions);
+
+    if (ext->portforwarding_pool)
+        deref(ext->portforwarding_pool);
+
+    if (ext->file_streams)
+        deref(ext->file_streams);
+
     ids_heap_destroy((IdsHeap *)&ext->stream_ids);
 
     vlogD("Session: Extension destroyed.");
@@ -140,10 +201,28 @@ int IOEX_session_init(IOEXCarrier *w, IOEXSessionRequestCallback *callback, void
     ext->friend_invite_cb = friend_invite;
     ext->friend_invite_context = ext;
 
+    ext->file_receive_cb = filestream_receive;
+    ext->file_send_cb = filestream_send;
+    ext->file_cancel_cb = filestream_cancel;
+
     ext->request_callback = callback;
     ext->context = context;
     ext->create_transport = ice_transport_create;
 
+    ext->sessions = list_create(1, NULL);
+    if (!ext->sessions) {
+        deref(ext);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return -1;
+    }
+
+    ext->file_streams = filestreams_create();
+    if (!ext->file_streams) {
+        deref(ext);
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_OUT_OF_MEMORY));
+        return -1;
+    }
+
     rc = ids_heap_init((IdsHeap *)&ext->stream_ids, MAX_STREAM_ID);
     if (rc < 0) {
         deref(ext);
@@ -205,6 +284,10 @@ void IOEX_session_cleanup(IOEXCarrier *w)
     ext = w->extension;
     w->extension = NULL;
 
+    // Transfers still running close their sessions first.
+    if (ext->file_streams)
+        filestreams_stop(ext->file_streams);
+
     if (ext->transport) {
         remove_transport(ext->transport);
         ext->transport = NULL;
@@ -292,6 +375,7 @@ IOEXSession *IOEX_session_new(IOEXCarrier *w, const char *address)
 
     ws->transport = transport;
     ws->to = strdup(address);
+    ws->extension = extension_name;
 
     rc = IOEX_get_turn_server(w, &turn_server);
     if (rc < 0) {
@@ -324,6 +408,9 @@ IOEXSession *IOEX_session_new(IOEXCarrier *w, const char *address)
 
     list_add(transport->workers, &ws->worker->le);
 
+    ws->le.data = ws;
+    list_add(ext->sessions, &ws->le);
+
     vlogD("Session: Session to %s created.", ws->to);
 
     return ws;
@@ -358,9 +445,13 @@ void *IOEX_session_get_userdata(IOEXSession *ws)
 
 static void session_internal_close(IOEXSession *ws)
 {
+    SessionExtension *ext = session_get_extension(ws);
     ListIterator it;
     assert(ws);
 
+    if (list_contains(ext->sessions, &ws->le))
+        deref(list_remove_entry(ext->sessions, &ws->le));
+
 restop:
     list_iterate(ws->streams, &it);
     while (list_iterator_has_next(&it)) {
@@ -415,16 +506,75 @@ static void friend_invite_response(IOEXCarrier *w, const char *from,
     }
 }
 
-int IOEX_session_request(IOEXSession *ws,
+static void restart_invite_response(IOEXCarrier *w, const char *from,
+                                    int status, const char *reason,
+                                    const void *sdp, size_t len, void *context)
+{
+    IOEXSession *ws = (IOEXSession*)context;
+
+    if (status != 0 || !sdp || !len) {
+        vlogW("Session: Restart refused by %s: %s.", ws->to,
+              reason ? reason : "no SDP");
+        ws->restart(ws, true, NULL, 0);
+    } else {
+        ws->restart(ws, true, (const char *)sdp, len - 1);
+    }
+
+    deref(ws);
+}
+
+int session_send_restart(IOEXSession *ws, bool answer,
+                         const char *sdp, size_t len)
+{
+    IOEXCarrier *w;
+    char *ext_to;
+    int rc;
+
+    assert(ws);
+
+    w = session_get_extension(ws)->carrier;
+    assert(w);
+
+    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(extension_name) + 2);
+    strcpy(ext_to, ws->to);
+    strcat(ext_to, ":");
+    strcat(ext_to, extension_name);
+
+    if (answer) {
+        if (sdp)
+            rc = IOEX_reply_friend_invite(w, ext_to, 0, NULL, sdp, len);
+        else
+            rc = IOEX_reply_friend_invite(w, ext_to,
+                                IOEX_GENERAL_ERROR(IOEXERR_WRONG_STATE),
+                                "Restart failed", NULL, 0);
+    } else {
+        rc = IOEX_invite_friend(w, ext_to, sdp, len,
+                                restart_invite_response, ref(ws));
+        if (rc < 0)
+            deref(ws);
+    }
+
+    vlogD("Session: Restart %s to %s %s.", answer ? "answer" : "offer",
+          ws->to, rc == 0 ? "success" : "failed");
+
+    return rc;
+}
+
+/*
+ * The header, if any, goes in front of the SDP for the invite extension of
+ * the session to pick up.
+ */
+int session_send_request(IOEXSession *ws, const char *header,
         IOEXSessionRequestCompleteCallback *callback, void *context)
 {
     IOEXCarrier *w;
     int rc = 0;
     ListIterator iterator;
     char sdp[SDP_MAX_LEN];
+    size_t hlen = header ? strlen(header) : 0;
     char *ext_to;
 
-    if (!ws || !callback) {
+    if (!ws || !callback || hlen >= sizeof(sdp)) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
@@ -468,26 +618,29 @@ reprepare:
         }
     }
 
-    rc = ws->encode_local_sdp(ws, sdp, sizeof(sdp));
+    if (hlen)
+        memcpy(sdp, header, hlen);
+
+    rc = ws->encode_local_sdp(ws, sdp + hlen, sizeof(sdp) - hlen);
     if (rc < 0) {
         vlogE("Session: Encode local SDP failed(0x%x).", rc);
         IOEX_set_error(rc);
         return -1;
     }
     // IMPORTANT: add terminal null
-    sdp[rc] = 0;
+    sdp[hlen + rc] = 0;
 
     vlogD("Session: Encode local SDP success[%s].", sdp);
 
     ws->complete_callback = callback;
     ws->context = context;
 
-    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(extension_name) + 2);
+    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(ws->extension) + 2);
     strcpy(ext_to, ws->to);
     strcat(ext_to, ":");
-    strcat(ext_to, extension_name);
+    strcat(ext_to, ws->extension);
 
-    rc = IOEX_invite_friend(w, ext_to, sdp, rc + 1,
+    rc = IOEX_invite_friend(w, ext_to, sdp, hlen + rc + 1,
                            friend_invite_response, (void *)ws);
 
     vlogD("Session: Session request to %s %s.", ws->to,
@@ -496,6 +649,12 @@ reprepare:
     return rc;
 }
 
+int IOEX_session_request(IOEXSession *ws,
+        IOEXSessionRequestCompleteCallback *callback, void *context)
+{
+    return session_send_request(ws, NULL, callback, context);
+}
+
 int IOEX_session_reply_request(IOEXSession *ws,
                               int status, const char* reason)
 {
@@ -568,10 +727,10 @@ reprepare:
         sdp_len = rc + 1;
     }
 
-    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(extension_name) + 2);
+    ext_to = (char *)alloca(IOEX_MAX_ID_LEN + strlen(ws->extension) + 2);
     strcpy(ext_to, ws->to);
     strcat(ext_to, ":");
-    strcat(ext_to, extension_name);
+    strcat(ext_to, ws->extension);
 
     rc = IOEX_reply_friend_invite(w, ext_to, status, reason,
                                  local_sdp, sdp_len);
@@ -714,6 +873,11 @@ int IOEX_session_add_stream(IOEXSession *ws, IOEXStreamType type,
         return -1;
     }
 
+    if ((options & IOEX_STREAM_MULTIPATH) && !(options & IOEX_STREAM_RELIABLE)) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
+        return -1;
+    }
+
     rc = ws->create_stream(ws, &s);
     if (rc != 0) {
         IOEX_set_error(rc);
@@ -749,6 +913,8 @@ int IOEX_session_add_stream(IOEXSession *ws, IOEXStreamType type,
         s->multiplexing = 1;
         s->portforwarding = 1;
     }
+    if (options & IOEX_STREAM_MULTIPATH)
+        s->multipath = 1;
 
     s->pipeline.name = "Root Handler";
     s->pipeline.init = default_handler_init;
@@ -1153,7 +1319,8 @@ int IOEX_session_add_service(IOEXSession *ws, const char *service,
     size_t port_len;
 
     if (!ws || !service || !*service || !host || !*host|| !port || !*port ||
-        protocol != PortForwardingProtocol_TCP) {
+        (protocol != PortForwardingProtocol_TCP &&
+         protocol != PortForwardingProtocol_UDP)) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
@@ -1212,6 +1379,69 @@ void IOEX_session_remove_service(IOEXSession *ws, const char *service)
         services_remove(ws->portforwarding.services, service);
 }
 
+int IOEX_session_get_portforwarding_stats(IOEXSession *ws,
+                        IOEXPortForwardingStatsCallback *callback,
+                        void *context)
+{
+    IOEXPortForwardingStats stats;
+    HashtableIterator it;
+    ListIterator iterator;
+    IOEXStream *s;
+    Service *svc;
+    int rc;
+
+    if (!ws || !callback) {
+        IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
+        return -1;
+    }
+
+    if (ws->portforwarding.services) {
+restats:
+        services_iterate(ws->portforwarding.services, &it);
+        while (services_iterator_has_next(&it)) {
+            rc = services_iterator_next(&it, &svc);
+            if (rc == 0)
+                break;
+
+            if (rc < 0)
+                goto restats;
+
+            memset(&stats, 0, sizeof(stats));
+            stats.service = svc->name;
+            stats.protocol = svc->protocol;
+            portforwarding_counters_read(&svc->counters, &stats);
+
+            if (!callback(&stats, context)) {
+                deref(svc);
+                return 0;
+            }
+
+            deref(svc);
+        }
+    }
+
+rescan:
+    list_iterate(ws->streams, &iterator);
+    while (list_iterator_has_next(&iterator)) {
+        rc = list_iterator_next(&iterator, (void **)&s);
+        if (rc == 0)
+            break;
+
+        if (rc == -1)
+            goto rescan;
+
+        if (s->mux && !s->mux->portforwarding.stats(s->mux, callback, context)) {
+            deref(s);
+            return 0;
+        }
+
+        deref(s);
+    }
+
+    callback(NULL, context);
+    return 0;
+}
+
 int IOEX_stream_open_port_forwarding(IOEXSession *ws, int stream,
         const char *service, PortForwardingProtocol protocol,
         const char *host, const char *port)
@@ -1220,7 +1450,8 @@ int IOEX_stream_open_port_forwarding(IOEXSession *ws, int stream,
     IOEXStream *s;
 
     if (!ws || stream <= 0 || !service || !*service || !port || !*port ||
-        protocol != PortForwardingProtocol_TCP) {
+        (protocol != PortForwardingProtocol_TCP &&
+         protocol != PortForwardingProtocol_UDP)) {
         IOEX_set_error(IOEX_GENERAL_ERROR(IOEXERR_INVALID_ARGS));
         return -1;
     }
@@ -41,6 +41,7 @@
 #include <ids_heap.h>
 
 #include "IOEX_session.h"
+#include "IOEX_filestream.h"
 #include "stream_handler.h"
 
 #ifdef __cplusplus
@@ -49,6 +50,9 @@ extern "C" {
 
 #define MAX_STREAM_ID       256
 
+/* SDP session attribute carried by ICE restart offers and answers */
+#define SDP_RESTART_ATTR    "ice-restart"
+
 typedef void Timer;
 typedef bool TimerCallback(void *user_data);
 
@@ -57,6 +61,8 @@ typedef struct TransportWorker      TransportWorker;
 typedef struct IOEXTransport         IOEXTransport;
 typedef struct IOEXSession           IOEXSession;
 typedef struct IOEXStream            IOEXStream;
+typedef struct PortForwardingPool   PortForwardingPool;
+typedef struct FileStreams          FileStreams;
 
 typedef struct IceTransportOptions {
     const char *stun_host;
@@ -82,10 +88,22 @@ struct SessionExtension {
     friend_invite_callback  friend_invite_cb;
     void                    *friend_invite_context;
 
+    /* Called by the carrier, same layout as its view of the extension */
+    file_receive_callback   file_receive_cb;
+    file_send_callback      file_send_cb;
+    file_cancel_callback    file_cancel_cb;
+
     IOEXSessionRequestCallback *request_callback;
     void                    *context;
 
     IOEXTransport            *transport;
+    List                    *sessions;
+
+    /* Event loops shared by all portforwarding streams, created on demand */
+    PortForwardingPool      *portforwarding_pool;
+
+    /* Files transferred over session streams */
+    FileStreams             *file_streams;
 
     IdsHeapDecl(stream_ids, MAX_STREAM_ID);
 
@@ -117,6 +135,9 @@ struct TransportWorker {
 typedef struct IOEXSession {
     IOEXTransport            *transport;
     char                    *to;
+    const char              *extension;  // friend invite extension name.
+
+    ListEntry               le;
 
     TransportWorker         *worker;
 
@@ -151,6 +172,8 @@ typedef struct IOEXSession {
     bool (*set_offer)       (IOEXSession *session, bool offerer);
     int  (*encode_local_sdp)(IOEXSession *session, char *sdp, size_t len);
     int  (*apply_remote_sdp)(IOEXSession *session, const char *sdp, size_t sdp_len);
+    int  (*restart)         (IOEXSession *session, bool answer,
+                             const char *sdp, size_t sdp_len);
 } IOEXSession;
 
 typedef struct Multiplexer  Multiplexer;
@@ -170,7 +193,10 @@ struct IOEXStream {
     int                     reliable;
     int                     multiplexing;
     int                     portforwarding;
+    int                     multipath;
     int                     deactivate;
+    int                     compact_mux;
+    int                     early_data;
 
     IOEXStreamCallbacks  callbacks;
     void *context;
@@ -187,6 +213,13 @@ void session_base_destroy(void *p);
 
 void stream_base_destroy(void *p);
 
+int session_send_restart(IOEXSession *session, bool answer,
+                         const char *sdp, size_t len);
+
+int session_send_request(IOEXSession *session, const char *header,
+                         IOEXSessionRequestCompleteCallback *callback,
+                         void *context);
+
 static inline
 SessionExtension *stream_get_extension(IOEXStream *stream)
 {
@@ -29,6 +29,12 @@
 extern "C" {
 #endif
 
+/*
+ * send_space() reporting less than this arms on_writable(), which is called
+ * on the handler before once there is at least this much room again.
+ */
+#define HANDLER_SEND_SPACE_LOW      (8 * 1024)
+
 typedef struct IOEXStream IOEXStream;
 typedef struct StreamHandler StreamHandler;
 typedef struct FlexBuffer FlexBuffer;
@@ -48,6 +54,11 @@ struct StreamHandler {
     ssize_t (*write)        (StreamHandler *handler, FlexBuffer *buf);
     void (*on_data)         (StreamHandler *handler, FlexBuffer *buf);
     void (*on_state_changed)(StreamHandler *handler, int state);
+
+    /* Optional, bytes the handler takes by write without waiting */
+    size_t  (*send_space)   (StreamHandler *handler);
+    /* Optional, room to write again after send_space() ran low */
+    void (*on_writable)     (StreamHandler *handler);
 };
 
 static inline void handler_connect(StreamHandler *handler, StreamHandler *next)
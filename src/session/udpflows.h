@@ -0,0 +1,114 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __UDPFLOWS_H__
+#define __UDPFLOWS_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <rc_mem.h>
+#include <linkedhashtable.h>
+#include "multiplex_handler.h"
+
+/* UDP portforwarding flows, keyed by the source address of the datagrams */
+
+static inline
+uint32_t udpflows_hash_code(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline
+int udpflows_key_compare(const void *key1, size_t len1,
+                         const void *key2, size_t len2)
+{
+    if (len1 != len2)
+        return 1;
+
+    return memcmp(key1, key2, len1);
+}
+
+static inline
+Hashtable *udpflows_create(int capacity)
+{
+    return hashtable_create(capacity, 1, udpflows_hash_code,
+                            udpflows_key_compare);
+}
+
+static inline
+void udpflows_put(Hashtable *htab, UdpChannel *uch)
+{
+    uch->flow_he.data = uch;
+    uch->flow_he.key = &uch->addr;
+    uch->flow_he.keylen = uch->addrlen;
+
+    hashtable_put(htab, &uch->flow_he);
+}
+
+static inline
+UdpChannel *udpflows_get(Hashtable *htab, const struct sockaddr *addr,
+                         socklen_t addrlen)
+{
+    return (UdpChannel *)hashtable_get(htab, addr, addrlen);
+}
+
+static inline
+void udpflows_remove(Hashtable *htab, const struct sockaddr *addr,
+                     socklen_t addrlen)
+{
+    UdpChannel *uch;
+
+    uch = (UdpChannel *)hashtable_remove(htab, addr, addrlen);
+    if (uch)
+        deref(uch);
+}
+
+static inline
+HashtableIterator *udpflows_iterate(Hashtable *htab,
+                                    HashtableIterator *iterator)
+{
+    return hashtable_iterate(htab, iterator);
+}
+
+// return 1 on success, 0 end of iterator, -1 on modified conflict or error.
+static inline
+int udpflows_iterator_next(HashtableIterator *iterator, UdpChannel **uch)
+{
+    return hashtable_iterator_next(iterator, NULL, NULL, (void **)uch);
+}
+
+static inline
+int udpflows_iterator_has_next(HashtableIterator *iterator)
+{
+    return hashtable_iterator_has_next(iterator);
+}
+
+#endif /* __UDPFLOWS_H__ */
@@ -0,0 +1,356 @@
+/*
+ * 
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <CUnit/Basic.h>
+
+#include "IOEX_carrier.h"
+#include "IOEX_session.h"
+#include "cond.h"
+#include "tests.h"
+#include "test_helper.h"
+#include "test_assert.h"
+
+struct CarrierContextExtra {
+    uint32_t fileindex;
+    bool chunk_sent;
+};
+
+static CarrierContextExtra extra = {
+    .fileindex  = 0,
+    .chunk_sent = false
+};
+
+static inline void wakeup(void* context)
+{
+    cond_signal(((CarrierContext *)context)->cond);
+}
+
+static void ready_cb(IOEXCarrier *w, void *context)
+{
+    cond_signal(((CarrierContext *)context)->ready_cond);
+}
+
+static void friend_added_cb(IOEXCarrier *w, const IOEXFriendInfo *info, void *context)
+{
+    wakeup(context);
+}
+
+static void friend_removed_cb(IOEXCarrier *w, const char *friendid, void *context)
+{
+    wakeup(context);
+}
+
+static void friend_connection_cb(IOEXCarrier *w, const char *friendid,
+                                 IOEXConnectionStatus status, void *context)
+{
+    CarrierContext *wctxt = (CarrierContext *)context;
+
+    wakeup(context);
+    wctxt->robot_online = (status == IOEXConnectionStatus_Connected);
+
+    test_log_debug("Robot connection status changed -> %s\n",
+                    connection_str(status));
+}
+
+static void file_chunk_send_cb(IOEXCarrier *w, const char *friendid,
+                               const uint32_t fileindex, const char *fullpath,
+                               const uint64_t position, const size_t length,
+                               void *context)
+{
+    CarrierContextExtra *extra = ((CarrierContext *)context)->extra;
+
+    // Only the first chunk of a file wakes the test up.
+    if (extra->chunk_sent)
+        return;
+
+    extra->fileindex = fileindex;
+    extra->chunk_sent = true;
+
+    wakeup(context);
+}
+
+static IOEXCallbacks callbacks = {
+    .idle            = NULL,
+    .connection_status = NULL,
+    .ready           = ready_cb,
+    .self_info       = NULL,
+    .friend_list     = NULL,
+    .friend_connection = friend_connection_cb,
+    .friend_info     = NULL,
+    .friend_presence = NULL,
+    .friend_request  = NULL,
+    .friend_added    = friend_added_cb,
+    .friend_removed  = friend_removed_cb,
+    .friend_message  = NULL,
+    .friend_invite   = NULL,
+    .file_chunk_send = file_chunk_send_cb
+};
+
+static Condition DEFINE_COND(ready_cond);
+static Condition DEFINE_COND(cond);
+
+static CarrierContext carrier_context = {
+    .cbs = &callbacks,
+    .carrier = NULL,
+    .ready_cond = &ready_cond,
+    .cond = &cond,
+    .extra = &extra
+};
+
+static void test_context_reset(TestContext *context)
+{
+    cond_reset(context->carrier->cond);
+
+    context->carrier->extra->fileindex = 0;
+    context->carrier->extra->chunk_sent = false;
+}
+
+static TestContext test_context = {
+    .carrier = &carrier_context,
+    .session = NULL,
+    .stream  = NULL,
+    .context_reset = test_context_reset
+};
+
+/*
+ * Creates the file to send in the test data directory, filled with a
+ * pattern so the receiver has something to check the hash against.
+ */
+static int create_test_file(const char *name, size_t size, char *fullpath)
+{
+    char buf[4096];
+    size_t len;
+    size_t i;
+    FILE *fp;
+
+    sprintf(fullpath, "%s/tests/%s", global_config.data_location, name);
+
+    fp = fopen(fullpath, "wb");
+    if (!fp)
+        return -1;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)(i * 31 + size);
+
+    while (size > 0) {
+        len = size < sizeof(buf) ? size : sizeof(buf);
+        if (fwrite(buf, 1, len, fp) != len) {
+            fclose(fp);
+            return -1;
+        }
+        size -= len;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static int robot_sinit_ack(void)
+{
+    char cmd[32];
+    char result[32];
+    int rc;
+
+    rc = robot_sinit();
+    if (rc <= 0)
+        return -1;
+
+    rc = wait_robot_ack("%32s %32s", cmd, result);
+    if (rc != 2 || strcmp(cmd, "sinit") != 0 || strcmp(result, "success") != 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Sends a file the robot accepts, and checks the size of the file the
+ * robot received once complete, and whether it came over a stream or
+ * toxcore. The robot verifies the file against its hash before reporting
+ * it complete.
+ */
+static int send_file_to_robot(const char *name, size_t size, const char *path)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    char fullpath[PATH_MAX] = {0};
+    char expected[32];
+    char cmd[32];
+    char result[32];
+    char via[32];
+    int rc;
+
+    rc = create_test_file(name, size, fullpath);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    rc = IOEX_send_file_request(wctxt->carrier, robotid, fullpath);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    rc = wait_robot_ack("%32s %32s %32s", cmd, result, via);
+    TEST_ASSERT_TRUE(rc == 3);
+    TEST_ASSERT_TRUE(strcmp(cmd, "freceived") == 0);
+
+    sprintf(expected, "%zu", size);
+    TEST_ASSERT_TRUE(strcmp(result, expected) == 0);
+    TEST_ASSERT_TRUE(strcmp(via, path) == 0);
+
+    remove(fullpath);
+    return 0;
+
+cleanup:
+    if (*fullpath)
+        remove(fullpath);
+    return -1;
+}
+
+static void test_send_file_over_stream(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(IOEX_is_friend(wctxt->carrier, robotid));
+
+    rc = IOEX_session_init(wctxt->carrier, NULL, NULL);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+
+    rc = robot_sinit_ack();
+    TEST_ASSERT_TRUE(rc == 0);
+
+    // Several stream blocks, acknowledged past the window.
+    rc = send_file_to_robot("file-stream.dat", 6 * 1024 * 1024 + 4321, "stream");
+    TEST_ASSERT_TRUE(rc == 0);
+
+cleanup:
+    IOEX_session_cleanup(wctxt->carrier);
+    robot_sfree();
+}
+
+static void test_send_file_stream_fallback(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(IOEX_is_friend(wctxt->carrier, robotid));
+
+    // Without a session here, the stream the robot requests is refused and
+    // the file goes over toxcore instead.
+    rc = robot_sinit_ack();
+    TEST_ASSERT_TRUE(rc == 0);
+
+    rc = send_file_to_robot("file-fallback.dat", 512 * 1024 + 123, "toxcore");
+    TEST_ASSERT_TRUE(rc == 0);
+
+cleanup:
+    robot_sfree();
+}
+
+static void test_cancel_file_over_stream(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    CarrierContextExtra *extra = wctxt->extra;
+    char fullpath[PATH_MAX] = {0};
+    char index[32];
+    char cmd[32];
+    char result[32];
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(IOEX_is_friend(wctxt->carrier, robotid));
+
+    rc = IOEX_session_init(wctxt->carrier, NULL, NULL);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+
+    rc = robot_sinit_ack();
+    TEST_ASSERT_TRUE(rc == 0);
+
+    // Large enough to be still on its way once the first blocks are stored.
+    rc = create_test_file("file-cancel.dat", 64 * 1024 * 1024, fullpath);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    rc = IOEX_send_file_request(wctxt->carrier, robotid, fullpath);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    // wait for the first chunk stored by the robot.
+    cond_wait(wctxt->cond);
+    TEST_ASSERT_TRUE(extra->chunk_sent);
+
+    sprintf(index, "%u", extra->fileindex);
+    rc = IOEX_send_file_cancel(wctxt->carrier, robotid, index);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    rc = wait_robot_ack("%32s %32s", cmd, result);
+    TEST_ASSERT_TRUE(rc == 2);
+    TEST_ASSERT_TRUE(strcmp(cmd, "fcancel") == 0);
+    TEST_ASSERT_TRUE(strcmp(result, "received") == 0);
+
+cleanup:
+    if (*fullpath)
+        remove(fullpath);
+
+    IOEX_session_cleanup(wctxt->carrier);
+    robot_sfree();
+}
+
+static CU_TestInfo cases[] = {
+    { "test_send_file_over_stream",     test_send_file_over_stream },
+    { "test_send_file_stream_fallback", test_send_file_stream_fallback },
+    { "test_cancel_file_over_stream",   test_cancel_file_over_stream },
+    {NULL, NULL }
+};
+
+CU_TestInfo *file_stream_test_get_cases(void)
+{
+    return cases;
+}
+
+int file_stream_test_suite_init(void)
+{
+    int rc;
+
+    rc = test_suite_init(&test_context);
+    if (rc < 0) {
+        CU_FAIL("Error: test suite initialize error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int file_stream_test_suite_cleanup(void)
+{
+    test_suite_cleanup(&test_context);
+
+    return 0;
+}
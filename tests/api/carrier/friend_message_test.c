@@ -146,6 +146,34 @@ static void test_send_message_to_friend(void)
     CU_ASSERT_STRING_EQUAL(in, out);
 }
 
+static void test_send_messages_in_burst(void)
+{
+    CarrierContext *wctxt = test_context.carrier;
+    char out[32];
+    char in[64];
+    int i;
+    int rc;
+
+    test_context.context_reset(&test_context);
+
+    rc = add_friend_anyway(&test_context, robotid, robotaddr);
+    CU_ASSERT_EQUAL_FATAL(rc, 0);
+    CU_ASSERT_TRUE_FATAL(IOEX_is_friend(wctxt->carrier, robotid));
+
+    for (i = 0; i < 16; i++) {
+        sprintf(out, "message-burst-%d", i);
+        rc = IOEX_send_friend_message(wctxt->carrier, robotid, out, strlen(out) + 1);
+        CU_ASSERT_EQUAL_FATAL(rc, 0);
+    }
+
+    for (i = 0; i < 16; i++) {
+        sprintf(out, "message-burst-%d", i);
+        rc = wait_robot_ack("%64s", in);
+        CU_ASSERT_EQUAL(rc, 1);
+        CU_ASSERT_STRING_EQUAL(in, out);
+    }
+}
+
 static void test_send_message_from_friend(void)
 {
     CarrierContext *wctxt = test_context.carrier;
@@ -213,6 +241,7 @@ static void test_send_message_to_self(void)
 
 static CU_TestInfo cases[] = {
     { "test_send_message_to_friend",   test_send_message_to_friend },
+    { "test_send_messages_in_burst",   test_send_messages_in_burst },
     { "test_send_message_from_friend", test_send_message_from_friend },
     { "test_send_message_to_stranger", test_send_message_to_stranger },
     { "test_send_message_to_self",     test_send_message_to_self },
@@ -29,6 +29,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "IOEX_carrier.h"
 #include "IOEX_session.h"
@@ -206,6 +207,86 @@ static void friend_invite_cb(IOEXCarrier *w, const char *from,
 
     robot_ack("data %s\n", data);
 }
+
+/*
+ * Largest chunk of the file being received: stream blocks are far larger
+ * than the chunks toxcore carries, which tells how the file came.
+ */
+#define TOXCORE_MAX_CHUNK   4096
+
+static size_t file_max_chunk;
+
+/*
+ * Files offered are accepted into the robot data directory, over a session
+ * stream if "sinit" was done before.
+ */
+static void file_request_cb(IOEXCarrier *w, const char *friendid,
+                            const uint32_t fileindex, const char *filename,
+                            uint64_t filesize, void *context)
+{
+    char datadir[PATH_MAX];
+    char index[32];
+    int rc;
+
+    robot_log_debug("Received file %s (%llu bytes) from %s\n", filename,
+                    (unsigned long long)filesize, friendid);
+
+    sprintf(datadir, "%s/robot", global_config.data_location);
+    sprintf(index, "%u", fileindex);
+
+    file_max_chunk = 0;
+
+    rc = IOEX_send_file_accept(w, friendid, index, filename, datadir);
+    if (rc < 0) {
+        robot_log_error("Accept file %s error (0x%x)\n", filename,
+                        IOEX_get_error());
+        robot_ack("freceived failed\n");
+    }
+}
+
+static void file_canceled_cb(IOEXCarrier *w, const char *friendid,
+                             const uint32_t fileindex, void *context)
+{
+    robot_log_debug("File %u canceled by %s\n", fileindex, friendid);
+
+    robot_ack("fcancel received\n");
+}
+
+static void file_chunk_receive_cb(IOEXCarrier *w, const char *friendid,
+                                  const uint32_t fileindex, const char *fullpath,
+                                  const uint64_t position, const size_t length,
+                                  void *context)
+{
+    struct stat st;
+
+    // The last chunk is reported with no data.
+    if (length > 0) {
+        if (length > file_max_chunk)
+            file_max_chunk = length;
+        return;
+    }
+
+    if (stat(fullpath, &st) < 0) {
+        robot_log_error("Stat received file %s error\n", fullpath);
+        robot_ack("freceived failed\n");
+        return;
+    }
+
+    robot_log_debug("Received file %s complete\n", fullpath);
+    robot_ack("freceived %llu %s\n", (unsigned long long)st.st_size,
+              file_max_chunk > TOXCORE_MAX_CHUNK ? "stream" : "toxcore");
+}
+
+static void file_receive_error_cb(IOEXCarrier *w, int errcode,
+                                  const char *friendid, const uint32_t fileindex,
+                                  const char *fullpath, void *context)
+{
+    robot_log_error("Received file %s error (0x%x)\n", fullpath, errcode);
+
+    robot_ack("freceived %s\n",
+              errcode == IOEX_GENERAL_ERROR(IOEXERR_FILE_CORRUPTED) ?
+              "corrupted" : "failed");
+}
 static void signal_handler(int signum)
 {
     IOEXCarrier *w = test_context.carrier->carrier;
@@ -230,7 +311,11 @@ static IOEXCallbacks callbacks = {
     .friend_added    = friend_added_cb,
     .friend_removed  = friend_removed_cb,
     .friend_message  = friend_message_cb,
-    .friend_invite   = friend_invite_cb
+    .friend_invite   = friend_invite_cb,
+    .file_request    = file_request_cb,
+    .file_canceled   = file_canceled_cb,
+    .file_chunk_receive = file_chunk_receive_cb,
+    .file_receive_error = file_receive_error_cb
 };
 
 CarrierContext carrier_context = {
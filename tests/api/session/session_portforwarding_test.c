@@ -419,6 +419,164 @@ static void *server_thread_entry(void *argv)
     return NULL;
 }
 
+static int udp_socket_open(const char *host, const char *port, bool do_bind)
+{
+    int sockfd = -1;
+    struct addrinfo hints;
+    struct addrinfo *ai;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    rc = getaddrinfo(host, port, &hints, &ai);
+    if (rc != 0)
+        return -1;
+
+    sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sockfd >= 0) {
+        if (do_bind)
+            rc = bind(sockfd, ai->ai_addr, ai->ai_addrlen);
+        else
+            rc = connect(sockfd, ai->ai_addr, ai->ai_addrlen);
+
+        if (rc != 0) {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+
+    freeaddrinfo(ai);
+    return sockfd;
+}
+
+static void *udp_client_thread_entry(void *argv)
+{
+    PortForwardingContxt *ctxt = (PortForwardingContxt *)argv;
+    int sockfd;
+    int i;
+    char data[1024];
+
+    memset(data, 'U', sizeof(data));
+
+    ctxt->return_val = -1;
+
+    sockfd = udp_socket_open("127.0.0.1", ctxt->port, false);
+    if (sockfd < 0) {
+        test_log_error("client connect to udp 127.0.0.1:%s failed\n", ctxt->port);
+        return NULL;
+    }
+
+    test_log_info("client begin to send datagrams:");
+
+    // Paced, datagrams may be dropped on the way.
+    for (i = 0; i < ctxt->sent_count; i++) {
+        if (send(sockfd, data, sizeof(data), 0) < 0) {
+            test_log_error("client send datagram error (%d)\n", errno);
+            tcp_socket_close(sockfd);
+            return NULL;
+        }
+
+        usleep(1000);
+    }
+
+    test_log_info("finished sending %d datagrams\n", ctxt->sent_count);
+
+    tcp_socket_close(sockfd);
+    ctxt->return_val = 0;
+
+    return NULL;
+}
+
+static void *udp_server_thread_entry(void *argv)
+{
+    PortForwardingContxt *ctxt = (PortForwardingContxt *)argv;
+    struct timeval timeout = { 3, 0 };
+    int sockfd;
+    ssize_t rc;
+    char data[1025];
+
+    ctxt->return_val = -1;
+
+    sockfd = udp_socket_open("127.0.0.1", ctxt->port, true);
+    if (sockfd < 0) {
+        test_log_error("server create on udp 127.0.0.1:%s failed (%d)\n",
+                       ctxt->port, errno);
+        return NULL;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&timeout,
+               sizeof(timeout));
+
+    // Done once no datagram arrived within the timeout.
+    while ((rc = recv(sockfd, data, sizeof(data), 0)) > 0) {
+        if (rc != 1024) {
+            test_log_error("received datagram of %d bytes\n", (int)rc);
+            tcp_socket_close(sockfd);
+            return NULL;
+        }
+
+        ctxt->recv_count++;
+    }
+
+    test_log_info("finished receiving %d datagrams\n", ctxt->recv_count);
+
+    tcp_socket_close(sockfd);
+    ctxt->return_val = 0;
+    return NULL;
+}
+
+static
+int forwarding_datagrams(const char *service_port, const char *shadow_service_port)
+{
+    pthread_t client_thread;
+    pthread_t server_thread;
+    PortForwardingContxt client_ctxt;
+    PortForwardingContxt server_ctxt;
+    int rc;
+
+    server_ctxt.port = service_port;
+    server_ctxt.recv_count = 0;
+    server_ctxt.sent_count = 0;
+    server_ctxt.return_val = -1;
+
+    rc = pthread_create(&server_thread, NULL, &udp_server_thread_entry, &server_ctxt);
+    if (rc != 0) {
+        test_log_error("create server thread failed (%d)\n", rc);
+        return -1;
+    }
+
+    client_ctxt.port = shadow_service_port;
+    client_ctxt.recv_count = 0;
+    client_ctxt.sent_count = 256;
+    client_ctxt.return_val = -1;
+
+    rc = pthread_create(&client_thread, NULL, &udp_client_thread_entry, &client_ctxt);
+    if (rc != 0) {
+        test_log_error("create client thread failed (%d)\n", rc);
+        return -1;
+    }
+
+    pthread_join(client_thread, NULL);
+    pthread_join(server_thread, NULL);
+
+    if (client_ctxt.return_val == -1 || server_ctxt.return_val == -1) {
+        test_log_error("client or server thread running failed\n");
+        return -1;
+    }
+
+    if (server_ctxt.recv_count == 0 ||
+            server_ctxt.recv_count > client_ctxt.sent_count) {
+        test_log_error("received %d datagrams of %d sent\n.",
+                       server_ctxt.recv_count, client_ctxt.sent_count);
+        return -1;
+    }
+
+    return 0;
+}
+
 static
 int forwarding_data(const char *service_port, const char *shadow_service_port)
 {
@@ -471,8 +629,21 @@ int forwarding_data(const char *service_port, const char *shadow_service_port)
     return 0;
 }
 
+static bool portforwarding_stats_cb(const IOEXPortForwardingStats *stats,
+                                    void *context)
+{
+    IOEXPortForwardingStats *found = (IOEXPortForwardingStats *)context;
+
+    if (stats && stats->portforwarding == found->portforwarding &&
+            stats->stream == found->stream)
+        *found = *stats;
+
+    return true;
+}
+
 static int do_portforwarding_internal(TestContext *context)
 {
+    IOEXPortForwardingStats stats;
     StreamContextExtra *extra = context->stream->extra;
     int rc;
     char cmd[32];
@@ -503,6 +674,57 @@ static int do_portforwarding_internal(TestContext *context)
     rc = forwarding_data(extra->port, extra->shadow_port);
     TEST_ASSERT_TRUE(rc == 0);
 
+    memset(&stats, 0, sizeof(stats));
+    stats.stream = context->stream->stream_id;
+    stats.portforwarding = pfid;
+    rc = IOEX_session_get_portforwarding_stats(context->session->session,
+                                    portforwarding_stats_cb, &stats);
+    TEST_ASSERT_TRUE(rc == 0);
+    TEST_ASSERT_TRUE(stats.connections == 1);
+    TEST_ASSERT_TRUE(stats.bytes_sent == (uint64_t)extra->sent_count * 1024);
+
+    rc = IOEX_stream_close_port_forwarding(context->session->session,
+                                              context->stream->stream_id, pfid);
+    TEST_ASSERT_TRUE(rc == 0);
+
+    robot_ctrl("spfsvcremove %s\n", extra->service);
+
+    return 0;
+
+cleanup:
+    if (pfid > 0)
+        IOEX_stream_close_port_forwarding(context->session->session,
+                                             context->stream->stream_id, pfid);
+
+    robot_ctrl("spfsvcremove %s\n", extra->service);
+    return -1;
+}
+
+static int do_udp_portforwarding_internal(TestContext *context)
+{
+    StreamContextExtra *extra = context->stream->extra;
+    int rc;
+    char cmd[32];
+    char result[32];
+    int pfid = -1;
+
+    rc = robot_ctrl("spfsvcadd %s udp 127.0.0.1 %s\n", extra->service, extra->port);
+    TEST_ASSERT_TRUE(rc > 0);
+
+    rc = wait_robot_ack("%32s %32s", cmd, result);
+    TEST_ASSERT_TRUE(rc == 2);
+    TEST_ASSERT_TRUE(strcmp(cmd, "spfsvcadd") == 0);
+    TEST_ASSERT_TRUE(strcmp(result, "success") == 0);
+
+    pfid = IOEX_stream_open_port_forwarding(context->session->session,
+                            context->stream->stream_id,
+                            extra->service, PortForwardingProtocol_UDP, "127.0.0.1",
+                            extra->shadow_port);
+    TEST_ASSERT_TRUE(pfid > 0);
+
+    rc = forwarding_datagrams(extra->port, extra->shadow_port);
+    TEST_ASSERT_TRUE(rc == 0);
+
     rc = IOEX_stream_close_port_forwarding(context->session->session,
                                               context->stream->stream_id, pfid);
     TEST_ASSERT_TRUE(rc == 0);
@@ -590,6 +812,15 @@ static void test_session_portforwarding_reliable_plain(void)
     portforwarding_impl(stream_options);
 }
 
+static void test_session_portforwarding_udp_unreliable(void)
+{
+    int stream_options = 0;
+    stream_options |= IOEX_STREAM_PORT_FORWARDING;
+
+    test_stream_scheme(IOEXStreamType_text, stream_options,
+                       &test_context, do_udp_portforwarding_internal);
+}
+
 static void test_session_reversed_portforwarding_reliable(void)
 {
     int stream_options = 0;
@@ -614,6 +845,7 @@ void test_session_reversed_portforwarding_reliable_plain(void)
 static CU_TestInfo cases[] = {
     { "test_session_portforwarding_reliable", test_session_portforwarding_reliable },
     { "test_session_portforwarding_reliable_plain", test_session_portforwarding_reliable_plain },
+    { "test_session_portforwarding_udp_unreliable", test_session_portforwarding_udp_unreliable },
 
     { "test_session_reversed_portforwarding_reliable", test_session_reversed_portforwarding_reliable },
     { "test_session_reversed_portforwarding_reliable_plain", test_session_reversed_portforwarding_reliable_plain },